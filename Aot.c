@@ -0,0 +1,681 @@
+/*
+Ahead-of-time translation.
+vm -aot program library translates the blocks of VmVerify into a C file (library
+with .c appended) and builds it with the system compiler ($CC , cc by default)
+into a shared object. vm -native library [program] loads it and runs the program
+on it instead of interpreting.
+
+The generated code has one straight-line function per Valid block : the GPRs , SP
+and the flags are local variables loaded when the block starts and stored when it
+leaves , and the block returns the address it continues at. A dispatcher function
+calls the blocks and goes straight to the successors it knows , the blocks are
+inlined into it so that the compiler keeps the registers in host registers across
+blocks and drops the flags nobody reads. The runtime checks that are left are the
+ones VmVerify can't prove : pointers in registers and the stack bounds.
+
+Anything else goes back to VmLoop , which goes on from the IP the native code
+stopped at :
+- a block that isn't Valid (bad operands , running into the end of data) and an
+  entry point that isn't a block start. A jump into the middle of an instruction
+  is a block start of its own and is compiled like the others.
+- a write into compiled code (known at translation time for the immediate
+  addresses , looked up in the code map for the others) , after the write.
+- an address space whose compiled code bytes aren't the ones the library was
+  translated from , the whole run is interpreted then.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+#define AOT_BIT(map,addr) ((map)[(addr)>>3] & (1 << ((addr) & 7)))
+#define AOT_SET(map,addr) ((map)[(addr)>>3] |= 1 << ((addr) & 7))
+struct VM_AOT
+{
+    void* Handle;
+    const VM_AOT_INFO* Info;
+};
+/*the part of the generated file that doesn't depend on the program*/
+static void AotEmitPrologue(FILE* File)
+{
+    fprintf(File,"/*generated by vm -aot , do not edit*/\n"
+                 "#include <string.h>\n"
+                 "typedef unsigned char BYTE;\n"
+                 "typedef unsigned short WORD;\n"
+                 "typedef unsigned int DWORD;\n"
+                 "/*layout of VM_AOT_STATE and VM_AOT_INFO (VM.h)*/\n"
+                 "typedef struct\n"
+                 "{\n"
+                 "    WORD GPRs[4];\n"
+                 "    WORD IP;\n"
+                 "    WORD SP;\n"
+                 "    BYTE ZF;\n"
+                 "    BYTE CF;\n"
+                 "    BYTE* Data;\n"
+                 "    WORD* Stack;\n"
+                 "    BYTE* Dirty;\n"
+                 "    void* AS;\n"
+                 "    void (*PrintInteger)(WORD Value);\n"
+                 "    void (*PrintString)(const char* String);\n"
+                 "    void (*ScanString)(char* Buffer,DWORD Size);\n"
+                 "    void (*MarkDirty)(void* AS,DWORD Offset,DWORD Size);\n"
+                 "    BYTE (*Bulk)(void* AS,BYTE Opcode,WORD Dst,WORD Src,WORD Count,WORD Key,void* Result);\n"
+                 "}VM_AOT_STATE;\n"
+                 "/*layout of VM_BULK_RESULT*/\n"
+                 "typedef struct\n"
+                 "{\n"
+                 "    WORD Length;\n"
+                 "    BYTE ZF;\n"
+                 "    BYTE CF;\n"
+                 "    DWORD WriteSize;\n"
+                 "}AOT_BULK;\n"
+                 "typedef struct\n"
+                 "{\n"
+                 "    DWORD Version;\n"
+                 "    DWORD DataSize;\n"
+                 "    DWORD StackSize;\n"
+                 "    const BYTE* CodeMap;\n"
+                 "    const BYTE* Image;\n"
+                 "    int (*Run)(VM_AOT_STATE* State);\n"
+                 "}VM_AOT_INFO;\n"
+                 "/*registers of the dispatcher , the blocks take them into locals*/\n"
+                 "typedef struct\n"
+                 "{\n"
+                 "    WORD R[4];\n"
+                 "    WORD SP;\n"
+                 "    BYTE ZF;\n"
+                 "    BYTE CF;\n"
+                 "}AOT_REGS;\n");
+    fprintf(File,"#define AOT_EXIT %d\n"
+                 "#define AOT_EXCEPTION %d\n"
+                 "#define AOT_INTERPRET %d\n"
+                 "#define DATA_SIZE 0x%X\n"
+                 "#define STACK_SIZE 0x%X\n"
+                 "#define OUT_OF_DATA(addr) ((DWORD)(addr) & 0x%XU)\n"
+                 "#define IS_CODE(addr) (CodeMap[(addr)>>3] & (1 << ((addr) & 7)))\n"
+                 "#define DIRTY(offset) (s->Dirty[(offset) >> %d] |= (BYTE)(1 << (((offset) >> %d) & 7)))\n",
+            VM_AOT_EXIT,VM_AOT_EXCEPTION,VM_AOT_INTERPRET,VM_DATA_SIZE,VM_STACK_SIZE,
+            ~(DWORD)VM_DATA_MASK,VM_PAGE_SHIFT + 3,VM_PAGE_SHIFT);
+    fprintf(File,"#define LOAD() WORD r0 = x->R[0],r1 = x->R[1],r2 = x->R[2],r3 = x->R[3],sp = x->SP; \\\n"
+                 "               BYTE zf = x->ZF,cf = x->CF; \\\n"
+                 "               BYTE* D = s->Data; \\\n"
+                 "               WORD* S = s->Stack; \\\n"
+                 "               WORD t; \\\n"
+                 "               BYTE b; \\\n"
+                 "               (void)D,(void)S,(void)t,(void)b\n"
+                 "#define SAVE() (x->R[0] = r0,x->R[1] = r1,x->R[2] = r2,x->R[3] = r3,x->SP = sp,x->ZF = zf,x->CF = cf)\n"
+                 "/*stop at ip , negative returns are stops*/\n"
+                 "#define LEAVE(ip,reason) do { SAVE(); s->IP = (ip); return -(reason); } while(0)\n"
+                 "static inline WORD LoadWord(const BYTE* p)\n"
+                 "{\n"
+                 "    WORD w;\n"
+                 "    memcpy(&w,p,2);\n"
+                 "    return w;\n"
+                 "}\n"
+                 "static inline void StoreWord(BYTE* p,WORD w)\n"
+                 "{\n"
+                 "    memcpy(p,&w,2);\n"
+                 "}\n");
+}
+static void AotEmitData(FILE* File,const char* Name,const BYTE* Data,DWORD Size)
+{
+    DWORD i;
+    fprintf(File,"static const BYTE %s[%u] =\n{",Name,Size);
+    for(i = 0;i < Size;i++)
+        fprintf(File,"%s0x%.2X",i % 16 ? "," : (i ? ",\n    " : "\n    "),Data[i]);
+    fprintf(File,"\n};\n");
+}
+static boolean AotIsCode(const BYTE* Code,DWORD addr)
+{
+    return addr < VM_DATA_SIZE && AOT_BIT(Code,addr);
+}
+/*one instruction of a Valid block , Code has the bytes of every compiled block*/
+static void AotEmitInstruction(FILE* File,PDECODED_OP op,const BYTE* Code)
+{
+    DWORD next = op->IP + op->Length;
+    BYTE d = op->Dst,s = op->Src;
+    fprintf(File,"    /*0x%.4X %s*/\n",op->IP,VmMnemonic(op->Handler));
+    switch(op->Handler)
+    {
+        case 0x90 :
+            break;
+        case 0x10 :
+            fprintf(File,"    r%d = r%d;\n",d,s);
+            break;
+        case 0x12 :
+            fprintf(File,"    r%d = D[0x%.4X];\n",d,op->Imm);
+            break;
+        case 0x14 :
+            fprintf(File,"    r%d = LoadWord(D + 0x%.4X);\n",d,op->Imm);
+            break;
+        case 0x16 :
+        case 0x18 :
+            fprintf(File,"    r%d = 0x%.4X;\n",d,op->Imm);
+            break;
+        case 0x1c :
+            fprintf(File,"    D[0x%.4X] = (BYTE)r%d;\n"
+                         "    DIRTY(0x%.4X);\n",op->Imm,d,op->Imm);
+            if(AotIsCode(Code,op->Imm))
+                fprintf(File,"    LEAVE(0x%.4X,AOT_INTERPRET);\n",next);
+            break;
+        case 0x1f :
+            fprintf(File,"    StoreWord(D + 0x%.4X,r%d);\n"
+                         "    DIRTY(0x%.4X);\n"
+                         "    DIRTY(0x%.4X);\n",op->Imm,d,op->Imm,op->Imm + 1);
+            if(AotIsCode(Code,op->Imm) || AotIsCode(Code,op->Imm + 1))
+                fprintf(File,"    LEAVE(0x%.4X,AOT_INTERPRET);\n",next);
+            break;
+        case 0xAD :
+            fprintf(File,"    t = (WORD)(r%d + 0x%.4X);\n"
+                         "    zf = t == 0;\n"
+                         "    cf = t < r%d;\n"
+                         "    r%d = t;\n",d,op->Imm,d,d);
+            break;
+        case 0xA5 :
+            fprintf(File,"    t = (WORD)(r%d + r%d);\n"
+                         "    zf = t == 0;\n"
+                         "    cf = t < r%d;\n"
+                         "    r%d = t;\n",d,s,d,d);
+            break;
+        case 0xA2 :
+            fprintf(File,"    b = (BYTE)(r%d + r%d);\n"
+                         "    zf = b == 0;\n"
+                         "    cf = b < (BYTE)r%d;\n"
+                         "    r%d = (WORD)((r%d & 0xFF00) | b);\n",d,s,d,d,d);
+            break;
+        case 0x5B :
+            fprintf(File,"    t = (WORD)(r%d - 0x%.4X);\n"
+                         "    zf = t == 0;\n"
+                         "    cf = t > r%d;\n"
+                         "    r%d = t;\n",d,op->Imm,d,d);
+            break;
+        case 0x5C :
+            fprintf(File,"    t = (WORD)(r%d - r%d);\n"
+                         "    zf = t == 0;\n"
+                         "    cf = t > r%d;\n"
+                         "    r%d = t;\n",d,s,d,d);
+            break;
+        case 0x5D :
+            fprintf(File,"    b = (BYTE)(r%d - r%d);\n"
+                         "    zf = b == 0;\n"
+                         "    cf = b > (BYTE)r%d;\n"
+                         "    r%d = (WORD)((r%d & 0xFF00) | b);\n",d,s,d,d,d);
+            break;
+        case 0xF0 :
+            fprintf(File,"    r%d ^= r%d;\n"
+                         "    zf = r%d == 0;\n"
+                         "    cf = 0;\n",d,s,d);
+            break;
+        case 0xF1 :
+            fprintf(File,"    b = (BYTE)(r%d ^ r%d);\n"
+                         "    r%d = (WORD)((r%d & 0xFF00) | b);\n"
+                         "    zf = b == 0;\n"
+                         "    cf = 0;\n",d,s,d,d);
+            break;
+        case 0xA1 :
+            fprintf(File,"    b = (BYTE)(r%d + 0x%.2X);\n"
+                         "    zf = b == 0;\n"
+                         "    cf = b < (BYTE)r%d;\n"
+                         "    r%d = (WORD)((r%d & 0xFF00) | b);\n",d,op->Imm,d,d,d);
+            break;
+        case 0x51 :
+            fprintf(File,"    b = (BYTE)(r%d - 0x%.2X);\n"
+                         "    zf = b == 0;\n"
+                         "    cf = b > (BYTE)r%d;\n"
+                         "    r%d = (WORD)((r%d & 0xFF00) | b);\n",d,op->Imm,d,d,d);
+            break;
+        case 0x55 :
+            fprintf(File,"    if(OUT_OF_DATA(r%d))\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    D[r%d] = (BYTE)r%d;\n"
+                         "    DIRTY(r%d);\n"
+                         "    if(IS_CODE(r%d))\n"
+                         "        LEAVE(0x%.4X,AOT_INTERPRET);\n",d,next,d,s,d,d,next);
+            break;
+        case 0x56 :
+            fprintf(File,"    if(OUT_OF_DATA(r%d))\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    r%d = D[r%d];\n",s,next,d,s);
+            break;
+        /*CMP and CMPL raise an exception when the source isn't a data address , like VmLoop*/
+        case 0x70 :
+            fprintf(File,"    if(OUT_OF_DATA(r%d))\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    t = (WORD)(r%d - r%d);\n"
+                         "    zf = t == 0;\n"
+                         "    cf = t > r%d;\n",s,next,d,s,d);
+            break;
+        case 0x71 :
+            fprintf(File,"    if(OUT_OF_DATA(r%d))\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    b = (BYTE)(r%d - r%d);\n"
+                         "    zf = b == 0;\n"
+                         "    cf = b > (BYTE)r%d;\n",s,next,d,s,d);
+            break;
+        case 0xAF :
+            fprintf(File,"    if(!sp)\n"
+                         "    {\n"
+                         "        sp = 0xFFFF;\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    }\n"
+                         "    S[--sp] = r%d;\n"
+                         "    DIRTY(DATA_SIZE + sp * 2);\n",next,d);
+            break;
+        case 0xAE :
+            fprintf(File,"    if(sp == STACK_SIZE)\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    r%d = S[sp++];\n",next,d);
+            break;
+        case 0xC0 :
+            fprintf(File,"    if(sp == STACK_SIZE)\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    s->PrintInteger(S[sp++]);\n",next);
+            break;
+        case 0xC2 :
+            fprintf(File,"    if(sp == STACK_SIZE)\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    t = S[sp++];\n"
+                         "    if(OUT_OF_DATA(t))\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    s->PrintString((const char*)D + t);\n",next,next);
+            break;
+        case 0x89 :
+            fprintf(File,"    if(sp == STACK_SIZE)\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    t = S[sp++];\n"
+                         "    if(OUT_OF_DATA(t))\n"
+                         "        LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "    s->ScanString((char*)D + t,DATA_SIZE - t);\n"
+                         "    if(ScanWritesCode(s,t))\n"
+                         "        LEAVE(0x%.4X,AOT_INTERPRET);\n",next,next,next);
+            break;
+        /*bulk memory , Bulk.c does the work*/
+        case 0x60 :
+        case 0x61 :
+        case 0x62 :
+        case 0x64 :
+            fprintf(File,"    {\n"
+                         "        AOT_BULK k;\n"
+                         "        if(!s->Bulk(s->AS,0x%.2X,r%d,r%d,r%d,r%d,&k))\n"
+                         "            LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "        zf = k.ZF;\n"
+                         "        cf = k.CF;\n"
+                         "        if(BulkWritesCode(r%d,k.WriteSize))\n"
+                         "            LEAVE(0x%.4X,AOT_INTERPRET);\n"
+                         "    }\n",op->Handler,d,s,op->Imm >> 4,op->Imm & 0x0F,next,d,next);
+            break;
+        case 0x63 :
+            fprintf(File,"    {\n"
+                         "        AOT_BULK k;\n"
+                         "        if(!s->Bulk(s->AS,0x63,0,r%d,0,0,&k))\n"
+                         "            LEAVE(0x%.4X,AOT_EXCEPTION);\n"
+                         "        r%d = k.Length;\n"
+                         "        zf = k.ZF;\n"
+                         "        cf = k.CF;\n"
+                         "    }\n",s,next,d);
+            break;
+        case 0xED :
+            fprintf(File,"    LEAVE(0x%.4X,AOT_EXIT);\n",next);
+            break;
+        case 0xE0 :
+            fprintf(File,"    SAVE();\n"
+                         "    return 0x%.4X;\n",op->Imm);
+            break;
+        default :
+            /*conditional jumps*/
+            fprintf(File,"    SAVE();\n"
+                         "    return %s ? 0x%.4X : 0x%.4X;\n",
+                    op->Handler == 0xE2 ? "zf" :
+                    op->Handler == 0xE3 ? "!zf" :
+                    op->Handler == 0xE4 ? "zf || !cf" :
+                    op->Handler == 0xE6 ? "zf || cf" :
+                    op->Handler == 0xE8 ? "cf && !zf" : "!cf && !zf",
+                    op->Imm,next);
+            break;
+    }
+}
+/*
+Write the C translation of the code reachable from IP 0 of AS to File.
+Returns the number of blocks compiled (the Valid ones).
+*/
+DWORD VmAotTranslate(PADDRESS_SPACE AS,FILE* File)
+{
+    PVM_CFG Cfg;
+    PVM_BLOCK block;
+    DECODED_OP op;
+    BYTE code[VM_DATA_SIZE/8];
+    DWORD i,j,ip,count = 0;
+    Cfg = (PVM_CFG) malloc(sizeof(VM_CFG));
+    if(!Cfg)
+        return 0;
+    VmVerify(AS,Cfg,0);
+    memset(code,0,sizeof(code));
+    for(i = 0;i < Cfg->Count;i++)
+    {
+        block = &Cfg->Blocks[i];
+        if(!block->Valid)
+            continue;
+        for(ip = block->Start;ip < block->End;ip++)
+            AOT_SET(code,ip);
+    }
+    AotEmitPrologue(File);
+    AotEmitData(File,"CodeMap",code,sizeof(code));
+    AotEmitData(File,"Image",AS->data,VM_DATA_SIZE);
+    fprintf(File,"/*the input of 89 was written into compiled code*/\n"
+                 "static inline int ScanWritesCode(VM_AOT_STATE* s,WORD addr)\n"
+                 "{\n"
+                 "    DWORD size = (DWORD)strlen((char*)s->Data + addr) + 1,i;\n"
+                 "    s->MarkDirty(s->AS,addr,size);\n"
+                 "    for(i = addr;i < (DWORD)addr + size && i < DATA_SIZE;i++)\n"
+                 "    {\n"
+                 "        if(IS_CODE(i))\n"
+                 "            return 1;\n"
+                 "    }\n"
+                 "    return 0;\n"
+                 "}\n"
+                 "/*a bulk opcode wrote into compiled code*/\n"
+                 "static inline int BulkWritesCode(WORD addr,DWORD size)\n"
+                 "{\n"
+                 "    DWORD i;\n"
+                 "    for(i = addr;i < (DWORD)addr + size;i++)\n"
+                 "    {\n"
+                 "        if(IS_CODE(i))\n"
+                 "            return 1;\n"
+                 "    }\n"
+                 "    return 0;\n"
+                 "}\n");
+    for(i = 0;i < Cfg->Count;i++)
+    {
+        block = &Cfg->Blocks[i];
+        if(!block->Valid)
+            continue;
+        fprintf(File,"static inline int B_%.4X(AOT_REGS* x,VM_AOT_STATE* s)\n"
+                     "{\n"
+                     "    LOAD();\n",block->Start);
+        for(ip = block->Start;ip < block->End;ip += op.Length)
+        {
+            VmDecodeInstruction(AS,ip,&op);
+            AotEmitInstruction(File,&op,code);
+        }
+        /*the block ends at a leader*/
+        if(op.Handler != 0xED && !(op.Handler >= 0xE0 && op.Handler <= 0xEC))
+            fprintf(File,"    SAVE();\n"
+                         "    return 0x%.4X;\n",block->End);
+        fprintf(File,"}\n");
+        count++;
+    }
+    fprintf(File,"static int Run(VM_AOT_STATE* s)\n"
+                 "{\n"
+                 "    AOT_REGS x;\n"
+                 "    int ip = s->IP;\n"
+                 "    memcpy(x.R,s->GPRs,sizeof(x.R));\n"
+                 "    x.SP = s->SP;\n"
+                 "    x.ZF = s->ZF;\n"
+                 "    x.CF = s->CF;\n"
+                 "    goto dispatch;\n");
+    for(i = 0;i < Cfg->Count;i++)
+    {
+        block = &Cfg->Blocks[i];
+        if(!block->Valid)
+            continue;
+        fprintf(File,"L_%.4X :\n"
+                     "    ip = B_%.4X(&x,s);\n",block->Start,block->Start);
+        for(j = 0;j < 2;j++)
+        {
+            if(block->Next[j] != VM_NO_BLOCK && Cfg->Blocks[block->Next[j]].Valid)
+                fprintf(File,"    if(ip == 0x%.4X)\n"
+                             "        goto L_%.4X;\n",Cfg->Blocks[block->Next[j]].Start,Cfg->Blocks[block->Next[j]].Start);
+        }
+        fprintf(File,"    goto dispatch;\n");
+    }
+    fprintf(File,"dispatch :\n"
+                 "    switch(ip)\n"
+                 "    {\n");
+    for(i = 0;i < Cfg->Count;i++)
+    {
+        block = &Cfg->Blocks[i];
+        if(block->Valid)
+            fprintf(File,"        case 0x%.4X : goto L_%.4X;\n",block->Start,block->Start);
+    }
+    fprintf(File,"    }\n"
+                 "    /*not a compiled block*/\n"
+                 "    if(ip >= 0)\n"
+                 "    {\n"
+                 "        s->IP = (WORD)ip;\n"
+                 "        ip = -AOT_INTERPRET;\n"
+                 "    }\n"
+                 "    memcpy(s->GPRs,x.R,sizeof(x.R));\n"
+                 "    s->SP = x.SP;\n"
+                 "    s->ZF = x.ZF;\n"
+                 "    s->CF = x.CF;\n"
+                 "    return -ip;\n"
+                 "}\n"
+                 "#ifdef _WIN32\n"
+                 "__declspec(dllexport)\n"
+                 "#endif\n"
+                 "const VM_AOT_INFO vm_aot_info = {%d,DATA_SIZE,STACK_SIZE,CodeMap,Image,Run};\n",VM_AOT_VERSION);
+    free(Cfg);
+    return count;
+}
+/*
+compile Source into the shared object Library with $CC (cc by default). The
+compiler is run with an argument list , not through the shell : $CC names the
+program only and the paths are passed as they are.
+*/
+boolean VmAotBuild(const char* Source,const char* Library)
+{
+    const char* cc = getenv("CC");
+    char* argv[8];
+#ifndef _WIN32
+    pid_t pid;
+#endif
+    int status;
+    if(!cc || !*cc)
+        cc = "cc";
+    argv[0] = (char*)cc;
+    argv[1] = (char*)"-O2";
+    argv[2] = (char*)"-shared";
+    argv[3] = (char*)"-fPIC";
+    argv[4] = (char*)"-o";
+    argv[5] = (char*)Library;
+    argv[6] = (char*)Source;
+    argv[7] = NULL;
+#ifdef _WIN32
+    status = (int)_spawnvp(_P_WAIT,cc,(const char* const*)argv);
+    return status == 0;
+#else
+    if(posix_spawnp(&pid,cc,NULL,NULL,argv,environ))
+        return FALSE;
+    if(waitpid(pid,&status,0) != pid)
+        return FALSE;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+/*load a library made by VmAotBuild , NULL if it can't be loaded or was made for another VM build*/
+PVM_AOT VmAotLoad(const char* Library)
+{
+    PVM_AOT Aot = (PVM_AOT) calloc(1,sizeof(struct VM_AOT));
+#ifndef _WIN32
+    char* path;
+#endif
+    if(!Aot)
+        return NULL;
+#ifdef _WIN32
+    Aot->Handle = LoadLibraryA(Library);
+    if(Aot->Handle)
+        Aot->Info = (const VM_AOT_INFO*) GetProcAddress((HMODULE)Aot->Handle,"vm_aot_info");
+#else
+    /*dlopen only looks in the current directory for a path*/
+    path = (char*) malloc(strlen(Library) + 3);
+    if(path)
+    {
+        sprintf(path,"%s%s",strchr(Library,'/') ? "" : "./",Library);
+        Aot->Handle = dlopen(path,RTLD_NOW | RTLD_LOCAL);
+        free(path);
+    }
+    if(Aot->Handle)
+        Aot->Info = (const VM_AOT_INFO*) dlsym(Aot->Handle,"vm_aot_info");
+#endif
+    if(!Aot->Info || Aot->Info->Version != VM_AOT_VERSION ||
+       Aot->Info->DataSize != VM_DATA_SIZE || Aot->Info->StackSize != VM_STACK_SIZE)
+    {
+        VmAotRelease(Aot);
+        return NULL;
+    }
+    return Aot;
+}
+void VmAotRelease(PVM_AOT Aot)
+{
+    if(Aot->Handle)
+    {
+#ifdef _WIN32
+        FreeLibrary((HMODULE)Aot->Handle);
+#else
+        dlclose(Aot->Handle);
+#endif
+    }
+    free(Aot);
+}
+/*TRUE if the compiled code bytes of AS are the ones the library was translated from*/
+static boolean AotMatches(const VM_AOT_INFO* Info,PADDRESS_SPACE AS)
+{
+    DWORD i,addr;
+    for(i = 0;i < VM_DATA_SIZE/8;i++)
+    {
+        if(!Info->CodeMap[i])
+            continue;
+        for(addr = i * 8;addr < i * 8 + 8;addr++)
+        {
+            if(AOT_BIT(Info->CodeMap,addr) && AS->data[addr] != Info->Image[addr])
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+/*
+Run from Regs->IP on the native code of Aot , and on VmLoop from where it stops
+unless it exited or raised an exception. Aot can be NULL.
+*/
+void VmLoopAot(PADDRESS_SPACE AS,PREGS Regs,PVM_AOT Aot)
+{
+    VM_AOT_STATE state;
+    int status;
+    if(!Aot || !AotMatches(Aot->Info,AS))
+    {
+        VmLoop(AS,Regs);
+        return;
+    }
+    memcpy(state.GPRs,Regs->GPRs,sizeof(state.GPRs));
+    state.IP = Regs->IP;
+    state.SP = Regs->SP;
+    state.ZF = Regs->ZF;
+    state.CF = Regs->CF;
+    state.Data = AS->data;
+    state.Stack = AS->stack;
+    state.Dirty = AS->Dirty;
+    state.AS = AS;
+    state.PrintInteger = VmPrintInteger;
+    state.PrintString = VmPrintString;
+    state.ScanString = VmScanString;
+    state.MarkDirty = VmMarkDirty;
+    state.Bulk = VmBulk;
+    status = Aot->Info->Run(&state);
+    memcpy(Regs->GPRs,state.GPRs,sizeof(Regs->GPRs));
+    Regs->IP = state.IP;
+    Regs->SP = state.SP;
+    Regs->ZF = state.ZF;
+    Regs->CF = state.CF;
+    if(status == VM_AOT_INTERPRET)
+        VmLoop(AS,Regs);
+}
+/*vm -aot program library : translate program into library.c and build library*/
+int VmAotMain(const char* Program,const char* Library)
+{
+    PVM_IMAGE image;
+    PVM_CONTEXT context = NULL;
+    FILE* File;
+    char* source = NULL;
+    DWORD count;
+    int status = 1;
+    image = VmImageOpen(Program);
+    if(!image)
+    {
+        printf("Found trouble opening the file");
+        return 1;
+    }
+    context = VmCreateContext();
+    source = (char*) malloc(strlen(Library) + 3);
+    if(!context || !source)
+        goto done;
+    sprintf(source,"%s.c",Library);
+    File = fopen(source,"w");
+    if(!File)
+    {
+        printf("Found trouble creating %s",source);
+        goto done;
+    }
+    VmImageLoad(image,context);
+    count = VmAotTranslate(&context->AS,File);
+    fclose(File);
+    if(!VmAotBuild(source,Library))
+    {
+        printf("Found trouble compiling %s",source);
+        goto done;
+    }
+    printf("%u blocks compiled into %s\n",count,Library);
+    status = 0;
+done:
+    if(context)
+    {
+        context->Image = NULL;
+        VmDestroyContext(context);
+    }
+    VmImageRelease(image);
+    free(source);
+    return status;
+}
+/*vm -native library [program] : run program (vm_file by default) on library*/
+int VmNativeMain(const char* Library,const char* Program)
+{
+    PVM_IMAGE image = NULL;
+    PVM_CONTEXT context = NULL;
+    PVM_AOT Aot;
+    int status = 1;
+    Aot = VmAotLoad(Library);
+    if(!Aot)
+    {
+        printf("Found trouble loading %s",Library);
+        return 1;
+    }
+    image = VmImageOpen(Program);
+    if(!image)
+    {
+        printf("Found trouble opening the file");
+        goto done;
+    }
+    context = VmCreateContext();
+    if(!context)
+        goto done;
+    VmImageLoad(image,context);
+    VmLoopAot(&context->AS,&context->Regs,Aot);
+    VmFlushIo(NULL);
+    status = 0;
+done:
+    if(context)
+    {
+        context->Image = NULL;
+        VmDestroyContext(context);
+    }
+    if(image)
+        VmImageRelease(image);
+    VmAotRelease(Aot);
+    return status;
+}
@@ -0,0 +1,191 @@
+/*
+Embedding API.
+A program linking the VM (built with VM_NO_MAIN) runs VM programs in-process :
+it takes a context from a pool , loads a program into it from an image
+(VmImageOpen , VmImageFromMemory) or from plain memory , runs it with its own
+VM_IO (Sink and Reader callbacks) and reads the registers and memory back.
+
+A pool allocates its contexts SlabSize at a time in one cache-aligned block ,
+every context holds the address space , the registers and the engine state so
+that a run touches a single allocation. Released contexts go on a free list and
+the next VmPoolAcquire takes one back without going through the allocator , an
+engine state made by an earlier run (e.g. the executable buffer of the JIT) is
+kept. A pool is not locked : each thread uses its own.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+struct VM_POOL
+{
+    DWORD SlabSize;
+    /*slabs of SlabSize contexts*/
+    PVM_CONTEXT* Slabs;
+    DWORD SlabCount;
+    /*released contexts , room for all the contexts of the slabs*/
+    PVM_CONTEXT* Free;
+    DWORD FreeCount;
+};
+static void* PoolAlloc(size_t Size)
+{
+    void* block;
+#ifdef _WIN32
+    block = _aligned_malloc(Size,64);
+#else
+    if(posix_memalign(&block,64,Size))
+        block = NULL;
+#endif
+    return block;
+}
+static void PoolFree(void* Block)
+{
+#ifdef _WIN32
+    _aligned_free(Block);
+#else
+    free(Block);
+#endif
+}
+/*SlabSize contexts are allocated at a time (VM_POOL_SLAB if 0)*/
+PVM_POOL VmPoolCreate(DWORD SlabSize)
+{
+    PVM_POOL Pool = (PVM_POOL) calloc(1,sizeof(struct VM_POOL));
+    if(Pool)
+        Pool->SlabSize = SlabSize ? SlabSize : VM_POOL_SLAB;
+    return Pool;
+}
+/*one more slab , its contexts go on the free list*/
+static boolean PoolGrow(PVM_POOL Pool)
+{
+    PVM_CONTEXT* slabs;
+    PVM_CONTEXT* free_list;
+    PVM_CONTEXT slab;
+    DWORD i;
+    slabs = (PVM_CONTEXT*) realloc(Pool->Slabs,(Pool->SlabCount + 1) * sizeof(PVM_CONTEXT));
+    if(!slabs)
+        return FALSE;
+    Pool->Slabs = slabs;
+    free_list = (PVM_CONTEXT*) realloc(Pool->Free,(Pool->SlabCount + 1) * Pool->SlabSize * sizeof(PVM_CONTEXT));
+    if(!free_list)
+        return FALSE;
+    Pool->Free = free_list;
+    slab = (PVM_CONTEXT) PoolAlloc(Pool->SlabSize * sizeof(VM_CONTEXT));
+    if(!slab)
+        return FALSE;
+    memset(slab,0,Pool->SlabSize * sizeof(VM_CONTEXT));
+    Pool->Slabs[Pool->SlabCount++] = slab;
+    /*handed out in address order*/
+    for(i = Pool->SlabSize;i--;)
+    {
+        VmResetRegs(&slab[i].Regs);
+        Pool->Free[Pool->FreeCount++] = &slab[i];
+    }
+    return TRUE;
+}
+/*a context from the pool , its address space is whatever it was released with until it is loaded*/
+PVM_CONTEXT VmPoolAcquire(PVM_POOL Pool)
+{
+    if(!Pool->FreeCount && !PoolGrow(Pool))
+        return NULL;
+    return Pool->Free[--Pool->FreeCount];
+}
+void VmPoolRelease(PVM_POOL Pool,PVM_CONTEXT Context)
+{
+    Context->Image = NULL;
+    Pool->Free[Pool->FreeCount++] = Context;
+}
+/*frees every context of the pool , released or not*/
+void VmPoolDestroy(PVM_POOL Pool)
+{
+    DWORD i;
+#ifdef VM_JIT
+    DWORD j;
+#endif
+    for(i = 0;i < Pool->SlabCount;i++)
+    {
+#ifdef VM_JIT
+        for(j = 0;j < Pool->SlabSize;j++)
+            VmJitRelease(&Pool->Slabs[i][j].Jit);
+#endif
+        PoolFree(Pool->Slabs[i]);
+    }
+    free(Pool->Slabs);
+    free(Pool->Free);
+    free(Pool);
+}
+/*
+The context becomes a fresh instance of the Size bytes of Program (at most
+VM_DATA_SIZE). Unlike an image nothing is shared with other contexts , every run
+makes its own analyses of the code.
+*/
+boolean VmLoadMemory(PVM_CONTEXT Context,const BYTE* Program,DWORD Size)
+{
+    if(Size > VM_DATA_SIZE)
+        return FALSE;
+    memset(&Context->AS,0,sizeof(Context->AS));
+    memcpy(Context->AS.data,Program,Size);
+    VmResetRegs(&Context->Regs);
+    Context->Image = NULL;
+    return TRUE;
+}
+/*back to a fresh instance of the image it was loaded from , or to an empty address space*/
+void VmResetContext(PVM_CONTEXT Context)
+{
+    if(Context->Image)
+    {
+        VmImageLoad(Context->Image,Context);
+        return;
+    }
+    memset(&Context->AS,0,sizeof(Context->AS));
+    VmResetRegs(&Context->Regs);
+}
+/*run with the engine selected at build time , the output is flushed to Io before it returns*/
+void VmRun(PVM_CONTEXT Context,PVM_IO Io)
+{
+    VmSetIo(Io);
+    VmRunContext(Context);
+    VmFlushIo(Io);
+    VmSetIo(NULL);
+}
+/*
+Run at most Blocks basic blocks (fuel , see Sched.c) with VmLoop. Returns
+VM_STOP_FUEL if the program can be resumed by calling again , VM_STOP_INPUT if it
+waits for a line of an open input (Io->InputOpen) , VM_STOP_EXIT or
+VM_STOP_EXCEPTION when it stopped.
+*/
+int VmStep(PVM_CONTEXT Context,PVM_IO Io,uint64_t Blocks)
+{
+    int status;
+    VmSetIo(Io);
+    status = VmLoopFuel(&Context->AS,&Context->Regs,&Blocks);
+    VmFlushIo(Io);
+    VmSetIo(NULL);
+    return status;
+}
+/*
+Memory is addressed as data then stack (the stack starts at VM_DATA_SIZE) , the
+stack WORDs are in host order. FALSE if the range doesn't fit.
+*/
+boolean VmReadMemory(PVM_CONTEXT Context,DWORD Offset,void* Buffer,DWORD Size)
+{
+    if(Offset > VM_DATA_SIZE + VM_STACK_SIZE * 2 || Size > VM_DATA_SIZE + VM_STACK_SIZE * 2 - Offset)
+        return FALSE;
+    memcpy(Buffer,(BYTE*)&Context->AS + Offset,Size);
+    return TRUE;
+}
+/*the written pages are marked dirty for VmRestore*/
+boolean VmWriteMemory(PVM_CONTEXT Context,DWORD Offset,const void* Buffer,DWORD Size)
+{
+    if(Offset > VM_DATA_SIZE + VM_STACK_SIZE * 2 || Size > VM_DATA_SIZE + VM_STACK_SIZE * 2 - Offset)
+        return FALSE;
+    memcpy((BYTE*)&Context->AS + Offset,Buffer,Size);
+    VmMarkDirty(&Context->AS,Offset,Size);
+    return TRUE;
+}
+void VmGetRegs(PVM_CONTEXT Context,PREGS Regs)
+{
+    *Regs = Context->Regs;
+}
+void VmSetRegs(PVM_CONTEXT Context,const REGS* Regs)
+{
+    Context->Regs = *Regs;
+}
@@ -0,0 +1,416 @@
+/*
+Batch runner.
+vm -batch manifest [threads] runs every job of the manifest on a pool of worker
+threads. Each line of the manifest is a job :
+
+    program [input]
+
+program is a vm_file image and input an optional file whose lines feed the scan
+instruction (0x89) , lines starting with '#' are comments. Each input file is
+read once and shared read-only by the jobs that name it , programs are images of
+the cache (Cache.c) so jobs of the same program also share its decoded stream and
+CFG.
+
+Every worker owns one VM_CONTEXT that it reuses for all of its jobs and a
+work-stealing deque (Chase-Lev) holding indexes into the job array. The jobs are
+dealt round-robin to the deques before the workers start , a worker pops from the
+bottom of its own deque and when it runs dry steals from the top of the others.
+Output is captured in a per-job VM_IO buffer and written in manifest order once
+all the workers are done.
+A worker keeps a snapshot of the loaded program , when it runs the same program
+again (e.g. one program over many inputs) only the pages dirtied by the previous
+job are reset.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#define BATCH_MAX_LINE 1024
+typedef struct
+{
+    char* Name;
+    BYTE* Data;
+    DWORD Size;
+    PVM_IMAGE Image;
+}BATCH_FILE,*PBATCH_FILE;
+typedef struct
+{
+    PBATCH_FILE Program;
+    PBATCH_FILE Input;
+    VM_IO Io;
+}BATCH_JOB,*PBATCH_JOB;
+/*Top and Bottom on their own cache lines , thieves only touch Top*/
+typedef struct VM_CACHE_ALIGNED
+{
+    VM_CACHE_ALIGNED atomic_long Top;
+    VM_CACHE_ALIGNED atomic_long Bottom;
+    DWORD* Jobs;
+    long Capacity;
+}BATCH_DEQUE,*PBATCH_DEQUE;
+typedef struct
+{
+    PBATCH_JOB Jobs;
+    DWORD JobCount;
+    PBATCH_FILE Files;
+    DWORD FileCount;
+    PBATCH_DEQUE Deques;
+    int Threads;
+}BATCH,*PBATCH;
+typedef struct
+{
+    PBATCH Batch;
+    int Id;
+}BATCH_WORKER,*PBATCH_WORKER;
+/*only the owner pushes , all pushes happen before the workers start*/
+static void DequePush(PBATCH_DEQUE Deque,DWORD Job)
+{
+    long bottom = atomic_load_explicit(&Deque->Bottom,memory_order_relaxed);
+    Deque->Jobs[bottom % Deque->Capacity] = Job;
+    atomic_store_explicit(&Deque->Bottom,bottom + 1,memory_order_release);
+}
+/*owner side , FALSE when empty*/
+static boolean DequePop(PBATCH_DEQUE Deque,DWORD* Job)
+{
+    long bottom = atomic_load_explicit(&Deque->Bottom,memory_order_relaxed) - 1;
+    long top;
+    boolean found = TRUE;
+    atomic_store_explicit(&Deque->Bottom,bottom,memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&Deque->Top,memory_order_relaxed);
+    if(top > bottom)
+    {
+        atomic_store_explicit(&Deque->Bottom,bottom + 1,memory_order_relaxed);
+        return FALSE;
+    }
+    *Job = Deque->Jobs[bottom % Deque->Capacity];
+    if(top == bottom)
+    {
+        /*last job , race the thieves for it*/
+        if(!atomic_compare_exchange_strong_explicit(&Deque->Top,&top,top + 1,
+                                                    memory_order_seq_cst,memory_order_relaxed))
+            found = FALSE;
+        atomic_store_explicit(&Deque->Bottom,bottom + 1,memory_order_relaxed);
+    }
+    return found;
+}
+/*thief side , FALSE when empty or when another thread won the job*/
+static boolean DequeSteal(PBATCH_DEQUE Deque,DWORD* Job)
+{
+    long top = atomic_load_explicit(&Deque->Top,memory_order_acquire);
+    long bottom;
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&Deque->Bottom,memory_order_acquire);
+    if(top >= bottom)
+        return FALSE;
+    *Job = Deque->Jobs[top % Deque->Capacity];
+    return atomic_compare_exchange_strong_explicit(&Deque->Top,&top,top + 1,
+                                                   memory_order_seq_cst,memory_order_relaxed);
+}
+/*next job for worker Id , its own deque first then the others'*/
+static boolean BatchNextJob(PBATCH Batch,int Id,DWORD* Job)
+{
+    int i,victim;
+    boolean retry;
+    if(DequePop(&Batch->Deques[Id],Job))
+        return TRUE;
+    do
+    {
+        retry = FALSE;
+        for(i = 1;i < Batch->Threads;i++)
+        {
+            victim = (Id + i) % Batch->Threads;
+            if(DequeSteal(&Batch->Deques[victim],Job))
+                return TRUE;
+            /*lost a race , the deque may still hold jobs*/
+            if(atomic_load(&Batch->Deques[victim].Top) < atomic_load(&Batch->Deques[victim].Bottom))
+                retry = TRUE;
+        }
+    }while(retry);
+    return FALSE;
+}
+/*a fresh instance of the program of Job*/
+static void BatchLoadJob(PVM_CONTEXT Context,PBATCH_JOB Job)
+{
+    VmImageLoad(Job->Program->Image,Context);
+}
+static void BatchRunJob(PVM_CONTEXT Context,PVM_SNAPSHOT Snapshot,PBATCH_FILE* Loaded,PBATCH_JOB Job)
+{
+    if(*Loaded == Job->Program)
+        VmRestore(Snapshot,&Context->AS,&Context->Regs);
+    else
+    {
+        BatchLoadJob(Context,Job);
+        VmSnapshot(Snapshot,&Context->AS,&Context->Regs);
+        *Loaded = Job->Program;
+    }
+    VmSetIo(&Job->Io);
+    VmRunContext(Context);
+    VmSetIo(NULL);
+}
+#ifdef _WIN32
+static DWORD WINAPI BatchWorker(LPVOID Parameter)
+#else
+static void* BatchWorker(void* Parameter)
+#endif
+{
+    PBATCH_WORKER Worker = (PBATCH_WORKER) Parameter;
+    PVM_CONTEXT Context = VmCreateContext();
+    PVM_SNAPSHOT snapshot = (PVM_SNAPSHOT) malloc(sizeof(VM_SNAPSHOT));
+    PBATCH_FILE loaded = NULL;
+    DWORD job;
+    if(Context && snapshot)
+    {
+        while(BatchNextJob(Worker->Batch,Worker->Id,&job))
+            BatchRunJob(Context,snapshot,&loaded,&Worker->Batch->Jobs[job]);
+    }
+    if(Context)
+        VmDestroyContext(Context);
+    free(snapshot);
+    return 0;
+}
+/*read a whole file*/
+static BYTE* BatchReadFile(const char* Name,DWORD* Size)
+{
+    FILE* File = fopen(Name,"rb");
+    BYTE* data;
+    long size;
+    if(!File)
+        return NULL;
+    fseek(File,0,SEEK_END);
+    size = ftell(File);
+    rewind(File);
+    if(size < 0)
+    {
+        fclose(File);
+        return NULL;
+    }
+    data = (BYTE*) malloc(size ? size : 1);
+    if(data)
+        *Size = fread(data,1,size,File);
+    fclose(File);
+    return data;
+}
+/*files are shared between the jobs that name them , a program is opened as an image*/
+static PBATCH_FILE BatchGetFile(PBATCH Batch,const char* Name,boolean Program)
+{
+    DWORD i;
+    PBATCH_FILE file;
+    for(i = 0;i < Batch->FileCount;i++)
+    {
+        if(!strcmp(Batch->Files[i].Name,Name) && !Batch->Files[i].Image == !Program)
+            return &Batch->Files[i];
+    }
+    file = &Batch->Files[Batch->FileCount];
+    if(Program)
+        file->Image = VmImageOpen(Name);
+    else
+        file->Data = BatchReadFile(Name,&file->Size);
+    if(!file->Image && !file->Data)
+    {
+        printf("Found trouble loading %s\n",Name);
+        return NULL;
+    }
+    file->Name = strdup(Name);
+    Batch->FileCount++;
+    return file;
+}
+static boolean BatchLoadManifest(PBATCH Batch,const char* Manifest)
+{
+    FILE* File = fopen(Manifest,"r");
+    char line[BATCH_MAX_LINE],program[BATCH_MAX_LINE],input[BATCH_MAX_LINE];
+    DWORD lines = 0;
+    PBATCH_JOB job;
+    int fields;
+    if(!File)
+    {
+        printf("Found trouble opening the manifest");
+        return FALSE;
+    }
+    while(fgets(line,sizeof(line),File))
+        lines++;
+    rewind(File);
+    Batch->Jobs = (PBATCH_JOB) calloc(lines + 1,sizeof(BATCH_JOB));
+    Batch->Files = (PBATCH_FILE) calloc(2 * lines + 1,sizeof(BATCH_FILE));
+    if(!Batch->Jobs || !Batch->Files)
+    {
+        fclose(File);
+        return FALSE;
+    }
+    while(fgets(line,sizeof(line),File))
+    {
+        fields = sscanf(line,"%s %s",program,input);
+        if(fields < 1 || program[0] == '#')
+            continue;
+        job = &Batch->Jobs[Batch->JobCount];
+        job->Program = BatchGetFile(Batch,program,TRUE);
+        job->Input = fields == 2 ? BatchGetFile(Batch,input,FALSE) : NULL;
+        if(!job->Program || (fields == 2 && !job->Input))
+        {
+            fclose(File);
+            return FALSE;
+        }
+        if(job->Input)
+        {
+            job->Io.Input = (const char*) job->Input->Data;
+            job->Io.InputSize = job->Input->Size;
+        }
+        Batch->JobCount++;
+    }
+    fclose(File);
+    return TRUE;
+}
+/*one worker per CPU*/
+int VmDefaultThreads(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+/*the output of every job in manifest order*/
+static void BatchPrint(PBATCH Batch)
+{
+    DWORD i;
+    for(i = 0;i < Batch->JobCount;i++)
+    {
+        printf("[job %u] %s%s%s\n",i,Batch->Jobs[i].Program->Name,
+               Batch->Jobs[i].Input ? " " : "",Batch->Jobs[i].Input ? Batch->Jobs[i].Input->Name : "");
+        fwrite(Batch->Jobs[i].Io.Output,1,Batch->Jobs[i].Io.OutputSize,stdout);
+    }
+}
+static void BatchFree(PBATCH Batch)
+{
+    DWORD i;
+    for(i = 0;i < Batch->JobCount;i++)
+        free(Batch->Jobs[i].Io.Output);
+    for(i = 0;i < Batch->FileCount;i++)
+    {
+        free(Batch->Files[i].Name);
+        free(Batch->Files[i].Data);
+        if(Batch->Files[i].Image)
+            VmImageRelease(Batch->Files[i].Image);
+    }
+    free(Batch->Files);
+    free(Batch->Jobs);
+}
+int VmBatchMain(const char* Manifest,int Threads)
+{
+    BATCH batch;
+    PBATCH_WORKER workers;
+    DWORD i;
+    int t;
+#ifdef _WIN32
+    HANDLE* handles;
+#else
+    pthread_t* handles;
+#endif
+    memset(&batch,0,sizeof(batch));
+    if(!BatchLoadManifest(&batch,Manifest))
+        return 1;
+    if(Threads <= 0)
+        Threads = VmDefaultThreads();
+    if((DWORD)Threads > batch.JobCount)
+        Threads = batch.JobCount ? batch.JobCount : 1;
+    batch.Threads = Threads;
+    batch.Deques = (PBATCH_DEQUE) calloc(Threads,sizeof(BATCH_DEQUE));
+    workers = (PBATCH_WORKER) calloc(Threads,sizeof(BATCH_WORKER));
+    handles = calloc(Threads,sizeof(*handles));
+    if(!batch.Deques || !workers || !handles)
+        return 1;
+    for(t = 0;t < Threads;t++)
+    {
+        batch.Deques[t].Capacity = batch.JobCount / Threads + 1;
+        batch.Deques[t].Jobs = (DWORD*) malloc(batch.Deques[t].Capacity * sizeof(DWORD));
+        if(!batch.Deques[t].Jobs)
+            return 1;
+        workers[t].Batch = &batch;
+        workers[t].Id = t;
+    }
+    /*deal in reverse so each owner pops its jobs in manifest order*/
+    for(i = batch.JobCount;i-- > 0;)
+        DequePush(&batch.Deques[i % Threads],i);
+    for(t = 0;t < Threads;t++)
+    {
+#ifdef _WIN32
+        handles[t] = CreateThread(NULL,0,BatchWorker,&workers[t],0,NULL);
+#else
+        pthread_create(&handles[t],NULL,BatchWorker,&workers[t]);
+#endif
+    }
+    for(t = 0;t < Threads;t++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handles[t],INFINITE);
+        CloseHandle(handles[t]);
+#else
+        pthread_join(handles[t],NULL);
+#endif
+    }
+    BatchPrint(&batch);
+    for(t = 0;t < Threads;t++)
+        free(batch.Deques[t].Jobs);
+    free(batch.Deques);
+    BatchFree(&batch);
+    free(workers);
+    free(handles);
+    return 0;
+}
+/*
+vm -green manifest [quantum] : every job gets its own context and all of them run on
+this thread , Quantum basic blocks at a time (Sched.c).
+*/
+int VmGreenMain(const char* Manifest,DWORD Quantum)
+{
+    BATCH batch;
+    VM_SCHEDULER sched;
+    PVM_CONTEXT* contexts;
+    DWORD i;
+    int result = 0;
+    memset(&batch,0,sizeof(batch));
+    if(!BatchLoadManifest(&batch,Manifest))
+        return 1;
+    VmSchedInit(&sched,Quantum);
+    contexts = (PVM_CONTEXT*) calloc(batch.JobCount + 1,sizeof(PVM_CONTEXT));
+    if(!contexts)
+        return 1;
+    for(i = 0;i < batch.JobCount;i++)
+    {
+        contexts[i] = VmCreateContext();
+        if(!contexts[i])
+        {
+            result = 1;
+            break;
+        }
+        BatchLoadJob(contexts[i],&batch.Jobs[i]);
+        if(VmSchedAdd(&sched,contexts[i],&batch.Jobs[i].Io) == VM_NO_TASK)
+        {
+            result = 1;
+            break;
+        }
+    }
+    if(!result)
+    {
+        VmSchedRun(&sched);
+        BatchPrint(&batch);
+    }
+    for(i = 0;i < batch.JobCount;i++)
+    {
+        if(contexts[i])
+            VmDestroyContext(contexts[i]);
+    }
+    free(contexts);
+    VmSchedFree(&sched);
+    BatchFree(&batch);
+    return result;
+}
@@ -0,0 +1,127 @@
+/*
+Bulk memory and string opcodes.
+MEMCPY , MEMSET , MEMCMP , STRLEN and XORKEY work on whole ranges of data in one
+instruction instead of a loop of byte loads and stores. Every engine decodes the
+operands and calls VmBulk with the values of the registers , the ranges are checked
+once before anything is done : an instruction that raises an exception leaves the
+memory untouched.
+
+Copy , fill , compare and the search of the terminating 0 go through the C library ,
+its x86 versions are SSE2/AVX2 kernels picked for the CPU at load time. XORKEY has
+its own : a key shorter than BULK_PATTERN bytes is repeated into a pattern of a
+whole number of keys at least BULK_PATTERN long , then the data is XORed with the
+pattern 32 (AVX2) or 16 (SSE2) bytes at a time.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#define BULK_PATTERN 64
+/*Data ^= Key , Size bytes of both*/
+static void BulkXorRun(BYTE* Data,const BYTE* Key,DWORD Size)
+{
+    DWORD i = 0;
+#if defined(__AVX2__)
+    for(;i + 32 <= Size;i += 32)
+        _mm256_storeu_si256((__m256i*)(Data + i),_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(Data + i)),
+                                                                   _mm256_loadu_si256((const __m256i*)(Key + i))));
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    for(;i + 16 <= Size;i += 16)
+        _mm_storeu_si128((__m128i*)(Data + i),_mm_xor_si128(_mm_loadu_si128((const __m128i*)(Data + i)),
+                                                            _mm_loadu_si128((const __m128i*)(Key + i))));
+#endif
+    for(;i < Size;i++)
+        Data[i] ^= Key[i];
+}
+/*Data[i] ^= Key[i % KeySize] for the Size bytes of Data , in order*/
+static void BulkXor(BYTE* Data,DWORD Size,const BYTE* Key,DWORD KeySize)
+{
+    BYTE pattern[2 * BULK_PATTERN];
+    DWORD i,run;
+    /*a key inside the data changes while it is used , only the byte loop gives the same result*/
+    if(Key < Data + Size && Data < Key + KeySize)
+    {
+        for(i = 0;i < Size;i++)
+            Data[i] ^= Key[i % KeySize];
+        return;
+    }
+    if(KeySize < BULK_PATTERN && Size > KeySize)
+    {
+        run = KeySize * ((BULK_PATTERN + KeySize - 1) / KeySize);
+        for(i = 0;i < run;i++)
+            pattern[i] = Key[i % KeySize];
+        Key = pattern;
+        KeySize = run;
+    }
+    for(;Size;Data += run,Size -= run)
+    {
+        run = Size < KeySize ? Size : KeySize;
+        BulkXorRun(Data,Key,run);
+    }
+}
+/*
+Run the bulk instruction Opcode with the values of its registers : Dst and Src are
+addresses in data (Src is the fill byte for MEMSET) , Count is the number of bytes
+and Key the size of the key for XORKEY. The flags go to Result with the bytes
+written from Dst (marked dirty). Returns FALSE for an exception (a range that
+doesn't fit in data , an empty key).
+*/
+boolean VmBulk(PADDRESS_SPACE AS,BYTE Opcode,WORD Dst,WORD Src,WORD Count,WORD Key,PVM_BULK_RESULT Result)
+{
+    const BYTE* end;
+    int diff;
+    Result->Length = 0;
+    Result->ZF = Count == 0;
+    Result->CF = 0;
+    Result->WriteSize = 0;
+    switch(Opcode)
+    {
+        /*MEMCPY : overlapping ranges are copied like memmove*/
+        case 0x60 :
+            if((DWORD)Dst + Count > VM_DATA_SIZE || (DWORD)Src + Count > VM_DATA_SIZE)
+                return FALSE;
+            memmove(&AS->data[Dst],&AS->data[Src],Count);
+            break;
+        /*MEMSET*/
+        case 0x61 :
+            if((DWORD)Dst + Count > VM_DATA_SIZE)
+                return FALSE;
+            memset(&AS->data[Dst],(BYTE)Src,Count);
+            break;
+        /*MEMCMP : CF like CMP on the first bytes that differ*/
+        case 0x62 :
+            if((DWORD)Dst + Count > VM_DATA_SIZE || (DWORD)Src + Count > VM_DATA_SIZE)
+                return FALSE;
+            diff = memcmp(&AS->data[Dst],&AS->data[Src],Count);
+            Result->ZF = diff == 0;
+            Result->CF = diff < 0;
+            return TRUE;
+        /*STRLEN : without a 0 the string ends with data*/
+        case 0x63 :
+            if(VM_OUT_OF_DATA(Src))
+                return FALSE;
+            end = (const BYTE*) memchr(&AS->data[Src],0,VM_DATA_SIZE - Src);
+            Result->Length = end ? (WORD)(end - &AS->data[Src]) : (WORD)(VM_DATA_SIZE - Src);
+            /*the length of a 64 KB data without 0 wraps to 0 , ZF only says the string is empty*/
+            Result->ZF = end == &AS->data[Src];
+            Result->CF = end == NULL;
+            return TRUE;
+        /*XORKEY*/
+        case 0x64 :
+            if(!Key || (DWORD)Dst + Count > VM_DATA_SIZE || (DWORD)Src + Key > VM_DATA_SIZE)
+                return FALSE;
+            BulkXor(&AS->data[Dst],Count,&AS->data[Src],Key);
+            break;
+        default :
+            return FALSE;
+    }
+    Result->WriteSize = Count;
+    VmMarkDirty(AS,Dst,Count);
+    return TRUE;
+}
@@ -0,0 +1,310 @@
+/*
+Program image cache.
+VmImageOpen maps the program file read-only and hashes it (FNV-1a 64). Images are
+kept in a hash table keyed by content : when an image with the same bytes is
+already open the new mapping is dropped and the cached image is returned with one
+more reference , so N instances of a program share one mapping whatever the file
+names. The last VmImageRelease unmaps it. VmImageFromMemory does the same for a
+program an embedder has in memory , a new image keeps a copy of it.
+
+The decoded stream (VM_PREDECODE builds) and the CFG (VM_VERIFY builds) of an
+image are made once from entry 0 , under the cache lock , the first time they are
+asked for. An instance can start from them as long as it didn't change any byte
+they were made from : VmImageDecoded and VmImageCfg compare those bytes (the
+CodeMap of the decoded stream , the Code of the proven blocks) with the image and
+return NULL when they differ (self-modifying code , breakpoints of VmRunTo ...) ,
+the engine then makes its own private analysis as usual. The engines never write
+into the shared analyses , a write into code switches them to a private one.
+
+Instances still get a private copy of the image in their ADDRESS_SPACE : the
+engines address data as an array inside it , and the copy is one memcpy of
+VM_DATA_SIZE bytes where a copy-on-write mapping would take a page fault on the
+first write into each of its pages.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#define CACHE_BUCKETS 256
+struct VM_IMAGE
+{
+    uint64_t Hash;
+    const BYTE* Data;
+    DWORD Size;
+    /*Data is a mapping of the program file , or a copy of a program in memory*/
+    boolean Mapped;
+    DWORD RefCount;
+    PDECODED_PROGRAM Decoded;
+    PVM_CFG Cfg;
+    struct VM_IMAGE* Next;
+};
+static PVM_IMAGE CacheBuckets[CACHE_BUCKETS];
+#ifdef _WIN32
+static SRWLOCK CacheLock = SRWLOCK_INIT;
+#define CACHE_LOCK() AcquireSRWLockExclusive(&CacheLock)
+#define CACHE_UNLOCK() ReleaseSRWLockExclusive(&CacheLock)
+#else
+static pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK() pthread_mutex_lock(&CacheLock)
+#define CACHE_UNLOCK() pthread_mutex_unlock(&CacheLock)
+#endif
+static uint64_t CacheHash(const BYTE* Data,DWORD Size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    while(Size--)
+    {
+        hash ^= *Data++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+/*map Name read-only , an empty file gives Data NULL*/
+static boolean CacheMap(const char* Name,const BYTE** Data,DWORD* Size)
+{
+#ifdef _WIN32
+    HANDLE file,mapping;
+    LARGE_INTEGER size;
+    file = CreateFileA(Name,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return FALSE;
+    if(!GetFileSizeEx(file,&size) || size.QuadPart > VM_DATA_SIZE)
+    {
+        CloseHandle(file);
+        return FALSE;
+    }
+    *Size = (DWORD)size.QuadPart;
+    *Data = NULL;
+    if(*Size)
+    {
+        mapping = CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+        if(mapping)
+        {
+            *Data = (const BYTE*) MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return !*Size || *Data;
+#else
+    struct stat info;
+    void* map;
+    int file = open(Name,O_RDONLY);
+    if(file < 0)
+        return FALSE;
+    if(fstat(file,&info) || info.st_size > VM_DATA_SIZE)
+    {
+        close(file);
+        return FALSE;
+    }
+    *Size = (DWORD)info.st_size;
+    *Data = NULL;
+    if(*Size)
+    {
+        map = mmap(NULL,*Size,PROT_READ,MAP_PRIVATE,file,0);
+        if(map != MAP_FAILED)
+            *Data = (const BYTE*) map;
+    }
+    close(file);
+    return !*Size || *Data;
+#endif
+}
+static void CacheUnmap(const BYTE* Data,DWORD Size)
+{
+    if(!Data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(Data);
+#else
+    munmap((void*)Data,Size);
+#endif
+}
+/*
+The cached image with the content of Data or a new one : Mapped data becomes the
+data of the new image or is unmapped , other data is copied when it is new.
+*/
+static PVM_IMAGE CacheInsert(const BYTE* Data,DWORD Size,boolean Mapped)
+{
+    uint64_t hash = CacheHash(Data,Size);
+    PVM_IMAGE image;
+    BYTE* copy = NULL;
+    CACHE_LOCK();
+    for(image = CacheBuckets[hash % CACHE_BUCKETS];image;image = image->Next)
+    {
+        if(image->Hash == hash && image->Size == Size && !memcmp(image->Data,Data,Size))
+            break;
+    }
+    if(image)
+    {
+        image->RefCount++;
+        CACHE_UNLOCK();
+        if(Mapped)
+            CacheUnmap(Data,Size);
+        return image;
+    }
+    image = (PVM_IMAGE) calloc(1,sizeof(struct VM_IMAGE));
+    if(image && !Mapped && Size)
+    {
+        copy = (BYTE*) malloc(Size);
+        if(copy)
+            memcpy(copy,Data,Size);
+        else
+        {
+            free(image);
+            image = NULL;
+        }
+    }
+    if(image)
+    {
+        image->Hash = hash;
+        image->Data = Mapped ? Data : copy;
+        image->Size = Size;
+        image->Mapped = Mapped;
+        image->RefCount = 1;
+        image->Next = CacheBuckets[hash % CACHE_BUCKETS];
+        CacheBuckets[hash % CACHE_BUCKETS] = image;
+    }
+    CACHE_UNLOCK();
+    if(!image && Mapped)
+        CacheUnmap(Data,Size);
+    return image;
+}
+/*the cached image of the program file Name (at most VM_DATA_SIZE bytes) , NULL if it can't be read*/
+PVM_IMAGE VmImageOpen(const char* Name)
+{
+    const BYTE* data;
+    DWORD size;
+    if(!CacheMap(Name,&data,&size))
+        return NULL;
+    return CacheInsert(data,size,TRUE);
+}
+/*the cached image of a program in memory (at most VM_DATA_SIZE bytes) , Data can be freed once it returns*/
+PVM_IMAGE VmImageFromMemory(const BYTE* Data,DWORD Size)
+{
+    if(Size > VM_DATA_SIZE)
+        return NULL;
+    return CacheInsert(Data,Size,FALSE);
+}
+void VmImageRelease(PVM_IMAGE Image)
+{
+    PVM_IMAGE* link;
+    CACHE_LOCK();
+    if(--Image->RefCount)
+    {
+        CACHE_UNLOCK();
+        return;
+    }
+    for(link = &CacheBuckets[Image->Hash % CACHE_BUCKETS];*link != Image;link = &(*link)->Next);
+    *link = Image->Next;
+    CACHE_UNLOCK();
+    if(Image->Mapped)
+        CacheUnmap(Image->Data,Image->Size);
+    else
+        free((void*)Image->Data);
+    free(Image->Decoded);
+    free(Image->Cfg);
+    free(Image);
+}
+/*the context becomes a fresh instance of the image*/
+void VmImageLoad(PVM_IMAGE Image,PVM_CONTEXT Context)
+{
+    memset(&Context->AS,0,sizeof(Context->AS));
+    if(Image->Size)
+        memcpy(Context->AS.data,Image->Data,Image->Size);
+    VmResetRegs(&Context->Regs);
+    Context->Image = Image;
+}
+/*TRUE if every byte of AS set in Map is the byte of the image (0 past its end)*/
+static boolean CacheMatches(PVM_IMAGE Image,PADDRESS_SPACE AS,const BYTE* Map)
+{
+    DWORD i,addr;
+    BYTE expected;
+    for(i = 0;i < VM_DATA_SIZE/8;i++)
+    {
+        if(!Map[i])
+            continue;
+        for(addr = i * 8;addr < i * 8 + 8;addr++)
+        {
+            if(!(Map[i] & (1 << (addr & 7))))
+                continue;
+            expected = addr < Image->Size ? Image->Data[addr] : 0;
+            if(AS->data[addr] != expected)
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+/*a fresh instance of the image in a scratch address space*/
+static PADDRESS_SPACE CacheInstance(PVM_IMAGE Image)
+{
+    PADDRESS_SPACE AS = (PADDRESS_SPACE) calloc(1,sizeof(ADDRESS_SPACE));
+    if(AS && Image->Size)
+        memcpy(AS->data,Image->Data,Image->Size);
+    return AS;
+}
+/*
+The shared decoded stream of the image (fused unless VM_NO_FUSION) if AS still has
+the code it was decoded from , NULL otherwise. The fusion counters of
+VM_FUSION_STATS would be shared too , such builds don't share.
+*/
+const DECODED_PROGRAM* VmImageDecoded(PVM_IMAGE Image,PADDRESS_SPACE AS)
+{
+    PADDRESS_SPACE instance;
+#ifdef VM_FUSION_STATS
+    return NULL;
+#endif
+    CACHE_LOCK();
+    if(!Image->Decoded)
+    {
+        Image->Decoded = (PDECODED_PROGRAM) malloc(sizeof(DECODED_PROGRAM));
+        instance = CacheInstance(Image);
+        if(Image->Decoded && instance)
+        {
+            VmDecode(instance,Image->Decoded,0);
+#ifndef VM_NO_FUSION
+            VmFuse(Image->Decoded);
+#endif
+        }
+        else
+        {
+            free(Image->Decoded);
+            Image->Decoded = NULL;
+        }
+        free(instance);
+    }
+    CACHE_UNLOCK();
+    if(!Image->Decoded || !CacheMatches(Image,AS,Image->Decoded->CodeMap))
+        return NULL;
+    return Image->Decoded;
+}
+/*the shared CFG of the image if AS still has the code of its proven blocks , NULL otherwise*/
+const VM_CFG* VmImageCfg(PVM_IMAGE Image,PADDRESS_SPACE AS)
+{
+    PADDRESS_SPACE instance;
+    CACHE_LOCK();
+    if(!Image->Cfg)
+    {
+        Image->Cfg = (PVM_CFG) malloc(sizeof(VM_CFG));
+        instance = CacheInstance(Image);
+        if(Image->Cfg && instance)
+            VmVerify(instance,Image->Cfg,0);
+        else
+        {
+            free(Image->Cfg);
+            Image->Cfg = NULL;
+        }
+        free(instance);
+    }
+    CACHE_UNLOCK();
+    if(!Image->Cfg || !CacheMatches(Image,AS,Image->Cfg->Code))
+        return NULL;
+    return Image->Cfg;
+}
@@ -0,0 +1,310 @@
+/*
+On-disk checkpoints.
+A checkpoint file holds the state of a running VM so that a job whose process died
+goes on from its last checkpoint instead of IP 0. The file is mapped in memory and
+has two slots that are written in turn :
+
+    CHECKPOINT_HEADER   magic "VMCP" , CHECKPOINT_VERSION , VM_DATA_SIZE ,
+                        VM_STACK_SIZE and VM_PAGE_SIZE of the VM , then for every
+                        slot its state , the number of the checkpoint it holds and
+                        the registers , flags (ZF bit 0 , CF bit 1) , IP and SP
+    BYTE AS[2][]        the data then the stack of every slot , the first one at
+                        CHECKPOINT_HEADER_SIZE and both CHECKPOINT_SLOT_SIZE long
+
+VmCheckpoint takes over the dirty bits of the address space like VmSnapshot and
+only copies the pages the slot it writes is missing : the pages written since the
+previous checkpoint and the ones written before it (that went to the other slot).
+The first checkpoints of a file copy everything. A slot is CHECKPOINT_WRITING while
+its pages are copied and CHECKPOINT_VALID once its registers are in , a process that
+dies in the middle of a checkpoint leaves the previous one whole in the other slot.
+VmCheckpointRestore loads the valid slot with the highest number.
+
+The mapping is written back by the system , VmCheckpoint only starts the write of
+the pages it changed so that the VM doesn't wait for the disk.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#define CHECKPOINT_MAGIC   0x50434D56 /*"VMCP"*/
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_EMPTY   0
+#define CHECKPOINT_WRITING 1
+#define CHECKPOINT_VALID   2
+#define CHECKPOINT_AS_SIZE (VM_PAGES * VM_PAGE_SIZE)
+#define CHECKPOINT_HEADER_SIZE 4096
+#define CHECKPOINT_SLOT_SIZE ((CHECKPOINT_AS_SIZE + 4095) & ~4095)
+#define CHECKPOINT_FILE_SIZE (CHECKPOINT_HEADER_SIZE + 2 * CHECKPOINT_SLOT_SIZE)
+/*vm -checkpoint : blocks run between two looks at the clock , seconds between checkpoints*/
+#define CHECKPOINT_SLICE 1000000
+#define CHECKPOINT_SECONDS 10
+typedef struct
+{
+    DWORD State;
+    DWORD Reserved;
+    uint64_t Sequence;
+    WORD GPRs[4];
+    WORD IP;
+    WORD SP;
+    BYTE Flags;
+    BYTE Reserved2[7];
+}CHECKPOINT_SLOT,*PCHECKPOINT_SLOT;
+typedef struct
+{
+    DWORD Magic;
+    DWORD Version;
+    DWORD DataSize;
+    DWORD StackSize;
+    DWORD PageSize;
+    DWORD Reserved;
+    CHECKPOINT_SLOT Slots[2];
+}CHECKPOINT_HEADER,*PCHECKPOINT_HEADER;
+struct VM_CHECKPOINT
+{
+    BYTE* Map;
+    PCHECKPOINT_HEADER Header;
+    /*per slot : the pages that may differ from the address space*/
+    BYTE Stale[2][VM_PAGES / 8];
+    DWORD Next;         /*slot of the next checkpoint*/
+    uint64_t Sequence;  /*number of the last checkpoint*/
+};
+static BYTE* CheckpointSlot(PVM_CHECKPOINT Checkpoint,DWORD Slot)
+{
+    return Checkpoint->Map + CHECKPOINT_HEADER_SIZE + Slot * CHECKPOINT_SLOT_SIZE;
+}
+/*map Name , an empty or new file gets a header with both slots empty*/
+static BYTE* CheckpointMap(const char* Name)
+{
+    BYTE* map = NULL;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file,mapping;
+    LARGE_INTEGER file_size;
+    file = CreateFileA(Name,GENERIC_READ | GENERIC_WRITE,FILE_SHARE_READ,NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return NULL;
+    if(!GetFileSizeEx(file,&file_size) || (file_size.QuadPart && file_size.QuadPart != CHECKPOINT_FILE_SIZE))
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    size = file_size.QuadPart;
+    mapping = CreateFileMappingA(file,NULL,PAGE_READWRITE,0,CHECKPOINT_FILE_SIZE,NULL);
+    if(mapping)
+    {
+        map = (BYTE*) MapViewOfFile(mapping,FILE_MAP_WRITE,0,0,0);
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    struct stat info;
+    void* view;
+    int file = open(Name,O_RDWR | O_CREAT,0644);
+    if(file < 0)
+        return NULL;
+    if(fstat(file,&info) || (info.st_size && info.st_size != CHECKPOINT_FILE_SIZE) ||
+       (!info.st_size && ftruncate(file,CHECKPOINT_FILE_SIZE)))
+    {
+        close(file);
+        return NULL;
+    }
+    size = info.st_size;
+    view = mmap(NULL,CHECKPOINT_FILE_SIZE,PROT_READ | PROT_WRITE,MAP_SHARED,file,0);
+    if(view != MAP_FAILED)
+        map = (BYTE*) view;
+    close(file);
+#endif
+    /*the new file is zeroed : both slots are CHECKPOINT_EMPTY*/
+    if(map && !size)
+    {
+        ((PCHECKPOINT_HEADER)map)->Magic = CHECKPOINT_MAGIC;
+        ((PCHECKPOINT_HEADER)map)->Version = CHECKPOINT_VERSION;
+        ((PCHECKPOINT_HEADER)map)->DataSize = VM_DATA_SIZE;
+        ((PCHECKPOINT_HEADER)map)->StackSize = VM_STACK_SIZE;
+        ((PCHECKPOINT_HEADER)map)->PageSize = VM_PAGE_SIZE;
+    }
+    return map;
+}
+static void CheckpointUnmap(BYTE* Map)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(Map);
+#else
+    munmap(Map,CHECKPOINT_FILE_SIZE);
+#endif
+}
+/*
+Open the checkpoint file Name , it is created if it doesn't exist. NULL if it can't
+be mapped or isn't a checkpoint file of a VM with the same sizes.
+*/
+PVM_CHECKPOINT VmCheckpointOpen(const char* Name)
+{
+    PVM_CHECKPOINT Checkpoint;
+    PCHECKPOINT_HEADER header;
+    BYTE* map = CheckpointMap(Name);
+    if(!map)
+        return NULL;
+    header = (PCHECKPOINT_HEADER)map;
+    Checkpoint = (PVM_CHECKPOINT) calloc(1,sizeof(struct VM_CHECKPOINT));
+    if(!Checkpoint || header->Magic != CHECKPOINT_MAGIC || header->Version != CHECKPOINT_VERSION ||
+       header->DataSize != VM_DATA_SIZE || header->StackSize != VM_STACK_SIZE || header->PageSize != VM_PAGE_SIZE)
+    {
+        CheckpointUnmap(map);
+        free(Checkpoint);
+        return NULL;
+    }
+    Checkpoint->Map = map;
+    Checkpoint->Header = header;
+    memset(Checkpoint->Stale,0xFF,sizeof(Checkpoint->Stale));
+    Checkpoint->Sequence = header->Slots[0].Sequence > header->Slots[1].Sequence ? header->Slots[0].Sequence : header->Slots[1].Sequence;
+    return Checkpoint;
+}
+void VmCheckpointClose(PVM_CHECKPOINT Checkpoint)
+{
+    CheckpointUnmap(Checkpoint->Map);
+    free(Checkpoint);
+}
+/*
+Load the last complete checkpoint into AS and Regs , the VM resumes at the saved IP.
+FALSE if the file has none.
+*/
+boolean VmCheckpointRestore(PVM_CHECKPOINT Checkpoint,PADDRESS_SPACE AS,PREGS Regs)
+{
+    PCHECKPOINT_SLOT slots = Checkpoint->Header->Slots,slot;
+    DWORD i;
+    if(slots[0].State != CHECKPOINT_VALID && slots[1].State != CHECKPOINT_VALID)
+        return FALSE;
+    if(slots[1].State != CHECKPOINT_VALID || (slots[0].State == CHECKPOINT_VALID && slots[0].Sequence > slots[1].Sequence))
+        i = 0;
+    else
+        i = 1;
+    slot = &slots[i];
+    memcpy(AS,CheckpointSlot(Checkpoint,i),CHECKPOINT_AS_SIZE);
+    memset(AS->Dirty,0,sizeof(AS->Dirty));
+    VmResetRegs(Regs);
+    memcpy(Regs->GPRs,slot->GPRs,sizeof(Regs->GPRs));
+    Regs->IP = slot->IP;
+    Regs->SP = slot->SP;
+    Regs->ZF = slot->Flags & 1;
+    Regs->CF = (slot->Flags >> 1) & 1;
+    /*the slot is the address space , the other one is written next*/
+    memset(Checkpoint->Stale[i],0,sizeof(Checkpoint->Stale[i]));
+    memset(Checkpoint->Stale[i ^ 1],0xFF,sizeof(Checkpoint->Stale[i ^ 1]));
+    Checkpoint->Next = i ^ 1;
+    return TRUE;
+}
+/*
+Save AS and Regs as the next checkpoint (Regs.IP is where the VM resumes) , the
+dirty pages of AS are cleared. Returns the number of pages written.
+*/
+DWORD VmCheckpoint(PVM_CHECKPOINT Checkpoint,PADDRESS_SPACE AS,PREGS Regs)
+{
+    DWORD index = Checkpoint->Next,i,page,pages = 0;
+    PCHECKPOINT_SLOT slot = &Checkpoint->Header->Slots[index];
+    BYTE* image = CheckpointSlot(Checkpoint,index);
+    BYTE* stale = Checkpoint->Stale[index];
+    for(i = 0;i < sizeof(AS->Dirty);i++)
+    {
+        Checkpoint->Stale[0][i] |= AS->Dirty[i];
+        Checkpoint->Stale[1][i] |= AS->Dirty[i];
+        AS->Dirty[i] = 0;
+    }
+    slot->State = CHECKPOINT_WRITING;
+    atomic_thread_fence(memory_order_seq_cst);
+    for(i = 0;i < sizeof(Checkpoint->Stale[index]);i++)
+    {
+        if(!stale[i])
+            continue;
+        for(page = i * 8;page < i * 8 + 8;page++)
+        {
+            if(stale[i] & (1 << (page & 7)))
+            {
+                memcpy(image + page * VM_PAGE_SIZE,(BYTE*)AS + page * VM_PAGE_SIZE,VM_PAGE_SIZE);
+                pages++;
+            }
+        }
+        stale[i] = 0;
+    }
+    memcpy(slot->GPRs,Regs->GPRs,sizeof(slot->GPRs));
+    slot->IP = Regs->IP;
+    slot->SP = Regs->SP;
+    slot->Flags = Regs->ZF | (Regs->CF << 1);
+    slot->Sequence = ++Checkpoint->Sequence;
+    atomic_thread_fence(memory_order_seq_cst);
+    slot->State = CHECKPOINT_VALID;
+    Checkpoint->Next = index ^ 1;
+    /*start writing back , without waiting*/
+#ifdef _WIN32
+    FlushViewOfFile(Checkpoint->Map,CHECKPOINT_FILE_SIZE);
+#else
+    msync(Checkpoint->Map,CHECKPOINT_FILE_SIZE,MS_ASYNC);
+#endif
+    return pages;
+}
+/*
+vm -checkpoint file [seconds] [program] : run program (vm_file by default) with a
+checkpoint every seconds (CHECKPOINT_SECONDS by default) , or resume it from the
+last checkpoint in file. The file is deleted when the program stops.
+*/
+int VmCheckpointMain(const char* File,int Seconds,const char* Program)
+{
+    PVM_CHECKPOINT Checkpoint;
+    PVM_CONTEXT context;
+    PVM_IMAGE image;
+    uint64_t fuel;
+    time_t last;
+    int status;
+    if(Seconds <= 0)
+        Seconds = CHECKPOINT_SECONDS;
+    context = VmCreateContext();
+    if(!context)
+        return 1;
+    Checkpoint = VmCheckpointOpen(File);
+    if(!Checkpoint)
+    {
+        printf("Found trouble opening %s (or it isn't a checkpoint of this VM)",File);
+        return 1;
+    }
+    if(VmCheckpointRestore(Checkpoint,&context->AS,&context->Regs))
+        fprintf(stderr,"[checkpoint] resuming at %.4X\n",context->Regs.IP);
+    else
+    {
+        image = VmImageOpen(Program);
+        if(!image)
+        {
+            printf("Found trouble opening the file");
+            return 1;
+        }
+        VmImageLoad(image,context);
+        context->Image = NULL;
+        VmImageRelease(image);
+    }
+    last = time(NULL);
+    do
+    {
+        fuel = CHECKPOINT_SLICE;
+        status = VmLoopFuel(&context->AS,&context->Regs,&fuel);
+        if(status == VM_STOP_FUEL && time(NULL) - last >= Seconds)
+        {
+            /*the output so far isn't printed again after a restore*/
+            VmFlushIo(NULL);
+            VmCheckpoint(Checkpoint,&context->AS,&context->Regs);
+            last = time(NULL);
+        }
+    }while(status == VM_STOP_FUEL);
+    VmFlushIo(NULL);
+    VmCheckpointClose(Checkpoint);
+    remove(File);
+    VmDestroyContext(context);
+    return 0;
+}
@@ -0,0 +1,873 @@
+/*
+Pre-decoded instruction stream.
+VmDecode turns the code in AS->data into fixed-size DECODED_OPs, VmLoopDecoded
+runs over them. Semantics are the ones of VmLoop with two differences :
+- Running past the end of data is an exception (VmLoop would fetch from the stack
+  that follows data).
+- Operand bytes can't be read past the end of data , such instruction is an exception.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "VM.h"
+#ifdef VM_THREADED_DISPATCH
+#define VM_NEXT {op = pc++; goto *dispatch_table[op->Handler];}
+#else
+#define VM_NEXT break
+#endif
+#ifdef VM_FUSION_STATS
+#define VM_FUSED(kind) Program->FusedExecuted[(kind) - VM_FUSION_FIRST]++
+#else
+#define VM_FUSED(kind)
+#endif
+/*
+Decode one instruction at ip, the operand checks done by VmLoop at runtime
+that only depend on the encoding are done here.
+*/
+void VmDecodeInstruction(PADDRESS_SPACE AS,WORD ip,PDECODED_OP op)
+{
+    BYTE byte_val;
+    op->Handler = AS->data[ip];
+    op->Dst = 0;
+    op->Src = 0;
+    op->Imm = 0;
+    op->IP = ip;
+    switch(op->Handler)
+    {
+        /*no operands*/
+        case 0x90 :
+        case 0xC0 :
+        case 0xC2 :
+        case 0x89 :
+        case 0xED :
+            op->Length = 1;
+            return;
+        /*nibble-packed registers : high = dest , low = source*/
+        case 0x10 :
+        case 0xA5 :
+        case 0xA2 :
+        case 0x5C :
+        case 0x5D :
+        case 0xF0 :
+        case 0xF1 :
+        case 0x55 :
+        case 0x56 :
+        case 0x70 :
+        case 0x71 :
+        case 0x63 :
+            op->Length = 2;
+            if(ip + op->Length > VM_DATA_SIZE)
+                break;
+            byte_val = AS->data[ip + 1];
+            if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                break;
+            op->Dst = (byte_val & 0xF0) >> 4;
+            op->Src = byte_val & 0x0F;
+            return;
+        /*bulk memory : nibble-packed registers , then the count (high) and key (low) ones in Imm*/
+        case 0x60 :
+        case 0x61 :
+        case 0x62 :
+        case 0x64 :
+            op->Length = 3;
+            if(ip + op->Length > VM_DATA_SIZE)
+                break;
+            byte_val = AS->data[ip + 1];
+            if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                break;
+            op->Dst = (byte_val & 0xF0) >> 4;
+            op->Src = byte_val & 0x0F;
+            op->Imm = AS->data[ip + 2];
+            if((op->Imm & 0xF0) > 0x30 || (op->Imm & 0x0F) > 3)
+                break;
+            return;
+        /*register*/
+        case 0xAF :
+        case 0xAE :
+            op->Length = 2;
+            if(ip + op->Length > VM_DATA_SIZE || AS->data[ip + 1] > 3)
+                break;
+            op->Dst = AS->data[ip + 1];
+            return;
+        /*register , byte immediate*/
+        case 0x16 :
+        case 0xA1 :
+        case 0x51 :
+            op->Length = 3;
+            if(ip + op->Length > VM_DATA_SIZE || AS->data[ip + 1] > 3)
+                break;
+            op->Dst = AS->data[ip + 1];
+            op->Imm = AS->data[ip + 2];
+            return;
+        /*register , word immediate*/
+        case 0x18 :
+        case 0xAD :
+        case 0x5B :
+            op->Length = 4;
+            if(ip + op->Length > VM_DATA_SIZE || AS->data[ip + 1] > 3)
+                break;
+            op->Dst = AS->data[ip + 1];
+            op->Imm = *(WORD*)&AS->data[ip + 2];
+            return;
+        /*register , memory address*/
+        case 0x12 :
+        case 0x14 :
+        case 0x1c :
+        case 0x1f :
+            op->Length = 4;
+            if(ip + op->Length > VM_DATA_SIZE || AS->data[ip + 1] > 3)
+                break;
+            op->Dst = AS->data[ip + 1];
+            op->Imm = *(WORD*)&AS->data[ip + 2];
+            if(VM_OUT_OF_DATA(op->Imm))
+                break;
+            return;
+        /*jumps , the target is translated to an op index once everything is decoded*/
+        case 0xE0 :
+        case 0xE2 :
+        case 0xE3 :
+        case 0xE4 :
+        case 0xE6 :
+        case 0xE8 :
+        case 0xEC :
+            op->Length = 3;
+            if(ip + op->Length > VM_DATA_SIZE)
+                break;
+            op->Imm = *(WORD*)&AS->data[ip + 1];
+            if(VM_OUT_OF_DATA(op->Imm))
+                break;
+            return;
+        default :
+            op->Length = 1;
+            break;
+    }
+    /*the instruction raises an exception when executed*/
+    if(ip + op->Length > VM_DATA_SIZE)
+        op->Length = VM_DATA_SIZE - ip;
+    op->Handler = VM_OP_EXCEPTION;
+}
+/*
+The bit of a page is also set when the first byte of the next page is code , a word
+store tests the page of its first byte only.
+*/
+static void MarkCodePages(PDECODED_PROGRAM Program,DWORD addr,DWORD size)
+{
+    DWORD page;
+    if(!size)
+        return;
+    for(page = (addr ? addr - 1 : 0) >> VM_PAGE_SHIFT;page <= (addr + size - 1) >> VM_PAGE_SHIFT;page++)
+        Program->CodePages[page >> 3] |= 1 << (page & 7);
+}
+/*
+Decode all the code reachable from Entry that isn't decoded yet , after the ops of
+Program. Linear runs are decoded into consecutive ops (the fall-through of an op is
+the next op), a run ends at JMP , EXIT , an exception or when it reaches code that
+is already decoded (a VM_OP_GOTO is appended then). FALSE if Ops is full.
+*/
+static boolean DecodeRuns(PADDRESS_SPACE AS,PDECODED_PROGRAM Program,WORD Entry)
+{
+    WORD worklist[VM_DATA_SIZE + 1];
+    DWORD pending = 0,first = Program->Count,i;
+    WORD ip;
+    PDECODED_OP op;
+    worklist[pending++] = Entry;
+    while(pending)
+    {
+        ip = worklist[--pending];
+        if(!VM_OUT_OF_DATA(ip) && Program->Index[ip] != VM_NO_OP)
+            continue;
+        while(1)
+        {
+            if(Program->Count == VM_MAX_DECODED_OPS)
+                return FALSE;
+            op = &Program->Ops[Program->Count];
+            if(VM_OUT_OF_DATA(ip))
+            {
+                /*ran off the end of data*/
+                op->Handler = VM_OP_EXCEPTION;
+                op->Length = 0;
+                op->IP = ip;
+                Program->Count++;
+                break;
+            }
+            if(Program->Index[ip] != VM_NO_OP)
+            {
+                op->Handler = VM_OP_GOTO;
+                op->Length = 0;
+                op->Imm = Program->Index[ip];
+                op->IP = ip;
+                Program->Count++;
+                break;
+            }
+            Program->Index[ip] = Program->Count++;
+            VmDecodeInstruction(AS,ip,op);
+            for(i = ip;i < (DWORD)ip + op->Length;i++)
+                Program->CodeMap[i >> 3] |= 1 << (i & 7);
+            MarkCodePages(Program,ip,op->Length);
+            if(op->Handler >= 0xE0 && op->Handler <= 0xEC && Program->Index[op->Imm] == VM_NO_OP)
+                worklist[pending++] = op->Imm;
+            if(op->Handler == 0xE0 || op->Handler == 0xED || op->Handler == VM_OP_EXCEPTION)
+                break;
+            ip += op->Length;
+        }
+    }
+    /*every jump target has been decoded , translate them to op indexes*/
+    for(i = first;i < Program->Count;i++)
+    {
+        op = &Program->Ops[i];
+        if(op->Handler >= 0xE0 && op->Handler <= 0xEC)
+            op->Imm = Program->Index[op->Imm];
+    }
+    return TRUE;
+}
+/*
+Decode all the code reachable from Entry, the previous content of Program is discarded.
+Returns the index of the op at Entry.
+*/
+VM_INDEX VmDecode(PADDRESS_SPACE AS,PDECODED_PROGRAM Program,WORD Entry)
+{
+    Program->Count = 0;
+    memset(Program->Index,0xFF,sizeof(Program->Index));
+    memset(Program->Stale,0xFF,sizeof(Program->Stale));
+    memset(Program->CodeMap,0,sizeof(Program->CodeMap));
+    memset(Program->CodePages,0,sizeof(Program->CodePages));
+    /*a fresh stream always fits*/
+    DecodeRuns(AS,Program,Entry);
+    return VM_OUT_OF_DATA(Entry) ? 0 : Program->Index[Entry];
+}
+/*
+Returns TRUE if a write of size bytes at addr overwrites decoded code.
+*/
+static boolean IsCodeWrite(PDECODED_PROGRAM Program,DWORD addr,DWORD size)
+{
+    for(;size && addr < VM_DATA_SIZE;size--,addr++)
+    {
+        /*8 aligned bytes at a time for the bulk opcodes*/
+        if(!(addr & 7) && size >= 8)
+        {
+            if(Program->CodeMap[addr >> 3])
+                return TRUE;
+            addr += 7;
+            size -= 7;
+        }
+        else if(VM_IS_CODE(Program,addr))
+            return TRUE;
+    }
+    return FALSE;
+}
+static boolean IsJcc(BYTE opcode)
+{
+    return opcode >= 0xE2 && opcode <= 0xEC;
+}
+/*
+Condition of a conditional jump as a 4-bit mask indexed by ZF | CF << 1 ,
+bit n is set if the jump is taken for that combination of flags.
+*/
+static BYTE JccMask(BYTE opcode)
+{
+    switch(opcode)
+    {
+        case 0xE2 : return 0xA; /*ZF*/
+        case 0xE3 : return 0x5; /*!ZF*/
+        case 0xE4 : return 0xB; /*ZF || !CF*/
+        case 0xE6 : return 0xE; /*ZF || CF*/
+        case 0xE8 : return 0x4; /*CF && !ZF*/
+        case 0xEC : return 0x1; /*!CF && !ZF*/
+    }
+    return 0;
+}
+/*
+Detect the common sequences of the stream and fuse them.
+Ops that follow each other in the stream are fall-throughs so no jump can come between
+them , and a jump to one of the following ops still runs it alone. The fused handlers
+find the condition of a Jcc in its Dst field (unused by the jump handlers).
+*/
+static void FuseOps(PDECODED_PROGRAM Program,DWORD First)
+{
+    DWORD i;
+    PDECODED_OP op;
+    BYTE fused;
+    for(i = First;i + 1 < Program->Count;i++)
+    {
+        op = &Program->Ops[i];
+        fused = 0;
+        switch(op->Handler)
+        {
+            case 0x70 :
+                if(IsJcc(op[1].Handler))
+                    fused = VM_OP_CMP_JCC;
+                break;
+            case 0x71 :
+                if(IsJcc(op[1].Handler))
+                    fused = VM_OP_CMPL_JCC;
+                break;
+            case 0x56 :
+                if(i + 2 < Program->Count && op[1].Handler == 0x71 && IsJcc(op[2].Handler))
+                    fused = VM_OP_LOADB_CMPL_JCC;
+                else if(op[1].Handler == 0xF1)
+                    fused = VM_OP_LOADB_XORL;
+                else if(op[1].Handler == 0xA2)
+                    fused = VM_OP_LOADB_ADDL;
+                break;
+            case 0xAD :
+                if(i + 2 < Program->Count && op[1].Handler == 0x70 && IsJcc(op[2].Handler))
+                    fused = VM_OP_ADD_CMP_JCC;
+                else if(op[1].Handler == 0xE3)
+                    fused = VM_OP_ADD_JNZ;
+                break;
+            case 0x5B :
+                if(op[1].Handler == 0xE3)
+                    fused = VM_OP_SUB_JNZ;
+                break;
+        }
+        if(!fused)
+            continue;
+        op->Handler = fused;
+        Program->FusedSites[fused - VM_FUSION_FIRST]++;
+        if(IsJcc(op[1].Handler))
+            op[1].Dst = JccMask(op[1].Handler);
+        if(fused == VM_OP_LOADB_CMPL_JCC || fused == VM_OP_ADD_CMP_JCC)
+            op[2].Dst = JccMask(op[2].Handler);
+    }
+}
+void VmFuse(PDECODED_PROGRAM Program)
+{
+    memset(Program->FusedSites,0,sizeof(Program->FusedSites));
+    FuseOps(Program,0);
+}
+void VmFusionReport(PDECODED_PROGRAM Program)
+{
+    static const char* names[VM_FUSION_KINDS] =
+    {
+        "CMP ; Jcc",
+        "CMPL ; Jcc",
+        "MOVX [R] ; XORL",
+        "MOVX [R] ; ADDL",
+        "ADD imm ; JNZ",
+        "SUB imm ; JNZ",
+        "MOVX [R] ; CMPL ; Jcc",
+        "ADD imm ; CMP ; Jcc"
+    };
+    int i;
+    fprintf(stderr,"%-24s %8s %12s\n","fusion","sites","executed");
+    for(i = 0;i < VM_FUSION_KINDS;i++)
+        fprintf(stderr,"%-24s %8u %12llu\n",names[i],Program->FusedSites[i],(unsigned long long)Program->FusedExecuted[i]);
+}
+static VM_INDEX DecodeForInterpreter(PADDRESS_SPACE AS,PDECODED_PROGRAM Program,WORD Entry)
+{
+    VM_INDEX index = VmDecode(AS,Program,Entry);
+#ifndef VM_NO_FUSION
+    VmFuse(Program);
+#endif
+    return index;
+}
+/*
+Self-modifying code. The store handlers test the page bit (VM_IS_CODE_PAGE) before
+the byte bit , a store into a page without code costs one test. A write into
+decoded code makes the ops of the pages it hits stale and leaves the others alone :
+their addresses are forgotten and their Handler becomes VM_OP_STALE , the ops that
+jump or fall through to them still do and decode the code again from their IP
+(appended to the stream) when they run. A fused op is made stale with the ops it
+reads. The engine goes on at the op after the store , which is decoded again if it
+was in a written page.
+*/
+#define DECODE_MAX_LENGTH 4
+static void StaleOp(PDECODED_PROGRAM Program,VM_INDEX index)
+{
+    PDECODED_OP op = &Program->Ops[index],prev;
+    DWORD k;
+    if(op->Handler == VM_OP_STALE)
+        return;
+    if(Program->Index[op->IP] == index)
+        Program->Index[op->IP] = VM_NO_OP;
+    op->Handler = VM_OP_STALE;
+    for(k = 1;k <= 2 && k <= index;k++)
+    {
+        prev = &Program->Ops[index - k];
+        if(prev->Handler >= VM_FUSION_FIRST && prev->Handler < VM_FUSION_FIRST + VM_FUSION_KINDS &&
+           (k == 1 || prev->Handler == VM_OP_LOADB_CMPL_JCC || prev->Handler == VM_OP_ADD_CMP_JCC))
+            StaleOp(Program,index - k);
+    }
+}
+static void InvalidatePage(PDECODED_PROGRAM Program,DWORD page)
+{
+    DWORD start = page << VM_PAGE_SHIFT,end = start + VM_PAGE_SIZE,lo,hi,addr,i;
+    PDECODED_OP op;
+    /*the ops that have a byte in the page*/
+    lo = start >= DECODE_MAX_LENGTH - 1 ? start - (DECODE_MAX_LENGTH - 1) : 0;
+    for(addr = lo;addr < end;addr++)
+    {
+        if(Program->Index[addr] != VM_NO_OP && addr + Program->Ops[Program->Index[addr]].Length > start)
+            StaleOp(Program,Program->Index[addr]);
+    }
+    /*the code map around the page is made again from the ops that are left*/
+    hi = end + DECODE_MAX_LENGTH - 1 < VM_DATA_SIZE ? end + DECODE_MAX_LENGTH - 1 : VM_DATA_SIZE;
+    for(addr = lo;addr < hi;addr++)
+        Program->CodeMap[addr >> 3] &= ~(1 << (addr & 7));
+    for(addr = lo >= DECODE_MAX_LENGTH - 1 ? lo - (DECODE_MAX_LENGTH - 1) : 0;addr < hi;addr++)
+    {
+        if(Program->Index[addr] == VM_NO_OP)
+            continue;
+        op = &Program->Ops[Program->Index[addr]];
+        for(i = addr;i < addr + op->Length;i++)
+            Program->CodeMap[i >> 3] |= 1 << (i & 7);
+    }
+    Program->CodePages[page >> 3] &= ~(1 << (page & 7));
+    for(addr = start;addr <= end && addr < VM_DATA_SIZE;addr++)
+    {
+        if(VM_IS_CODE(Program,addr))
+        {
+            Program->CodePages[page >> 3] |= 1 << (page & 7);
+            break;
+        }
+    }
+}
+/*size bytes were written at addr , invalidate the pages where they hit decoded code*/
+static void CodeWritten(PDECODED_PROGRAM Program,DWORD addr,DWORD size)
+{
+    DWORD end = addr + size,page,lo,hi;
+    if(end > VM_DATA_SIZE)
+        end = VM_DATA_SIZE;
+    for(page = addr >> VM_PAGE_SHIFT;page << VM_PAGE_SHIFT < end;page++)
+    {
+        lo = page << VM_PAGE_SHIFT > addr ? page << VM_PAGE_SHIFT : addr;
+        hi = (page + 1) << VM_PAGE_SHIFT < end ? (page + 1) << VM_PAGE_SHIFT : end;
+        if(IsCodeWrite(Program,lo,hi - lo))
+            InvalidatePage(Program,page);
+    }
+}
+/*
+Decode the code of a stale op again , the op becomes a VM_OP_GOTO to it. So does
+the first op that went stale at that address : the jumps decoded before the first
+write go through one VM_OP_GOTO however many times the code is written.
+*/
+static PDECODED_OP Redecode(PADDRESS_SPACE AS,PDECODED_PROGRAM Program,PDECODED_OP op)
+{
+    VM_INDEX* first_stale = &Program->Stale[op->IP];
+#ifndef VM_NO_FUSION
+    DWORD first = Program->Count;
+#endif
+    if(!DecodeRuns(AS,Program,op->IP))
+    {
+        /*no room left , start over from it*/
+        return &Program->Ops[DecodeForInterpreter(AS,Program,op->IP)];
+    }
+#ifndef VM_NO_FUSION
+    FuseOps(Program,first);
+#endif
+    op->Handler = VM_OP_GOTO;
+    op->Imm = Program->Index[op->IP];
+    if(*first_stale == VM_NO_OP)
+        *first_stale = op - Program->Ops;
+    else
+        Program->Ops[*first_stale].Imm = op->Imm;
+    return &Program->Ops[op->Imm];
+}
+/*a store of a byte or a word at addr*/
+#define VM_CODE_WRITE(addr,size) if(VM_IS_CODE_PAGE(Program,addr) && IsCodeWrite(Program,addr,size)) \
+                                 { \
+                                     written = (addr); \
+                                     written_size = (size); \
+                                     goto code_written; \
+                                 }
+void VmLoopDecoded(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program)
+{
+    VmLoopDecodedShared(AS,Regs,Program,NULL);
+}
+/*
+Shared is a read-only stream decoded from the same code (VmImageDecoded) to start
+from instead of decoding , Private is used once the code is written (or if Shared
+has nothing at Regs->IP).
+*/
+void VmLoopDecodedShared(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Private,const DECODED_PROGRAM* Shared)
+{
+    PDECODED_PROGRAM Program = (PDECODED_PROGRAM) Shared;
+    PDECODED_OP pc,op;
+    BYTE byte_val,byte_val2;
+    WORD word_val,word_val2;
+    DWORD written,written_size;
+    VM_BULK_RESULT bulk;
+#ifdef VM_LAZY_FLAGS
+    BYTE flags_op;
+    WORD flags_a,flags_res;
+#endif
+#ifdef VM_THREADED_DISPATCH
+    static const void* const dispatch_table[256] =
+    {
+        [0 ... 255] = &&op_default,
+        [VM_OP_GOTO] = &&op_VM_OP_GOTO, [VM_OP_STALE] = &&op_VM_OP_STALE,
+        [VM_OP_CMP_JCC] = &&op_VM_OP_CMP_JCC, [VM_OP_CMPL_JCC] = &&op_VM_OP_CMPL_JCC,
+        [VM_OP_LOADB_XORL] = &&op_VM_OP_LOADB_XORL, [VM_OP_LOADB_ADDL] = &&op_VM_OP_LOADB_ADDL,
+        [VM_OP_ADD_JNZ] = &&op_VM_OP_ADD_JNZ, [VM_OP_SUB_JNZ] = &&op_VM_OP_SUB_JNZ,
+        [VM_OP_LOADB_CMPL_JCC] = &&op_VM_OP_LOADB_CMPL_JCC, [VM_OP_ADD_CMP_JCC] = &&op_VM_OP_ADD_CMP_JCC,
+        [0x90] = &&op_0x90,
+        [0x10] = &&op_0x10, [0x12] = &&op_0x12, [0x14] = &&op_0x14, [0x16] = &&op_0x16,
+        [0x18] = &&op_0x18, [0x1c] = &&op_0x1c, [0x1f] = &&op_0x1f,
+        [0xE0] = &&op_0xE0, [0xE2] = &&op_0xE2, [0xE3] = &&op_0xE3, [0xE4] = &&op_0xE4,
+        [0xE6] = &&op_0xE6, [0xE8] = &&op_0xE8, [0xEC] = &&op_0xEC,
+        [0xAD] = &&op_0xAD, [0xA5] = &&op_0xA5, [0xA2] = &&op_0xA2,
+        [0x5B] = &&op_0x5B, [0x5C] = &&op_0x5C, [0x5D] = &&op_0x5D,
+        [0xF0] = &&op_0xF0, [0xF1] = &&op_0xF1, [0xA1] = &&op_0xA1, [0x51] = &&op_0x51,
+        [0x55] = &&op_0x55, [0x56] = &&op_0x56, [0x70] = &&op_0x70, [0x71] = &&op_0x71,
+        [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&op_0x63, [0x64] = &&op_0x64,
+        [0xAF] = &&op_0xAF, [0xAE] = &&op_0xAE,
+        [0xC0] = &&op_0xC0, [0xC2] = &&op_0xC2, [0x89] = &&op_0x89,
+        [0xED] = &&op_0xED
+    };
+#else
+    boolean exit = FALSE;
+#endif
+    VM_LOAD_FLAGS();
+    if(Shared && !VM_OUT_OF_DATA(Regs->IP) && Shared->Index[Regs->IP] != VM_NO_OP)
+        pc = &Program->Ops[Shared->Index[Regs->IP]];
+    else
+    {
+        Program = Private;
+        pc = &Program->Ops[DecodeForInterpreter(AS,Program,Regs->IP)];
+    }
+#ifdef VM_THREADED_DISPATCH
+    VM_NEXT;
+    {
+        {
+#else
+    while(!exit)
+    {
+        op = pc++;
+        switch(op->Handler)
+        {
+#endif
+            VM_CASE(0x90) :
+                VM_NEXT;
+            VM_CASE(VM_OP_GOTO) :
+                pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            /*MOV Rd,Rs*/
+            VM_CASE(0x10) :
+                Regs->GPRs[op->Dst] = Regs->GPRs[op->Src];
+                VM_NEXT;
+            /*MOVX Rd,BYTE [Imm]*/
+            VM_CASE(0x12) :
+                Regs->GPRs[op->Dst] = AS->data[op->Imm];
+                VM_NEXT;
+            /*MOV Rd,WORD [Imm]*/
+            VM_CASE(0x14) :
+                Regs->GPRs[op->Dst] = *(WORD*)&AS->data[op->Imm];
+                VM_NEXT;
+            /*MOVX Rd,Imm (byte) and MOV Rd,Imm (word)*/
+            VM_CASE(0x16) :
+            VM_CASE(0x18) :
+                Regs->GPRs[op->Dst] = op->Imm;
+                VM_NEXT;
+            /*MOV BYTE [Imm],Rd*/
+            VM_CASE(0x1c) :
+                AS->data[op->Imm] = *(BYTE*)&Regs->GPRs[op->Dst];
+                VM_MARK_DIRTY(AS,op->Imm);
+                VM_CODE_WRITE(op->Imm,1);
+                VM_NEXT;
+            /*MOV WORD [Imm],Rd*/
+            VM_CASE(0x1f) :
+                *(WORD*)&AS->data[op->Imm] = Regs->GPRs[op->Dst];
+                VM_MARK_DIRTY(AS,op->Imm);
+                VM_MARK_DIRTY(AS,op->Imm + 1);
+                VM_CODE_WRITE(op->Imm,sizeof(WORD));
+                VM_NEXT;
+            /*Jumps , Imm is the index of the target op*/
+            VM_CASE(0xE0) :
+                pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            VM_CASE(0xE2) :
+                if(VM_ZF)
+                    pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            VM_CASE(0xE3) :
+                if(! VM_ZF)
+                    pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            VM_CASE(0xE4) :
+                if(VM_ZF || ! VM_CF)
+                    pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            VM_CASE(0xE6) :
+                if(VM_ZF || VM_CF)
+                    pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            VM_CASE(0xE8) :
+                if(VM_CF && ! VM_ZF)
+                    pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            VM_CASE(0xEC) :
+                if( ! VM_CF && ! VM_ZF)
+                    pc = &Program->Ops[op->Imm];
+                VM_NEXT;
+            /*ADD Rd,Imm*/
+            VM_CASE(0xAD) :
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] = word_val + op->Imm;
+                VM_FLAGS_ADD(word_val,word_val2);
+                VM_NEXT;
+            /*ADD Rd,Rs*/
+            VM_CASE(0xA5) :
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] += Regs->GPRs[op->Src];
+                VM_FLAGS_ADD(word_val,word_val2);
+                VM_NEXT;
+            /*ADDL Rd,Rs*/
+            VM_CASE(0xA2) :
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Dst] += *(BYTE*)&Regs->GPRs[op->Src];
+                VM_FLAGS_ADD(byte_val,byte_val2);
+                VM_NEXT;
+            /*SUB Rd,Imm*/
+            VM_CASE(0x5B) :
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] = word_val - op->Imm;
+                VM_FLAGS_SUB(word_val,word_val2);
+                VM_NEXT;
+            /*SUB Rd,Rs*/
+            VM_CASE(0x5C) :
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] -= Regs->GPRs[op->Src];
+                VM_FLAGS_SUB(word_val,word_val2);
+                VM_NEXT;
+            /*SUBL Rd,Rs*/
+            VM_CASE(0x5D) :
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Dst] -= *(BYTE*)&Regs->GPRs[op->Src];
+                VM_FLAGS_SUB(byte_val,byte_val2);
+                VM_NEXT;
+            /*XOR Rd,Rs*/
+            VM_CASE(0xF0) :
+                word_val = Regs->GPRs[op->Dst] ^= Regs->GPRs[op->Src];
+                VM_FLAGS_LOGIC(word_val);
+                VM_NEXT;
+            /*XORL Rd,Rs*/
+            VM_CASE(0xF1) :
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst] ^= *(BYTE*)&Regs->GPRs[op->Src];
+                VM_FLAGS_LOGIC(byte_val);
+                VM_NEXT;
+            /*ADDL Rd,Imm*/
+            VM_CASE(0xA1) :
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Dst] = byte_val + (BYTE)op->Imm;
+                VM_FLAGS_ADD(byte_val,byte_val2);
+                VM_NEXT;
+            /*SUBL Rd,Imm*/
+            VM_CASE(0x51) :
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Dst] = byte_val - (BYTE)op->Imm;
+                VM_FLAGS_SUB(byte_val,byte_val2);
+                VM_NEXT;
+            /*MOV BYTE [Rd],Rs*/
+            VM_CASE(0x55) :
+                word_val = Regs->GPRs[op->Dst];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                AS->data[word_val] = *(BYTE*)&Regs->GPRs[op->Src];
+                VM_MARK_DIRTY(AS,word_val);
+                VM_CODE_WRITE(word_val,1);
+                VM_NEXT;
+            /*MOVX Rd,BYTE [Rs]*/
+            VM_CASE(0x56) :
+                word_val = Regs->GPRs[op->Src];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                Regs->GPRs[op->Dst] = AS->data[word_val];
+                VM_NEXT;
+            /*CMP Rd,Rs (same source operand check as VmLoop)*/
+            VM_CASE(0x70) :
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Src];
+                if(VM_OUT_OF_DATA(word_val2))
+                    goto exception;
+                VM_FLAGS_SUB(word_val,(WORD)(word_val - word_val2));
+                VM_NEXT;
+            /*CMPL Rd,Rs*/
+            VM_CASE(0x71) :
+                if(VM_OUT_OF_DATA(Regs->GPRs[op->Src]))
+                    goto exception;
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Src];
+                VM_FLAGS_SUB(byte_val,(BYTE)(byte_val - byte_val2));
+                VM_NEXT;
+            /*MEMCPY , MEMSET , MEMCMP , XORKEY [Rd],[Rs],Rcount(,Rkey) (Bulk.c)*/
+            VM_CASE(0x60) :
+            VM_CASE(0x61) :
+            VM_CASE(0x62) :
+            VM_CASE(0x64) :
+                word_val = Regs->GPRs[op->Dst];
+                if(!VmBulk(AS,op->Handler,word_val,Regs->GPRs[op->Src],Regs->GPRs[op->Imm >> 4],Regs->GPRs[op->Imm & 0x0F],&bulk))
+                    goto exception;
+                VM_FLAGS_SET(bulk.ZF,bulk.CF);
+                written = word_val;
+                written_size = bulk.WriteSize;
+                if(IsCodeWrite(Program,written,written_size))
+                    goto code_written;
+                VM_NEXT;
+            /*STRLEN Rd,[Rs]*/
+            VM_CASE(0x63) :
+                if(!VmBulk(AS,0x63,0,Regs->GPRs[op->Src],0,0,&bulk))
+                    goto exception;
+                Regs->GPRs[op->Dst] = bulk.Length;
+                VM_FLAGS_SET(bulk.ZF,bulk.CF);
+                VM_NEXT;
+            /*PUSH Rd*/
+            VM_CASE(0xAF) :
+                Regs->SP--;
+                if(Regs->SP == 0xFFFF)
+                    goto exception;
+                AS->stack[Regs->SP] = Regs->GPRs[op->Dst];
+                VM_MARK_STACK_DIRTY(AS,Regs->SP);
+                VM_NEXT;
+            /*POP Rd*/
+            VM_CASE(0xAE) :
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                Regs->GPRs[op->Dst] = AS->stack[Regs->SP++];
+                VM_NEXT;
+            /*Print integer*/
+            VM_CASE(0xC0) :
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                word_val = AS->stack[Regs->SP++];
+                VmPrintInteger(word_val);
+                VM_NEXT;
+            /*Print string*/
+            VM_CASE(0xC2) :
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                word_val = AS->stack[Regs->SP++];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                VmPrintString((char*)&AS->data[word_val]);
+                VM_NEXT;
+            /*Scan string*/
+            VM_CASE(0x89) :
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                word_val = AS->stack[Regs->SP++];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                VmScanString((char*)&AS->data[word_val],VM_DATA_SIZE - word_val);
+                VmMarkDirty(AS,word_val,strlen((char*)&AS->data[word_val]) + 1);
+                written = word_val;
+                written_size = strlen((char*)&AS->data[word_val]) + 1;
+                if(IsCodeWrite(Program,written,written_size))
+                    goto code_written;
+                VM_NEXT;
+            /*
+            Superinstructions (VmFuse) : op is the first op of the sequence , pc the next one.
+            Flags that the sequence itself overwrites are not stored.
+            */
+            VM_CASE(VM_OP_CMP_JCC) :
+                VM_FUSED(VM_OP_CMP_JCC);
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Src];
+                if(VM_OUT_OF_DATA(word_val2))
+                    goto exception;
+                VM_FLAGS_SUB(word_val,(WORD)(word_val - word_val2));
+                pc = (pc->Dst >> (VM_ZF | VM_CF << 1)) & 1 ? &Program->Ops[pc->Imm] : pc + 1;
+                VM_NEXT;
+            VM_CASE(VM_OP_CMPL_JCC) :
+                VM_FUSED(VM_OP_CMPL_JCC);
+                if(VM_OUT_OF_DATA(Regs->GPRs[op->Src]))
+                    goto exception;
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Src];
+                VM_FLAGS_SUB(byte_val,(BYTE)(byte_val - byte_val2));
+                pc = (pc->Dst >> (VM_ZF | VM_CF << 1)) & 1 ? &Program->Ops[pc->Imm] : pc + 1;
+                VM_NEXT;
+            VM_CASE(VM_OP_LOADB_XORL) :
+                VM_FUSED(VM_OP_LOADB_XORL);
+                word_val = Regs->GPRs[op->Src];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                Regs->GPRs[op->Dst] = AS->data[word_val];
+                byte_val = *(BYTE*)&Regs->GPRs[pc->Dst] ^= *(BYTE*)&Regs->GPRs[pc->Src];
+                VM_FLAGS_LOGIC(byte_val);
+                pc++;
+                VM_NEXT;
+            VM_CASE(VM_OP_LOADB_ADDL) :
+                VM_FUSED(VM_OP_LOADB_ADDL);
+                word_val = Regs->GPRs[op->Src];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                Regs->GPRs[op->Dst] = AS->data[word_val];
+                byte_val = *(BYTE*)&Regs->GPRs[pc->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[pc->Dst] += *(BYTE*)&Regs->GPRs[pc->Src];
+                VM_FLAGS_ADD(byte_val,byte_val2);
+                pc++;
+                VM_NEXT;
+            VM_CASE(VM_OP_ADD_JNZ) :
+                VM_FUSED(VM_OP_ADD_JNZ);
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] = word_val + op->Imm;
+                VM_FLAGS_ADD(word_val,word_val2);
+                pc = word_val2 ? &Program->Ops[pc->Imm] : pc + 1;
+                VM_NEXT;
+            VM_CASE(VM_OP_SUB_JNZ) :
+                VM_FUSED(VM_OP_SUB_JNZ);
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] = word_val - op->Imm;
+                VM_FLAGS_SUB(word_val,word_val2);
+                pc = word_val2 ? &Program->Ops[pc->Imm] : pc + 1;
+                VM_NEXT;
+            VM_CASE(VM_OP_LOADB_CMPL_JCC) :
+                VM_FUSED(VM_OP_LOADB_CMPL_JCC);
+                word_val = Regs->GPRs[op->Src];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                Regs->GPRs[op->Dst] = AS->data[word_val];
+                op = pc;
+                if(VM_OUT_OF_DATA(Regs->GPRs[op->Src]))
+                    goto exception;
+                byte_val = *(BYTE*)&Regs->GPRs[op->Dst];
+                byte_val2 = *(BYTE*)&Regs->GPRs[op->Src];
+                VM_FLAGS_SUB(byte_val,(BYTE)(byte_val - byte_val2));
+                pc = (pc[1].Dst >> (VM_ZF | VM_CF << 1)) & 1 ? &Program->Ops[pc[1].Imm] : pc + 2;
+                VM_NEXT;
+            VM_CASE(VM_OP_ADD_CMP_JCC) :
+                VM_FUSED(VM_OP_ADD_CMP_JCC);
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Dst] = word_val + op->Imm;
+                if(VM_OUT_OF_DATA(Regs->GPRs[pc->Src]))
+                {
+                    /*the CMP raises , the flags of the ADD are visible*/
+                    VM_FLAGS_ADD(word_val,word_val2);
+                    op = pc;
+                    goto exception;
+                }
+                op = pc;
+                word_val = Regs->GPRs[op->Dst];
+                word_val2 = Regs->GPRs[op->Src];
+                VM_FLAGS_SUB(word_val,(WORD)(word_val - word_val2));
+                pc = (pc[1].Dst >> (VM_ZF | VM_CF << 1)) & 1 ? &Program->Ops[pc[1].Imm] : pc + 2;
+                VM_NEXT;
+            /*
+            Self-modifying code : the stream is stale , decode again from the
+            instruction that follows the write.
+            */
+            code_written:
+                if(Program != Private)
+                {
+                    /*the shared stream is read-only , go on with a private copy*/
+                    memcpy(Private,Program,sizeof(DECODED_PROGRAM));
+                    pc = &Private->Ops[pc - Program->Ops];
+                    Program = Private;
+                }
+                CodeWritten(Program,written,written_size);
+                VM_NEXT;
+            VM_CASE(VM_OP_STALE) :
+                pc = Redecode(AS,Program,op);
+                VM_NEXT;
+            VM_CASE(0xED) :
+                VM_EXIT;
+            VM_DEFAULT :
+                exception:
+                VM_EXIT;
+        }
+    }
+#ifdef VM_THREADED_DISPATCH
+vm_exit:
+#endif
+    VM_STORE_FLAGS();
+    Regs->IP = op->IP + op->Length;
+}
@@ -0,0 +1,537 @@
+/*
+Event-driven sessions.
+A session is a VM whose 89 reads lines from a file descriptor and whose C0 and C2
+write to one (the same one for a socket). The event loop runs all the sessions on
+the calling thread without ever blocking on one of them :
+
+    - the runnable sessions get Quantum basic blocks in turn (VmLoopFuel) like the
+      green threads of Sched.c
+    - the input of a session is open (VM_IO.InputOpen) : a 89 that finds no complete
+      line suspends the VM before the 89 (VM_STOP_INPUT) , it is put back in the run
+      queue once epoll reports its descriptor readable and a whole line came in
+    - the descriptors are non-blocking , the input is read into the VM_IO of the
+      session as it arrives and the output is written from it as far as the
+      descriptor takes it , the rest waits for EPOLLOUT
+
+A session isn't run while more than EVENT_OUTPUT_LIMIT bytes of its output wait for
+the descriptor (a client that doesn't read) and its input isn't read while
+EVENT_INPUT_LIMIT bytes are buffered (a client that writes faster than the VM reads).
+The end of the input is the end of the input of gets : the last line is read even
+without a newline , then 89 leaves its buffer untouched. A session ends when its VM
+stops and its output is written , or when its output descriptor is closed.
+
+VmEventListen accepts the connections of a listening socket and runs a fresh
+instance of an image for each one , with contexts from a VM_POOL. epoll is Linux
+only : elsewhere the loop can't be created.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#define EVENT_BATCH        256      /*events taken by one epoll_wait*/
+#define EVENT_READ_SIZE    4096
+#define EVENT_INPUT_LIMIT  65536
+#define EVENT_OUTPUT_LIMIT 65536
+#define EVENT_RUNNABLE    0
+#define EVENT_WAIT_INPUT  1         /*suspended at a 89*/
+#define EVENT_WAIT_OUTPUT 2         /*too much output waiting*/
+#define EVENT_DRAINING    3         /*the VM stopped , the end of its output waits*/
+#define EVENT_CLOSED      4
+#ifdef __linux__
+typedef struct EVENT_SESSION* PEVENT_SESSION;
+/*what an epoll event points to : a descriptor of a session , or the listening socket (Session NULL)*/
+typedef struct
+{
+    PEVENT_SESSION Session;
+    int Fd;
+    DWORD Events;       /*registered , 0 when not in the epoll set*/
+}EVENT_HANDLE,*PEVENT_HANDLE;
+typedef struct EVENT_SESSION
+{
+    PVM_CONTEXT Context;
+    boolean Owned;      /*taken from the pool of the loop*/
+    int State;
+    boolean Stopped;
+    boolean Queued;
+    VM_IO Io;
+    char* Input;        /*buffer behind Io.Input*/
+    DWORD InputCapacity;
+    DWORD Sent;         /*bytes of Io.Output already written*/
+    /*input then output , the output Fd is -1 when it is the input descriptor*/
+    EVENT_HANDLE Handles[2];
+    /*run queue , or the list of closed sessions to free*/
+    PEVENT_SESSION Prev;
+    PEVENT_SESSION Next;
+    /*sessions not closed*/
+    PEVENT_SESSION PrevLive;
+    PEVENT_SESSION NextLive;
+}EVENT_SESSION;
+struct VM_EVENT_LOOP
+{
+    int Epoll;
+    uint64_t Quantum;
+    DWORD Sessions;     /*not closed*/
+    PEVENT_SESSION Live;
+    PEVENT_SESSION Head;
+    PEVENT_SESSION Tail;
+    DWORD Runnable;
+    PEVENT_SESSION Closed;
+    EVENT_HANDLE Listener;
+    PVM_IMAGE Image;
+    PVM_POOL Pool;
+};
+/*Quantum basic blocks per slice (VM_SCHED_QUANTUM if 0)*/
+PVM_EVENT_LOOP VmEventCreate(uint64_t Quantum)
+{
+    PVM_EVENT_LOOP Loop = (PVM_EVENT_LOOP) calloc(1,sizeof(struct VM_EVENT_LOOP));
+    if(!Loop)
+        return NULL;
+    Loop->Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(Loop->Epoll < 0)
+    {
+        free(Loop);
+        return NULL;
+    }
+    Loop->Quantum = Quantum ? Quantum : VM_SCHED_QUANTUM;
+    Loop->Listener.Fd = -1;
+    /*a client that goes away must not kill the process with its writes*/
+    signal(SIGPIPE,SIG_IGN);
+    return Loop;
+}
+/*register the events wanted for Handle , a handle that wants none leaves the set*/
+static boolean EventWatch(PVM_EVENT_LOOP Loop,PEVENT_HANDLE Handle,DWORD Events)
+{
+    struct epoll_event event;
+    int op;
+    if(Handle->Fd < 0 || Handle->Events == Events)
+        return TRUE;
+    if(!Events)
+        op = EPOLL_CTL_DEL;
+    else
+        op = Handle->Events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    memset(&event,0,sizeof(event));
+    event.events = Events;
+    event.data.ptr = Handle;
+    if(epoll_ctl(Loop->Epoll,op,Handle->Fd,&event))
+        return FALSE;
+    Handle->Events = Events;
+    return TRUE;
+}
+static void EventEnqueue(PVM_EVENT_LOOP Loop,PEVENT_SESSION Session)
+{
+    Session->Prev = Loop->Tail;
+    Session->Next = NULL;
+    if(Loop->Tail)
+        Loop->Tail->Next = Session;
+    else
+        Loop->Head = Session;
+    Loop->Tail = Session;
+    Loop->Runnable++;
+    Session->Queued = TRUE;
+}
+static void EventDequeue(PVM_EVENT_LOOP Loop,PEVENT_SESSION Session)
+{
+    if(Session->Prev)
+        Session->Prev->Next = Session->Next;
+    else
+        Loop->Head = Session->Next;
+    if(Session->Next)
+        Session->Next->Prev = Session->Prev;
+    else
+        Loop->Tail = Session->Prev;
+    Loop->Runnable--;
+    Session->Queued = FALSE;
+}
+/*
+The descriptors are closed and the context given back , the session itself is
+freed after the events of the round (one of them may still point to it).
+*/
+static void EventClose(PVM_EVENT_LOOP Loop,PEVENT_SESSION Session)
+{
+    DWORD i;
+    if(Session->State == EVENT_CLOSED)
+        return;
+    if(Session->Queued)
+        EventDequeue(Loop,Session);
+    for(i = 0;i < 2;i++)
+    {
+        if(Session->Handles[i].Fd < 0)
+            continue;
+        EventWatch(Loop,&Session->Handles[i],0);
+        close(Session->Handles[i].Fd);
+    }
+    if(Session->Owned)
+        VmPoolRelease(Loop->Pool,Session->Context);
+    if(Session->PrevLive)
+        Session->PrevLive->NextLive = Session->NextLive;
+    else
+        Loop->Live = Session->NextLive;
+    if(Session->NextLive)
+        Session->NextLive->PrevLive = Session->PrevLive;
+    Session->State = EVENT_CLOSED;
+    Session->Next = Loop->Closed;
+    Loop->Closed = Session;
+    Loop->Sessions--;
+}
+static void EventFreeClosed(PVM_EVENT_LOOP Loop)
+{
+    PEVENT_SESSION session;
+    while((session = Loop->Closed))
+    {
+        Loop->Closed = session->Next;
+        free(session->Input);
+        free(session->Io.Output);
+        free(session);
+    }
+}
+/*
+read what the input descriptor has , up to EVENT_INPUT_LIMIT bytes buffered unless
+the VM waits for the end of a longer line
+*/
+static void EventRead(PEVENT_SESSION Session)
+{
+    PVM_IO Io = &Session->Io;
+    char* input;
+    DWORD capacity;
+    ssize_t size;
+    /*the lines already read by the VM go*/
+    if(Io->InputPos)
+    {
+        memmove(Session->Input,Session->Input + Io->InputPos,Io->InputSize - Io->InputPos);
+        Io->InputSize -= Io->InputPos;
+        Io->InputPos = 0;
+    }
+    while(Io->InputOpen && (Io->InputSize < EVENT_INPUT_LIMIT || Session->State == EVENT_WAIT_INPUT))
+    {
+        if(Io->InputSize + EVENT_READ_SIZE > Session->InputCapacity)
+        {
+            capacity = Session->InputCapacity ? Session->InputCapacity * 2 : EVENT_READ_SIZE;
+            input = (char*) realloc(Session->Input,capacity);
+            if(!input)
+                return;
+            Session->Input = input;
+            Session->InputCapacity = capacity;
+            Io->Input = input;
+        }
+        size = read(Session->Handles[0].Fd,Session->Input + Io->InputSize,EVENT_READ_SIZE);
+        if(size > 0)
+        {
+            Io->InputSize += (DWORD)size;
+            /*a short read emptied the descriptor*/
+            if(size < EVENT_READ_SIZE)
+                return;
+        }
+        else if(size < 0 && errno == EINTR)
+            continue;
+        else if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        else
+            Io->InputOpen = FALSE;
+    }
+}
+/*write the output as far as the descriptor takes it , FALSE if it can't be written anymore*/
+static boolean EventWrite(PEVENT_SESSION Session)
+{
+    PVM_IO Io = &Session->Io;
+    int fd = Session->Handles[1].Fd >= 0 ? Session->Handles[1].Fd : Session->Handles[0].Fd;
+    ssize_t size;
+    while(Session->Sent < Io->OutputSize)
+    {
+        size = write(fd,Io->Output + Session->Sent,Io->OutputSize - Session->Sent);
+        if(size > 0)
+            Session->Sent += (DWORD)size;
+        else if(size < 0 && errno == EINTR)
+            continue;
+        else if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            return FALSE;
+    }
+    if(Session->Sent == Io->OutputSize)
+    {
+        Io->OutputSize = 0;
+        Session->Sent = 0;
+    }
+    else if(Session->Sent >= Io->OutputCapacity / 2)
+    {
+        /*the VM appends at the end of the buffer , keep room there*/
+        memmove(Io->Output,Io->Output + Session->Sent,Io->OutputSize - Session->Sent);
+        Io->OutputSize -= Session->Sent;
+        Session->Sent = 0;
+    }
+    return TRUE;
+}
+/*the state of the session after it ran or one of its descriptors was ready , and the events it waits for*/
+static void EventUpdate(PVM_EVENT_LOOP Loop,PEVENT_SESSION Session)
+{
+    PVM_IO Io = &Session->Io;
+    DWORD pending = Io->OutputSize - Session->Sent;
+    DWORD input = 0,output = 0;
+    if(Session->State == EVENT_CLOSED)
+        return;
+    if(Session->Stopped)
+    {
+        if(!pending)
+        {
+            EventClose(Loop,Session);
+            return;
+        }
+        Session->State = EVENT_DRAINING;
+    }
+    else if(pending > EVENT_OUTPUT_LIMIT)
+        Session->State = EVENT_WAIT_OUTPUT;
+    else if(Session->State == EVENT_WAIT_INPUT && !VmInputReady(Io))
+        Session->State = EVENT_WAIT_INPUT;
+    else
+        Session->State = EVENT_RUNNABLE;
+    if(Session->State == EVENT_RUNNABLE && !Session->Queued)
+        EventEnqueue(Loop,Session);
+    else if(Session->State != EVENT_RUNNABLE && Session->Queued)
+        EventDequeue(Loop,Session);
+    if(Io->InputOpen && !Session->Stopped &&
+       (Io->InputSize - Io->InputPos < EVENT_INPUT_LIMIT || Session->State == EVENT_WAIT_INPUT))
+        input = EPOLLIN;
+    if(pending)
+        output = EPOLLOUT;
+    if(Session->Handles[1].Fd < 0)
+        input |= output;
+    if(!EventWatch(Loop,&Session->Handles[0],input) || !EventWatch(Loop,&Session->Handles[1],output))
+        EventClose(Loop,Session);
+}
+static void EventSlice(PVM_EVENT_LOOP Loop,PEVENT_SESSION Session)
+{
+    uint64_t fuel = Loop->Quantum;
+    int status;
+    VmSetIo(&Session->Io);
+    status = VmLoopFuel(&Session->Context->AS,&Session->Context->Regs,&fuel);
+    VmSetIo(NULL);
+    Session->Stopped = status == VM_STOP_EXIT || status == VM_STOP_EXCEPTION;
+    if(status == VM_STOP_INPUT)
+        Session->State = EVENT_WAIT_INPUT;
+    if(!EventWrite(Session))
+    {
+        EventClose(Loop,Session);
+        return;
+    }
+    EventUpdate(Loop,Session);
+}
+static boolean EventNonBlocking(int Fd)
+{
+    int flags = fcntl(Fd,F_GETFL);
+    return flags >= 0 && fcntl(Fd,F_SETFL,flags | O_NONBLOCK) >= 0;
+}
+static boolean EventStart(PVM_EVENT_LOOP Loop,PVM_CONTEXT Context,int Input,int Output,boolean Owned)
+{
+    PEVENT_SESSION session;
+    if(!EventNonBlocking(Input) || !EventNonBlocking(Output))
+        return FALSE;
+    session = (PEVENT_SESSION) calloc(1,sizeof(EVENT_SESSION));
+    if(!session)
+        return FALSE;
+    session->Context = Context;
+    session->Owned = Owned;
+    session->Io.InputOpen = TRUE;
+    session->Handles[0].Session = session;
+    session->Handles[0].Fd = Input;
+    session->Handles[1].Session = session;
+    session->Handles[1].Fd = Output == Input ? -1 : Output;
+    session->State = EVENT_RUNNABLE;
+    session->NextLive = Loop->Live;
+    if(Loop->Live)
+        Loop->Live->PrevLive = session;
+    Loop->Live = session;
+    Loop->Sessions++;
+    EventUpdate(Loop,session);
+    return TRUE;
+}
+/*
+Run Context (from its current registers) with its 89 reading Input and its C0 and
+C2 writing to Output , which can be the same descriptor. Both must be pollable
+(pipes , sockets , terminals) , the loop makes them non-blocking and closes them
+when the session ends. The context stays the caller's. FALSE if it can't be added.
+*/
+boolean VmEventAdd(PVM_EVENT_LOOP Loop,PVM_CONTEXT Context,int Input,int Output)
+{
+    return EventStart(Loop,Context,Input,Output,FALSE);
+}
+/*every connection accepted on Socket (listening) runs a fresh instance of Image*/
+boolean VmEventListen(PVM_EVENT_LOOP Loop,int Socket,PVM_IMAGE Image)
+{
+    if(Loop->Listener.Fd >= 0 || !EventNonBlocking(Socket))
+        return FALSE;
+    if(!Loop->Pool && !(Loop->Pool = VmPoolCreate(0)))
+        return FALSE;
+    Loop->Listener.Fd = Socket;
+    Loop->Image = Image;
+    if(!EventWatch(Loop,&Loop->Listener,EPOLLIN))
+    {
+        Loop->Listener.Fd = -1;
+        return FALSE;
+    }
+    return TRUE;
+}
+static void EventAccept(PVM_EVENT_LOOP Loop)
+{
+    PVM_CONTEXT context;
+    int fd;
+    while((fd = accept(Loop->Listener.Fd,NULL,NULL)) >= 0)
+    {
+        context = VmPoolAcquire(Loop->Pool);
+        if(context)
+        {
+            VmImageLoad(Loop->Image,context);
+            if(EventStart(Loop,context,fd,fd,TRUE))
+                continue;
+            VmPoolRelease(Loop->Pool,context);
+        }
+        close(fd);
+    }
+}
+static void EventDispatch(PVM_EVENT_LOOP Loop,PEVENT_HANDLE Handle,DWORD Events)
+{
+    PEVENT_SESSION session = Handle->Session;
+    boolean output = Handle == &session->Handles[1] || session->Handles[1].Fd < 0;
+    if(session->State == EVENT_CLOSED)
+        return;
+    if(Handle == &session->Handles[0] && (Events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        EventRead(session);
+    /*nobody reads the output anymore*/
+    if(output && (Events & EPOLLERR || (Events & EPOLLHUP && !session->Io.InputOpen)))
+    {
+        EventClose(Loop,session);
+        return;
+    }
+    if(output && (Events & EPOLLOUT) && !EventWrite(session))
+    {
+        EventClose(Loop,session);
+        return;
+    }
+    EventUpdate(Loop,session);
+}
+/*
+Run until every session has ended (forever with a listening socket). Every round
+handles the ready descriptors then gives one slice to each session that was
+runnable , it only waits for events when no session can run. FALSE if epoll fails.
+*/
+boolean VmEventRun(PVM_EVENT_LOOP Loop)
+{
+    struct epoll_event events[EVENT_BATCH];
+    PEVENT_SESSION session;
+    DWORD slices;
+    int i,count;
+    while(Loop->Sessions || Loop->Listener.Fd >= 0)
+    {
+        count = epoll_wait(Loop->Epoll,events,EVENT_BATCH,Loop->Runnable ? 0 : -1);
+        if(count < 0 && errno != EINTR)
+            return FALSE;
+        for(i = 0;i < count;i++)
+        {
+            if(events[i].data.ptr == &Loop->Listener)
+                EventAccept(Loop);
+            else
+                EventDispatch(Loop,(PEVENT_HANDLE)events[i].data.ptr,events[i].events);
+        }
+        for(slices = Loop->Runnable;slices && Loop->Head;slices--)
+        {
+            session = Loop->Head;
+            EventDequeue(Loop,session);
+            EventSlice(Loop,session);
+        }
+        EventFreeClosed(Loop);
+    }
+    return TRUE;
+}
+/*ends the sessions still running , the listening socket is the caller's*/
+void VmEventDestroy(PVM_EVENT_LOOP Loop)
+{
+    PEVENT_SESSION session;
+    while((session = Loop->Live))
+        EventClose(Loop,session);
+    EventFreeClosed(Loop);
+    if(Loop->Pool)
+        VmPoolDestroy(Loop->Pool);
+    close(Loop->Epoll);
+    free(Loop);
+}
+/*
+vm -serve socket [program] [quantum] : listen on the Unix socket (path) and run a
+fresh instance of program (vm_file by default) for every connection , its input
+and output are the connection.
+*/
+int VmServeMain(const char* Path,const char* Program,DWORD Quantum)
+{
+    PVM_EVENT_LOOP loop;
+    PVM_IMAGE image;
+    struct sockaddr_un address;
+    struct rlimit limit;
+    int fd;
+    image = VmImageOpen(Program);
+    if(!image)
+    {
+        printf("Found trouble opening the file");
+        return 1;
+    }
+    /*a descriptor per session*/
+    if(!getrlimit(RLIMIT_NOFILE,&limit))
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE,&limit);
+    }
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(Path) >= sizeof(address.sun_path))
+        return 1;
+    strcpy(address.sun_path,Path);
+    unlink(Path);
+    fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if(fd < 0 || bind(fd,(struct sockaddr*)&address,sizeof(address)) || listen(fd,SOMAXCONN))
+    {
+        printf("Found trouble listening on %s",Path);
+        return 1;
+    }
+    loop = VmEventCreate(Quantum);
+    if(!loop || !VmEventListen(loop,fd,image))
+        return 1;
+    fprintf(stderr,"[serve] listening on %s\n",Path);
+    VmEventRun(loop);
+    VmEventDestroy(loop);
+    close(fd);
+    VmImageRelease(image);
+    return 1;
+}
+#else
+PVM_EVENT_LOOP VmEventCreate(uint64_t Quantum)
+{
+    return NULL;
+}
+boolean VmEventAdd(PVM_EVENT_LOOP Loop,PVM_CONTEXT Context,int Input,int Output)
+{
+    return FALSE;
+}
+boolean VmEventListen(PVM_EVENT_LOOP Loop,int Socket,PVM_IMAGE Image)
+{
+    return FALSE;
+}
+boolean VmEventRun(PVM_EVENT_LOOP Loop)
+{
+    return FALSE;
+}
+void VmEventDestroy(PVM_EVENT_LOOP Loop)
+{
+}
+int VmServeMain(const char* Path,const char* Program,DWORD Quantum)
+{
+    printf("The event loop needs epoll (Linux)");
+    return 1;
+}
+#endif
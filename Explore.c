@@ -0,0 +1,441 @@
+/*
+Coverage-guided input explorer.
+vm -explore program [threads] [seconds] [corpus] looks for inputs that take the
+program down new paths. Every worker thread owns a context that is run once up to
+the first input read (VmRunToInput) and snapshotted there , an execution restores
+the pages the previous one dirtied (VmRestore) and runs VmLoopCoverage from the
+snapshot with the input as the lines read by 0x89 , for at most EXPLORE_FUEL blocks.
+
+VmLoopCoverage counts the edges between basic blocks in a per-thread map. After a
+run the counts are put in buckets (1 , 2 , 3 , 4-7 , 8-15 , 16-31 , 32-127 , 128+)
+and compared with the shared Seen map , an input that sets a bucket bit nobody had
+seen is added to the corpus. The corpus only grows : entries are written once and
+published by incrementing CorpusCount , the workers read it without a lock.
+
+A worker takes a corpus entry and runs EXPLORE_ROUNDS mutations of it : bit flips ,
+random and interesting bytes , small additions , inserted and deleted bytes ,
+bytes of the program (immediates and data that isn't code , which is where the
+constants a routine compares its input with usually are) and splices with other
+entries. The corpus is written to the corpus directory at the end , one file per
+entry that can be used as the input of a batch job.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#define EXPLORE_MAX_INPUT 256
+#define EXPLORE_MAX_CORPUS 4096
+#define EXPLORE_FUEL 100000
+#define EXPLORE_ROUNDS 64
+#define EXPLORE_SECONDS 60
+typedef struct
+{
+    BYTE Data[EXPLORE_MAX_INPUT];
+    DWORD Size;
+    int Status;     /*VM_STOP_xxx of the run that added it*/
+}EXPLORE_INPUT,*PEXPLORE_INPUT;
+typedef struct
+{
+    PVM_IMAGE Image;
+    /*bucket bits of the edges seen by every worker*/
+    atomic_uchar Seen[VM_COVERAGE_SIZE];
+    /*inputs that found new bits , entries below CorpusCount don't change*/
+    PEXPLORE_INPUT Corpus;
+    atomic_uint CorpusCount;
+    /*bytes of the program worth trying in an input*/
+    BYTE Dictionary[256];
+    DWORD DictionarySize;
+    atomic_bool Stop;
+#ifdef _WIN32
+    SRWLOCK Lock;
+#else
+    pthread_mutex_t Lock;
+#endif
+}EXPLORER,*PEXPLORER;
+typedef struct VM_CACHE_ALIGNED
+{
+    PEXPLORER Explorer;
+    uint64_t Random;
+    /*read by the main thread for the progress line*/
+    atomic_ullong Execs;
+    atomic_ullong Exceptions;
+    atomic_ullong Hangs;
+}EXPLORE_WORKER,*PEXPLORE_WORKER;
+#ifdef _WIN32
+#define EXPLORE_LOCK(Explorer) AcquireSRWLockExclusive(&(Explorer)->Lock)
+#define EXPLORE_UNLOCK(Explorer) ReleaseSRWLockExclusive(&(Explorer)->Lock)
+#else
+#define EXPLORE_LOCK(Explorer) pthread_mutex_lock(&(Explorer)->Lock)
+#define EXPLORE_UNLOCK(Explorer) pthread_mutex_unlock(&(Explorer)->Lock)
+#endif
+/*xorshift64*/
+static DWORD ExploreRandom(PEXPLORE_WORKER Worker,DWORD Limit)
+{
+    uint64_t x = Worker->Random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    Worker->Random = x;
+    return (DWORD)(x >> 32) % Limit;
+}
+/*bit of the bucket of an edge count*/
+static BYTE ExploreBucket(BYTE Count)
+{
+    if(Count <= 2)
+        return Count;
+    if(Count == 3)
+        return 4;
+    if(Count <= 7)
+        return 8;
+    if(Count <= 15)
+        return 16;
+    if(Count <= 31)
+        return 32;
+    if(Count <= 127)
+        return 64;
+    return 128;
+}
+/*merge the edges of a run into Seen , TRUE if it set a new bit*/
+static boolean ExploreNewBits(PEXPLORER Explorer,const BYTE* Trace)
+{
+    const uint64_t* words = (const uint64_t*) Trace;
+    DWORD i,j;
+    BYTE bits;
+    boolean found = FALSE;
+    for(i = 0;i < VM_COVERAGE_SIZE / 8;i++)
+    {
+        if(!words[i])
+            continue;
+        for(j = i * 8;j < i * 8 + 8;j++)
+        {
+            if(!Trace[j])
+                continue;
+            bits = ExploreBucket(Trace[j]);
+            if(bits & ~atomic_load_explicit(&Explorer->Seen[j],memory_order_relaxed))
+            {
+                atomic_fetch_or_explicit(&Explorer->Seen[j],bits,memory_order_relaxed);
+                found = TRUE;
+            }
+        }
+    }
+    return found;
+}
+static void ExploreAdd(PEXPLORER Explorer,const EXPLORE_INPUT* Input)
+{
+    DWORD count;
+    EXPLORE_LOCK(Explorer);
+    count = atomic_load_explicit(&Explorer->CorpusCount,memory_order_relaxed);
+    if(count < EXPLORE_MAX_CORPUS)
+    {
+        Explorer->Corpus[count] = *Input;
+        atomic_store_explicit(&Explorer->CorpusCount,count + 1,memory_order_release);
+    }
+    EXPLORE_UNLOCK(Explorer);
+}
+/*bytes of immediates and of data outside the decoded code , each value once*/
+static void ExploreDictionary(PEXPLORER Explorer,PADDRESS_SPACE AS)
+{
+    PDECODED_PROGRAM Program = (PDECODED_PROGRAM) malloc(sizeof(DECODED_PROGRAM));
+    BYTE found[256];
+    DWORD i,end;
+    PDECODED_OP op;
+    if(!Program)
+        return;
+    memset(found,0,sizeof(found));
+    VmDecode(AS,Program,0);
+    for(i = 0;i < Program->Count;i++)
+    {
+        op = &Program->Ops[i];
+        /*register , immediate and register , address : Imm is a value or an address*/
+        if(op->Length >= 3 && op->Handler != VM_OP_GOTO && (op->Handler & 0xF0) != 0xE0)
+        {
+            found[op->Imm & 0xFF] = 1;
+            if(op->Length == 4)
+                found[op->Imm >> 8] = 1;
+        }
+    }
+    /*the data after the last byte of code , up to the end of what isn't zero*/
+    for(end = VM_DATA_SIZE;end && !AS->data[end - 1];end--);
+    for(i = 0;i < end;i++)
+    {
+        if(!VM_IS_CODE(Program,i))
+            found[AS->data[i]] = 1;
+    }
+    for(i = 0;i < 256;i++)
+    {
+        if(found[i])
+            Explorer->Dictionary[Explorer->DictionarySize++] = (BYTE)i;
+    }
+    free(Program);
+}
+static void ExploreMutate(PEXPLORE_WORKER Worker,PEXPLORE_INPUT Input)
+{
+    static const BYTE Interesting[] = {0,1,0x7F,0x80,0xFF,' ','0','9','A','Z','a','z'};
+    PEXPLORER Explorer = Worker->Explorer;
+    const EXPLORE_INPUT* other;
+    DWORD stack = 1 + ExploreRandom(Worker,4);
+    DWORD pos,size;
+    while(stack--)
+    {
+        pos = Input->Size ? ExploreRandom(Worker,Input->Size) : 0;
+        switch(Input->Size ? ExploreRandom(Worker,8) : 4)
+        {
+            case 0 :
+                Input->Data[pos] ^= 1 << ExploreRandom(Worker,8);
+                break;
+            case 1 :
+                Input->Data[pos] = (BYTE) ExploreRandom(Worker,256);
+                break;
+            case 2 :
+                Input->Data[pos] = Interesting[ExploreRandom(Worker,sizeof(Interesting))];
+                break;
+            case 3 :
+                size = 1 + ExploreRandom(Worker,16);
+                Input->Data[pos] += ExploreRandom(Worker,2) ? size : -size;
+                break;
+            /*insert a byte , of the program half the time*/
+            case 4 :
+                if(Input->Size == EXPLORE_MAX_INPUT)
+                    break;
+                pos = ExploreRandom(Worker,Input->Size + 1);
+                memmove(&Input->Data[pos + 1],&Input->Data[pos],Input->Size - pos);
+                Input->Data[pos] = Explorer->DictionarySize && ExploreRandom(Worker,2) ?
+                                   Explorer->Dictionary[ExploreRandom(Worker,Explorer->DictionarySize)] :
+                                   (BYTE) ExploreRandom(Worker,256);
+                Input->Size++;
+                break;
+            case 5 :
+                memmove(&Input->Data[pos],&Input->Data[pos + 1],Input->Size - pos - 1);
+                Input->Size--;
+                break;
+            case 6 :
+                if(Explorer->DictionarySize)
+                    Input->Data[pos] = Explorer->Dictionary[ExploreRandom(Worker,Explorer->DictionarySize)];
+                break;
+            /*the tail of another entry from pos*/
+            case 7 :
+                other = &Explorer->Corpus[ExploreRandom(Worker,atomic_load_explicit(&Explorer->CorpusCount,memory_order_acquire))];
+                if(!other->Size)
+                    break;
+                size = ExploreRandom(Worker,other->Size) + 1;
+                if(pos + size > EXPLORE_MAX_INPUT)
+                    size = EXPLORE_MAX_INPUT - pos;
+                memcpy(&Input->Data[pos],&other->Data[other->Size - size],size);
+                if(pos + size > Input->Size)
+                    Input->Size = pos + size;
+                break;
+        }
+    }
+}
+/*one run of Input from the snapshot , returns VM_STOP_xxx*/
+static int ExploreRun(PVM_CONTEXT Context,PVM_SNAPSHOT Snapshot,PVM_IO Io,BYTE* Trace,PEXPLORE_INPUT Input)
+{
+    uint64_t fuel = EXPLORE_FUEL;
+    VmRestore(Snapshot,&Context->AS,&Context->Regs);
+    memset(Trace,0,VM_COVERAGE_SIZE);
+    Io->Input = (const char*) Input->Data;
+    Io->InputSize = Input->Size;
+    Io->InputPos = 0;
+    Io->OutputSize = 0;
+    return VmLoopCoverage(&Context->AS,&Context->Regs,Trace,&fuel);
+}
+#ifdef _WIN32
+static DWORD WINAPI ExploreWorker(LPVOID Parameter)
+#else
+static void* ExploreWorker(void* Parameter)
+#endif
+{
+    PEXPLORE_WORKER Worker = (PEXPLORE_WORKER) Parameter;
+    PEXPLORER Explorer = Worker->Explorer;
+    PVM_CONTEXT Context = VmCreateContext();
+    PVM_SNAPSHOT snapshot = (PVM_SNAPSHOT) malloc(sizeof(VM_SNAPSHOT));
+    BYTE* trace = (BYTE*) malloc(VM_COVERAGE_SIZE);
+    EXPLORE_INPUT input;
+    VM_IO io;
+    DWORD round,count;
+    uint64_t execs = 0;
+    int status;
+    memset(&io,0,sizeof(io));
+    if(Context && snapshot && trace)
+    {
+        VmImageLoad(Explorer->Image,Context);
+        VmRunToInput(Context);
+        VmSnapshot(snapshot,&Context->AS,&Context->Regs);
+        VmSetIo(&io);
+        while(!atomic_load_explicit(&Explorer->Stop,memory_order_relaxed))
+        {
+            count = atomic_load_explicit(&Explorer->CorpusCount,memory_order_acquire);
+            for(round = 0;round < EXPLORE_ROUNDS;round++)
+            {
+                input = Explorer->Corpus[ExploreRandom(Worker,count)];
+                ExploreMutate(Worker,&input);
+                status = ExploreRun(Context,snapshot,&io,trace,&input);
+                if(status == VM_STOP_EXCEPTION)
+                    atomic_fetch_add_explicit(&Worker->Exceptions,1,memory_order_relaxed);
+                else if(status == VM_STOP_FUEL)
+                    atomic_fetch_add_explicit(&Worker->Hangs,1,memory_order_relaxed);
+                if(ExploreNewBits(Explorer,trace))
+                {
+                    input.Status = status;
+                    ExploreAdd(Explorer,&input);
+                }
+            }
+            execs += EXPLORE_ROUNDS;
+            atomic_store_explicit(&Worker->Execs,execs,memory_order_relaxed);
+        }
+        VmSetIo(NULL);
+    }
+    if(Context)
+        VmDestroyContext(Context);
+    free(snapshot);
+    free(trace);
+    free(io.Output);
+    return 0;
+}
+/*every entry as Corpus/NNNNN_status*/
+static void ExploreSave(PEXPLORER Explorer,const char* Corpus)
+{
+    static const char* const Status[] = {"exit","exception","fuel"};
+    char name[1024];
+    DWORD i,count = atomic_load(&Explorer->CorpusCount);
+    PEXPLORE_INPUT input;
+    FILE* File;
+#ifdef _WIN32
+    _mkdir(Corpus);
+#else
+    mkdir(Corpus,0777);
+#endif
+    for(i = 0;i < count;i++)
+    {
+        input = &Explorer->Corpus[i];
+        snprintf(name,sizeof(name),"%s/%05u_%s",Corpus,i,Status[input->Status]);
+        File = fopen(name,"wb");
+        if(!File)
+        {
+            printf("Found trouble writing %s\n",name);
+            return;
+        }
+        fwrite(input->Data,1,input->Size,File);
+        fclose(File);
+    }
+}
+static DWORD ExploreEdges(PEXPLORER Explorer)
+{
+    DWORD i,edges = 0;
+    for(i = 0;i < VM_COVERAGE_SIZE;i++)
+        edges += atomic_load_explicit(&Explorer->Seen[i],memory_order_relaxed) != 0;
+    return edges;
+}
+/*
+vm -explore program [threads] [seconds] [corpus] : one worker per CPU by default
+for EXPLORE_SECONDS , a progress line a second on stderr , the corpus is written to
+the corpus directory if one is given.
+*/
+int VmExploreMain(const char* Program,int Threads,int Seconds,const char* Corpus)
+{
+    PEXPLORER explorer;
+    PEXPLORE_WORKER workers;
+    PVM_CONTEXT context;
+    uint64_t execs,exceptions,hangs;
+    EXPLORE_INPUT empty;
+    int t,second;
+#ifdef _WIN32
+    HANDLE* handles;
+#else
+    pthread_t* handles;
+#endif
+#ifndef VM_COVERAGE
+    printf("The explorer needs a build with VM_COVERAGE\n");
+    return 1;
+#endif
+    if(Threads <= 0)
+        Threads = VmDefaultThreads();
+    if(Seconds <= 0)
+        Seconds = EXPLORE_SECONDS;
+    explorer = (PEXPLORER) calloc(1,sizeof(EXPLORER));
+    workers = (PEXPLORE_WORKER) calloc(Threads,sizeof(EXPLORE_WORKER));
+    handles = calloc(Threads,sizeof(*handles));
+    context = VmCreateContext();
+    if(!explorer || !workers || !handles || !context)
+        return 1;
+    explorer->Corpus = (PEXPLORE_INPUT) malloc(EXPLORE_MAX_CORPUS * sizeof(EXPLORE_INPUT));
+    explorer->Image = VmImageOpen(Program);
+    if(!explorer->Corpus || !explorer->Image)
+    {
+        printf("Found trouble opening the file (or it is larger than the storage available for data and code)");
+        return 1;
+    }
+#ifdef _WIN32
+    InitializeSRWLock(&explorer->Lock);
+#else
+    pthread_mutex_init(&explorer->Lock,NULL);
+#endif
+    VmImageLoad(explorer->Image,context);
+    ExploreDictionary(explorer,&context->AS);
+    if(!VmRunToInput(context))
+    {
+        printf("%s doesn't read any input\n",Program);
+        return 1;
+    }
+    VmDestroyContext(context);
+    /*the first entry is the empty input*/
+    memset(&empty,0,sizeof(empty));
+    ExploreAdd(explorer,&empty);
+    for(t = 0;t < Threads;t++)
+    {
+        workers[t].Explorer = explorer;
+        workers[t].Random = 0x9E3779B97F4A7C15ULL * (t + 1);
+#ifdef _WIN32
+        handles[t] = CreateThread(NULL,0,ExploreWorker,&workers[t],0,NULL);
+#else
+        pthread_create(&handles[t],NULL,ExploreWorker,&workers[t]);
+#endif
+    }
+    for(second = 1;second <= Seconds;second++)
+    {
+#ifdef _WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif
+        execs = exceptions = hangs = 0;
+        for(t = 0;t < Threads;t++)
+        {
+            execs += atomic_load(&workers[t].Execs);
+            exceptions += atomic_load(&workers[t].Exceptions);
+            hangs += atomic_load(&workers[t].Hangs);
+        }
+        fprintf(stderr,"[explore %ds] execs %llu (%llu/s) corpus %u edges %u exceptions %llu out of fuel %llu\n",
+                second,(unsigned long long)execs,(unsigned long long)(execs / second),
+                atomic_load(&explorer->CorpusCount),ExploreEdges(explorer),
+                (unsigned long long)exceptions,(unsigned long long)hangs);
+    }
+    atomic_store(&explorer->Stop,TRUE);
+    for(t = 0;t < Threads;t++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handles[t],INFINITE);
+        CloseHandle(handles[t]);
+#else
+        pthread_join(handles[t],NULL);
+#endif
+    }
+    printf("%u inputs , %u edges\n",atomic_load(&explorer->CorpusCount),ExploreEdges(explorer));
+    if(Corpus)
+        ExploreSave(explorer,Corpus);
+    VmImageRelease(explorer->Image);
+    free(explorer->Corpus);
+    free(explorer);
+    free(workers);
+    free(handles);
+    return 0;
+}
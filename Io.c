@@ -0,0 +1,137 @@
+/*
+VM input/output.
+C0 , C2 and 89 go through the VM_IO of the calling thread (VmSetIo). Without one
+they use a VM_IO whose sink is stdout and whose reader is stdin , so the output
+is written in VM_IO_FLUSH_SIZE blocks instead of one printf per instruction.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+static void IoStdoutSink(void* Context,const char* Data,DWORD Size);
+static boolean IoStdinReader(void* Context,char* Buffer,DWORD Size);
+static VM_IO StdIo = {NULL,0,0,IoStdoutSink,NULL,NULL,0,0,IoStdinReader,NULL};
+static VM_THREAD_LOCAL PVM_IO CurrentIo;
+void VmSetIo(PVM_IO Io)
+{
+    CurrentIo = Io;
+}
+static void IoStdoutSink(void* Context,const char* Data,DWORD Size)
+{
+    fwrite(Data,1,Size,stdout);
+    fflush(stdout);
+}
+/*one line of stdin without its newline , the rest of a line longer than Size - 1 is dropped*/
+static boolean IoStdinReader(void* Context,char* Buffer,DWORD Size)
+{
+    char scratch[64];
+    char* line = Size >= 2 ? Buffer : scratch;
+    size_t length;
+    int c;
+    if(!fgets(line,Size >= 2 ? Size : sizeof(scratch),stdin))
+        return FALSE;
+    if(Size == 1)
+        Buffer[0] = 0;
+    length = strlen(line);
+    if(length && line[length - 1] == '\n')
+    {
+        line[length - 1] = 0;
+        return TRUE;
+    }
+    while((c = getchar()) != EOF && c != '\n')
+        ;
+    return TRUE;
+}
+/*hand the buffered output to the sink , buffers without a sink keep their output*/
+void VmFlushIo(PVM_IO Io)
+{
+    if(!Io)
+        Io = CurrentIo ? CurrentIo : &StdIo;
+    if(!Io->Sink || !Io->OutputSize)
+        return;
+    Io->Sink(Io->SinkContext,Io->Output,Io->OutputSize);
+    Io->OutputSize = 0;
+}
+/*append to the output buffer , it grows as needed*/
+static void IoWrite(PVM_IO Io,const char* String,DWORD Size)
+{
+    DWORD capacity;
+    char* output;
+    if(Io->OutputSize + Size > Io->OutputCapacity)
+    {
+        capacity = Io->OutputCapacity ? Io->OutputCapacity : 256;
+        while(capacity < Io->OutputSize + Size)
+            capacity *= 2;
+        output = (char*) realloc(Io->Output,capacity);
+        if(!output)
+            return;
+        Io->Output = output;
+        Io->OutputCapacity = capacity;
+    }
+    memcpy(&Io->Output[Io->OutputSize],String,Size);
+    Io->OutputSize += Size;
+    if(Io->Sink && Io->OutputSize >= VM_IO_FLUSH_SIZE)
+        VmFlushIo(Io);
+}
+/*decimal and a newline , the digits are written from the end of the buffer*/
+void VmPrintInteger(WORD Value)
+{
+    char buffer[6];
+    char* digit = &buffer[sizeof(buffer) - 1];
+    *digit = '\n';
+    do
+    {
+        *--digit = '0' + Value % 10;
+        Value /= 10;
+    }while(Value);
+    IoWrite(CurrentIo ? CurrentIo : &StdIo,digit,&buffer[sizeof(buffer)] - digit);
+}
+void VmPrintString(const char* String)
+{
+    IoWrite(CurrentIo ? CurrentIo : &StdIo,String,strlen(String));
+}
+/*
+FALSE when a 89 has to wait : the input of Io (of the thread if NULL) is still open
+and holds no complete line. The interpreter then stops before the 89 (VM_STOP_INPUT).
+*/
+boolean VmInputReady(PVM_IO Io)
+{
+    if(!Io)
+        Io = CurrentIo ? CurrentIo : &StdIo;
+    if(!Io->InputOpen || Io->Reader)
+        return TRUE;
+    if(Io->InputPos >= Io->InputSize)
+        return FALSE;
+    return memchr(&Io->Input[Io->InputPos],'\n',Io->InputSize - Io->InputPos) != NULL;
+}
+/*
+Read a line without its newline into Buffer , at most Size - 1 characters are
+stored and the rest of the line is dropped. Like gets the buffer is left
+untouched when there is no more input.
+*/
+void VmScanString(char* Buffer,DWORD Size)
+{
+    PVM_IO Io = CurrentIo ? CurrentIo : &StdIo;
+    DWORD size;
+    const char* line;
+    const char* end;
+    if(Io->Reader)
+    {
+        /*a prompt printed before the read has to be seen*/
+        VmFlushIo(Io);
+        Io->Reader(Io->ReaderContext,Buffer,Size);
+        return;
+    }
+    if(Io->InputPos >= Io->InputSize)
+        return;
+    line = &Io->Input[Io->InputPos];
+    end = memchr(line,'\n',Io->InputSize - Io->InputPos);
+    size = end ? (DWORD)(end - line) : Io->InputSize - Io->InputPos;
+    Io->InputPos += size + (end ? 1 : 0);
+    if(!Size)
+        return;
+    if(size > Size - 1)
+        size = Size - 1;
+    memcpy(Buffer,line,size);
+    Buffer[size] = 0;
+}
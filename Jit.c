@@ -0,0 +1,628 @@
+/*
+x86-64 JIT.
+The program is decoded with VmDecode and every decoded op is compiled to native
+code in an executable buffer. The VM state lives in host registers while the
+compiled code runs :
+    R0 -> R3 : r12w -> r15w
+    ZF , CF  : bl , bh
+    SP       : r10d
+    AS       : rbp (data is at [rbp] , stack at [rbp+VM_DATA_SIZE])
+Jumps are native branches between the compiled ops. C is only called for the
+print , scan and bulk memory opcodes. Exceptions , EXIT and writes to code leave the compiled
+code with Regs->IP set to the instruction that follows; a write to code is
+handled by compiling again from there.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "VM.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+/*host registers*/
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R10 10
+#define R11 11
+#define HOST_GPR(r) (12 + (r))
+#ifdef _WIN32
+#define ARG1 RCX
+#define ARG2 RDX
+#define ARG3 8
+#define ARG4 9
+#else
+#define ARG1 RDI
+#define ARG2 RSI
+#define ARG3 RDX
+#define ARG4 RCX
+#endif
+/*condition codes*/
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+/*exit reasons , returned in the high word of eax (the low word is the IP)*/
+#define JIT_EXIT          (1 << 16)
+#define JIT_EXCEPTION     (2 << 16)
+#define JIT_CODE_WRITTEN  (3 << 16)
+/*frame slot holding Regs (above the 32 bytes of shadow space)*/
+#define FRAME_REGS 32
+/*the longest op is well below this*/
+#define JIT_MAX_OP_SIZE 256
+#define OPC(s) (const BYTE*)(s),sizeof(s) - 1
+typedef DWORD (*JIT_ENTRY)(PADDRESS_SPACE AS,PREGS Regs,void* Entry);
+static void Emit(PJIT_PROGRAM Jit,const BYTE* bytes,DWORD n)
+{
+    memcpy(&Jit->Code[Jit->CodeSize],bytes,n);
+    Jit->CodeSize += n;
+}
+static void Emit1(PJIT_PROGRAM Jit,BYTE b)
+{
+    Jit->Code[Jit->CodeSize++] = b;
+}
+static void Emit2(PJIT_PROGRAM Jit,WORD w)
+{
+    Emit(Jit,(BYTE*)&w,sizeof(w));
+}
+static void Emit4(PJIT_PROGRAM Jit,DWORD d)
+{
+    Emit(Jit,(BYTE*)&d,sizeof(d));
+}
+static void Emit8(PJIT_PROGRAM Jit,uint64_t q)
+{
+    Emit(Jit,(BYTE*)&q,sizeof(q));
+}
+/*
+[prefix] [REX] opcode ModRM with a register operand (rm), reg is a register or an opcode extension.
+*/
+static void EmitReg(PJIT_PROGRAM Jit,BYTE prefix,BYTE rexw,const BYTE* opcode,DWORD oplen,BYTE reg,BYTE rm)
+{
+    BYTE rex = 0x40 | (rexw << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if(prefix)
+        Emit1(Jit,prefix);
+    if(rex != 0x40)
+        Emit1(Jit,rex);
+    Emit(Jit,opcode,oplen);
+    Emit1(Jit,0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+/*
+[prefix] [REX] opcode ModRM [SIB] disp32 with a memory operand [base + index*(1<<scale) + disp].
+*/
+static void EmitMem(PJIT_PROGRAM Jit,BYTE prefix,BYTE rexw,const BYTE* opcode,DWORD oplen,BYTE reg,BYTE base,int index,BYTE scale,DWORD disp)
+{
+    BYTE rex = 0x40 | (rexw << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if(index >= 0)
+        rex |= (index >> 3) << 1;
+    if(prefix)
+        Emit1(Jit,prefix);
+    if(rex != 0x40)
+        Emit1(Jit,rex);
+    Emit(Jit,opcode,oplen);
+    if(index >= 0 || (base & 7) == RSP)
+    {
+        Emit1(Jit,0x80 | ((reg & 7) << 3) | 4);
+        Emit1(Jit,(scale << 6) | ((index >= 0 ? index : RSP) & 7) << 3 | (base & 7));
+    }
+    else
+        Emit1(Jit,0x80 | ((reg & 7) << 3) | (base & 7));
+    Emit4(Jit,disp);
+}
+static void EmitMovImm64(PJIT_PROGRAM Jit,BYTE reg,uint64_t imm)
+{
+    Emit1(Jit,0x48 | (reg >> 3));
+    Emit1(Jit,0xB8 | (reg & 7));
+    Emit8(Jit,imm);
+}
+/*set the dirty bit of the page holding AS byte offset Offset (known at compile time)*/
+static void EmitMarkDirty(PJIT_PROGRAM Jit,DWORD Offset)
+{
+    EmitMem(Jit,0,0,OPC("\x80"),1,RBP,-1,0,offsetof(ADDRESS_SPACE,Dirty) + (Offset >> (VM_PAGE_SHIFT + 3)));
+    Emit1(Jit,1 << ((Offset >> VM_PAGE_SHIFT) & 7));   /*or byte [Dirty],bit*/
+}
+/*same with the offset in edx , clobbers edx*/
+static void EmitMarkDirtyEdx(PJIT_PROGRAM Jit)
+{
+    EmitReg(Jit,0,0,OPC("\xC1"),5,RDX);                /*shr edx,VM_PAGE_SHIFT*/
+    Emit1(Jit,VM_PAGE_SHIFT);
+    EmitMem(Jit,0,0,OPC("\x0F\xAB"),RDX,RBP,-1,0,offsetof(ADDRESS_SPACE,Dirty));  /*bts [Dirty],edx*/
+}
+/*jmp to the common exit with eax = reason | IP*/
+static void EmitExit(PJIT_PROGRAM Jit,DWORD reason)
+{
+    Emit1(Jit,0xB8);
+    Emit4(Jit,reason);
+    Emit1(Jit,0xE9);
+    Emit4(Jit,Jit->Epilogue - (Jit->CodeSize + 4));
+}
+/*exit if the host condition cc is true*/
+static void EmitExitIf(PJIT_PROGRAM Jit,BYTE cc,DWORD reason)
+{
+    Emit1(Jit,0x70 | (cc ^ 1));
+    Emit1(Jit,10);
+    EmitExit(Jit,reason);
+}
+/*jump to a decoded op , the rel32 holds the op index until the fixups are applied*/
+static void EmitJump(PJIT_PROGRAM Jit,const BYTE* opcode,DWORD oplen,VM_INDEX target)
+{
+    Emit(Jit,opcode,oplen);
+    Jit->Fixups[Jit->FixupCount++] = Jit->CodeSize;
+    Emit4(Jit,target);
+}
+/*ZF and CF of the VM from the host flags of the last operation*/
+static void EmitSetFlags(PJIT_PROGRAM Jit)
+{
+    Emit(Jit,OPC("\x0F\x94\xC3"));  /*setz bl*/
+    Emit(Jit,OPC("\x0F\x92\xC7"));  /*setc bh*/
+}
+static DWORD JitPrintInteger(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program)
+{
+    if(Regs->SP == VM_STACK_SIZE)
+        return JIT_EXCEPTION;
+    VmPrintInteger(AS->stack[Regs->SP++]);
+    return 0;
+}
+static DWORD JitPrintString(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program)
+{
+    WORD word_val;
+    if(Regs->SP == VM_STACK_SIZE)
+        return JIT_EXCEPTION;
+    word_val = AS->stack[Regs->SP++];
+    if(VM_OUT_OF_DATA(word_val))
+        return JIT_EXCEPTION;
+    VmPrintString((char*)&AS->data[word_val]);
+    return 0;
+}
+static DWORD JitScanString(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program)
+{
+    WORD word_val;
+    DWORD i,size;
+    if(Regs->SP == VM_STACK_SIZE)
+        return JIT_EXCEPTION;
+    word_val = AS->stack[Regs->SP++];
+    if(VM_OUT_OF_DATA(word_val))
+        return JIT_EXCEPTION;
+    VmScanString((char*)&AS->data[word_val],VM_DATA_SIZE - word_val);
+    size = strlen((char*)&AS->data[word_val]) + 1;
+    VmMarkDirty(AS,word_val,size);
+    for(i = word_val;i < (DWORD)word_val + size && i < VM_DATA_SIZE;i++)
+    {
+        if(Program->CodeMap[i >> 3] & (1 << (i & 7)))
+            return JIT_CODE_WRITTEN;
+    }
+    return 0;
+}
+/*the bulk opcodes (Bulk.c) , the registers and the flags are in Regs*/
+static DWORD JitBulk(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program,const DECODED_OP* op)
+{
+    VM_BULK_RESULT bulk;
+    DWORD i,end = Regs->GPRs[op->Dst];
+    if(!VmBulk(AS,op->Handler,Regs->GPRs[op->Dst],Regs->GPRs[op->Src],Regs->GPRs[op->Imm >> 4],Regs->GPRs[op->Imm & 0x0F],&bulk))
+        return JIT_EXCEPTION;
+    if(op->Handler == 0x63)
+        Regs->GPRs[op->Dst] = bulk.Length;
+    Regs->ZF = bulk.ZF;
+    Regs->CF = bulk.CF;
+    for(i = end,end += bulk.WriteSize;i < end;i++)
+    {
+        /*8 aligned bytes of code map at a time*/
+        if(!(i & 7) && i + 8 <= end)
+        {
+            if(Program->CodeMap[i >> 3])
+                return JIT_CODE_WRITTEN;
+            i += 7;
+        }
+        else if(Program->CodeMap[i >> 3] & (1 << (i & 7)))
+            return JIT_CODE_WRITTEN;
+    }
+    return 0;
+}
+/*bl = ZF , bh = CF from Regs->Flags (Regs in r11) , clobbers ecx*/
+static void EmitLoadFlags(PJIT_PROGRAM Jit)
+{
+    EmitMem(Jit,0,0,OPC("\x0F\xB6"),RCX,R11,-1,0,offsetof(REGS,Flags));
+    Emit(Jit,OPC("\x89\xCB"));          /*mov ebx,ecx*/
+    Emit(Jit,OPC("\xD1\xE9"));          /*shr ecx,1*/
+    Emit(Jit,OPC("\x83\xE1\x01"));      /*and ecx,1*/
+    Emit(Jit,OPC("\x83\xE3\x01"));      /*and ebx,1 : bl = ZF*/
+    Emit(Jit,OPC("\x88\xCF"));          /*mov bh,cl : bh = CF*/
+}
+/*ZF and CF into Regs->Flags (Regs in r11) , its other bits are kept , clobbers ecx and edx*/
+static void EmitStoreFlags(PJIT_PROGRAM Jit)
+{
+    Emit(Jit,OPC("\x0F\xB6\xCF"));      /*movzx ecx,bh*/
+    Emit(Jit,OPC("\xD1\xE1"));          /*shl ecx,1*/
+    Emit(Jit,OPC("\x08\xD9"));          /*or cl,bl*/
+    EmitMem(Jit,0,0,OPC("\x0F\xB6"),RDX,R11,-1,0,offsetof(REGS,Flags));
+    Emit(Jit,OPC("\x83\xE2\xFC"));      /*and edx,~3*/
+    Emit(Jit,OPC("\x09\xCA"));          /*or edx,ecx*/
+    EmitMem(Jit,0,0,OPC("\x88"),RDX,R11,-1,0,offsetof(REGS,Flags));
+}
+/*call a helper with (AS,Regs,Program) , SP is synced around the call*/
+static void EmitCall(PJIT_PROGRAM Jit,void* helper,DWORD next)
+{
+    EmitMem(Jit,0,1,OPC("\x8B"),R11,RSP,-1,0,FRAME_REGS);
+    EmitMem(Jit,0x66,0,OPC("\x89"),R10,R11,-1,0,offsetof(REGS,SP));
+    EmitReg(Jit,0,1,OPC("\x89"),RBP,ARG1);
+    EmitReg(Jit,0,1,OPC("\x89"),R11,ARG2);
+    EmitMovImm64(Jit,ARG3,(uint64_t)(uintptr_t)&Jit->Program);
+    EmitMovImm64(Jit,RAX,(uint64_t)(uintptr_t)helper);
+    Emit(Jit,OPC("\xFF\xD0"));                      /*call rax*/
+    EmitMem(Jit,0,1,OPC("\x8B"),R11,RSP,-1,0,FRAME_REGS);
+    EmitMem(Jit,0,0,OPC("\x0F\xB7"),R10,R11,-1,0,offsetof(REGS,SP));
+    Emit(Jit,OPC("\x85\xC0"));                      /*test eax,eax*/
+    Emit(Jit,OPC("\x74\x0A"));                      /*jz over the exit*/
+    Emit1(Jit,0x0D);                                /*or eax,next*/
+    Emit4(Jit,next);
+    Emit1(Jit,0xE9);
+    Emit4(Jit,Jit->Epilogue - (Jit->CodeSize + 4));
+}
+/*
+Call JitBulk with (AS,Regs,Program,op) , unlike EmitCall the registers and the flags
+are synced around the call as well.
+*/
+static void EmitBulkCall(PJIT_PROGRAM Jit,PDECODED_OP op,DWORD next)
+{
+    int i;
+    EmitMem(Jit,0,1,OPC("\x8B"),R11,RSP,-1,0,FRAME_REGS);
+    for(i = 0;i <= 3;i++)
+        EmitMem(Jit,0x66,0,OPC("\x89"),HOST_GPR(i),R11,-1,0,offsetof(REGS,GPRs) + i*sizeof(WORD));
+    EmitMem(Jit,0x66,0,OPC("\x89"),R10,R11,-1,0,offsetof(REGS,SP));
+    EmitStoreFlags(Jit);
+    EmitReg(Jit,0,1,OPC("\x89"),RBP,ARG1);
+    EmitReg(Jit,0,1,OPC("\x89"),R11,ARG2);
+    EmitMovImm64(Jit,ARG3,(uint64_t)(uintptr_t)&Jit->Program);
+    EmitMovImm64(Jit,ARG4,(uint64_t)(uintptr_t)op);
+    EmitMovImm64(Jit,RAX,(uint64_t)(uintptr_t)JitBulk);
+    Emit(Jit,OPC("\xFF\xD0"));                      /*call rax*/
+    EmitMem(Jit,0,1,OPC("\x8B"),R11,RSP,-1,0,FRAME_REGS);
+    EmitMem(Jit,0,0,OPC("\x0F\xB7"),R10,R11,-1,0,offsetof(REGS,SP));
+    if(op->Handler == 0x63)
+        EmitMem(Jit,0,0,OPC("\x0F\xB7"),HOST_GPR(op->Dst),R11,-1,0,offsetof(REGS,GPRs) + op->Dst*sizeof(WORD));
+    EmitLoadFlags(Jit);
+    Emit(Jit,OPC("\x85\xC0"));                      /*test eax,eax*/
+    Emit(Jit,OPC("\x74\x0A"));                      /*jz over the exit*/
+    Emit1(Jit,0x0D);                                /*or eax,next*/
+    Emit4(Jit,next);
+    Emit1(Jit,0xE9);
+    Emit4(Jit,Jit->Epilogue - (Jit->CodeSize + 4));
+}
+/*
+Entry : func(AS,Regs,native entry point) , loads the VM state into host registers.
+Exit : eax = reason | IP , stores the VM state back and returns the reason.
+*/
+static void EmitPrologueEpilogue(PJIT_PROGRAM Jit)
+{
+    int i;
+    Emit(Jit,OPC("\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57"));  /*push rbx,rbp,r12-r15*/
+    Emit(Jit,OPC("\x48\x83\xEC\x28"));                          /*sub rsp,40*/
+    EmitReg(Jit,0,1,OPC("\x89"),ARG1,RBP);
+    EmitMem(Jit,0,1,OPC("\x89"),ARG2,RSP,-1,0,FRAME_REGS);
+    EmitReg(Jit,0,1,OPC("\x89"),ARG2,R11);
+    for(i = 0;i <= 3;i++)
+        EmitMem(Jit,0,0,OPC("\x0F\xB7"),HOST_GPR(i),R11,-1,0,offsetof(REGS,GPRs) + i*sizeof(WORD));
+    EmitLoadFlags(Jit);
+    EmitMem(Jit,0,0,OPC("\x0F\xB7"),R10,R11,-1,0,offsetof(REGS,SP));
+    EmitReg(Jit,0,0,OPC("\xFF"),4,ARG3);  /*jmp entry*/
+    Jit->Epilogue = Jit->CodeSize;
+    EmitMem(Jit,0,1,OPC("\x8B"),R11,RSP,-1,0,FRAME_REGS);
+    EmitMem(Jit,0x66,0,OPC("\x89"),RAX,R11,-1,0,offsetof(REGS,IP));
+    for(i = 0;i <= 3;i++)
+        EmitMem(Jit,0x66,0,OPC("\x89"),HOST_GPR(i),R11,-1,0,offsetof(REGS,GPRs) + i*sizeof(WORD));
+    EmitMem(Jit,0x66,0,OPC("\x89"),R10,R11,-1,0,offsetof(REGS,SP));
+    EmitStoreFlags(Jit);
+    Emit(Jit,OPC("\xC1\xE8\x10"));      /*shr eax,16*/
+    Emit(Jit,OPC("\x48\x83\xC4\x28"));  /*add rsp,40*/
+    Emit(Jit,OPC("\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B\xC3"));
+}
+static boolean IsCode(PDECODED_PROGRAM Program,DWORD addr)
+{
+    return addr < VM_DATA_SIZE && (Program->CodeMap[addr >> 3] & (1 << (addr & 7)));
+}
+static void CompileOp(PJIT_PROGRAM Jit,PDECODED_OP op)
+{
+    BYTE d = HOST_GPR(op->Dst),s = HOST_GPR(op->Src);
+    /*the IP of the exits , it wraps like Regs->IP*/
+    DWORD next = (WORD)(op->IP + op->Length);
+    switch(op->Handler)
+    {
+        case 0x90 :
+            break;
+        case VM_OP_GOTO :
+        case 0xE0 :
+            EmitJump(Jit,OPC("\xE9"),op->Imm);
+            break;
+        /*MOV Rd,Rs*/
+        case 0x10 :
+            EmitReg(Jit,0x66,0,OPC("\x89"),s,d);
+            break;
+        /*MOVX Rd,BYTE [Imm]*/
+        case 0x12 :
+            EmitMem(Jit,0,0,OPC("\x0F\xB6"),d,RBP,-1,0,op->Imm);
+            break;
+        /*MOV Rd,WORD [Imm]*/
+        case 0x14 :
+            EmitMem(Jit,0x66,0,OPC("\x8B"),d,RBP,-1,0,op->Imm);
+            break;
+        /*MOVX Rd,Imm and MOV Rd,Imm*/
+        case 0x16 :
+        case 0x18 :
+            Emit1(Jit,0x41);
+            Emit1(Jit,0xB8 | (d & 7));
+            Emit4(Jit,op->Imm);
+            break;
+        /*MOV BYTE [Imm],Rd , a write to code is known at compile time*/
+        case 0x1c :
+            EmitMem(Jit,0,0,OPC("\x88"),d,RBP,-1,0,op->Imm);
+            EmitMarkDirty(Jit,op->Imm);
+            if(IsCode(&Jit->Program,op->Imm))
+                EmitExit(Jit,JIT_CODE_WRITTEN | next);
+            break;
+        /*MOV WORD [Imm],Rd*/
+        case 0x1f :
+            EmitMem(Jit,0x66,0,OPC("\x89"),d,RBP,-1,0,op->Imm);
+            EmitMarkDirty(Jit,op->Imm);
+            if((op->Imm >> VM_PAGE_SHIFT) != ((op->Imm + 1) >> VM_PAGE_SHIFT))
+                EmitMarkDirty(Jit,op->Imm + 1);
+            if(IsCode(&Jit->Program,op->Imm) || IsCode(&Jit->Program,op->Imm + 1))
+                EmitExit(Jit,JIT_CODE_WRITTEN | next);
+            break;
+        /*
+        Conditional jumps , bl = ZF and bh = CF are 0 or 1 so
+        bx == 0x0100 <=> CF && !ZF
+        */
+        case 0xE2 :
+            Emit(Jit,OPC("\x84\xDB"));                  /*test bl,bl*/
+            EmitJump(Jit,OPC("\x0F\x85"),op->Imm);      /*jnz*/
+            break;
+        case 0xE3 :
+            Emit(Jit,OPC("\x84\xDB"));
+            EmitJump(Jit,OPC("\x0F\x84"),op->Imm);      /*jz*/
+            break;
+        case 0xE4 :
+            Emit(Jit,OPC("\x66\x81\xFB\x00\x01"));      /*cmp bx,0x0100*/
+            EmitJump(Jit,OPC("\x0F\x85"),op->Imm);
+            break;
+        case 0xE6 :
+            Emit(Jit,OPC("\x66\x85\xDB"));              /*test bx,bx*/
+            EmitJump(Jit,OPC("\x0F\x85"),op->Imm);
+            break;
+        case 0xE8 :
+            Emit(Jit,OPC("\x66\x81\xFB\x00\x01"));
+            EmitJump(Jit,OPC("\x0F\x84"),op->Imm);
+            break;
+        case 0xEC :
+            Emit(Jit,OPC("\x66\x85\xDB"));
+            EmitJump(Jit,OPC("\x0F\x84"),op->Imm);
+            break;
+        /*
+        Arithmetic : the host ZF and CF of the same operation on the same width are the
+        ones of the VM (carry <=> result < old value , borrow <=> result > old value)
+        */
+        case 0xAD :
+            EmitReg(Jit,0x66,0,OPC("\x81"),0,d);        /*add d,imm16*/
+            Emit2(Jit,op->Imm);
+            EmitSetFlags(Jit);
+            break;
+        case 0xA5 :
+            EmitReg(Jit,0x66,0,OPC("\x01"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        case 0xA2 :
+            EmitReg(Jit,0,0,OPC("\x00"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        case 0x5B :
+            EmitReg(Jit,0x66,0,OPC("\x81"),5,d);        /*sub d,imm16*/
+            Emit2(Jit,op->Imm);
+            EmitSetFlags(Jit);
+            break;
+        case 0x5C :
+            EmitReg(Jit,0x66,0,OPC("\x29"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        case 0x5D :
+            EmitReg(Jit,0,0,OPC("\x28"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        /*xor clears the host CF*/
+        case 0xF0 :
+            EmitReg(Jit,0x66,0,OPC("\x31"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        case 0xF1 :
+            EmitReg(Jit,0,0,OPC("\x30"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        case 0xA1 :
+            EmitReg(Jit,0,0,OPC("\x80"),0,d);           /*add d8,imm8*/
+            Emit1(Jit,op->Imm);
+            EmitSetFlags(Jit);
+            break;
+        case 0x51 :
+            EmitReg(Jit,0,0,OPC("\x80"),5,d);           /*sub d8,imm8*/
+            Emit1(Jit,op->Imm);
+            EmitSetFlags(Jit);
+            break;
+        /*MOV BYTE [Rd],Rs*/
+        case 0x55 :
+            EmitReg(Jit,0,0,OPC("\x0F\xB7"),RAX,d);     /*movzx eax,d*/
+#if VM_DATA_SIZE < 0x10000
+            Emit1(Jit,0x3D);                            /*cmp eax,VM_DATA_SIZE*/
+            Emit4(Jit,VM_DATA_SIZE);
+            EmitExitIf(Jit,CC_AE,JIT_EXCEPTION | next);
+#endif
+            EmitMem(Jit,0,0,OPC("\x88"),s,RBP,RAX,0,0);
+            EmitReg(Jit,0,0,OPC("\x89"),RAX,RDX);        /*mov edx,eax*/
+            EmitMarkDirtyEdx(Jit);
+            EmitMovImm64(Jit,RCX,(uint64_t)(uintptr_t)Jit->Program.CodeMap);
+            EmitMem(Jit,0,0,OPC("\x0F\xA3"),RAX,RCX,-1,0,0);    /*bt [CodeMap],eax*/
+            EmitExitIf(Jit,CC_B,JIT_CODE_WRITTEN | next);
+            break;
+        /*MOVX Rd,BYTE [Rs]*/
+        case 0x56 :
+            EmitReg(Jit,0,0,OPC("\x0F\xB7"),RAX,s);
+#if VM_DATA_SIZE < 0x10000
+            Emit1(Jit,0x3D);
+            Emit4(Jit,VM_DATA_SIZE);
+            EmitExitIf(Jit,CC_AE,JIT_EXCEPTION | next);
+#endif
+            EmitMem(Jit,0,0,OPC("\x0F\xB6"),d,RBP,RAX,0,0);
+            break;
+        /*CMP and CMPL (same source operand check as VmLoop) , CF = Rs > Rd*/
+        case 0x70 :
+        case 0x71 :
+#if VM_DATA_SIZE < 0x10000
+            EmitReg(Jit,0x66,0,OPC("\x81"),7,s);        /*cmp s,VM_DATA_SIZE*/
+            Emit2(Jit,VM_DATA_SIZE);
+            EmitExitIf(Jit,CC_AE,JIT_EXCEPTION | next);
+#endif
+            if(op->Handler == 0x70)
+                EmitReg(Jit,0x66,0,OPC("\x39"),s,d);
+            else
+                EmitReg(Jit,0,0,OPC("\x38"),s,d);
+            EmitSetFlags(Jit);
+            break;
+        /*PUSH Rd , SP-- underflowing is the stack overflow*/
+        case 0xAF :
+            EmitReg(Jit,0,0,OPC("\x83"),5,R10);         /*sub r10d,1*/
+            Emit1(Jit,1);
+            EmitExitIf(Jit,CC_B,JIT_EXCEPTION | next);
+            EmitMem(Jit,0x66,0,OPC("\x89"),d,RBP,R10,1,offsetof(ADDRESS_SPACE,stack));
+            EmitMem(Jit,0,0,OPC("\x8D"),RDX,R10,R10,0,offsetof(ADDRESS_SPACE,stack));  /*lea edx,[stack+r10*2]*/
+            EmitMarkDirtyEdx(Jit);
+            break;
+        /*POP Rd*/
+        case 0xAE :
+            EmitReg(Jit,0,0,OPC("\x81"),7,R10);         /*cmp r10d,VM_STACK_SIZE*/
+            Emit4(Jit,VM_STACK_SIZE);
+            EmitExitIf(Jit,CC_E,JIT_EXCEPTION | next);
+            EmitMem(Jit,0x66,0,OPC("\x8B"),d,RBP,R10,1,offsetof(ADDRESS_SPACE,stack));
+            EmitReg(Jit,0,0,OPC("\x83"),0,R10);         /*add r10d,1*/
+            Emit1(Jit,1);
+            break;
+        case 0xC0 :
+            EmitCall(Jit,(void*)JitPrintInteger,next);
+            break;
+        case 0xC2 :
+            EmitCall(Jit,(void*)JitPrintString,next);
+            break;
+        case 0x89 :
+            EmitCall(Jit,(void*)JitScanString,next);
+            break;
+        case 0x60 :
+        case 0x61 :
+        case 0x62 :
+        case 0x63 :
+        case 0x64 :
+            EmitBulkCall(Jit,op,next);
+            break;
+        case 0xED :
+            EmitExit(Jit,JIT_EXIT | next);
+            break;
+        default :
+            EmitExit(Jit,JIT_EXCEPTION | next);
+            break;
+    }
+}
+/*
+Decode from Entry and compile the whole decoded stream.
+Returns the native address of Entry , NULL if the code doesn't fit in the buffer.
+*/
+static void* JitCompile(PADDRESS_SPACE AS,PJIT_PROGRAM Jit,WORD Entry)
+{
+    DWORD i,target;
+    VM_INDEX entry_op;
+#ifndef _WIN32
+    if(!Jit->Code)
+    {
+        Jit->Code = mmap(NULL,JIT_CODE_SIZE,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+        if(Jit->Code == MAP_FAILED)
+        {
+            Jit->Code = NULL;
+            return NULL;
+        }
+    }
+    else
+        mprotect(Jit->Code,JIT_CODE_SIZE,PROT_READ | PROT_WRITE);
+#else
+    DWORD old;
+    if(!Jit->Code)
+    {
+        Jit->Code = VirtualAlloc(NULL,JIT_CODE_SIZE,MEM_COMMIT | MEM_RESERVE,PAGE_READWRITE);
+        if(!Jit->Code)
+            return NULL;
+    }
+    else
+        VirtualProtect(Jit->Code,JIT_CODE_SIZE,PAGE_READWRITE,&old);
+#endif
+    entry_op = VmDecode(AS,&Jit->Program,Entry);
+    Jit->CodeSize = 0;
+    Jit->FixupCount = 0;
+    EmitPrologueEpilogue(Jit);
+    for(i = 0;i < Jit->Program.Count;i++)
+    {
+        if(Jit->CodeSize + JIT_MAX_OP_SIZE > JIT_CODE_SIZE)
+            return NULL;
+        Jit->Offsets[i] = Jit->CodeSize;
+        CompileOp(Jit,&Jit->Program.Ops[i]);
+    }
+    for(i = 0;i < Jit->FixupCount;i++)
+    {
+        target = *(DWORD*)&Jit->Code[Jit->Fixups[i]];
+        *(DWORD*)&Jit->Code[Jit->Fixups[i]] = Jit->Offsets[target] - (Jit->Fixups[i] + 4);
+    }
+#ifndef _WIN32
+    mprotect(Jit->Code,JIT_CODE_SIZE,PROT_READ | PROT_EXEC);
+#else
+    VirtualProtect(Jit->Code,JIT_CODE_SIZE,PAGE_EXECUTE_READ,&old);
+    FlushInstructionCache(GetCurrentProcess(),Jit->Code,Jit->CodeSize);
+#endif
+    return &Jit->Code[Jit->Offsets[entry_op]];
+}
+void VmLoopJit(PADDRESS_SPACE AS,PREGS Regs,PJIT_PROGRAM Jit)
+{
+    void* entry;
+    DWORD reason;
+    do
+    {
+        entry = JitCompile(AS,Jit,Regs->IP);
+        if(!entry)
+        {
+            /*can't compile , interpret*/
+            VmLoopDecoded(AS,Regs,&Jit->Program);
+            return;
+        }
+        reason = ((JIT_ENTRY)Jit->Code)(AS,Regs,entry);
+    }while(reason == JIT_CODE_WRITTEN >> 16);
+}
+/*free the executable buffer*/
+void VmJitRelease(PJIT_PROGRAM Jit)
+{
+    if(!Jit->Code)
+        return;
+#ifndef _WIN32
+    munmap(Jit->Code,JIT_CODE_SIZE);
+#else
+    VirtualFree(Jit->Code,0,MEM_RELEASE);
+#endif
+    Jit->Code = NULL;
+}
+#else
+/*not an x86-64 host , interpret the decoded stream*/
+void VmLoopJit(PADDRESS_SPACE AS,PREGS Regs,PJIT_PROGRAM Jit)
+{
+    VmLoopDecoded(AS,Regs,&Jit->Program);
+}
+void VmJitRelease(PJIT_PROGRAM Jit)
+{
+}
+#endif
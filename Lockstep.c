@@ -0,0 +1,667 @@
+/*
+SIMD lockstep engine.
+Runs the same program over many instances (e.g. a checker fed with many candidate
+inputs through 0x89). The program is decoded once (VmDecode , no fusion) and the
+instances are run VM_LANES at a time in a LOCKSTEP_GROUP that keeps the registers ,
+SP , flags and the current op of every lane in struct-of-arrays form. Each lane
+keeps its own address space.
+
+Each step runs one op for all the lanes that are at it (the execution mask) :
+register , ALU , flag and control flow work is done on whole vectors (AVX2 , SSE2
+or a plain loop) , memory , stack and I/O ops loop over the running lanes.
+When a conditional jump splits the lanes the group is diverged : the op with the
+lowest address among the lanes runs next so that the lanes behind catch up and
+reconverge. A lane leaves the group when it exits or raises an exception. A lane
+that writes to decoded code , or the last lane of a group , finishes on VmLoop.
+
+Semantics are the ones of VmLoopDecoded.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i LANE_VEC;
+#define VEC_WIDTH 16
+#define VecLoad(p) _mm256_load_si256((const __m256i*)(p))
+#define VecStore(p,v) _mm256_store_si256((__m256i*)(p),v)
+#define VecSet(x) _mm256_set1_epi16((short)(x))
+#define VecAdd _mm256_add_epi16
+#define VecSub _mm256_sub_epi16
+#define VecAnd _mm256_and_si256
+#define VecOr _mm256_or_si256
+#define VecXor _mm256_xor_si256
+#define VecAndNot _mm256_andnot_si256
+#define VecEq _mm256_cmpeq_epi16
+#define VecGt _mm256_cmpgt_epi16
+#define VecAny(v) _mm256_movemask_epi8(v)
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+typedef __m128i LANE_VEC;
+#define VEC_WIDTH 8
+#define VecLoad(p) _mm_load_si128((const __m128i*)(p))
+#define VecStore(p,v) _mm_store_si128((__m128i*)(p),v)
+#define VecSet(x) _mm_set1_epi16((short)(x))
+#define VecAdd _mm_add_epi16
+#define VecSub _mm_sub_epi16
+#define VecAnd _mm_and_si128
+#define VecOr _mm_or_si128
+#define VecXor _mm_xor_si128
+#define VecAndNot _mm_andnot_si128
+#define VecEq _mm_cmpeq_epi16
+#define VecGt _mm_cmpgt_epi16
+#define VecAny(v) _mm_movemask_epi8(v)
+#else
+/*scalar fallback , one lane per "vector"*/
+typedef WORD LANE_VEC;
+#define VEC_WIDTH 1
+#define VecLoad(p) (*(p))
+#define VecStore(p,v) (*(p) = (v))
+#define VecSet(x) ((WORD)(x))
+#define VecAdd(a,b) ((WORD)((a) + (b)))
+#define VecSub(a,b) ((WORD)((a) - (b)))
+#define VecAnd(a,b) ((WORD)((a) & (b)))
+#define VecOr(a,b) ((WORD)((a) | (b)))
+#define VecXor(a,b) ((WORD)((a) ^ (b)))
+#define VecAndNot(a,b) ((WORD)(~(a) & (b)))
+#define VecEq(a,b) ((WORD)((a) == (b) ? 0xFFFF : 0))
+#define VecGt(a,b) ((WORD)((short)(a) > (short)(b) ? 0xFFFF : 0))
+#define VecAny(v) (v)
+#endif
+/*a where the mask m is set , b elsewhere*/
+#define VecSelect(m,a,b) VecOr(VecAnd(m,a),VecAndNot(m,b))
+/*unsigned a > b*/
+#define VecGtU(a,b) VecGt(VecXor(a,VecSet(0x8000)),VecXor(b,VecSet(0x8000)))
+#define FOR_EACH_VEC(v) for(v = 0;v < VM_LANES;v += VEC_WIDTH)
+/*lanes that run the current op*/
+#define FOR_EACH_LANE(Group,l) for(l = 0;l < VM_LANES;l++) if((Group)->Exec[l])
+/*instances per VmLoopLockstep call of vm -lockstep*/
+#define LOCKSTEP_CHUNK 1024
+/*the lanes keep op indexes in 16 bits*/
+#define LANE_NO_OP 0xFFFF
+/*masks are 0xFFFF (set) or 0 per lane*/
+typedef struct VM_CACHE_ALIGNED
+{
+    WORD GPRs[4][VM_LANES];
+    WORD SP[VM_LANES];
+    WORD ZF[VM_LANES];
+    WORD CF[VM_LANES];
+    /*index of the decoded op the lane is at*/
+    WORD Pc[VM_LANES];
+    /*lane still running*/
+    WORD Active[VM_LANES];
+    /*lane runs the current op*/
+    WORD Exec[VM_LANES];
+    PADDRESS_SPACE AS[VM_LANES];
+    PREGS Regs[VM_LANES];
+    PVM_IO Io[VM_LANES];
+    int ActiveCount;
+}LOCKSTEP_GROUP,*PLOCKSTEP_GROUP;
+/*the lane leaves the group , its state goes back to its REGS*/
+static void LaneStop(PLOCKSTEP_GROUP Group,int Lane,WORD Ip)
+{
+    PREGS regs = Group->Regs[Lane];
+    int i;
+    for(i = 0;i < 4;i++)
+        regs->GPRs[i] = Group->GPRs[i][Lane];
+    regs->SP = Group->SP[Lane];
+    regs->ZF = Group->ZF[Lane] != 0;
+    regs->CF = Group->CF[Lane] != 0;
+    regs->IP = Ip;
+    Group->Active[Lane] = 0;
+    Group->Exec[Lane] = 0;
+    Group->ActiveCount--;
+}
+/*the lane leaves the group and runs to the end on its own*/
+static void LaneScalar(PLOCKSTEP_GROUP Group,int Lane,WORD Ip)
+{
+    LaneStop(Group,Lane,Ip);
+    VmSetIo(Group->Io[Lane]);
+    VmLoop(Group->AS[Lane],Group->Regs[Lane]);
+    VmSetIo(NULL);
+}
+/*running lanes where Row >= Limit raise an exception*/
+static void LaneCheck(PLOCKSTEP_GROUP Group,const WORD* Row,DWORD Limit,PDECODED_OP op)
+{
+    LANE_VEC bad = VecSet(0);
+    int v,l;
+    FOR_EACH_VEC(v)
+        bad = VecOr(bad,VecAnd(VecLoad(&Group->Exec[v]),VecGtU(VecLoad(&Row[v]),VecSet(Limit - 1))));
+    if(!VecAny(bad))
+        return;
+    FOR_EACH_LANE(Group,l)
+    {
+        if(Row[l] >= Limit)
+            LaneStop(Group,l,op->IP + op->Length);
+    }
+}
+static boolean LaneCodeWrite(PDECODED_PROGRAM Program,DWORD addr,DWORD size)
+{
+    for(;size && addr < VM_DATA_SIZE;size--,addr++)
+    {
+        if(VM_IS_CODE(Program,addr))
+            return TRUE;
+    }
+    return FALSE;
+}
+/*
+ALU operation on the running lanes of vector v. Kind is LAZY_ADD , LAZY_SUB or
+LAZY_LOGIC (XOR) , Low works on the low byte and keeps the high one , CMP doesn't
+Write its result. Called with constants so each use is specialized.
+*/
+static inline void LaneAlu(PLOCKSTEP_GROUP Group,int v,BYTE Dst,LANE_VEC b,int Kind,boolean Low,boolean Write)
+{
+    LANE_VEC m = VecLoad(&Group->Exec[v]);
+    LANE_VEC reg = VecLoad(&Group->GPRs[Dst][v]);
+    LANE_VEC low = VecSet(0xFF);
+    LANE_VEC a = reg,r,cf;
+    if(Low)
+    {
+        a = VecAnd(a,low);
+        b = VecAnd(b,low);
+    }
+    r = Kind == LAZY_ADD ? VecAdd(a,b) : Kind == LAZY_SUB ? VecSub(a,b) : VecXor(a,b);
+    if(Low)
+        r = VecAnd(r,low);
+    cf = Kind == LAZY_ADD ? VecGtU(a,r) : Kind == LAZY_SUB ? VecGtU(r,a) : VecSet(0);
+    if(Write)
+        VecStore(&Group->GPRs[Dst][v],VecSelect(m,Low ? VecOr(VecAndNot(low,reg),r) : r,reg));
+    VecStore(&Group->ZF[v],VecSelect(m,VecEq(r,VecSet(0)),VecLoad(&Group->ZF[v])));
+    VecStore(&Group->CF[v],VecSelect(m,cf,VecLoad(&Group->CF[v])));
+}
+/*Rd = value on the running lanes*/
+static inline void LaneMove(PLOCKSTEP_GROUP Group,int v,BYTE Dst,LANE_VEC value)
+{
+    LANE_VEC m = VecLoad(&Group->Exec[v]);
+    VecStore(&Group->GPRs[Dst][v],VecSelect(m,value,VecLoad(&Group->GPRs[Dst][v])));
+}
+/*condition of a Jcc for vector v*/
+static inline LANE_VEC LaneCondition(PLOCKSTEP_GROUP Group,int v,BYTE opcode)
+{
+    LANE_VEC zf = VecLoad(&Group->ZF[v]);
+    LANE_VEC cf = VecLoad(&Group->CF[v]);
+    LANE_VEC ones = VecSet(0xFFFF);
+    switch(opcode)
+    {
+        case 0xE2 : return zf;
+        case 0xE3 : return VecXor(zf,ones);
+        case 0xE4 : return VecOr(zf,VecXor(cf,ones));
+        case 0xE6 : return VecOr(zf,cf);
+        case 0xE8 : return VecAndNot(zf,cf);
+        case 0xEC : return VecAndNot(VecOr(zf,cf),ones);
+    }
+    return ones;
+}
+/*
+Diverged group : pick the op with the lowest address among the running lanes and
+build the execution mask. Returns FALSE when the group is done , Diverged is
+cleared when every running lane is at that op.
+*/
+static boolean LockstepSchedule(PLOCKSTEP_GROUP Group,PDECODED_PROGRAM Program,boolean* Diverged,WORD* Pc)
+{
+    LANE_VEC others = VecSet(0);
+    WORD pc = LANE_NO_OP;
+    int v,l;
+    for(l = 0;l < VM_LANES;l++)
+    {
+        if(Group->Active[l] && (pc == LANE_NO_OP || Program->Ops[Group->Pc[l]].IP < Program->Ops[pc].IP))
+            pc = Group->Pc[l];
+    }
+    if(pc == LANE_NO_OP)
+        return FALSE;
+    FOR_EACH_VEC(v)
+    {
+        LANE_VEC active = VecLoad(&Group->Active[v]);
+        LANE_VEC exec = VecAnd(active,VecEq(VecLoad(&Group->Pc[v]),VecSet(pc)));
+        VecStore(&Group->Exec[v],exec);
+        others = VecOr(others,VecXor(exec,active));
+    }
+    *Diverged = VecAny(others) != 0;
+    *Pc = pc;
+    return TRUE;
+}
+/*
+While the group is converged every running lane is at pc and Exec is Active , the
+per-lane Pc is only kept up to date while it is diverged. Handlers end with
+LANE_NEXT , the slow path (lanes_slow) is taken when the group is diverged or
+has less than two lanes left.
+*/
+#ifdef VM_THREADED_DISPATCH
+#define VM_NEXT {op = &Program->Ops[pc]; goto *dispatch_table[op->Handler];}
+#else
+#define VM_NEXT break
+#endif
+#define LANE_NEXT(target) {pc = (target); if(diverged || Group->ActiveCount < 2) goto lanes_slow; VM_NEXT;}
+static void LockstepGroup(PLOCKSTEP_GROUP Group,PDECODED_PROGRAM Program)
+{
+    PDECODED_OP op;
+    PADDRESS_SPACE as;
+    boolean diverged = TRUE;
+    WORD pc = 0,word_val;
+    VM_BULK_RESULT bulk;
+    LANE_VEC taken,taken_any,fall_any,m;
+    int v,l;
+#ifdef VM_THREADED_DISPATCH
+    static const void* const dispatch_table[256] =
+    {
+        [0 ... 255] = &&op_default,
+        [VM_OP_GOTO] = &&op_VM_OP_GOTO,
+        [0x90] = &&op_0x90,
+        [0x10] = &&op_0x10, [0x12] = &&op_0x12, [0x14] = &&op_0x14, [0x16] = &&op_0x16,
+        [0x18] = &&op_0x18, [0x1c] = &&op_0x1c, [0x1f] = &&op_0x1f,
+        [0xE0] = &&op_0xE0, [0xE2] = &&op_0xE2, [0xE3] = &&op_0xE3, [0xE4] = &&op_0xE4,
+        [0xE6] = &&op_0xE6, [0xE8] = &&op_0xE8, [0xEC] = &&op_0xEC,
+        [0xAD] = &&op_0xAD, [0xA5] = &&op_0xA5, [0xA2] = &&op_0xA2,
+        [0x5B] = &&op_0x5B, [0x5C] = &&op_0x5C, [0x5D] = &&op_0x5D,
+        [0xF0] = &&op_0xF0, [0xF1] = &&op_0xF1, [0xA1] = &&op_0xA1, [0x51] = &&op_0x51,
+        [0x55] = &&op_0x55, [0x56] = &&op_0x56, [0x70] = &&op_0x70, [0x71] = &&op_0x71,
+        [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&op_0x63, [0x64] = &&op_0x64,
+        [0xAF] = &&op_0xAF, [0xAE] = &&op_0xAE,
+        [0xC0] = &&op_0xC0, [0xC2] = &&op_0xC2, [0x89] = &&op_0x89,
+        [0xED] = &&op_0xED
+    };
+    goto lanes_schedule;
+    {
+        {
+#else
+    boolean exit = FALSE;
+    goto lanes_schedule;
+    while(!exit)
+    {
+        op = &Program->Ops[pc];
+        switch(op->Handler)
+        {
+#endif
+            VM_CASE(0x90) :
+                LANE_NEXT(pc + 1);
+            VM_CASE(VM_OP_GOTO) :
+            VM_CASE(0xE0) :
+                LANE_NEXT(op->Imm);
+            VM_CASE(0xE2) :
+            VM_CASE(0xE3) :
+            VM_CASE(0xE4) :
+            VM_CASE(0xE6) :
+            VM_CASE(0xE8) :
+            VM_CASE(0xEC) :
+                taken_any = VecSet(0);
+                fall_any = VecSet(0);
+                FOR_EACH_VEC(v)
+                {
+                    m = VecLoad(&Group->Exec[v]);
+                    taken = VecAnd(m,LaneCondition(Group,v,op->Handler));
+                    taken_any = VecOr(taken_any,taken);
+                    fall_any = VecOr(fall_any,VecAndNot(taken,m));
+                }
+                if(!VecAny(fall_any))
+                    LANE_NEXT(op->Imm);
+                if(!VecAny(taken_any))
+                    LANE_NEXT(pc + 1);
+                /*the lanes split*/
+                FOR_EACH_VEC(v)
+                {
+                    m = VecLoad(&Group->Exec[v]);
+                    taken = VecAnd(m,LaneCondition(Group,v,op->Handler));
+                    VecStore(&Group->Pc[v],VecSelect(m,VecSelect(taken,VecSet(op->Imm),VecSet(pc + 1)),VecLoad(&Group->Pc[v])));
+                }
+                diverged = TRUE;
+                goto lanes_schedule;
+            VM_CASE(0x10) :
+                FOR_EACH_VEC(v)
+                    LaneMove(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]));
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x16) :
+            VM_CASE(0x18) :
+                FOR_EACH_VEC(v)
+                    LaneMove(Group,v,op->Dst,VecSet(op->Imm));
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xAD) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecSet(op->Imm),LAZY_ADD,FALSE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xA5) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_ADD,FALSE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xA2) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_ADD,TRUE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xA1) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecSet(op->Imm),LAZY_ADD,TRUE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x5B) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecSet(op->Imm),LAZY_SUB,FALSE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x5C) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_SUB,FALSE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x5D) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_SUB,TRUE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x51) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecSet(op->Imm),LAZY_SUB,TRUE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xF0) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_LOGIC,FALSE,TRUE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xF1) :
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_LOGIC,TRUE,TRUE);
+                LANE_NEXT(pc + 1);
+            /*CMP and CMPL have the source operand check of VmLoop*/
+            VM_CASE(0x70) :
+                LaneCheck(Group,Group->GPRs[op->Src],VM_DATA_SIZE,op);
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_SUB,FALSE,FALSE);
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x71) :
+                LaneCheck(Group,Group->GPRs[op->Src],VM_DATA_SIZE,op);
+                FOR_EACH_VEC(v)
+                    LaneAlu(Group,v,op->Dst,VecLoad(&Group->GPRs[op->Src][v]),LAZY_SUB,TRUE,FALSE);
+                LANE_NEXT(pc + 1);
+            /*memory , stack and I/O : every lane has its own address space*/
+            VM_CASE(0x12) :
+                FOR_EACH_LANE(Group,l)
+                    Group->GPRs[op->Dst][l] = Group->AS[l]->data[op->Imm];
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x14) :
+                FOR_EACH_LANE(Group,l)
+                    Group->GPRs[op->Dst][l] = *(WORD*)&Group->AS[l]->data[op->Imm];
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x1c) :
+                FOR_EACH_LANE(Group,l)
+                {
+                    Group->AS[l]->data[op->Imm] = (BYTE)Group->GPRs[op->Dst][l];
+                    VM_MARK_DIRTY(Group->AS[l],op->Imm);
+                    if(VM_IS_CODE(Program,op->Imm))
+                        LaneScalar(Group,l,op->IP + op->Length);
+                }
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x1f) :
+                FOR_EACH_LANE(Group,l)
+                {
+                    *(WORD*)&Group->AS[l]->data[op->Imm] = Group->GPRs[op->Dst][l];
+                    VM_MARK_DIRTY(Group->AS[l],op->Imm);
+                    VM_MARK_DIRTY(Group->AS[l],op->Imm + 1);
+                    if(LaneCodeWrite(Program,op->Imm,sizeof(WORD)))
+                        LaneScalar(Group,l,op->IP + op->Length);
+                }
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x55) :
+                LaneCheck(Group,Group->GPRs[op->Dst],VM_DATA_SIZE,op);
+                FOR_EACH_LANE(Group,l)
+                {
+                    word_val = Group->GPRs[op->Dst][l];
+                    Group->AS[l]->data[word_val] = (BYTE)Group->GPRs[op->Src][l];
+                    VM_MARK_DIRTY(Group->AS[l],word_val);
+                    if(VM_IS_CODE(Program,word_val))
+                        LaneScalar(Group,l,op->IP + op->Length);
+                }
+                LANE_NEXT(pc + 1);
+            VM_CASE(0x56) :
+                LaneCheck(Group,Group->GPRs[op->Src],VM_DATA_SIZE,op);
+                FOR_EACH_LANE(Group,l)
+                    Group->GPRs[op->Dst][l] = Group->AS[l]->data[Group->GPRs[op->Src][l]];
+                LANE_NEXT(pc + 1);
+            /*bulk memory (Bulk.c) , the lanes have their own ranges*/
+            VM_CASE(0x60) :
+            VM_CASE(0x61) :
+            VM_CASE(0x62) :
+            VM_CASE(0x63) :
+            VM_CASE(0x64) :
+                FOR_EACH_LANE(Group,l)
+                {
+                    word_val = Group->GPRs[op->Dst][l];
+                    if(!VmBulk(Group->AS[l],op->Handler,word_val,Group->GPRs[op->Src][l],Group->GPRs[op->Imm >> 4][l],Group->GPRs[op->Imm & 0x0F][l],&bulk))
+                    {
+                        LaneStop(Group,l,op->IP + op->Length);
+                        continue;
+                    }
+                    if(op->Handler == 0x63)
+                        Group->GPRs[op->Dst][l] = bulk.Length;
+                    Group->ZF[l] = bulk.ZF ? 0xFFFF : 0;
+                    Group->CF[l] = bulk.CF ? 0xFFFF : 0;
+                    if(LaneCodeWrite(Program,word_val,bulk.WriteSize))
+                        LaneScalar(Group,l,op->IP + op->Length);
+                }
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xAF) :
+                FOR_EACH_LANE(Group,l)
+                {
+                    if(--Group->SP[l] == 0xFFFF)
+                        LaneStop(Group,l,op->IP + op->Length);
+                    else
+                    {
+                        Group->AS[l]->stack[Group->SP[l]] = Group->GPRs[op->Dst][l];
+                        VM_MARK_STACK_DIRTY(Group->AS[l],Group->SP[l]);
+                    }
+                }
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xAE) :
+                LaneCheck(Group,Group->SP,VM_STACK_SIZE,op);
+                FOR_EACH_LANE(Group,l)
+                    Group->GPRs[op->Dst][l] = Group->AS[l]->stack[Group->SP[l]++];
+                LANE_NEXT(pc + 1);
+            VM_CASE(0xC0) :
+            VM_CASE(0xC2) :
+            VM_CASE(0x89) :
+                LaneCheck(Group,Group->SP,VM_STACK_SIZE,op);
+                FOR_EACH_LANE(Group,l)
+                {
+                    as = Group->AS[l];
+                    word_val = as->stack[Group->SP[l]++];
+                    VmSetIo(Group->Io[l]);
+                    if(op->Handler == 0xC0)
+                        VmPrintInteger(word_val);
+                    else if(VM_OUT_OF_DATA(word_val))
+                        LaneStop(Group,l,op->IP + op->Length);
+                    else if(op->Handler == 0xC2)
+                        VmPrintString((char*)&as->data[word_val]);
+                    else
+                    {
+                        VmScanString((char*)&as->data[word_val],VM_DATA_SIZE - word_val);
+                        VmMarkDirty(as,word_val,strlen((char*)&as->data[word_val]) + 1);
+                        if(LaneCodeWrite(Program,word_val,strlen((char*)&as->data[word_val]) + 1))
+                            LaneScalar(Group,l,op->IP + op->Length);
+                    }
+                    VmSetIo(NULL);
+                }
+                LANE_NEXT(pc + 1);
+            /*exit or exception*/
+            VM_CASE(0xED) :
+            VM_DEFAULT :
+                FOR_EACH_LANE(Group,l)
+                    LaneStop(Group,l,op->IP + op->Length);
+                goto lanes_schedule;
+            /*the running lanes go to pc*/
+            lanes_slow:
+                if(diverged)
+                {
+                    FOR_EACH_VEC(v)
+                    {
+                        m = VecLoad(&Group->Exec[v]);
+                        VecStore(&Group->Pc[v],VecSelect(m,VecSet(pc),VecLoad(&Group->Pc[v])));
+                    }
+                }
+            lanes_schedule:
+                if(!Group->ActiveCount || (diverged && !LockstepSchedule(Group,Program,&diverged,&pc)))
+                {
+                    VM_EXIT;
+                }
+                if(Group->ActiveCount == 1 && Program->Ops[pc].Handler != VM_OP_EXCEPTION)
+                {
+                    /*a lone lane doesn't need the vectors*/
+                    FOR_EACH_LANE(Group,l)
+                        LaneScalar(Group,l,Program->Ops[pc].IP);
+                    VM_EXIT;
+                }
+                VM_NEXT;
+        }
+    }
+#ifdef VM_THREADED_DISPATCH
+vm_exit:
+    return;
+#endif
+}
+void VmLoopLockstep(PADDRESS_SPACE AS,PREGS Regs,PVM_IO Io,DWORD Count)
+{
+    PDECODED_PROGRAM Program;
+    LOCKSTEP_GROUP group;
+    DWORD base,i;
+    VM_INDEX entry;
+    int l,r;
+    if(!Count)
+        return;
+    Program = (PDECODED_PROGRAM) malloc(sizeof(DECODED_PROGRAM));
+    if(!Program)
+        return;
+    VmDecode(&AS[0],Program,Regs[0].IP);
+    if(Program->Count >= LANE_NO_OP)
+    {
+        /*too many ops for the lanes*/
+        for(i = 0;i < Count;i++)
+        {
+            VmSetIo(Io ? &Io[i] : NULL);
+            VmLoop(&AS[i],&Regs[i]);
+            VmSetIo(NULL);
+        }
+        free(Program);
+        return;
+    }
+    for(base = 0;base < Count;base += VM_LANES)
+    {
+        memset(&group,0,sizeof(group));
+        for(l = 0;l < VM_LANES && base + l < Count;l++)
+        {
+            i = base + l;
+            group.AS[l] = &AS[i];
+            group.Regs[l] = &Regs[i];
+            group.Io[l] = Io ? &Io[i] : NULL;
+            for(r = 0;r < 4;r++)
+                group.GPRs[r][l] = Regs[i].GPRs[r];
+            group.SP[l] = Regs[i].SP;
+            group.ZF[l] = Regs[i].ZF ? 0xFFFF : 0;
+            group.CF[l] = Regs[i].CF ? 0xFFFF : 0;
+            entry = VM_OUT_OF_DATA(Regs[i].IP) ? VM_NO_OP : Program->Index[Regs[i].IP];
+            group.Active[l] = 0xFFFF;
+            group.ActiveCount++;
+            if(entry == VM_NO_OP)
+            {
+                /*not reached from the entry of the first instance*/
+                group.Exec[l] = 0xFFFF;
+                LaneScalar(&group,l,Regs[i].IP);
+                continue;
+            }
+            group.Pc[l] = entry;
+        }
+        LockstepGroup(&group,Program);
+    }
+    free(Program);
+}
+/*
+vm -lockstep inputs : run vm_file once per line of inputs , the line is the input
+of the instance. The output of each instance follows a [input N] header.
+*/
+int VmLockstepMain(const char* Inputs)
+{
+    PVM_IMAGE image;
+    PADDRESS_SPACE as;
+    PREGS regs;
+    PVM_IO io;
+    PVM_CONTEXT context;
+    PVM_SNAPSHOT snapshot;
+    VM_IO setup;
+    boolean forked = FALSE;
+    FILE* File;
+    char* text;
+    char* line;
+    char* end;
+    long size;
+    DWORD count,i;
+    image = VmImageOpen("vm_file");
+    if(!image)
+    {
+        printf("Found trouble opening the file");
+        return 1;
+    }
+    File = fopen(Inputs,"rb");
+    if(!File)
+    {
+        printf("Found trouble opening the inputs");
+        return 1;
+    }
+    fseek(File,0,SEEK_END);
+    size = ftell(File);
+    rewind(File);
+    text = (char*) malloc(size + 1);
+    as = (PADDRESS_SPACE) malloc(LOCKSTEP_CHUNK * sizeof(ADDRESS_SPACE));
+    regs = (PREGS) malloc(LOCKSTEP_CHUNK * sizeof(REGS));
+    io = (PVM_IO) malloc(LOCKSTEP_CHUNK * sizeof(VM_IO));
+    snapshot = (PVM_SNAPSHOT) malloc(sizeof(VM_SNAPSHOT));
+    context = VmCreateContext();
+    if(!text || !as || !regs || !io || !snapshot || !context)
+        return 1;
+    size = fread(text,1,size,File);
+    text[size] = 0;
+    fclose(File);
+    /*
+    The code before the first input read is the same for every instance , run it
+    once and start every instance from a snapshot of the state it leaves. Its
+    output is printed for every instance.
+    */
+    VmImageLoad(image,context);
+    VmSnapshot(snapshot,&context->AS,&context->Regs);
+    memset(&setup,0,sizeof(setup));
+    VmSetIo(&setup);
+    if(VmRunToInput(context))
+        VmSnapshot(snapshot,&context->AS,&context->Regs);
+    else
+        setup.OutputSize = 0;
+    VmSetIo(NULL);
+    VmDestroyContext(context);
+    VmImageRelease(image);
+    line = text;
+    count = 0;
+    while(*line)
+    {
+        /*fill a chunk of instances , one per line*/
+        for(i = 0;i < LOCKSTEP_CHUNK && *line;i++)
+        {
+            end = strchr(line,'\n');
+            end = end ? end + 1 : line + strlen(line);
+            /*the first chunk copies the snapshot , the others only undo what the previous instance wrote*/
+            if(forked)
+                VmRestore(snapshot,&as[i],&regs[i]);
+            else
+                VmFork(snapshot,&as[i],&regs[i]);
+            memset(&io[i],0,sizeof(VM_IO));
+            io[i].Input = line;
+            io[i].InputSize = end - line;
+            line = end;
+        }
+        if(i == LOCKSTEP_CHUNK)
+            forked = TRUE;
+        VmLoopLockstep(as,regs,io,i);
+        for(size = 0;size < i;size++)
+        {
+            printf("[input %u]\n",count++);
+            fwrite(setup.Output,1,setup.OutputSize,stdout);
+            fwrite(io[size].Output,1,io[size].OutputSize,stdout);
+            free(io[size].Output);
+        }
+    }
+    free(setup.Output);
+    free(snapshot);
+    free(text);
+    free(as);
+    free(regs);
+    free(io);
+    return 0;
+}
@@ -0,0 +1,1096 @@
+/*
+Offline optimizer.
+vm -optimize program output writes a faster equivalent of program to output. The
+code reachable from IP 0 is split into the basic blocks of VmVerify and analysed
+in three steps :
+- constants : the registers and flags are propagated from the reset state over the
+  blocks , a value is known at the start of a block when every edge reaching it
+  brings the same one. A conditional jump whose flags are known only follows the
+  edge it takes. The values pushed in a block are followed to its end so that the
+  addresses popped by 89 and C2 are known. A register that isn't known keeps the
+  range of values it may have : a pointer walking a buffer from a known address
+  stays above it , a CMP with a known value bounds it on both edges of the jump and
+  an address that didn't raise an exception is in data.
+- memory : every store (1C , 1F , 55 , MEMCPY , MEMSET , XORKEY) and input (89 ,
+  from its buffer to the end of data) needs a bounded address , a single write that
+  may be anywhere in data leaves the program as it is. The blocks whose bytes may
+  be written are kept as they are. Loads (12 , 14 , 56) of bytes that are never
+  written are then folded to their value in the image and the blocks read are kept
+  too : every read (56 , C2 , STRLEN and the sources of the bulk instructions) needs
+  a bounded address as well , the code read through a pointer that may be anywhere
+  could be any.
+- liveness : the registers and flags a block may read before it writes them.
+Every block that isn't kept is then compacted at its own address : NOPs , MOV Rx,Rx ,
+instructions whose result is dead or already in the register and the conditional
+jumps that are never taken are removed , the ones always taken become JMP and an ALU
+result that is known becomes a MOV of it when its flags are dead. A block that goes
+on to the next one ends with a filler (NOP , MOV R0,R0 or a JMP over the bytes it
+freed). Last , jumps to a block starting with a JMP (or with the same conditional
+jump) go straight to its target.
+
+The optimized program prints the same output , reads the same input and stops the
+same way with the same SP , the registers and flags it stops with may differ. The
+analysis assumes that the program starts from reset registers at IP 0 and , if it
+writes its code , that the new code only jumps to the start of blocks : the
+constants are then dropped and only what every block does on its own is used.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#define OPT_BIT(map,addr) ((map)[(addr)>>3] & (1 << ((addr) & 7)))
+#define OPT_SET(map,addr) ((map)[(addr)>>3] |= 1 << ((addr) & 7))
+/*masks of the registers and flags an instruction uses , writes or that are live*/
+#define OPT_R(n) (1 << (n))
+#define OPT_FLAGS 0x10
+#define OPT_ALL 0x1F
+#define OPT_KNOWN(State,r) ((State)->Known & OPT_R(r))
+/*a pointer in [Lo,Hi] that may be anywhere in data*/
+#define OPT_ANYWHERE(Lo,Hi) ((Lo) == 0 && (Hi) >= VM_DATA_MASK)
+/*State->Cmp when the flags don't come from a CMP with a known operand*/
+#define OPT_NO_CMP 0xFF
+/*values pushed in a block that are followed*/
+#define OPT_STACK 64
+/*what the rewriting does with an instruction*/
+#define OPT_KEEP 0
+#define OPT_DROP 1
+#define OPT_FOLD 2  /*becomes a MOV of its result*/
+#define OPT_JMP  3  /*conditional jump always taken*/
+typedef struct
+{
+    WORD Value[4];
+    BYTE Known;         /*bit n : the value of Rn is known*/
+    signed char ZF,CF;  /*0 , 1 or -1 when unknown*/
+    /*Rn is in [Lo[n],Hi[n]] , both are Value[n] when it is known*/
+    WORD Lo[4],Hi[4];
+    /*the flags are those of CMP RCmp,Compared (CMP Compared,RCmp if CmpSwap)*/
+    BYTE Cmp;
+    boolean CmpSwap;
+    WORD Compared;
+}OPT_STATE,*POPT_STATE;
+/*top of the stack , what was pushed before the block is unknown*/
+typedef struct
+{
+    WORD Lo[OPT_STACK];
+    WORD Hi[OPT_STACK];
+    DWORD Depth;
+}OPT_PUSHED,*POPT_PUSHED;
+typedef struct
+{
+    DECODED_OP Op;
+    BYTE Use,Def;
+    boolean Keep;       /*side effects , may raise an exception or is a jump*/
+    boolean Same;       /*the register it writes keeps its value*/
+    boolean Folded;     /*the value written to Op.Dst is Result*/
+    WORD Result;
+    signed char Branch; /*jumps : 1 always taken , 0 never , -1 unknown*/
+    BYTE Action;
+    /*bytes of data it may write and read (WriteUnknown , ReadUnknown : anywhere)*/
+    boolean WriteUnknown,ReadUnknown;
+    DWORD WriteStart,WriteEnd;
+    DWORD ReadStart[2],ReadEnd[2];
+}OPT_INSN,*POPT_INSN;
+typedef struct
+{
+    PADDRESS_SPACE AS;
+    ADDRESS_SPACE Out;
+    VM_CFG Cfg;
+    /*per block : state at the start , reached by the propagation , left as it is*/
+    OPT_STATE In[VM_DATA_SIZE];
+    boolean Reached[VM_DATA_SIZE];
+    boolean Kept[VM_DATA_SIZE];
+    /*per block : liveness at the start , and the ones it reads first and writes*/
+    BYTE LiveIn[VM_DATA_SIZE];
+    BYTE Gen[VM_DATA_SIZE];
+    BYTE Kill[VM_DATA_SIZE];
+    /*address -> block its byte is in*/
+    VM_INDEX Owner[VM_DATA_SIZE];
+    VM_INDEX Worklist[VM_DATA_SIZE];
+    boolean Pending[VM_DATA_SIZE];
+    /*one bit per byte of data the program may write*/
+    BYTE Written[VM_DATA_SIZE/8];
+    /*loads of bytes never written are folded*/
+    boolean Fold;
+    /*the program writes its code , the blocks start with nothing known*/
+    boolean Blind;
+    /*instructions of the block being looked at*/
+    OPT_INSN Insns[VM_DATA_SIZE];
+}OPT,*POPT;
+static boolean IsJump(BYTE Opcode)
+{
+    return Opcode >= 0xE0 && Opcode <= 0xEC;
+}
+static signed char OptNot(signed char a)
+{
+    return a < 0 ? -1 : !a;
+}
+static signed char OptOr(signed char a,signed char b)
+{
+    if(a == 1 || b == 1)
+        return 1;
+    return a == 0 && b == 0 ? 0 : -1;
+}
+static signed char OptAnd(signed char a,signed char b)
+{
+    if(a == 0 || b == 0)
+        return 0;
+    return a == 1 && b == 1 ? 1 : -1;
+}
+/*1 if the jump is taken with the flags of State , 0 if it isn't , -1 if they aren't known*/
+static signed char OptCondition(BYTE Opcode,POPT_STATE State)
+{
+    switch(Opcode)
+    {
+        case 0xE2 :
+            return State->ZF;
+        case 0xE3 :
+            return OptNot(State->ZF);
+        case 0xE4 :
+            return OptOr(State->ZF,OptNot(State->CF));
+        case 0xE6 :
+            return OptOr(State->ZF,State->CF);
+        case 0xE8 :
+            return OptAnd(State->CF,OptNot(State->ZF));
+        case 0xEC :
+            return OptAnd(OptNot(State->CF),OptNot(State->ZF));
+        default :
+            return 1;
+    }
+}
+/*an address in Rr may be out of data (exception)*/
+static boolean OptMayRaise(POPT_STATE State,BYTE r)
+{
+    return State->Hi[r] > VM_DATA_MASK;
+}
+/*Rr is in [Lo,Hi] , known when they are the same*/
+static void OptSetRange(POPT_STATE State,BYTE r,WORD Lo,WORD Hi)
+{
+    State->Lo[r] = Lo;
+    State->Hi[r] = Hi;
+    State->Value[r] = Lo;
+    if(Lo == Hi)
+        State->Known |= OPT_R(r);
+    else
+        State->Known &= ~OPT_R(r);
+}
+/*Rr was used as an address and the instruction didn't raise : it is in data*/
+static void OptInData(POPT_STATE State,BYTE r)
+{
+    if(State->Lo[r] <= VM_DATA_MASK && State->Hi[r] > VM_DATA_MASK)
+        OptSetRange(State,r,State->Lo[r],VM_DATA_MASK);
+}
+/*end of the string at Addr : its 0 if that byte is never written , else the end of data*/
+static DWORD OptStringEnd(POPT Opt,DWORD Addr)
+{
+    while(Addr < VM_DATA_SIZE && (Opt->AS->data[Addr] || OPT_BIT(Opt->Written,Addr)))
+        Addr++;
+    return Addr < VM_DATA_SIZE ? Addr + 1 : VM_DATA_SIZE;
+}
+static void OptWrite(POPT_INSN Insn,DWORD Start,DWORD End)
+{
+    Insn->WriteStart = Start;
+    Insn->WriteEnd = End < VM_DATA_SIZE ? End : VM_DATA_SIZE;
+}
+static void OptRead(POPT_INSN Insn,DWORD i,DWORD Start,DWORD End)
+{
+    Insn->ReadStart[i] = Start;
+    Insn->ReadEnd[i] = End < VM_DATA_SIZE ? End : VM_DATA_SIZE;
+}
+static void OptPush(POPT_PUSHED Pushed,WORD Lo,WORD Hi)
+{
+    if(Pushed->Depth == OPT_STACK)
+    {
+        memmove(Pushed->Lo,Pushed->Lo + 1,(OPT_STACK - 1) * sizeof(WORD));
+        memmove(Pushed->Hi,Pushed->Hi + 1,(OPT_STACK - 1) * sizeof(WORD));
+        Pushed->Depth--;
+    }
+    Pushed->Lo[Pushed->Depth] = Lo;
+    Pushed->Hi[Pushed->Depth++] = Hi;
+}
+/*range of the popped value , any value if it was pushed before the block*/
+static void OptPop(POPT_PUSHED Pushed,WORD* Lo,WORD* Hi)
+{
+    *Lo = 0;
+    *Hi = 0xFFFF;
+    if(!Pushed->Depth)
+        return;
+    Pushed->Depth--;
+    *Lo = Pushed->Lo[Pushed->Depth];
+    *Hi = Pushed->Hi[Pushed->Depth];
+}
+/*result and flags of an ALU opcode on known operands , the low byte ones keep the high byte of a*/
+static WORD OptAlu(BYTE Opcode,WORD a,WORD b,POPT_STATE State)
+{
+    WORD res;
+    BYTE low;
+    switch(Opcode)
+    {
+        case 0xAD :
+        case 0xA5 :
+            res = a + b;
+            State->CF = res < a;
+            break;
+        case 0x5B :
+        case 0x5C :
+            res = a - b;
+            State->CF = res > a;
+            break;
+        case 0xF0 :
+            res = a ^ b;
+            State->CF = 0;
+            break;
+        case 0xA1 :
+        case 0xA2 :
+            low = (BYTE)a + (BYTE)b;
+            State->ZF = low == 0;
+            State->CF = low < (BYTE)a;
+            return (a & 0xFF00) | low;
+        case 0x51 :
+        case 0x5D :
+            low = (BYTE)a - (BYTE)b;
+            State->ZF = low == 0;
+            State->CF = low > (BYTE)a;
+            return (a & 0xFF00) | low;
+        default :
+            low = (BYTE)a ^ (BYTE)b;
+            State->ZF = low == 0;
+            State->CF = 0;
+            return (a & 0xFF00) | low;
+    }
+    State->ZF = res == 0;
+    return res;
+}
+/*range of Rr + b (ADD) or Rr - b (SUB) , left as it is when it may wrap around*/
+static void OptAddRange(POPT_STATE State,BYTE r,BYTE Opcode,WORD b,WORD* Lo,WORD* Hi)
+{
+    if((Opcode == 0xAD || Opcode == 0xA5) && (DWORD)State->Hi[r] + b <= 0xFFFF)
+    {
+        *Lo = State->Lo[r] + b;
+        *Hi = State->Hi[r] + b;
+    }
+    else if((Opcode == 0x5B || Opcode == 0x5C) && State->Lo[r] >= b)
+    {
+        *Lo = State->Lo[r] - b;
+        *Hi = State->Hi[r] - b;
+    }
+}
+/*run Insn->Op on State : what it uses , writes , its result if known , and the memory it touches*/
+static void OptStep(POPT Opt,POPT_STATE State,POPT_PUSHED Pushed,POPT_INSN Insn)
+{
+    PDECODED_OP op = &Insn->Op;
+    BYTE d = op->Dst,s = op->Src,c = (BYTE)(op->Imm >> 4),k = op->Imm & 0x0F;
+    WORD a,b,res = 0,lo = 0,hi = 0xFFFF;
+    DWORD end;
+    boolean known = FALSE;
+    Insn->Use = Insn->Def = 0;
+    Insn->Keep = Insn->Same = Insn->Folded = FALSE;
+    Insn->Branch = -1;
+    Insn->WriteUnknown = Insn->ReadUnknown = FALSE;
+    Insn->WriteStart = Insn->WriteEnd = 0;
+    Insn->ReadStart[0] = Insn->ReadEnd[0] = Insn->ReadStart[1] = Insn->ReadEnd[1] = 0;
+    switch(op->Handler)
+    {
+        case 0x90 :
+            return;
+        case 0x10 :
+            Insn->Use = OPT_R(s);
+            Insn->Def = OPT_R(d);
+            Insn->Same = d == s;
+            known = OPT_KNOWN(State,s);
+            res = State->Value[s];
+            lo = State->Lo[s];
+            hi = State->Hi[s];
+            break;
+        case 0x12 :
+            Insn->Def = OPT_R(d);
+            OptRead(Insn,0,op->Imm,op->Imm + 1);
+            known = Opt->Fold && !OPT_BIT(Opt->Written,op->Imm);
+            res = Opt->AS->data[op->Imm];
+            break;
+        case 0x14 :
+            Insn->Def = OPT_R(d);
+            OptRead(Insn,0,op->Imm,op->Imm + 2);
+            /*the high byte of a word at the end of data is in the stack*/
+            known = Opt->Fold && op->Imm + 1 < VM_DATA_SIZE &&
+                    !OPT_BIT(Opt->Written,op->Imm) && !OPT_BIT(Opt->Written,op->Imm + 1);
+            if(known)
+                res = *(WORD*)&Opt->AS->data[op->Imm];
+            break;
+        case 0x16 :
+        case 0x18 :
+            Insn->Def = OPT_R(d);
+            known = TRUE;
+            res = op->Imm;
+            break;
+        case 0x1c :
+        case 0x1f :
+            Insn->Use = OPT_R(d);
+            Insn->Keep = TRUE;
+            OptWrite(Insn,op->Imm,op->Imm + (op->Handler == 0x1c ? 1 : 2));
+            return;
+        case 0xE0 :
+        case 0xE2 :
+        case 0xE3 :
+        case 0xE4 :
+        case 0xE6 :
+        case 0xE8 :
+        case 0xEC :
+            Insn->Use = op->Handler == 0xE0 ? 0 : OPT_FLAGS;
+            Insn->Keep = TRUE;
+            Insn->Branch = OptCondition(op->Handler,State);
+            return;
+        /*ALU with an immediate*/
+        case 0xAD :
+        case 0x5B :
+        case 0xA1 :
+        case 0x51 :
+            Insn->Use = OPT_R(d);
+            Insn->Def = OPT_R(d) | OPT_FLAGS;
+            known = OPT_KNOWN(State,d);
+            if(known)
+                res = OptAlu(op->Handler,State->Value[d],op->Imm,State);
+            else
+            {
+                Insn->Same = op->Imm == 0;
+                OptAddRange(State,d,op->Handler,op->Imm,&lo,&hi);
+                State->ZF = State->CF = -1;
+            }
+            break;
+        /*ALU with 2 registers*/
+        case 0xA5 :
+        case 0x5C :
+        case 0xA2 :
+        case 0x5D :
+        case 0xF0 :
+        case 0xF1 :
+            Insn->Use = OPT_R(d) | OPT_R(s);
+            Insn->Def = OPT_R(d) | OPT_FLAGS;
+            a = State->Value[d];
+            b = State->Value[s];
+            known = OPT_KNOWN(State,d) && OPT_KNOWN(State,s);
+            /*SUB Rx,Rx and XOR Rx,Rx give 0 whatever Rx is*/
+            if(d == s && (op->Handler == 0x5C || op->Handler == 0xF0))
+            {
+                known = TRUE;
+                a = b = 0;
+            }
+            if(known)
+                res = OptAlu(op->Handler,a,b,State);
+            else
+            {
+                if(OPT_KNOWN(State,s))
+                    OptAddRange(State,d,op->Handler,b,&lo,&hi);
+                State->ZF = State->CF = -1;
+            }
+            break;
+        case 0x56 :
+            Insn->Use = OPT_R(s);
+            Insn->Def = OPT_R(d);
+            Insn->Keep = OptMayRaise(State,s);
+            a = State->Value[s];
+            if(OPT_KNOWN(State,s) && !VM_OUT_OF_DATA(a))
+            {
+                OptRead(Insn,0,a,a + 1);
+                known = Opt->Fold && !OPT_BIT(Opt->Written,a);
+                res = Opt->AS->data[a];
+            }
+            else if(OPT_ANYWHERE(State->Lo[s],State->Hi[s]))
+                Insn->ReadUnknown = TRUE;
+            else
+                OptRead(Insn,0,State->Lo[s],(DWORD)State->Hi[s] + 1);
+            OptInData(State,s);
+            /*the byte is zero extended*/
+            hi = 0xFF;
+            break;
+        case 0x70 :
+        case 0x71 :
+            Insn->Use = OPT_R(d) | OPT_R(s);
+            Insn->Def = OPT_FLAGS;
+            Insn->Keep = OptMayRaise(State,s);
+            State->Cmp = OPT_NO_CMP;
+            if(op->Handler == 0x70 && (OPT_KNOWN(State,d) || OPT_KNOWN(State,s)) && d != s)
+            {
+                /*the jump that follows bounds the other register*/
+                State->CmpSwap = !OPT_KNOWN(State,s);
+                State->Cmp = State->CmpSwap ? s : d;
+                State->Compared = State->CmpSwap ? State->Value[d] : State->Value[s];
+            }
+            if(d == s)
+            {
+                State->ZF = 1;
+                State->CF = 0;
+            }
+            else if(OPT_KNOWN(State,d) && OPT_KNOWN(State,s))
+            {
+                /*a SUB that doesn't write its result*/
+                OptAlu(op->Handler == 0x70 ? 0x5C : 0x5D,State->Value[d],State->Value[s],State);
+            }
+            else
+                State->ZF = State->CF = -1;
+            return;
+        case 0x55 :
+            Insn->Use = OPT_R(d) | OPT_R(s);
+            Insn->Keep = TRUE;
+            if(OPT_ANYWHERE(State->Lo[d],State->Hi[d]))
+                Insn->WriteUnknown = TRUE;
+            else
+                OptWrite(Insn,State->Lo[d],(DWORD)State->Hi[d] + 1);
+            OptInData(State,d);
+            return;
+        /*bulk memory : a count that isn't known goes to the end of data*/
+        case 0x60 :
+        case 0x61 :
+        case 0x62 :
+        case 0x64 :
+            Insn->Use = OPT_R(d) | OPT_R(s) | OPT_R(c) | (op->Handler == 0x64 ? OPT_R(k) : 0);
+            Insn->Def = OPT_FLAGS;
+            Insn->Keep = TRUE;
+            end = OPT_KNOWN(State,c) ? State->Value[c] : VM_DATA_SIZE;
+            if(op->Handler != 0x62)
+            {
+                if(OPT_ANYWHERE(State->Lo[d],State->Hi[d]))
+                    Insn->WriteUnknown = TRUE;
+                else
+                    OptWrite(Insn,State->Lo[d],State->Hi[d] + end);
+            }
+            else if(OPT_ANYWHERE(State->Lo[d],State->Hi[d]))
+                Insn->ReadUnknown = TRUE;
+            else
+                OptRead(Insn,1,State->Lo[d],State->Hi[d] + end);
+            if(op->Handler == 0x64)
+                end = OPT_KNOWN(State,k) ? State->Value[k] : VM_DATA_SIZE;
+            if(op->Handler != 0x61)
+            {
+                if(OPT_ANYWHERE(State->Lo[s],State->Hi[s]))
+                    Insn->ReadUnknown = TRUE;
+                else
+                    OptRead(Insn,0,State->Lo[s],State->Hi[s] + end);
+            }
+            State->ZF = op->Handler == 0x62 || !OPT_KNOWN(State,c) ? -1 : State->Value[c] == 0;
+            State->CF = op->Handler == 0x62 ? -1 : 0;
+            return;
+        case 0x63 :
+            Insn->Use = OPT_R(s);
+            Insn->Def = OPT_R(d) | OPT_FLAGS;
+            Insn->Keep = TRUE;
+            if(OPT_ANYWHERE(State->Lo[s],State->Hi[s]))
+                Insn->ReadUnknown = TRUE;
+            else if(!VM_OUT_OF_DATA(State->Lo[s]))
+                OptRead(Insn,0,State->Lo[s],OptStringEnd(Opt,State->Hi[s] < VM_DATA_MASK ? State->Hi[s] : VM_DATA_MASK));
+            OptSetRange(State,d,0,0xFFFF);
+            State->ZF = State->CF = -1;
+            return;
+        case 0xAF :
+            Insn->Use = OPT_R(d);
+            Insn->Keep = TRUE;
+            OptPush(Pushed,State->Lo[d],State->Hi[d]);
+            return;
+        case 0xAE :
+            Insn->Def = OPT_R(d);
+            Insn->Keep = TRUE;
+            OptPop(Pushed,&lo,&hi);
+            OptSetRange(State,d,lo,hi);
+            return;
+        case 0xC0 :
+            Insn->Keep = TRUE;
+            OptPop(Pushed,&lo,&hi);
+            return;
+        case 0xC2 :
+            Insn->Keep = TRUE;
+            OptPop(Pushed,&lo,&hi);
+            if(OPT_ANYWHERE(lo,hi))
+                Insn->ReadUnknown = TRUE;
+            else if(!VM_OUT_OF_DATA(lo))
+                OptRead(Insn,0,lo,OptStringEnd(Opt,hi < VM_DATA_MASK ? hi : VM_DATA_MASK));
+            return;
+        /*the input is cut to the end of data , its length isn't known*/
+        case 0x89 :
+            Insn->Keep = TRUE;
+            OptPop(Pushed,&lo,&hi);
+            if(OPT_ANYWHERE(lo,hi))
+                Insn->WriteUnknown = TRUE;
+            else if(!VM_OUT_OF_DATA(lo))
+                OptWrite(Insn,lo,VM_DATA_SIZE);
+            return;
+        default :
+            Insn->Keep = TRUE;
+            return;
+    }
+    /*the instructions that write Op.Dst*/
+    if(known)
+    {
+        Insn->Same |= OPT_KNOWN(State,d) && State->Value[d] == res;
+        Insn->Folded = TRUE;
+        Insn->Result = res;
+        OptSetRange(State,d,res,res);
+    }
+    else if(!Insn->Same)
+        OptSetRange(State,d,lo,hi);
+}
+/*run the instructions of Block from State into Opt->Insns , returns their count*/
+static DWORD OptRun(POPT Opt,DWORD Block,POPT_STATE State)
+{
+    PVM_BLOCK block = &Opt->Cfg.Blocks[Block];
+    OPT_PUSHED pushed;
+    DWORD ip,count = 0;
+    pushed.Depth = 0;
+    State->Cmp = OPT_NO_CMP;
+    for(ip = block->Start;ip < block->End;ip += Opt->Insns[count++].Op.Length)
+    {
+        VmDecodeInstruction(Opt->AS,(WORD)ip,&Opt->Insns[count].Op);
+        OptStep(Opt,State,&pushed,&Opt->Insns[count]);
+        /*the flags or the compared register changed since the CMP*/
+        if(Opt->Insns[count].Op.Handler != 0x70 && State->Cmp != OPT_NO_CMP &&
+           (Opt->Insns[count].Def & (OPT_FLAGS | OPT_R(State->Cmp))))
+            State->Cmp = OPT_NO_CMP;
+    }
+    return count;
+}
+/*the blocks Block can go on to after running Count instructions*/
+static void OptSuccessors(POPT Opt,DWORD Block,DWORD Count,VM_INDEX* Next)
+{
+    PVM_BLOCK block = &Opt->Cfg.Blocks[Block];
+    POPT_INSN last = &Opt->Insns[Count - 1];
+    Next[0] = block->Next[0];
+    Next[1] = block->Next[1];
+    if(IsJump(last->Op.Handler) && last->Branch == 1)
+        Next[0] = VM_NO_BLOCK;
+    if(IsJump(last->Op.Handler) && last->Branch == 0)
+        Next[1] = VM_NO_BLOCK;
+}
+/*
+Range of RCmp on the edge of the conditional jump Opcode (Taken or not) after its
+CMP , FALSE if it has none.
+*/
+static boolean OptBound(POPT_STATE State,BYTE Opcode,boolean Taken,WORD* Lo,WORD* Hi)
+{
+    /*RCmp is 0 : below Compared , 1 : below or equal , 2 : above , 3 : above or equal*/
+    BYTE rel;
+    WORD v = State->Compared;
+    switch(Opcode)
+    {
+        case 0xE2 :
+        case 0xE3 :
+            if((Opcode == 0xE2) != Taken)
+                return FALSE;
+            *Lo = *Hi = v;
+            return TRUE;
+        case 0xE8 :
+            rel = 0;
+            break;
+        case 0xE6 :
+            rel = 1;
+            break;
+        case 0xEC :
+            rel = 2;
+            break;
+        case 0xE4 :
+            rel = 3;
+            break;
+        default :
+            return FALSE;
+    }
+    /*CMP Compared,RCmp turns it around , the edge not taken is the opposite*/
+    if(State->CmpSwap)
+        rel ^= 2;
+    if(!Taken)
+        rel ^= 3;
+    *Lo = 0;
+    *Hi = 0xFFFF;
+    if((rel == 0 && !v) || (rel == 2 && v == 0xFFFF))
+        return FALSE;
+    if(rel == 0)
+        *Hi = v - 1;
+    else if(rel == 1)
+        *Hi = v;
+    else if(rel == 2)
+        *Lo = v + 1;
+    else
+        *Lo = v;
+    return TRUE;
+}
+/*
+State reaches Block with RCmp bounded to [Lo,Hi] (Cmp is OPT_NO_CMP if it isn't) ,
+TRUE if its state at the start changed. A bound that moves goes to the end of data
+or of its range so that a loop doesn't grow it one iteration at a time , the bound
+of the loop's CMP then brings it back.
+*/
+static boolean OptMeet(POPT Opt,DWORD Block,POPT_STATE State,BYTE Cmp,WORD Lo,WORD Hi)
+{
+    POPT_STATE in = &Opt->In[Block];
+    OPT_STATE met = *State;
+    DWORD r;
+    if(Cmp != OPT_NO_CMP && (State->Hi[Cmp] < Lo || State->Lo[Cmp] > Hi))
+        return FALSE;
+    if(Opt->Reached[Block])
+    {
+        for(r = 0;r < 4;r++)
+        {
+            met.Lo[r] = State->Lo[r] < in->Lo[r] ? 0 : in->Lo[r];
+            met.Hi[r] = State->Hi[r] > in->Hi[r] ? (State->Hi[r] <= VM_DATA_MASK ? VM_DATA_MASK : 0xFFFF) : in->Hi[r];
+        }
+        met.ZF = in->ZF == State->ZF ? in->ZF : -1;
+        met.CF = in->CF == State->CF ? in->CF : -1;
+    }
+    if(Cmp != OPT_NO_CMP)
+    {
+        met.Lo[Cmp] = met.Lo[Cmp] > Lo ? met.Lo[Cmp] : Lo;
+        met.Hi[Cmp] = met.Hi[Cmp] < Hi ? met.Hi[Cmp] : Hi;
+    }
+    for(r = 0;r < 4;r++)
+    {
+        if(Opt->Reached[Block])
+        {
+            met.Lo[r] = met.Lo[r] < in->Lo[r] ? met.Lo[r] : in->Lo[r];
+            met.Hi[r] = met.Hi[r] > in->Hi[r] ? met.Hi[r] : in->Hi[r];
+        }
+        OptSetRange(&met,(BYTE)r,met.Lo[r],met.Hi[r]);
+    }
+    if(Opt->Reached[Block] && !memcmp(met.Lo,in->Lo,sizeof(met.Lo)) && !memcmp(met.Hi,in->Hi,sizeof(met.Hi)) &&
+       met.ZF == in->ZF && met.CF == in->CF)
+        return FALSE;
+    *in = met;
+    Opt->Reached[Block] = TRUE;
+    return TRUE;
+}
+/*states at the start of the blocks , from the reset registers at IP 0*/
+static void OptPropagate(POPT Opt)
+{
+    DWORD pending = 0,count,i,block;
+    VM_INDEX entry = Opt->Cfg.BlockAt[0],next[2];
+    OPT_STATE state;
+    POPT_INSN last;
+    WORD lo = 0,hi = 0xFFFF;
+    BYTE cmp,r;
+    memset(Opt->Reached,0,sizeof(Opt->Reached));
+    if(Opt->Blind)
+    {
+        for(i = 0;i < Opt->Cfg.Count;i++)
+        {
+            Opt->Reached[i] = TRUE;
+            for(r = 0;r < 4;r++)
+                OptSetRange(&Opt->In[i],(BYTE)r,0,0xFFFF);
+            Opt->In[i].ZF = Opt->In[i].CF = -1;
+        }
+        return;
+    }
+    if(entry == VM_NO_BLOCK)
+        return;
+    memset(&state,0,sizeof(state));
+    state.Known = OPT_R(0) | OPT_R(1) | OPT_R(2) | OPT_R(3);
+    OptMeet(Opt,entry,&state,OPT_NO_CMP,0,0);
+    Opt->Worklist[pending++] = entry;
+    Opt->Pending[entry] = TRUE;
+    while(pending)
+    {
+        block = Opt->Worklist[--pending];
+        Opt->Pending[block] = FALSE;
+        state = Opt->In[block];
+        count = OptRun(Opt,block,&state);
+        OptSuccessors(Opt,block,count,next);
+        last = &Opt->Insns[count - 1];
+        for(i = 0;i < 2;i++)
+        {
+            /*next[1] is the target of the jump*/
+            cmp = OPT_NO_CMP;
+            if(IsJump(last->Op.Handler) && state.Cmp != OPT_NO_CMP &&
+               OptBound(&state,last->Op.Handler,i == 1,&lo,&hi))
+                cmp = state.Cmp;
+            if(next[i] != VM_NO_BLOCK && OptMeet(Opt,next[i],&state,cmp,lo,hi) && !Opt->Pending[next[i]])
+            {
+                Opt->Worklist[pending++] = next[i];
+                Opt->Pending[next[i]] = TRUE;
+            }
+        }
+    }
+}
+/*bytes the reached blocks may write , FALSE if one of them writes to an unknown address*/
+static boolean OptWrites(POPT Opt,PVM_OPT_STATS Stats)
+{
+    DWORD block,count,i,addr;
+    OPT_STATE state;
+    memset(Opt->Written,0,sizeof(Opt->Written));
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Reached[block])
+            continue;
+        state = Opt->In[block];
+        count = OptRun(Opt,block,&state);
+        for(i = 0;i < count;i++)
+        {
+            if(Opt->Insns[i].WriteUnknown)
+            {
+                Stats->Unknown = Opt->Insns[i].Op.IP;
+                return FALSE;
+            }
+            for(addr = Opt->Insns[i].WriteStart;addr < Opt->Insns[i].WriteEnd;addr++)
+                OPT_SET(Opt->Written,addr);
+        }
+    }
+    return TRUE;
+}
+/*keep the reached blocks with written bytes , TRUE if there are some*/
+static boolean OptKeepWritten(POPT Opt)
+{
+    DWORD block,addr;
+    boolean written = FALSE;
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Reached[block])
+            continue;
+        for(addr = Opt->Cfg.Blocks[block].Start;addr < Opt->Cfg.Blocks[block].End;addr++)
+        {
+            if(OPT_BIT(Opt->Written,addr))
+            {
+                Opt->Kept[block] = TRUE;
+                written = TRUE;
+                break;
+            }
+        }
+    }
+    return written;
+}
+/*keep the blocks the reached ones read bytes of , FALSE if one of them reads at an unknown address*/
+static boolean OptKeepRead(POPT Opt,PVM_OPT_STATS Stats)
+{
+    DWORD block,count,i,j,addr;
+    OPT_STATE state;
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Reached[block])
+            continue;
+        state = Opt->In[block];
+        count = OptRun(Opt,block,&state);
+        for(i = 0;i < count;i++)
+        {
+            if(Opt->Insns[i].ReadUnknown)
+            {
+                Stats->Unknown = Opt->Insns[i].Op.IP;
+                return FALSE;
+            }
+            for(j = 0;j < 2;j++)
+            {
+                for(addr = Opt->Insns[i].ReadStart[j];addr < Opt->Insns[i].ReadEnd[j];addr++)
+                {
+                    if(Opt->Owner[addr] != VM_NO_BLOCK)
+                        Opt->Kept[Opt->Owner[addr]] = TRUE;
+                }
+            }
+        }
+    }
+    return TRUE;
+}
+/*invalid blocks and blocks sharing bytes (a jump into an instruction) are kept*/
+static void OptOwners(POPT Opt)
+{
+    DWORD block,addr;
+    for(addr = 0;addr < VM_DATA_SIZE;addr++)
+        Opt->Owner[addr] = VM_NO_BLOCK;
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Cfg.Blocks[block].Valid)
+            Opt->Kept[block] = TRUE;
+        for(addr = Opt->Cfg.Blocks[block].Start;addr < Opt->Cfg.Blocks[block].End;addr++)
+        {
+            if(Opt->Owner[addr] != VM_NO_BLOCK)
+            {
+                Opt->Kept[block] = TRUE;
+                Opt->Kept[Opt->Owner[addr]] = TRUE;
+            }
+            else
+                Opt->Owner[addr] = block;
+        }
+    }
+}
+static BYTE OptLiveOut(POPT Opt,DWORD Block)
+{
+    PVM_BLOCK block = &Opt->Cfg.Blocks[Block];
+    BYTE live = 0;
+    if(block->Next[0] != VM_NO_BLOCK)
+        live |= Opt->LiveIn[block->Next[0]];
+    if(block->Next[1] != VM_NO_BLOCK)
+        live |= Opt->LiveIn[block->Next[1]];
+    return live;
+}
+/*registers and flags live at the start of every block , everything for the kept ones that run*/
+static void OptLiveness(POPT Opt)
+{
+    DWORD block,count,i;
+    OPT_STATE state;
+    BYTE live;
+    boolean changed;
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        /*nothing is live in a block that never runs*/
+        Opt->Gen[block] = Opt->Reached[block] ? OPT_ALL : 0;
+        Opt->Kill[block] = Opt->Reached[block] ? 0 : OPT_ALL;
+        if(Opt->Reached[block] && !Opt->Kept[block])
+        {
+            state = Opt->In[block];
+            count = OptRun(Opt,block,&state);
+            Opt->Gen[block] = 0;
+            for(i = count;i-- > 0;)
+            {
+                Opt->Gen[block] = Opt->Insns[i].Use | (Opt->Gen[block] & ~Opt->Insns[i].Def);
+                Opt->Kill[block] |= Opt->Insns[i].Def;
+            }
+        }
+        Opt->LiveIn[block] = Opt->Gen[block];
+    }
+    do
+    {
+        changed = FALSE;
+        for(block = Opt->Cfg.Count;block-- > 0;)
+        {
+            live = Opt->Gen[block] | (OptLiveOut(Opt,block) & ~Opt->Kill[block]);
+            if(live != Opt->LiveIn[block])
+            {
+                Opt->LiveIn[block] = live;
+                changed = TRUE;
+            }
+        }
+    }while(changed);
+}
+static DWORD OptMovSize(WORD Value)
+{
+    return Value < 0x100 ? 3 : 4;
+}
+/*compact Block at its address in Opt->Out if that runs fewer instructions*/
+static void OptBlock(POPT Opt,DWORD Block,PVM_OPT_STATS Stats)
+{
+    PVM_BLOCK block = &Opt->Cfg.Blocks[Block];
+    OPT_STATE state = Opt->In[Block];
+    POPT_INSN insn;
+    BYTE* out = Opt->Out.data;
+    BYTE live = OptLiveOut(Opt,Block);
+    DWORD count,i,kept = 0,size = 0,filler,folded = 0,branches = 0,ip;
+    boolean through;
+    count = OptRun(Opt,Block,&state);
+    for(i = count;i-- > 0;)
+    {
+        insn = &Opt->Insns[i];
+        insn->Action = OPT_KEEP;
+        if(IsJump(insn->Op.Handler) && insn->Op.Handler != 0xE0)
+        {
+            if(insn->Branch == 0)
+                insn->Action = OPT_DROP;
+            else if(insn->Branch == 1)
+                insn->Action = OPT_JMP;
+            else
+                live |= OPT_FLAGS;
+        }
+        else if(!insn->Keep && (!(insn->Def & live) || (insn->Same && !(insn->Def & live & OPT_FLAGS))))
+            insn->Action = OPT_DROP;
+        else if(!insn->Keep && insn->Folded && !(insn->Def & live & OPT_FLAGS) &&
+                insn->Op.Handler != 0x16 && insn->Op.Handler != 0x18 && OptMovSize(insn->Result) <= insn->Op.Length)
+        {
+            insn->Action = OPT_FOLD;
+            live &= ~OPT_R(insn->Op.Dst);
+        }
+        else
+            live = (live & ~insn->Def) | insn->Use;
+    }
+    for(i = 0;i < count;i++)
+    {
+        insn = &Opt->Insns[i];
+        if(insn->Action == OPT_DROP)
+            continue;
+        kept++;
+        size += insn->Action == OPT_FOLD ? OptMovSize(insn->Result) : insn->Op.Length;
+    }
+    /*the code of the next block no longer follows*/
+    through = block->Next[0] != VM_NO_BLOCK && Opt->Insns[count - 1].Action != OPT_JMP;
+    filler = through && size < block->End - block->Start;
+    if(kept + filler >= count)
+        return;
+    ip = block->Start;
+    for(i = 0;i < count;i++)
+    {
+        insn = &Opt->Insns[i];
+        switch(insn->Action)
+        {
+            case OPT_DROP :
+                branches += IsJump(insn->Op.Handler);
+                break;
+            case OPT_FOLD :
+                out[ip] = insn->Result < 0x100 ? 0x16 : 0x18;
+                out[ip + 1] = insn->Op.Dst;
+                out[ip + 2] = (BYTE)insn->Result;
+                if(insn->Result >= 0x100)
+                    out[ip + 3] = (BYTE)(insn->Result >> 8);
+                ip += OptMovSize(insn->Result);
+                folded++;
+                break;
+            case OPT_JMP :
+                out[ip] = 0xE0;
+                memcpy(&out[ip + 1],&Opt->AS->data[insn->Op.IP + 1],2);
+                ip += 3;
+                branches++;
+                break;
+            default :
+                memcpy(&out[ip],&Opt->AS->data[insn->Op.IP],insn->Op.Length);
+                ip += insn->Op.Length;
+                break;
+        }
+    }
+    if(filler)
+    {
+        if(block->End - ip == 1)
+            out[ip++] = 0x90;
+        else if(block->End - ip == 2)
+        {
+            /*MOV R0,R0*/
+            out[ip++] = 0x10;
+            out[ip++] = 0x00;
+        }
+        else
+        {
+            out[ip] = 0xE0;
+            *(WORD*)&out[ip + 1] = (WORD)block->End;
+            ip += 3;
+        }
+    }
+    memset(&out[ip],0x90,block->End - ip);
+    Stats->Rewritten++;
+    Stats->Removed += count - kept - filler;
+    Stats->Folded += folded;
+    Stats->Branches += branches;
+}
+/*jumps to a block starting with a JMP , or with the same conditional jump , go to its target*/
+static void OptThread(POPT Opt,PVM_OPT_STATS Stats)
+{
+    DWORD block,ip,hops;
+    DECODED_OP op,first;
+    VM_INDEX next;
+    WORD target;
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Reached[block] || Opt->Kept[block])
+            continue;
+        for(ip = Opt->Cfg.Blocks[block].Start;ip < Opt->Cfg.Blocks[block].End;ip += op.Length)
+        {
+            VmDecodeInstruction(&Opt->Out,(WORD)ip,&op);
+            if(!IsJump(op.Handler))
+                continue;
+            target = op.Imm;
+            for(hops = 0;hops < Opt->Cfg.Count;hops++)
+            {
+                next = Opt->Cfg.BlockAt[target];
+                if(next == VM_NO_BLOCK || !Opt->Reached[next] || Opt->Kept[next])
+                    break;
+                VmDecodeInstruction(&Opt->Out,target,&first);
+                if((first.Handler != 0xE0 && first.Handler != op.Handler) || first.Imm == target)
+                    break;
+                target = first.Imm;
+            }
+            if(target != op.Imm)
+            {
+                *(WORD*)&Opt->Out.data[ip + 1] = target;
+                Stats->Threaded++;
+            }
+        }
+    }
+}
+/*
+Optimize the program in AS->data in place. FALSE if it is left as it is : a read or
+write at an unknown address (its IP in Stats->Unknown) or no memory for the analysis.
+*/
+boolean VmOptimize(PADDRESS_SPACE AS,PVM_OPT_STATS Stats)
+{
+    POPT Opt;
+    DWORD block;
+    memset(Stats,0,sizeof(*Stats));
+    Stats->Unknown = VM_DATA_SIZE;
+    Opt = (POPT) calloc(1,sizeof(OPT));
+    if(!Opt)
+        return FALSE;
+    Opt->AS = AS;
+    VmVerify(AS,&Opt->Cfg,0);
+    Stats->Blocks = Opt->Cfg.Count;
+    OptOwners(Opt);
+    OptPropagate(Opt);
+    if(!OptWrites(Opt,Stats))
+    {
+        free(Opt);
+        return FALSE;
+    }
+    if(OptKeepWritten(Opt))
+    {
+        /*the code that runs isn't only the one analysed*/
+        Opt->Blind = TRUE;
+        OptPropagate(Opt);
+        if(!OptWrites(Opt,Stats))
+        {
+            free(Opt);
+            return FALSE;
+        }
+        OptKeepWritten(Opt);
+    }
+    Opt->Fold = TRUE;
+    OptPropagate(Opt);
+    if(!OptKeepRead(Opt,Stats))
+    {
+        free(Opt);
+        return FALSE;
+    }
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Reached[block])
+            Opt->Kept[block] = TRUE;
+        Stats->Kept += Opt->Kept[block];
+    }
+    OptLiveness(Opt);
+    memcpy(Opt->Out.data,AS->data,VM_DATA_SIZE);
+    for(block = 0;block < Opt->Cfg.Count;block++)
+    {
+        if(!Opt->Kept[block])
+            OptBlock(Opt,block,Stats);
+    }
+    OptThread(Opt,Stats);
+    memcpy(AS->data,Opt->Out.data,VM_DATA_SIZE);
+    free(Opt);
+    return TRUE;
+}
+/*vm -optimize program output*/
+int VmOptimizeMain(const char* Program,const char* Output)
+{
+    PADDRESS_SPACE AS;
+    VM_OPT_STATS stats;
+    FILE* File;
+    DWORD size,end;
+    AS = (PADDRESS_SPACE) calloc(1,sizeof(ADDRESS_SPACE));
+    if(!AS)
+        return 1;
+    File = fopen(Program,"rb");
+    if(!File)
+    {
+        printf("Found trouble opening the file");
+        return 1;
+    }
+    size = fread(AS->data,1,VM_DATA_SIZE,File);
+    if(fgetc(File) != EOF)
+    {
+        printf("%s is larger than data",Program);
+        return 1;
+    }
+    fclose(File);
+    if(VmOptimize(AS,&stats))
+        printf("%u blocks : %u rewritten , %u kept , %u instructions removed , %u folded , %u branches decided , %u jumps threaded\n",
+               stats.Blocks,stats.Rewritten,stats.Kept,stats.Removed,stats.Folded,stats.Branches,stats.Threaded);
+    else if(stats.Unknown < VM_DATA_SIZE)
+        printf("Access to an unknown address at %.4X , the program is left as it is\n",stats.Unknown);
+    else
+        return 1;
+    /*operands of the last instructions can be past the end of the file*/
+    for(end = VM_DATA_SIZE;end > size && !AS->data[end - 1];end--);
+    File = fopen(Output,"wb");
+    if(!File)
+    {
+        printf("Found trouble creating %s",Output);
+        return 1;
+    }
+    fwrite(AS->data,1,end,File);
+    fclose(File);
+    free(AS);
+    return 0;
+}
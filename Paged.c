@@ -0,0 +1,812 @@
+/*
+Paged address space.
+A program larger than data runs in a sparse 32-bit address space instead : memory is
+split in VM_PAGED_PAGE_SIZE pages that are only allocated when they are first
+written , found through a two-level page table (VM_PAGED_TABLE pages per table). A
+page that was never written reads as zeros (one shared page of zeros) , a file that
+is loaded only allocates the pages that aren't all zeros.
+
+The instructions keep their 16-bit addresses , they are offsets in a 64 KB bank :
+    - the data accesses (12 , 14 , 1C , 1F , 55 , 56 , the bulk opcodes , C2 and 89)
+      go to the bank in DS
+    - the code runs in the bank in CS , the jumps (E0 - EC) stay in it and IP wraps
+      at its end
+    - D0 , D1 and E1 move between banks :
+        D0 0r               => MOV DS,Rr
+        D1 0r               => MOV Rr,DS
+        E1 lo hi lo hi      => JMP FAR bank:offset (offset first)
+A word at the last offset of a bank takes its high byte from the next bank , a bulk
+range must fit in its bank (like in a 64 KB data space) and a string ends with it.
+
+Every access goes through a direct-mapped software TLB of VM_PAGED_TLB entries in
+front of the page table : a hit is a compare of the page number and one indexed
+load. Reads and writes have their own entries so that a page of zeros can be read
+through the TLB and still gets allocated by the first write. An exception is raised
+when a write needs a page past VM_PAGED_MAX_PAGES.
+The stack , the registers and their semantics are the ones of VmLoop.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+#define VM_PAGED_MASK  (VM_PAGED_PAGE_SIZE - 1)
+#define VM_PAGED_TABLE 1024
+#define VM_PAGED_DIRECTORY ((DWORD)(0x100000000ULL >> VM_PAGED_SHIFT) / VM_PAGED_TABLE)
+#define VM_PAGED_NO_TAG 0xFFFFFFFF
+typedef struct
+{
+    DWORD Tag;      /*page number , VM_PAGED_NO_TAG if empty*/
+    BYTE* Page;
+}PAGED_TLB_ENTRY,*PPAGED_TLB_ENTRY;
+struct VM_PAGED
+{
+    PAGED_TLB_ENTRY ReadTlb[VM_PAGED_TLB];
+    PAGED_TLB_ENTRY WriteTlb[VM_PAGED_TLB];
+    /*tables of VM_PAGED_TABLE page pointers , allocated with their first page*/
+    BYTE** Directory[VM_PAGED_DIRECTORY];
+    DWORD Pages;
+    WORD Stack[VM_STACK_SIZE];
+};
+static const BYTE ZeroPage[VM_PAGED_PAGE_SIZE];
+PVM_PAGED VmPagedCreate(void)
+{
+    PVM_PAGED Space = (PVM_PAGED) calloc(1,sizeof(struct VM_PAGED));
+    DWORD i;
+    if(!Space)
+        return NULL;
+    for(i = 0;i < VM_PAGED_TLB;i++)
+    {
+        Space->ReadTlb[i].Tag = VM_PAGED_NO_TAG;
+        Space->WriteTlb[i].Tag = VM_PAGED_NO_TAG;
+    }
+    return Space;
+}
+void VmPagedDestroy(PVM_PAGED Space)
+{
+    DWORD i,j;
+    for(i = 0;i < VM_PAGED_DIRECTORY;i++)
+    {
+        if(!Space->Directory[i])
+            continue;
+        for(j = 0;j < VM_PAGED_TABLE;j++)
+            free(Space->Directory[i][j]);
+        free(Space->Directory[i]);
+    }
+    free(Space);
+}
+/*pages allocated so far*/
+DWORD VmPagedPages(PVM_PAGED Space)
+{
+    return Space->Pages;
+}
+/*the page of Address for a read , the page of zeros if it was never written*/
+static const BYTE* PagedReadMiss(PVM_PAGED Space,DWORD Address)
+{
+    DWORD number = Address >> VM_PAGED_SHIFT;
+    PPAGED_TLB_ENTRY entry = &Space->ReadTlb[number & (VM_PAGED_TLB - 1)];
+    BYTE** table = Space->Directory[number / VM_PAGED_TABLE];
+    BYTE* page = table ? table[number % VM_PAGED_TABLE] : NULL;
+    entry->Tag = number;
+    entry->Page = page ? page : (BYTE*)ZeroPage;
+    return entry->Page;
+}
+/*the page of Address for a write , allocated if needed. NULL past VM_PAGED_MAX_PAGES*/
+static BYTE* PagedWriteMiss(PVM_PAGED Space,DWORD Address)
+{
+    DWORD number = Address >> VM_PAGED_SHIFT;
+    PPAGED_TLB_ENTRY entry;
+    BYTE*** table = &Space->Directory[number / VM_PAGED_TABLE];
+    BYTE** page;
+    if(!*table)
+    {
+        *table = (BYTE**) calloc(VM_PAGED_TABLE,sizeof(BYTE*));
+        if(!*table)
+            return NULL;
+    }
+    page = &(*table)[number % VM_PAGED_TABLE];
+    if(!*page)
+    {
+        if(Space->Pages == VM_PAGED_MAX_PAGES)
+            return NULL;
+        *page = (BYTE*) calloc(1,VM_PAGED_PAGE_SIZE);
+        if(!*page)
+            return NULL;
+        Space->Pages++;
+        /*the read entry may still be the page of zeros*/
+        entry = &Space->ReadTlb[number & (VM_PAGED_TLB - 1)];
+        if(entry->Tag == number)
+            entry->Page = *page;
+    }
+    entry = &Space->WriteTlb[number & (VM_PAGED_TLB - 1)];
+    entry->Tag = number;
+    entry->Page = *page;
+    return *page;
+}
+static inline const BYTE* PagedReadPage(PVM_PAGED Space,DWORD Address)
+{
+    PPAGED_TLB_ENTRY entry = &Space->ReadTlb[(Address >> VM_PAGED_SHIFT) & (VM_PAGED_TLB - 1)];
+    if(entry->Tag == Address >> VM_PAGED_SHIFT)
+        return entry->Page;
+    return PagedReadMiss(Space,Address);
+}
+static inline BYTE* PagedWritePage(PVM_PAGED Space,DWORD Address)
+{
+    PPAGED_TLB_ENTRY entry = &Space->WriteTlb[(Address >> VM_PAGED_SHIFT) & (VM_PAGED_TLB - 1)];
+    if(entry->Tag == Address >> VM_PAGED_SHIFT)
+        return entry->Page;
+    return PagedWriteMiss(Space,Address);
+}
+static inline BYTE PagedLoad(PVM_PAGED Space,DWORD Address)
+{
+    return PagedReadPage(Space,Address)[Address & VM_PAGED_MASK];
+}
+static inline WORD PagedLoadWord(PVM_PAGED Space,DWORD Address)
+{
+    if((Address & VM_PAGED_MASK) != VM_PAGED_MASK)
+        return *(const WORD*)&PagedReadPage(Space,Address)[Address & VM_PAGED_MASK];
+    return PagedLoad(Space,Address) | PagedLoad(Space,Address + 1) << 8;
+}
+static inline boolean PagedStore(PVM_PAGED Space,DWORD Address,BYTE Value)
+{
+    BYTE* page = PagedWritePage(Space,Address);
+    if(!page)
+        return FALSE;
+    page[Address & VM_PAGED_MASK] = Value;
+    return TRUE;
+}
+static inline boolean PagedStoreWord(PVM_PAGED Space,DWORD Address,WORD Value)
+{
+    BYTE* page;
+    if((Address & VM_PAGED_MASK) != VM_PAGED_MASK)
+    {
+        page = PagedWritePage(Space,Address);
+        if(!page)
+            return FALSE;
+        *(WORD*)&page[Address & VM_PAGED_MASK] = Value;
+        return TRUE;
+    }
+    return PagedStore(Space,Address,(BYTE)Value) && PagedStore(Space,Address + 1,(BYTE)(Value >> 8));
+}
+/*the bytes left in the page of Address , at most Size*/
+static DWORD PagedRun(DWORD Address,DWORD Size)
+{
+    DWORD left = VM_PAGED_PAGE_SIZE - (Address & VM_PAGED_MASK);
+    return Size < left ? Size : left;
+}
+/*
+Copy Size bytes from the address space , FALSE if the range wraps past the end of
+the address space.
+*/
+boolean VmPagedRead(PVM_PAGED Space,DWORD Address,void* Buffer,DWORD Size)
+{
+    DWORD run;
+    if(Size && Address + Size - 1 < Address)
+        return FALSE;
+    for(;Size;Address += run,Size -= run,Buffer = (BYTE*)Buffer + run)
+    {
+        run = PagedRun(Address,Size);
+        memcpy(Buffer,&PagedReadPage(Space,Address)[Address & VM_PAGED_MASK],run);
+    }
+    return TRUE;
+}
+/*
+Copy Size bytes into the address space , the pages of zeros of Buffer that aren't
+allocated stay that way. FALSE if the range wraps or needs too many pages.
+*/
+boolean VmPagedWrite(PVM_PAGED Space,DWORD Address,const void* Buffer,DWORD Size)
+{
+    const BYTE* source = (const BYTE*) Buffer;
+    BYTE* page;
+    DWORD run,i;
+    if(Size && Address + Size - 1 < Address)
+        return FALSE;
+    for(;Size;Address += run,Size -= run,source += run)
+    {
+        run = PagedRun(Address,Size);
+        if(PagedReadPage(Space,Address) == ZeroPage)
+        {
+            for(i = 0;i < run && !source[i];i++)
+                ;
+            if(i == run)
+                continue;
+        }
+        page = PagedWritePage(Space,Address);
+        if(!page)
+            return FALSE;
+        memcpy(&page[Address & VM_PAGED_MASK],source,run);
+    }
+    return TRUE;
+}
+/*MEMSET , a fill with 0 leaves the pages that aren't allocated alone*/
+static boolean PagedFill(PVM_PAGED Space,DWORD Address,BYTE Value,DWORD Size)
+{
+    BYTE* page;
+    DWORD run;
+    for(;Size;Address += run,Size -= run)
+    {
+        run = PagedRun(Address,Size);
+        if(!Value && PagedReadPage(Space,Address) == ZeroPage)
+            continue;
+        page = PagedWritePage(Space,Address);
+        if(!page)
+            return FALSE;
+        memset(&page[Address & VM_PAGED_MASK],Value,run);
+    }
+    return TRUE;
+}
+/*MEMCPY , overlapping ranges are copied like memmove : a chunk at a time from the end that can't be overwritten first*/
+static boolean PagedCopy(PVM_PAGED Space,DWORD Dst,DWORD Src,DWORD Size)
+{
+    BYTE chunk[VM_PAGED_PAGE_SIZE];
+    DWORD run,offset;
+    if(Dst <= Src)
+    {
+        for(offset = 0;offset < Size;offset += run)
+        {
+            run = Size - offset < sizeof(chunk) ? Size - offset : sizeof(chunk);
+            VmPagedRead(Space,Src + offset,chunk,run);
+            if(!VmPagedWrite(Space,Dst + offset,chunk,run))
+                return FALSE;
+        }
+        return TRUE;
+    }
+    for(offset = Size;offset;offset -= run)
+    {
+        run = offset < sizeof(chunk) ? offset : sizeof(chunk);
+        VmPagedRead(Space,Src + offset - run,chunk,run);
+        if(!VmPagedWrite(Space,Dst + offset - run,chunk,run))
+            return FALSE;
+    }
+    return TRUE;
+}
+/*MEMCMP , like memcmp*/
+static int PagedCompare(PVM_PAGED Space,DWORD A,DWORD B,DWORD Size)
+{
+    DWORD run;
+    int diff;
+    for(;Size;A += run,B += run,Size -= run)
+    {
+        run = PagedRun(B,PagedRun(A,Size));
+        diff = memcmp(&PagedReadPage(Space,A)[A & VM_PAGED_MASK],&PagedReadPage(Space,B)[B & VM_PAGED_MASK],run);
+        if(diff)
+            return diff;
+    }
+    return 0;
+}
+/*STRLEN , Size bytes at most (the rest of the bank). Size if there is no 0*/
+static DWORD PagedLength(PVM_PAGED Space,DWORD Address,DWORD Size)
+{
+    const BYTE* start;
+    const BYTE* end;
+    DWORD run,length = 0;
+    for(;length < Size;Address += run,length += run)
+    {
+        run = PagedRun(Address,Size - length);
+        start = &PagedReadPage(Space,Address)[Address & VM_PAGED_MASK];
+        end = (const BYTE*) memchr(start,0,run);
+        if(end)
+            return length + (DWORD)(end - start);
+    }
+    return Size;
+}
+/*XORKEY , byte by byte in order : the key may be in the range*/
+static boolean PagedXor(PVM_PAGED Space,DWORD Dst,DWORD Size,DWORD Key,DWORD KeySize)
+{
+    DWORD i;
+    for(i = 0;i < Size;i++)
+    {
+        if(!PagedStore(Space,Dst + i,PagedLoad(Space,Dst + i) ^ PagedLoad(Space,Key + i % KeySize)))
+            return FALSE;
+    }
+    return TRUE;
+}
+/*VmBulk for bank DS , the ranges are offsets in it*/
+static boolean PagedBulk(PVM_PAGED Space,WORD DS,BYTE Opcode,WORD Dst,WORD Src,WORD Count,WORD Key,PVM_BULK_RESULT Result)
+{
+    DWORD bank = (DWORD)DS << 16;
+    DWORD length;
+    int diff;
+    Result->Length = 0;
+    Result->ZF = Count == 0;
+    Result->CF = 0;
+    Result->WriteSize = 0;
+    switch(Opcode)
+    {
+        case 0x60 :
+            if((DWORD)Dst + Count > 0x10000 || (DWORD)Src + Count > 0x10000)
+                return FALSE;
+            return PagedCopy(Space,bank | Dst,bank | Src,Count);
+        case 0x61 :
+            if((DWORD)Dst + Count > 0x10000)
+                return FALSE;
+            return PagedFill(Space,bank | Dst,(BYTE)Src,Count);
+        case 0x62 :
+            if((DWORD)Dst + Count > 0x10000 || (DWORD)Src + Count > 0x10000)
+                return FALSE;
+            diff = PagedCompare(Space,bank | Dst,bank | Src,Count);
+            Result->ZF = diff == 0;
+            Result->CF = diff < 0;
+            return TRUE;
+        /*without a 0 the string ends with the bank*/
+        case 0x63 :
+            length = PagedLength(Space,bank | Src,0x10000 - Src);
+            Result->Length = (WORD)length;
+            Result->ZF = length == 0;
+            Result->CF = length == 0x10000 - (DWORD)Src;
+            return TRUE;
+        case 0x64 :
+            if(!Key || (DWORD)Dst + Count > 0x10000 || (DWORD)Src + Key > 0x10000)
+                return FALSE;
+            return PagedXor(Space,bank | Dst,Count,bank | Src,Key);
+    }
+    return FALSE;
+}
+/*C2 , the string ends with its 0 or with the bank*/
+static void PagedPrint(PVM_PAGED Space,DWORD Address)
+{
+    char piece[VM_PAGED_PAGE_SIZE + 1];
+    DWORD size = 0x10000 - (Address & 0xFFFF);
+    DWORD run,length;
+    for(;size;Address += run,size -= run)
+    {
+        run = PagedRun(Address,size);
+        length = PagedLength(Space,Address,run);
+        memcpy(piece,&PagedReadPage(Space,Address)[Address & VM_PAGED_MASK],length);
+        piece[length] = 0;
+        VmPrintString(piece);
+        if(length < run)
+            return;
+    }
+}
+/*89 , the line is cut to the rest of the bank. FALSE if it needs too many pages*/
+static boolean PagedScan(PVM_PAGED Space,DWORD Address)
+{
+    DWORD size = 0x10000 - (Address & 0xFFFF);
+    char* line = (char*) malloc(size);
+    boolean written = TRUE;
+    const char* end;
+    if(!line)
+        return FALSE;
+    /*gets leaves the memory alone without input : no 0 in the buffer if nothing was read*/
+    memset(line,0xFF,size);
+    VmScanString(line,size);
+    end = (const char*) memchr(line,0,size);
+    if(end)
+        written = VmPagedWrite(Space,Address,line,(DWORD)(end - line) + 1);
+    free(line);
+    return written;
+}
+#define VM_CHARGE() if(!--fuel) goto out_of_fuel
+#define PAGED_FETCH() PagedLoad(Space,(DWORD)Paged->CS << 16 | Regs->IP++)
+#define PAGED_FETCH_WORD() (word_fetch = PAGED_FETCH(),word_fetch | PAGED_FETCH() << 8)
+#define PAGED_DATA(offset) ((DWORD)Paged->DS << 16 | (WORD)(offset))
+#ifdef VM_THREADED_DISPATCH
+#define VM_NEXT goto *dispatch_table[PAGED_FETCH()]
+#else
+#define VM_NEXT break
+#endif
+/*
+Run the program of Space from CS:IP for at most *Fuel basic blocks (NULL for no
+limit). Returns VM_STOP_xxx like VmLoopFuel.
+*/
+int VmLoopPaged(PVM_PAGED Space,PVM_PAGED_REGS Paged,uint64_t* Fuel)
+{
+    PREGS Regs = &Paged->Regs;
+    int status = VM_STOP_EXIT;
+    uint64_t fuel = Fuel ? *Fuel : UINT64_MAX;
+    BYTE byte_val,byte_val2,byte_val3;
+    WORD word_val,word_val2,word_fetch;
+    VM_BULK_RESULT bulk;
+#ifdef VM_LAZY_FLAGS
+    BYTE flags_op;
+    WORD flags_a,flags_res;
+#endif
+#ifdef VM_THREADED_DISPATCH
+    static const void* const dispatch_table[256] =
+    {
+        [0 ... 255] = &&op_default,
+        [0x90] = &&op_0x90,
+        [0x10] = &&op_0x10, [0x12] = &&op_0x12, [0x14] = &&op_0x14, [0x16] = &&op_0x16,
+        [0x18] = &&op_0x18, [0x1c] = &&op_0x1c, [0x1f] = &&op_0x1f,
+        [0xE0] = &&op_0xE0, [0xE2] = &&op_0xE2, [0xE3] = &&op_0xE3, [0xE4] = &&op_0xE4,
+        [0xE6] = &&op_0xE6, [0xE8] = &&op_0xE8, [0xEC] = &&op_0xEC,
+        [0xAD] = &&op_0xAD, [0xA5] = &&op_0xA5, [0xA2] = &&op_0xA2,
+        [0x5B] = &&op_0x5B, [0x5C] = &&op_0x5C, [0x5D] = &&op_0x5D,
+        [0xF0] = &&op_0xF0, [0xF1] = &&op_0xF1, [0xA1] = &&op_0xA1, [0x51] = &&op_0x51,
+        [0x55] = &&op_0x55, [0x56] = &&op_0x56, [0x70] = &&op_0x70, [0x71] = &&op_0x71,
+        [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&op_0x63, [0x64] = &&op_0x64,
+        [0xAF] = &&op_0xAF, [0xAE] = &&op_0xAE,
+        [0xC0] = &&op_0xC0, [0xC2] = &&op_0xC2, [0x89] = &&op_0x89,
+        [0xD0] = &&op_0xD0, [0xD1] = &&op_0xD1, [0xE1] = &&op_0xE1,
+        [0xED] = &&op_0xED
+    };
+    if(Fuel && !fuel)
+        return VM_STOP_FUEL;
+    VM_LOAD_FLAGS();
+    VM_NEXT;
+    {
+        {
+#else
+    boolean exit = FALSE;
+    if(Fuel && !fuel)
+        return VM_STOP_FUEL;
+    VM_LOAD_FLAGS();
+    while(!exit)
+    {
+        switch(PAGED_FETCH())
+        {
+#endif
+            VM_CASE(0x90) :
+                VM_NEXT;
+            /*MOV Rd,Rs*/
+            VM_CASE(0x10) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                Regs->GPRs[(byte_val & 0xF0)>>4] = Regs->GPRs[byte_val & 0x0F];
+                VM_NEXT;
+            /*MOVX R,BYTE [DS:addr]*/
+            VM_CASE(0x12) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                word_val = PAGED_FETCH_WORD();
+                Regs->GPRs[byte_val] = PagedLoad(Space,PAGED_DATA(word_val));
+                VM_NEXT;
+            /*MOV R,WORD [DS:addr]*/
+            VM_CASE(0x14) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                word_val = PAGED_FETCH_WORD();
+                Regs->GPRs[byte_val] = PagedLoadWord(Space,PAGED_DATA(word_val));
+                VM_NEXT;
+            /*MOVX R,imm8*/
+            VM_CASE(0x16) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                Regs->GPRs[byte_val] = PAGED_FETCH();
+                VM_NEXT;
+            /*MOV R,imm16*/
+            VM_CASE(0x18) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                Regs->GPRs[byte_val] = PAGED_FETCH_WORD();
+                VM_NEXT;
+            /*MOV BYTE [DS:addr],R*/
+            VM_CASE(0x1c) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                word_val = PAGED_FETCH_WORD();
+                if(!PagedStore(Space,PAGED_DATA(word_val),(BYTE)Regs->GPRs[byte_val]))
+                    goto exception;
+                VM_NEXT;
+            /*MOV WORD [DS:addr],R*/
+            VM_CASE(0x1f) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                word_val = PAGED_FETCH_WORD();
+                if(!PagedStoreWord(Space,PAGED_DATA(word_val),Regs->GPRs[byte_val]))
+                    goto exception;
+                VM_NEXT;
+            /*jumps in bank CS*/
+            VM_CASE(0xE0) :
+                word_val = PAGED_FETCH_WORD();
+                Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            VM_CASE(0xE2) :
+                word_val = PAGED_FETCH_WORD();
+                if(VM_ZF)
+                    Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            VM_CASE(0xE3) :
+                word_val = PAGED_FETCH_WORD();
+                if(! VM_ZF)
+                    Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            VM_CASE(0xE4) :
+                word_val = PAGED_FETCH_WORD();
+                if(VM_ZF || ! VM_CF)
+                    Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            VM_CASE(0xE6) :
+                word_val = PAGED_FETCH_WORD();
+                if(VM_ZF || VM_CF)
+                    Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            VM_CASE(0xE8) :
+                word_val = PAGED_FETCH_WORD();
+                if(VM_CF && ! VM_ZF)
+                    Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            VM_CASE(0xEC) :
+                word_val = PAGED_FETCH_WORD();
+                if(! VM_CF && ! VM_ZF)
+                    Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            /*JMP FAR bank:offset*/
+            VM_CASE(0xE1) :
+                word_val = PAGED_FETCH_WORD();
+                Paged->CS = PAGED_FETCH_WORD();
+                Regs->IP = word_val;
+                VM_CHARGE();
+                VM_NEXT;
+            /*MOV DS,R*/
+            VM_CASE(0xD0) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                Paged->DS = Regs->GPRs[byte_val];
+                VM_NEXT;
+            /*MOV R,DS*/
+            VM_CASE(0xD1) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                Regs->GPRs[byte_val] = Paged->DS;
+                VM_NEXT;
+            /*ADD R,imm16*/
+            VM_CASE(0xAD) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                word_val = PAGED_FETCH_WORD();
+                word_val2 = Regs->GPRs[byte_val] + word_val;
+                VM_FLAGS_ADD(Regs->GPRs[byte_val],word_val2);
+                Regs->GPRs[byte_val] = word_val2;
+                VM_NEXT;
+            /*ADD Rd,Rs*/
+            VM_CASE(0xA5) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
+                word_val2 = Regs->GPRs[(byte_val & 0xF0)>>4] += Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_ADD(word_val,word_val2);
+                VM_NEXT;
+            /*ADDL Rd,Rs*/
+            VM_CASE(0xA2) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4];
+                byte_val3 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] += *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_ADD(byte_val2,byte_val3);
+                VM_NEXT;
+            /*SUB R,imm16*/
+            VM_CASE(0x5B) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                word_val = PAGED_FETCH_WORD();
+                word_val2 = Regs->GPRs[byte_val] - word_val;
+                VM_FLAGS_SUB(Regs->GPRs[byte_val],word_val2);
+                Regs->GPRs[byte_val] = word_val2;
+                VM_NEXT;
+            /*SUB Rd,Rs*/
+            VM_CASE(0x5C) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
+                word_val2 = Regs->GPRs[(byte_val & 0xF0)>>4] -= Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(word_val,word_val2);
+                VM_NEXT;
+            /*SUBL Rd,Rs*/
+            VM_CASE(0x5D) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4];
+                byte_val3 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] -= *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(byte_val2,byte_val3);
+                VM_NEXT;
+            /*XOR Rd,Rs*/
+            VM_CASE(0xF0) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                word_val = Regs->GPRs[(byte_val & 0xF0)>>4] ^= Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_LOGIC(word_val);
+                VM_NEXT;
+            /*XORL Rd,Rs*/
+            VM_CASE(0xF1) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] ^= *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_LOGIC(byte_val2);
+                VM_NEXT;
+            /*ADDL R,imm8*/
+            VM_CASE(0xA1) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                byte_val2 = PAGED_FETCH();
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val] + byte_val2;
+                VM_FLAGS_ADD(*(BYTE*)&Regs->GPRs[byte_val],byte_val3);
+                *(BYTE*)&Regs->GPRs[byte_val] = byte_val3;
+                VM_NEXT;
+            /*SUBL R,imm8*/
+            VM_CASE(0x51) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                byte_val2 = PAGED_FETCH();
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val] - byte_val2;
+                VM_FLAGS_SUB(*(BYTE*)&Regs->GPRs[byte_val],byte_val3);
+                *(BYTE*)&Regs->GPRs[byte_val] = byte_val3;
+                VM_NEXT;
+            /*MOV BYTE [DS:Rd],Rs*/
+            VM_CASE(0x55) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                if(!PagedStore(Space,PAGED_DATA(Regs->GPRs[(byte_val & 0xF0)>>4]),(BYTE)Regs->GPRs[byte_val & 0x0F]))
+                    goto exception;
+                VM_NEXT;
+            /*MOVX Rd,BYTE [DS:Rs]*/
+            VM_CASE(0x56) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                Regs->GPRs[(byte_val & 0xF0)>>4] = PagedLoad(Space,PAGED_DATA(Regs->GPRs[byte_val & 0x0F]));
+                VM_NEXT;
+            /*bulk opcodes in bank DS*/
+            VM_CASE(0x60) :
+            VM_CASE(0x61) :
+            VM_CASE(0x62) :
+            VM_CASE(0x64) :
+                byte_val3 = PagedLoad(Space,(DWORD)Paged->CS << 16 | (WORD)(Regs->IP - 1));
+                byte_val = PAGED_FETCH();
+                byte_val2 = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3 || (byte_val2 & 0xF0) > 0x30 || (byte_val2 & 0x0F) > 3)
+                    goto exception;
+                if(!PagedBulk(Space,Paged->DS,byte_val3,Regs->GPRs[(byte_val & 0xF0)>>4],Regs->GPRs[byte_val & 0x0F],
+                              Regs->GPRs[(byte_val2 & 0xF0)>>4],Regs->GPRs[byte_val2 & 0x0F],&bulk))
+                    goto exception;
+                VM_FLAGS_SET(bulk.ZF,bulk.CF);
+                VM_NEXT;
+            VM_CASE(0x63) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                PagedBulk(Space,Paged->DS,0x63,0,Regs->GPRs[byte_val & 0x0F],0,0,&bulk);
+                Regs->GPRs[(byte_val & 0xF0)>>4] = bulk.Length;
+                VM_FLAGS_SET(bulk.ZF,bulk.CF);
+                VM_NEXT;
+            /*CMP Rd,Rs*/
+            VM_CASE(0x70) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
+                word_val2 = Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(word_val,(WORD)(word_val - word_val2));
+                VM_NEXT;
+            /*CMPL Rd,Rs*/
+            VM_CASE(0x71) :
+                byte_val = PAGED_FETCH();
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4];
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(byte_val2,(BYTE)(byte_val2 - byte_val3));
+                VM_NEXT;
+            /*PUSH R*/
+            VM_CASE(0xAF) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3)
+                    goto exception;
+                /*SP is 0xFFFF after an overflow , as in VmLoop*/
+                Regs->SP--;
+                if(Regs->SP == 0xFFFF)
+                    goto exception;
+                Space->Stack[Regs->SP] = Regs->GPRs[byte_val];
+                VM_NEXT;
+            /*POP R*/
+            VM_CASE(0xAE) :
+                byte_val = PAGED_FETCH();
+                if(byte_val > 3 || Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                Regs->GPRs[byte_val] = Space->Stack[Regs->SP++];
+                VM_NEXT;
+            /*print integer*/
+            VM_CASE(0xC0) :
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                VmPrintInteger(Space->Stack[Regs->SP++]);
+                VM_NEXT;
+            /*print the string at DS:[top of the stack]*/
+            VM_CASE(0xC2) :
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                PagedPrint(Space,PAGED_DATA(Space->Stack[Regs->SP++]));
+                VM_NEXT;
+            /*scan a string to DS:[top of the stack]*/
+            VM_CASE(0x89) :
+                if(!VmInputReady(NULL))
+                {
+                    Regs->IP--;
+                    goto input_wait;
+                }
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                if(!PagedScan(Space,PAGED_DATA(Space->Stack[Regs->SP++])))
+                    goto exception;
+                VM_NEXT;
+            VM_CASE(0xED) :
+                VM_EXIT;
+            VM_DEFAULT :
+                exception:
+                status = VM_STOP_EXCEPTION;
+                VM_EXIT;
+            out_of_fuel:
+                status = VM_STOP_FUEL;
+                VM_EXIT;
+            input_wait:
+                status = VM_STOP_INPUT;
+                VM_EXIT;
+        }
+    }
+#ifdef VM_THREADED_DISPATCH
+vm_exit:
+#endif
+    VM_STORE_FLAGS();
+    if(Fuel)
+        *Fuel = fuel;
+    return status;
+}
+/*
+vm -paged program : run program (any size up to the 4 GB of the address space) from
+0:0 in a paged address space. Only its pages that aren't all zeros are allocated.
+*/
+int VmPagedMain(const char* Program)
+{
+    BYTE chunk[VM_PAGED_PAGE_SIZE];
+    VM_PAGED_REGS regs;
+    PVM_PAGED space;
+    FILE* File;
+    DWORD address = 0;
+    size_t size;
+    space = VmPagedCreate();
+    File = fopen(Program,"rb");
+    if(!space || !File)
+    {
+        printf("Found trouble opening the file");
+        if(File)
+            fclose(File);
+        if(space)
+            VmPagedDestroy(space);
+        return 1;
+    }
+    while((size = fread(chunk,1,sizeof(chunk),File)) > 0)
+    {
+        if(!VmPagedWrite(space,address,chunk,(DWORD)size))
+        {
+            printf("The program is larger than the address space");
+            fclose(File);
+            VmPagedDestroy(space);
+            return 1;
+        }
+        address += (DWORD)size;
+    }
+    fclose(File);
+    memset(&regs,0,sizeof(regs));
+    VmResetRegs(&regs.Regs);
+    VmLoopPaged(space,&regs,NULL);
+    VmFlushIo(NULL);
+    VmPagedDestroy(space);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+Profiler reports.
+VmLoop fills a VM_PROFILE_COUNTERS when it is built with VM_PROFILE (two counter
+increments per instruction and one per conditional jump). VmProfileReport prints
+the opcodes , the hottest addresses and the conditional jumps sorted by executions.
+VmProfileFolded writes one line per executed address in the collapsed stack
+format of flamegraph.pl :
+
+    vm;JNZ;0x0123 51200
+
+the opcode is the parent frame so the graph groups the addresses by opcode.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+typedef struct
+{
+    uint64_t Count;
+    uint64_t Other;
+    DWORD Key;
+}PROFILE_ENTRY,*PPROFILE_ENTRY;
+static VM_PROFILE_COUNTERS ProcessProfile;
+static VM_THREAD_LOCAL PVM_PROFILE_COUNTERS CurrentProfile;
+void VmSetProfile(PVM_PROFILE_COUNTERS Profile)
+{
+    CurrentProfile = Profile;
+}
+PVM_PROFILE_COUNTERS VmGetProfile(void)
+{
+    return CurrentProfile ? CurrentProfile : &ProcessProfile;
+}
+/*opcode names for the reports*/
+const char* VmMnemonic(BYTE Opcode)
+{
+    switch(Opcode)
+    {
+        case 0x90 : return "NOP";
+        case 0x10 : return "MOV";
+        case 0x12 : return "MOVX_LOADB";
+        case 0x14 : return "MOV_LOADW";
+        case 0x16 : return "MOVX_IMM";
+        case 0x18 : return "MOV_IMM";
+        case 0x1c : return "MOV_STOREB";
+        case 0x1f : return "MOV_STOREW";
+        case 0xE0 : return "JMP";
+        case 0xE2 : return "JZ";
+        case 0xE3 : return "JNZ";
+        case 0xE4 : return "JAE";
+        case 0xE6 : return "JBE";
+        case 0xE8 : return "JB";
+        case 0xEC : return "JA";
+        case 0xAD : return "ADD_IMM";
+        case 0xA5 : return "ADD";
+        case 0xA2 : return "ADDL";
+        case 0x5B : return "SUB_IMM";
+        case 0x5C : return "SUB";
+        case 0x5D : return "SUBL";
+        case 0xF0 : return "XOR";
+        case 0xF1 : return "XORL";
+        case 0xA1 : return "ADDL_IMM";
+        case 0x51 : return "SUBL_IMM";
+        case 0x55 : return "MOV_STOREB_R";
+        case 0x56 : return "MOVX_LOADB_R";
+        case 0x70 : return "CMP";
+        case 0x71 : return "CMPL";
+        case 0x60 : return "MEMCPY";
+        case 0x61 : return "MEMSET";
+        case 0x62 : return "MEMCMP";
+        case 0x63 : return "STRLEN";
+        case 0x64 : return "XORKEY";
+        case 0xAF : return "PUSH";
+        case 0xAE : return "POP";
+        case 0xC0 : return "PRINTI";
+        case 0xC2 : return "PRINTS";
+        case 0x89 : return "SCAN";
+        case 0xED : return "EXIT";
+        default : return "INVALID";
+    }
+}
+/*descending count*/
+static int ProfileCompare(const void* a,const void* b)
+{
+    uint64_t x = ((const PROFILE_ENTRY*)a)->Count,y = ((const PROFILE_ENTRY*)b)->Count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+/*the non-zero counters of Counts sorted , returns how many*/
+static DWORD ProfileSort(const uint64_t* Counts,const uint64_t* Others,DWORD Size,PPROFILE_ENTRY Entries)
+{
+    DWORD i,n = 0;
+    for(i = 0;i < Size;i++)
+    {
+        if(!Counts[i] && (!Others || !Others[i]))
+            continue;
+        Entries[n].Count = Counts[i] + (Others ? Others[i] : 0);
+        Entries[n].Other = Others ? Others[i] : 0;
+        Entries[n].Key = i;
+        n++;
+    }
+    qsort(Entries,n,sizeof(PROFILE_ENTRY),ProfileCompare);
+    return n;
+}
+/*Top limits the addresses and jumps listed , 0 lists them all*/
+void VmProfileReport(PVM_PROFILE_COUNTERS Profile,PADDRESS_SPACE AS,FILE* File,DWORD Top)
+{
+    PPROFILE_ENTRY entries = (PPROFILE_ENTRY) malloc(VM_DATA_SIZE * sizeof(PROFILE_ENTRY));
+    uint64_t total = 0;
+    DWORD i,n;
+    if(!entries)
+        return;
+    for(i = 0;i < 256;i++)
+        total += Profile->Opcodes[i];
+    if(!total)
+        total = 1;
+    fprintf(File,"%-14s %14s %7s\n","opcode","executed","%");
+    n = ProfileSort(Profile->Opcodes,NULL,256,entries);
+    for(i = 0;i < n;i++)
+        fprintf(File,"%-14s %14llu %7.2f\n",VmMnemonic(entries[i].Key),
+                (unsigned long long)entries[i].Count,100.0 * entries[i].Count / total);
+    fprintf(File,"\n%-6s %-14s %14s %7s\n","ip","opcode","executed","%");
+    n = ProfileSort(Profile->Ips,NULL,VM_DATA_SIZE,entries);
+    for(i = 0;i < n && (!Top || i < Top);i++)
+        fprintf(File,"0x%.4X %-14s %14llu %7.2f\n",entries[i].Key,VmMnemonic(AS->data[entries[i].Key]),
+                (unsigned long long)entries[i].Count,100.0 * entries[i].Count / total);
+    fprintf(File,"\n%-6s %-14s %14s %14s %7s\n","ip","jump","taken","not taken","taken%");
+    n = ProfileSort(Profile->Taken,Profile->NotTaken,VM_DATA_SIZE,entries);
+    for(i = 0;i < n && (!Top || i < Top);i++)
+        fprintf(File,"0x%.4X %-14s %14llu %14llu %7.2f\n",entries[i].Key,VmMnemonic(AS->data[entries[i].Key]),
+                (unsigned long long)(entries[i].Count - entries[i].Other),(unsigned long long)entries[i].Other,
+                100.0 * (entries[i].Count - entries[i].Other) / entries[i].Count);
+    free(entries);
+}
+void VmProfileFolded(PVM_PROFILE_COUNTERS Profile,PADDRESS_SPACE AS,FILE* File)
+{
+    DWORD i;
+    for(i = 0;i < VM_DATA_SIZE;i++)
+    {
+        if(Profile->Ips[i])
+            fprintf(File,"vm;%s;0x%.4X %llu\n",VmMnemonic(AS->data[i]),i,(unsigned long long)Profile->Ips[i]);
+    }
+}
@@ -0,0 +1,92 @@
+/*
+Green threads.
+The scheduler runs many contexts on the calling thread , round-robin : the task at
+the head of the run queue runs for Quantum basic blocks (VmLoopFuel) with its own
+VM_IO , then goes to the tail if it ran out of fuel or leaves the queue if it
+exited or raised an exception. A program that loops forever only costs its slices ,
+no task waits more than one round of the others.
+The fuel is charged per block (at every jump) so a slice is at most Quantum blocks
+plus the straight-line code that follows the last jump.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+void VmSchedInit(PVM_SCHEDULER Sched,uint64_t Quantum)
+{
+    memset(Sched,0,sizeof(VM_SCHEDULER));
+    Sched->Quantum = Quantum ? Quantum : VM_SCHED_QUANTUM;
+}
+/*capacity doubles , the queue is copied back in order from index 0*/
+static boolean SchedGrow(PVM_SCHEDULER Sched)
+{
+    DWORD capacity = Sched->Capacity ? Sched->Capacity * 2 : 64;
+    PVM_TASK tasks;
+    DWORD* queue;
+    DWORD i;
+    tasks = (PVM_TASK) realloc(Sched->Tasks,capacity * sizeof(VM_TASK));
+    if(!tasks)
+        return FALSE;
+    Sched->Tasks = tasks;
+    queue = (DWORD*) malloc(capacity * sizeof(DWORD));
+    if(!queue)
+        return FALSE;
+    for(i = 0;i < Sched->Runnable;i++)
+        queue[i] = Sched->Queue[(Sched->Head + i) % Sched->Capacity];
+    free(Sched->Queue);
+    Sched->Queue = queue;
+    Sched->Head = 0;
+    Sched->Capacity = capacity;
+    return TRUE;
+}
+/*the context runs from its current registers , returns the task index (VM_NO_TASK on failure)*/
+DWORD VmSchedAdd(PVM_SCHEDULER Sched,PVM_CONTEXT Context,PVM_IO Io)
+{
+    PVM_TASK task;
+    if(Sched->Count == Sched->Capacity && !SchedGrow(Sched))
+        return VM_NO_TASK;
+    task = &Sched->Tasks[Sched->Count];
+    memset(task,0,sizeof(VM_TASK));
+    task->Context = Context;
+    task->Io = Io;
+    task->Status = VM_STOP_FUEL;
+    Sched->Queue[(Sched->Head + Sched->Runnable) % Sched->Capacity] = Sched->Count;
+    Sched->Runnable++;
+    return Sched->Count++;
+}
+/*run one slice of the task at the head of the queue , returns the number of runnable tasks*/
+DWORD VmSchedStep(PVM_SCHEDULER Sched)
+{
+    PVM_TASK task;
+    DWORD index;
+    uint64_t fuel = Sched->Quantum;
+    if(!Sched->Runnable)
+        return 0;
+    index = Sched->Queue[Sched->Head];
+    Sched->Head = (Sched->Head + 1) % Sched->Capacity;
+    Sched->Runnable--;
+    task = &Sched->Tasks[index];
+    VmSetIo(task->Io);
+    task->Status = VmLoopFuel(&task->Context->AS,&task->Context->Regs,&fuel);
+    VmSetIo(NULL);
+    task->Blocks += Sched->Quantum - fuel;
+    task->Slices++;
+    if(task->Status == VM_STOP_FUEL)
+    {
+        Sched->Queue[(Sched->Head + Sched->Runnable) % Sched->Capacity] = index;
+        Sched->Runnable++;
+    }
+    return Sched->Runnable;
+}
+/*run until every task has stopped*/
+void VmSchedRun(PVM_SCHEDULER Sched)
+{
+    while(VmSchedStep(Sched));
+}
+/*the contexts and VM_IOs belong to the caller*/
+void VmSchedFree(PVM_SCHEDULER Sched)
+{
+    free(Sched->Tasks);
+    free(Sched->Queue);
+    memset(Sched,0,sizeof(VM_SCHEDULER));
+}
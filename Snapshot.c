@@ -0,0 +1,112 @@
+/*
+Snapshots and fast reset.
+VmSnapshot copies an address space and its registers and clears its dirty pages ,
+from then on the engines mark every page they write (VM_MARK_DIRTY). VmRestore
+copies back only the marked pages , a run that changed a few bytes costs a few
+pages to reset instead of the whole address space.
+VmRunTo and VmRunToInput run a context up to an instruction (e.g. the first input
+read) so that the setup code that comes before can be snapshotted once.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "VM.h"
+void VmSnapshot(PVM_SNAPSHOT Snapshot,PADDRESS_SPACE AS,PREGS Regs)
+{
+    memset(AS->Dirty,0,sizeof(AS->Dirty));
+    memcpy(&Snapshot->AS,AS,sizeof(ADDRESS_SPACE));
+    Snapshot->Regs = *Regs;
+}
+/*AS becomes a full copy of the snapshot*/
+void VmFork(PVM_SNAPSHOT Snapshot,PADDRESS_SPACE AS,PREGS Regs)
+{
+    memcpy(AS,&Snapshot->AS,sizeof(ADDRESS_SPACE));
+    *Regs = Snapshot->Regs;
+}
+/*AS is based on the snapshot , only its dirty pages are copied back*/
+void VmRestore(PVM_SNAPSHOT Snapshot,PADDRESS_SPACE AS,PREGS Regs)
+{
+    DWORD i,page;
+    for(i = 0;i < sizeof(AS->Dirty);i++)
+    {
+        if(!AS->Dirty[i])
+            continue;
+        for(page = i * 8;page < i * 8 + 8;page++)
+        {
+            if(AS->Dirty[i] & (1 << (page & 7)))
+                memcpy((BYTE*)AS + page * VM_PAGE_SIZE,(BYTE*)&Snapshot->AS + page * VM_PAGE_SIZE,VM_PAGE_SIZE);
+        }
+        AS->Dirty[i] = 0;
+    }
+    *Regs = Snapshot->Regs;
+}
+/*mark Size bytes of data and stack from Offset (the stack starts at VM_DATA_SIZE)*/
+void VmMarkDirty(PADDRESS_SPACE AS,DWORD Offset,DWORD Size)
+{
+    DWORD end = Offset + Size;
+    if(!Size)
+        return;
+    if(end > VM_PAGES * VM_PAGE_SIZE)
+        end = VM_PAGES * VM_PAGE_SIZE;
+    for(Offset &= ~(VM_PAGE_SIZE - 1);Offset < end;Offset += VM_PAGE_SIZE)
+        VM_MARK_DIRTY(AS,Offset);
+}
+/*
+Run the context until the instruction at Stop is reached : EXIT is patched in at
+Stop (which must be the start of an instruction) for the run. Returns TRUE with
+Regs.IP = Stop if it got there , FALSE if the VM exited or raised an exception
+before.
+*/
+boolean VmRunTo(PVM_CONTEXT Context,WORD Stop)
+{
+    BYTE saved;
+    if(Stop >= VM_DATA_SIZE)
+        return FALSE;
+    saved = Context->AS.data[Stop];
+    Context->AS.data[Stop] = 0xED;
+    VmRunContext(Context);
+    /*leave it alone if the program wrote there*/
+    if(Context->AS.data[Stop] == 0xED)
+        Context->AS.data[Stop] = saved;
+    if(Context->Regs.IP != Stop + 1)
+        return FALSE;
+    Context->Regs.IP = Stop;
+    return TRUE;
+}
+/*
+Run the context until it is about to read input (0x89) , every scan instruction
+reachable from Regs.IP is a breakpoint. Returns FALSE if the VM stopped before
+reading input.
+*/
+boolean VmRunToInput(PVM_CONTEXT Context)
+{
+    PDECODED_PROGRAM Program;
+    PADDRESS_SPACE AS = &Context->AS;
+    DWORD i;
+    WORD ip;
+    boolean stopped = FALSE;
+    Program = (PDECODED_PROGRAM) malloc(sizeof(DECODED_PROGRAM));
+    if(!Program)
+        return FALSE;
+    VmDecode(AS,Program,Context->Regs.IP);
+    for(i = 0;i < Program->Count;i++)
+    {
+        if(Program->Ops[i].Handler == 0x89)
+            AS->data[Program->Ops[i].IP] = 0xED;
+    }
+    VmRunContext(Context);
+    for(i = 0;i < Program->Count;i++)
+    {
+        if(Program->Ops[i].Handler == 0x89 && AS->data[Program->Ops[i].IP] == 0xED)
+            AS->data[Program->Ops[i].IP] = 0x89;
+    }
+    ip = Context->Regs.IP - 1;
+    if(ip < VM_DATA_SIZE && Program->Index[ip] != VM_NO_OP && Program->Ops[Program->Index[ip]].Handler == 0x89)
+    {
+        Context->Regs.IP = ip;
+        stopped = TRUE;
+    }
+    free(Program);
+    return stopped;
+}
@@ -0,0 +1,288 @@
+/*
+Execution trace.
+Built with VM_TRACE , VmLoop appends one record per executed instruction to the
+VM_TRACER of the calling thread (VmSetTrace). The records go to a ring buffer with
+one producer (the VM) and one consumer (VmTraceDrain , called by another thread or
+by the VM itself when the ring is full) that appends them to a file mapped in
+memory. tools/TraceDecode.c reads the file back.
+
+The file starts with a VM_TRACE_HEADER (initial registers , flags and address
+space) followed by the records , each one gives the state after an instruction :
+
+    BYTE Changes       VM_TRACE_BIT_R0 << n for every changed Rn , VM_TRACE_BIT_FLAGS ,
+                       VM_TRACE_BIT_SP , VM_TRACE_BIT_WRITE
+    BYTE Opcode
+    varint IP          delta from the IP of the previous record
+    varint Rn          delta from the previous value , for every changed register
+    BYTE Flags         ZF (bit 0) and CF (bit 1)
+    varint SP          delta from the previous value
+    varint Offset      bytes written in the address space (the stack starts at
+    varint Size        VM_DATA_SIZE) followed by the Size bytes
+    BYTE Data[Size]
+
+Deltas are 16 bits , zigzag encoded (small negative values stay small) in 7 bit
+groups , low group first.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#define TRACE_DEFAULT_RING (1 << 20)
+#define TRACE_MAP_GROWTH (1 << 22)
+#define TRACE_MAX_RECORD (32 + VM_DATA_SIZE)
+struct VM_TRACER
+{
+    /*ring , Head and Tail only grow , the index is Head & (RingSize - 1)*/
+    BYTE* Ring;
+    DWORD RingSize;
+    VM_CACHE_ALIGNED atomic_ullong Head;
+    VM_CACHE_ALIGNED atomic_ullong Tail;
+    atomic_flag Draining;
+    /*state of the previous record*/
+    WORD GPRs[4];
+    WORD SP;
+    BYTE Flags;
+    WORD LastIp;
+    /*instruction being executed*/
+    boolean Pending;
+    WORD Ip;
+    BYTE Opcode;
+    /*output file*/
+#ifdef _WIN32
+    FILE* File;
+#else
+    int File;
+    BYTE* Map;
+    uint64_t MapSize;
+#endif
+    uint64_t Written;
+};
+static VM_THREAD_LOCAL PVM_TRACER CurrentTrace;
+void VmSetTrace(PVM_TRACER Trace)
+{
+    CurrentTrace = Trace;
+}
+PVM_TRACER VmGetTrace(void)
+{
+    return CurrentTrace;
+}
+static boolean TraceFileWrite(PVM_TRACER Trace,const BYTE* Data,DWORD Size)
+{
+#ifdef _WIN32
+    if(fwrite(Data,1,Size,Trace->File) != Size)
+        return FALSE;
+#else
+    uint64_t size = Trace->MapSize;
+    if(Trace->Written + Size > size)
+    {
+        while(Trace->Written + Size > size)
+            size += TRACE_MAP_GROWTH;
+        if(Trace->Map)
+            munmap(Trace->Map,Trace->MapSize);
+        Trace->Map = NULL;
+        if(ftruncate(Trace->File,size))
+            return FALSE;
+        Trace->Map = (BYTE*) mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,Trace->File,0);
+        if(Trace->Map == MAP_FAILED)
+        {
+            Trace->Map = NULL;
+            return FALSE;
+        }
+        Trace->MapSize = size;
+    }
+    memcpy(&Trace->Map[Trace->Written],Data,Size);
+#endif
+    Trace->Written += Size;
+    return TRUE;
+}
+/*
+Move what the ring holds to the file. Only one thread drains at a time , the
+others return at once.
+*/
+void VmTraceDrain(PVM_TRACER Trace)
+{
+    uint64_t head,tail;
+    DWORD start,size;
+    if(atomic_flag_test_and_set_explicit(&Trace->Draining,memory_order_acquire))
+        return;
+    tail = atomic_load_explicit(&Trace->Tail,memory_order_relaxed);
+    head = atomic_load_explicit(&Trace->Head,memory_order_acquire);
+    while(tail != head)
+    {
+        start = tail & (Trace->RingSize - 1);
+        size = head - tail < Trace->RingSize - start ? (DWORD)(head - tail) : Trace->RingSize - start;
+        TraceFileWrite(Trace,&Trace->Ring[start],size);
+        tail += size;
+    }
+    atomic_store_explicit(&Trace->Tail,tail,memory_order_release);
+    atomic_flag_clear_explicit(&Trace->Draining,memory_order_release);
+}
+static void TracePut(PVM_TRACER Trace,const BYTE* Data,DWORD Size)
+{
+    uint64_t head = atomic_load_explicit(&Trace->Head,memory_order_relaxed);
+    DWORD start,first;
+    while(Trace->RingSize - (head - atomic_load_explicit(&Trace->Tail,memory_order_acquire)) < Size)
+        VmTraceDrain(Trace);
+    start = head & (Trace->RingSize - 1);
+    first = Size < Trace->RingSize - start ? Size : Trace->RingSize - start;
+    memcpy(&Trace->Ring[start],Data,first);
+    memcpy(Trace->Ring,Data + first,Size - first);
+    atomic_store_explicit(&Trace->Head,head + Size,memory_order_release);
+}
+/*
+RingSize is rounded up to a power of two , 0 for the default. The ring holds at
+least the header (the address space and the stack , larger than the records with a
+big VM_STACK_SIZE) and two records , TracePut waits for room and would never get it
+for a larger one.
+*/
+PVM_TRACER VmTraceOpen(const char* Name,DWORD RingSize)
+{
+    PVM_TRACER Trace = (PVM_TRACER) calloc(1,sizeof(struct VM_TRACER));
+    DWORD size = 4096;
+    if(!Trace)
+        return NULL;
+    if(!RingSize)
+        RingSize = TRACE_DEFAULT_RING;
+    while(size < RingSize || size < 2 * TRACE_MAX_RECORD || size < sizeof(VM_TRACE_HEADER))
+        size *= 2;
+    Trace->RingSize = size;
+    Trace->Ring = (BYTE*) malloc(size);
+    atomic_init(&Trace->Head,0);
+    atomic_init(&Trace->Tail,0);
+    atomic_flag_clear(&Trace->Draining);
+#ifdef _WIN32
+    Trace->File = fopen(Name,"wb");
+    if(!Trace->Ring || !Trace->File)
+#else
+    Trace->File = open(Name,O_RDWR | O_CREAT | O_TRUNC,0644);
+    if(!Trace->Ring || Trace->File < 0)
+#endif
+    {
+        free(Trace->Ring);
+        free(Trace);
+        return NULL;
+    }
+    return Trace;
+}
+void VmTraceClose(PVM_TRACER Trace)
+{
+    VmTraceDrain(Trace);
+#ifdef _WIN32
+    fclose(Trace->File);
+#else
+    if(Trace->Map)
+        munmap(Trace->Map,Trace->MapSize);
+    if(ftruncate(Trace->File,Trace->Written))
+        perror("trace");
+    close(Trace->File);
+#endif
+    free(Trace->Ring);
+    free(Trace);
+}
+/*write the header , the records that follow are relative to this state*/
+void VmTraceStart(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs)
+{
+    static VM_TRACE_HEADER header;
+    memset(&header,0,sizeof(header));
+    header.Magic = VM_TRACE_MAGIC;
+    header.Version = VM_TRACE_VERSION;
+    memcpy(header.GPRs,Regs->GPRs,sizeof(header.GPRs));
+    header.IP = Regs->IP;
+    header.SP = Regs->SP;
+    header.Flags = Regs->ZF | (Regs->CF << 1);
+    memcpy(header.AS,AS->data,VM_DATA_SIZE);
+    memcpy(&header.AS[VM_DATA_SIZE],AS->stack,sizeof(AS->stack));
+    TracePut(Trace,(const BYTE*)&header,sizeof(header));
+    memcpy(Trace->GPRs,Regs->GPRs,sizeof(Trace->GPRs));
+    Trace->SP = Regs->SP;
+    Trace->Flags = header.Flags;
+    Trace->LastIp = Regs->IP;
+    Trace->Pending = FALSE;
+}
+static BYTE* TraceVarint(BYTE* Out,DWORD Value)
+{
+    while(Value >= 0x80)
+    {
+        *Out++ = (BYTE)(Value | 0x80);
+        Value >>= 7;
+    }
+    *Out++ = (BYTE)Value;
+    return Out;
+}
+/*16 bits delta , zigzag*/
+static BYTE* TraceDelta(BYTE* Out,WORD New,WORD Old)
+{
+    int16_t delta = (int16_t)(WORD)(New - Old);
+    return TraceVarint(Out,(DWORD)(((int32_t)delta << 1) ^ (delta >> 15)) & 0xFFFF);
+}
+/*record the instruction that just ran (if any) , the state is the one after it*/
+static void TraceRecord(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs,BYTE Flags,DWORD WriteOffset,DWORD WriteSize)
+{
+    BYTE record[TRACE_MAX_RECORD];
+    BYTE* out = &record[2];
+    BYTE changes = 0;
+    int i;
+    out = TraceDelta(out,Trace->Ip,Trace->LastIp);
+    Trace->LastIp = Trace->Ip;
+    for(i = 0;i < 4;i++)
+    {
+        if(Regs->GPRs[i] != Trace->GPRs[i])
+        {
+            changes |= VM_TRACE_BIT_R0 << i;
+            out = TraceDelta(out,Regs->GPRs[i],Trace->GPRs[i]);
+            Trace->GPRs[i] = Regs->GPRs[i];
+        }
+    }
+    if(Flags != Trace->Flags)
+    {
+        changes |= VM_TRACE_BIT_FLAGS;
+        *out++ = Flags;
+        Trace->Flags = Flags;
+    }
+    if(Regs->SP != Trace->SP)
+    {
+        changes |= VM_TRACE_BIT_SP;
+        out = TraceDelta(out,Regs->SP,Trace->SP);
+        Trace->SP = Regs->SP;
+    }
+    if(WriteSize)
+    {
+        if(WriteOffset + WriteSize > VM_DATA_SIZE + sizeof(AS->stack))
+            WriteSize = VM_DATA_SIZE + sizeof(AS->stack) - WriteOffset;
+        if(WriteSize > VM_DATA_SIZE)
+            WriteSize = VM_DATA_SIZE;
+        changes |= VM_TRACE_BIT_WRITE;
+        out = TraceVarint(out,WriteOffset);
+        out = TraceVarint(out,WriteSize);
+        /*data and stack follow each other in ADDRESS_SPACE*/
+        memcpy(out,(BYTE*)AS + WriteOffset,WriteSize);
+        out += WriteSize;
+    }
+    record[0] = changes;
+    record[1] = Trace->Opcode;
+    TracePut(Trace,record,out - record);
+}
+/*called before each instruction is fetched*/
+void VmTraceStep(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs,BYTE Flags,DWORD WriteOffset,DWORD WriteSize)
+{
+    if(Trace->Pending)
+        TraceRecord(Trace,AS,Regs,Flags,WriteOffset,WriteSize);
+    Trace->Pending = TRUE;
+    Trace->Ip = Regs->IP;
+    Trace->Opcode = AS->data[Regs->IP & VM_DATA_MASK];
+}
+/*called when the VM stops*/
+void VmTraceEnd(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs,BYTE Flags,DWORD WriteOffset,DWORD WriteSize)
+{
+    if(Trace->Pending)
+        TraceRecord(Trace,AS,Regs,Flags,WriteOffset,WriteSize);
+    Trace->Pending = FALSE;
+}
@@ -4,55 +4,219 @@ data space and stack space are customizable.
 Important : In calculations the VM is using unsigned values.
 */
 #include <stdio.h>
-#include <stdint.h>
-#include <conio.h>
-#define TRUE 1
-#define FALSE 0
-typedef unsigned char boolean;
-typedef uint8_t BYTE;
-typedef uint16_t WORD;
-typedef uint32_t DWORD;
-typedef struct
-{
-    /*data has also the code*/
-    BYTE data[4096];
-    /*stack space , size of one element is WORD in order to be able to push addresses*/
-    WORD stack[256];
-}ADDRESS_SPACE,*PADDRESS_SPACE;
-typedef struct
+#include <stdlib.h>
+#include <string.h>
+#include "VM.h"
+/*
+VM_PROFILE_STEP counts the instruction about to be fetched , VM_TAKEN(cond) counts
+the outcome of a conditional jump (IP is past its operand) and gives cond.
+*/
+#ifdef VM_PROFILE
+#define VM_PROFILE_STEP() (profile->Ips[Regs->IP & VM_DATA_MASK]++,profile->Opcodes[AS->data[Regs->IP]]++)
+#define VM_TAKEN(cond) ((cond) ? (profile->Taken[(Regs->IP - 3) & VM_DATA_MASK]++,1) \
+                               : (profile->NotTaken[(Regs->IP - 3) & VM_DATA_MASK]++,0))
+#else
+#define VM_PROFILE_STEP() (void)0
+#define VM_TAKEN(cond) (cond)
+#endif
+/*
+VM_TRACE_STEP records the instruction that just ran before the next one is
+fetched , VM_TRACE_WRITE(offset,size) gives the bytes of the address space it wrote.
+*/
+#ifdef VM_TRACE
+#define VM_TRACE_FLAGS_NOW ((VM_ZF ? 1 : 0) | (VM_CF ? 2 : 0))
+#define VM_TRACE_STEP() (trace ? (VmTraceStep(trace,AS,Regs,VM_TRACE_FLAGS_NOW,trace_offset,trace_size),trace_size = 0) : 0)
+#define VM_TRACE_WRITE(offset,size) (trace_offset = (offset),trace_size = (size))
+#define VM_TRACE_END() if(trace) VmTraceEnd(trace,AS,Regs,VM_TRACE_FLAGS_NOW,trace_offset,trace_size)
+#else
+#define VM_TRACE_STEP() (void)0
+#define VM_TRACE_WRITE(offset,size) (void)0
+#define VM_TRACE_END()
+#endif
+/*
+Verified code (VM_VERIFY , see Verify.c) : VM_SET_FAST switches the dispatch to the
+unchecked handlers (VM_FAST_CASE) or back to the checked ones , handlers without
+checks to drop are shared (VM_FAST_SAME). A checked jump that lands on a proven
+block switches to the unchecked handlers (VM_JUMPED) , a store into proven code
+verifies again from the next instruction (VM_CODE_WRITE) into the private CFG.
+VmVerify walks the whole reachable code , a program that keeps writing its code (a
+decryption loop , an input read into a proven block) would pay it at every write :
+after VM_VERIFY_REWRITES of them the run goes on with the checked handlers only.
+*/
+#ifdef VM_VERIFY
+#ifndef VM_VERIFY_REWRITES
+#define VM_VERIFY_REWRITES 16
+#endif
+#ifdef VM_THREADED_DISPATCH
+#define VM_FAST_CASE(op) fast_##op
+#define VM_FAST_SAME(op)
+#define VM_SET_FAST(on) (table = (on) ? fast_table : dispatch_table)
+#define VM_TABLE table
+/*a proven block only goes on to proven ones , the unchecked handlers don't look at table*/
+#define VM_FAST_NEXT goto *fast_table[(VM_PROFILE_STEP(),VM_TRACE_STEP(),AS->data[Regs->IP++])]
+#else
+#define VM_FAST_CASE(op) case 0x100 | op
+#define VM_FAST_SAME(op) case 0x100 | op :
+#define VM_SET_FAST(on) (fast = (on) ? 0x100 : 0)
+#define VM_FAST_NEXT VM_NEXT
+#endif
+/*
+The taken and the fall-through path of an unchecked jump have their own dispatch :
+a conditional move of IP would make the next fetch wait for the flags.
+*/
+#define VM_FAST_JUMP(cond) word_val = *(WORD*)&AS->data[Regs->IP]; \
+                           Regs->IP += 2; \
+                           if(VM_TAKEN(cond)) \
+                           { \
+                               Regs->IP = word_val; \
+                               VM_CHARGE(); \
+                               VM_FAST_NEXT; \
+                           } \
+                           VM_CHARGE(); \
+                           VM_FAST_NEXT
+#define VM_VERIFY_FROM_IP() if((Cfg = Private)) VmVerify(AS,Private,Regs->IP); VM_SET_FAST(Cfg && VM_IS_PROVEN(Cfg,Regs->IP))
+#define VM_VERIFY_START() if(!Shared) {VM_VERIFY_FROM_IP();} else VM_SET_FAST(VM_IS_PROVEN(Cfg,Regs->IP))
+#define VM_JUMPED() if(Cfg && VM_IS_PROVEN(Cfg,Regs->IP)) VM_SET_FAST(TRUE)
+#define VM_CODE_WRITE(offset) if(Cfg && VM_IS_PROVEN_CODE(Cfg,offset)) goto code_written
+#else
+#define VM_FAST_SAME(op)
+#define VM_VERIFY_START()
+#define VM_JUMPED()
+#define VM_CODE_WRITE(offset)
+#define VM_TABLE dispatch_table
+#endif
+/*
+Fuel : every jump (taken or not) ends a basic block and is charged one unit ,
+the VM stops with the registers ready to resume when none is left.
+Coverage (VM_COVERAGE) : when there is a Coverage map the jump also counts the
+edge from the block it ends to the block it goes to (the previous block is hashed
+into edge).
+*/
+#ifdef VM_COVERAGE
+#define VM_COVER() if(coverage) \
+                   { \
+                       coverage[(edge ^ Regs->IP) & (VM_COVERAGE_SIZE - 1)]++; \
+                       edge = (WORD)(Regs->IP * 0x9E37); \
+                   }
+#else
+#define VM_COVER()
+#endif
+#define VM_CHARGE() VM_COVER(); if(!--fuel) goto out_of_fuel
+#ifdef VM_THREADED_DISPATCH
+#define VM_NEXT goto *VM_TABLE[(VM_PROFILE_STEP(),VM_TRACE_STEP(),AS->data[Regs->IP++])]
+#else
+#define VM_NEXT break
+#endif
+/*
+The engine behind VmLoop , VmLoopVerified , VmLoopFuel and VmLoopCoverage. In
+VM_VERIFY builds the proven blocks run with the unchecked handlers : the program is
+verified into Private , or the read-only Shared CFG made from the same code is used
+until the code is written. Fuel is the number of blocks to run (NULL for no limit)
+and Coverage the edge map to count into (NULL for none). Returns VM_STOP_xxx.
+*/
+static int LoopEngine(PADDRESS_SPACE AS,PREGS Regs,PVM_CFG Private,const VM_CFG* Shared,uint64_t* Fuel,BYTE* Coverage)
 {
-    /*General Purpose Registers R0 -> R3*/
-    WORD GPRs[4];
-    union
+#ifdef VM_VERIFY
+    int i;
+#endif
+    int status = VM_STOP_EXIT;
+    uint64_t fuel = Fuel ? *Fuel : UINT64_MAX;
+#ifdef VM_COVERAGE
+    BYTE* coverage = Coverage;
+    WORD edge = 0;
+#endif
+    BYTE byte_val,byte_val2,byte_val3;
+    WORD word_val,word_val2;
+    VM_BULK_RESULT bulk;
+#ifdef VM_LAZY_FLAGS
+    BYTE flags_op;
+    WORD flags_a,flags_res;
+#endif
+#ifdef VM_PROFILE
+    PVM_PROFILE_COUNTERS profile = VmGetProfile();
+#endif
+#ifdef VM_TRACE
+    PVM_TRACER trace = VmGetTrace();
+    DWORD trace_offset = 0,trace_size = 0;
+#endif
+#ifdef VM_VERIFY
+    const VM_CFG* Cfg = Shared;
+    DWORD rewrites = 0;
+#endif
+#ifdef VM_THREADED_DISPATCH
+    /*Unknown opcodes land in the exception path*/
+    static const void* const dispatch_table[256] =
     {
-        unsigned char Flags;
-        struct
-        {
-            unsigned char ZF:1;
-            unsigned char CF:1;
-            unsigned char Unused:6;
-        };
+        [0 ... 255] = &&op_default,
+        [0x90] = &&op_0x90,
+        [0x10] = &&op_0x10, [0x12] = &&op_0x12, [0x14] = &&op_0x14, [0x16] = &&op_0x16,
+        [0x18] = &&op_0x18, [0x1c] = &&op_0x1c, [0x1f] = &&op_0x1f,
+        [0xE0] = &&op_0xE0, [0xE2] = &&op_0xE2, [0xE3] = &&op_0xE3, [0xE4] = &&op_0xE4,
+        [0xE6] = &&op_0xE6, [0xE8] = &&op_0xE8, [0xEC] = &&op_0xEC,
+        [0xAD] = &&op_0xAD, [0xA5] = &&op_0xA5, [0xA2] = &&op_0xA2,
+        [0x5B] = &&op_0x5B, [0x5C] = &&op_0x5C, [0x5D] = &&op_0x5D,
+        [0xF0] = &&op_0xF0, [0xF1] = &&op_0xF1, [0xA1] = &&op_0xA1, [0x51] = &&op_0x51,
+        [0x55] = &&op_0x55, [0x56] = &&op_0x56, [0x70] = &&op_0x70, [0x71] = &&op_0x71,
+        [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&op_0x63, [0x64] = &&op_0x64,
+        [0xAF] = &&op_0xAF, [0xAE] = &&op_0xAE,
+        [0xC0] = &&op_0xC0, [0xC2] = &&op_0xC2, [0x89] = &&op_0x89,
+        [0xED] = &&op_0xED
     };
-    WORD IP;
-    WORD SP;
-}REGS,*PREGS;
-void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
-{
-    int i;
+#ifdef VM_VERIFY
+    /*handlers of proven blocks*/
+    static const void* const fast_table[256] =
+    {
+        [0 ... 255] = &&op_default,
+        [0x90] = &&op_0x90,
+        [0x10] = &&fast_0x10, [0x12] = &&fast_0x12, [0x14] = &&fast_0x14, [0x16] = &&fast_0x16,
+        [0x18] = &&fast_0x18, [0x1c] = &&fast_0x1c, [0x1f] = &&fast_0x1f,
+        [0xE0] = &&fast_0xE0, [0xE2] = &&fast_0xE2, [0xE3] = &&fast_0xE3, [0xE4] = &&fast_0xE4,
+        [0xE6] = &&fast_0xE6, [0xE8] = &&fast_0xE8, [0xEC] = &&fast_0xEC,
+        [0xAD] = &&fast_0xAD, [0xA5] = &&fast_0xA5, [0xA2] = &&fast_0xA2,
+        [0x5B] = &&fast_0x5B, [0x5C] = &&fast_0x5C, [0x5D] = &&fast_0x5D,
+        [0xF0] = &&fast_0xF0, [0xF1] = &&fast_0xF1, [0xA1] = &&fast_0xA1, [0x51] = &&fast_0x51,
+        [0x55] = &&fast_0x55, [0x56] = &&fast_0x56, [0x70] = &&fast_0x70, [0x71] = &&fast_0x71,
+        [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&op_0x63, [0x64] = &&op_0x64,
+        [0xAF] = &&fast_0xAF, [0xAE] = &&fast_0xAE,
+        [0xC0] = &&op_0xC0, [0xC2] = &&op_0xC2, [0x89] = &&op_0x89,
+        [0xED] = &&op_0xED
+    };
+    const void* const* table = dispatch_table;
+#endif
+    VM_LOAD_FLAGS();
+    VM_VERIFY_START();
+    /*read byte (opcode) and jump to its handler, each handler does the same when it's done*/
+    //printf("[+] IP : %.4X => ",Regs->IP);
+    VM_NEXT;
+    {
+        {
+#else
     boolean exit = FALSE;
-    BYTE opcode,byte_val,byte_val2,byte_val3;
-    WORD word_val,word_val2;
+    BYTE opcode;
+#ifdef VM_VERIFY
+    WORD fast = 0;
+#endif
+    VM_LOAD_FLAGS();
+    VM_VERIFY_START();
     while(!exit)
     {
         /*read byte (opcode)*/
         //printf("[+] IP : %.4X => ",Regs->IP);
+        VM_PROFILE_STEP();
+        VM_TRACE_STEP();
         opcode = AS->data[Regs->IP++];
         /*opcodes switch*/
+#ifdef VM_VERIFY
+        switch(opcode | fast)
+#else
         switch(opcode)
+#endif
         {
-            case 0x90 :
+#endif
+            VM_CASE(0x90) :
+            VM_FAST_SAME(0x90)
                 //printf("NOP\n");
-                break;
+                VM_NEXT;
             /*
             Each nibble of the operand represents a General purpose register (GPR)
             the highest nibble is the destination , the lowest one is the source.
@@ -61,7 +225,7 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
             10 11 => MOV R1,R1
             10 01 => MOV R0,R1
             */
-            case 0x10 :
+            VM_CASE(0x10) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
@@ -70,58 +234,58 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 }
                 else
                     goto exception;
-                break;
+                VM_NEXT;
             /*
             Move and extend byte from memory to register
             Example:
             12 03 50 00 => MOVX R3,BYTE [0050]
             12 00 00 01 => MOVX R0,BYTE [0100]
             */
-            case 0x12 :
+            VM_CASE(0x12) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val >= sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 Regs->GPRs[byte_val] = 0;
                 *(BYTE*)&Regs->GPRs[byte_val] = AS->data[word_val];
                 //printf("MOVX R%d, BYTE [%.4X]\n",byte_val,word_val);
-                break;
+                VM_NEXT;
             /*
             Move word from memory to register
             14 03 50 00 => MOV R3,WORD [0050]
             14 00 00 01 => MOV R0,WORD [0100]
             */
-            case 0x14 :
+            VM_CASE(0x14) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val >= sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 Regs->GPRs[byte_val] = *(WORD*)&AS->data[word_val];
                 //printf("MOV R%d, WORD [%.4X]\n",byte_val,word_val);
-                break;
+                VM_NEXT;
             /*
             Move and extend byte to register
             16 01 15 => MOVX R1,15h
             */
-            case 0x16 :
+            VM_CASE(0x16) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 Regs->GPRs[byte_val] = 0;
                 *(BYTE*)&Regs->GPRs[byte_val] = AS->data[Regs->IP++];
                 //printf("MOVX R%d,%.2Xh\n",byte_val,AS->data[Regs->IP - 1]);
-                break;
+                VM_NEXT;
             /*
             Move word to register
             18 01 15 28 => MOV R1,2815h
             */
-            case 0x18 :
+            VM_CASE(0x18) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
@@ -129,134 +293,156 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 Regs->GPRs[byte_val] = *(WORD*)&AS->data[Regs->IP];
                 //printf("MOV R%d,%.4Xh\n",byte_val,*(WORD*)&AS->data[Regs->IP]);
                 Regs->IP += sizeof(WORD);
-                break;
+                VM_NEXT;
             /*
             Move byte from register to memory location
             ex :
             1C 01 20 01 => MOV BYTE [0120],R1
             1C 03 50 03 => MOV BYTE [0350],R3
             */
-            case 0x1c :
+            VM_CASE(0x1c) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val >= sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 AS->data[word_val] = *(BYTE*)&Regs->GPRs[byte_val];
+                VM_MARK_DIRTY(AS,word_val);
+                VM_TRACE_WRITE(word_val,1);
+                VM_CODE_WRITE(word_val);
                 //printf("MOV BYTE [%.4X],R%d\n",word_val,byte_val);
-                break;
+                VM_NEXT;
             /*
             Move word from register to memory location
             ex :
             1F 01 20 01 => MOV WORD [0120],R1
             1F 03 50 03 => MOV WORD [0350],R3
             */
-            case 0x1f :
+            VM_CASE(0x1f) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val >= sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 *(WORD*)&AS->data[word_val] = Regs->GPRs[byte_val];
+                VM_MARK_DIRTY(AS,word_val);
+                VM_MARK_DIRTY(AS,word_val + 1);
+                VM_TRACE_WRITE(word_val,2);
+                VM_CODE_WRITE(word_val);
+                VM_CODE_WRITE(word_val + 1);
                 //printf("MOV WORD [%.4X],R%d\n",word_val,byte_val);
-                break;
+                VM_NEXT;
             /*
                 Unconditional Jump
                 example :
                 E0 10 00 => JMP 0010
                 E0 54 02 => JMP 0254
             */
-            case 0xE0 :
+            VM_CASE(0xE0) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JMP %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*
                 JZ : Jump if equal
                 E2 54 01 =>JNZ 0154
             */
-            case 0xE2 :
+            VM_CASE(0xE2) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 /*Jump if ZF is set*/
-                if(Regs->ZF)
+                if(VM_TAKEN(VM_ZF))
                     Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JZ %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*
                 JNZ : Jump if not equal
                 E3 54 01 => JNZ 0154
             */
-            case 0xE3 :
+            VM_CASE(0xE3) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
-                if(! Regs->ZF)
+                if(VM_TAKEN(! VM_ZF))
                     Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JNZ %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*
                 JAE : Jump if above or equal
                 E4 54 01 : JAE 0154
             */
-            case 0xE4 :
+            VM_CASE(0xE4) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
-                if(Regs->ZF || ! Regs->CF)
+                if(VM_TAKEN(VM_ZF || ! VM_CF))
                     Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JAE %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*
                 JBE : Jump if below or equal
                 E6 54 01 : JBE 0154
             */
-            case 0xE6 :
+            VM_CASE(0xE6) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
-                if(Regs->ZF || Regs->CF)
+                if(VM_TAKEN(VM_ZF || VM_CF))
                     Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JBE %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*
                 JB : Jump if below
                     E8 54 01 : JB 0154
             */
-            case 0xE8 :
+            VM_CASE(0xE8) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
-                if(Regs->CF && ! Regs->ZF)
+                if(VM_TAKEN(VM_CF && ! VM_ZF))
                     Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JB %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*
                 JA : Jump if above
                 EC 54 01 => JA 0154
             */
-            case 0xEC :
+            VM_CASE(0xEC) :
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
-                if( ! Regs->CF && ! Regs->ZF)
+                if(VM_TAKEN(! VM_CF && ! VM_ZF))
                     Regs->IP = word_val;
+                VM_JUMPED();
+                VM_CHARGE();
                 //printf("JA %.4X\n",word_val);
-                break;
+                VM_NEXT;
             /*=======================================================*/
             /*ARITHMETIC OPERATIONS ON THE WHOLE REGISTER (WORD)*/
             /*
@@ -267,71 +453,50 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 Updated flags :
                 ZF and CF
             */
-            case 0xAD :
+            VM_CASE(0xAD) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
                 word_val2 = Regs->GPRs[byte_val] + word_val;
-                if(word_val2 == 0)
-                    Regs->ZF = 1;
-                else
-                    Regs->ZF = 0;
-                if(word_val2 < Regs->GPRs[byte_val])
-                    Regs->CF = 1;
-                else
-                    Regs->CF = 0;
+                VM_FLAGS_ADD(Regs->GPRs[byte_val],word_val2);
                 Regs->GPRs[byte_val] = word_val2;
                 //printf("ADD R%d,%.4X\n",byte_val,word_val);
-                break;
+                VM_NEXT;
             /*
                 ADD : Add 2 registers
                 A5 12  : ADD R1,R2
                 A5 30  : ADD R3,R0
             */
-            case 0xA5 :
+            VM_CASE(0xA5) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
                     word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
                     word_val2 = Regs->GPRs[(byte_val & 0xF0)>>4] += Regs->GPRs[byte_val & 0x0F];
-                    if(word_val2 == 0)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    if(word_val2 < word_val)
-                        Regs->CF = 1;
-                    else
-                        Regs->CF = 0;
+                    VM_FLAGS_ADD(word_val,word_val2);
                 }
                 else
                     goto exception;
                 //printf("ADD R%d,R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
                 ADDL : Add 2 registers (low byte)
                     A2 12 => ADDL R1,R2
             */
-            case 0xA2 :
+            VM_CASE(0xA2) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
                     byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4];
                     byte_val3 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] += *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
-                    if(byte_val3 == 0)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    if(byte_val3 < byte_val2)
-                        Regs->CF = 1;
-                    else
-                        Regs->CF = 0;
+                    VM_FLAGS_ADD(byte_val2,byte_val3);
                 }
                 else
                     goto exception;
                 //printf("ADDL R%d,R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
                 SUB : substract value from register
                 5B 01 15 00 : SUB R1,15h
@@ -340,91 +505,66 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 Updated flags :
                 ZF and CF
             */
-            case 0x5B :
+            VM_CASE(0x5B) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 word_val = *(WORD*)&AS->data[Regs->IP];
                 Regs->IP += 2;
                 word_val2 = Regs->GPRs[byte_val] - word_val;
-                if(word_val2 == 0)
-                    Regs->ZF = 1;
-                else
-                    Regs->ZF = 0;
-                if(word_val2 > Regs->GPRs[byte_val])
-                    Regs->CF = 1;
-                else
-                    Regs->CF = 0;
+                VM_FLAGS_SUB(Regs->GPRs[byte_val],word_val2);
                 Regs->GPRs[byte_val] = word_val2;
                 //printf("SUB R%d,%.4X\n",byte_val,word_val);
-                break;
+                VM_NEXT;
             /*
             SUB : substract registers (word)
                 5C 01 => SUB R0,R1
             */
-            case 0x5C :
+            VM_CASE(0x5C) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
                     word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
                     word_val2 = Regs->GPRs[(byte_val & 0xF0)>>4] -= Regs->GPRs[byte_val & 0x0F];
-                    if(word_val2 == 0)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    if(word_val2 > word_val)
-                        Regs->CF = 1;
-                    else
-                        Regs->CF = 0;
+                    VM_FLAGS_SUB(word_val,word_val2);
                 }
                 else
                     goto exception;
                 //printf("SUB R%d,R%d",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
                 SUBL : Substract 2 registers (low part)
                     5D 12 => SUBL R1,R2
             */
-            case 0x5D :
+            VM_CASE(0x5D) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
                     byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4];
                     byte_val3 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] -= *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
-                    if(byte_val3 == 0)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    if(byte_val3 > byte_val2)
-                        Regs->CF = 1;
-                    else
-                        Regs->CF = 0;
+                    VM_FLAGS_SUB(byte_val2,byte_val3);
                 }
                 else
                     goto exception;
                 //printf("SUBL R%d,R%d",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
                 XOR : Xor 2 registers
                 (operand uses nibbles : high = dest , low = source)
                 F0 12 => XOR R1,R2
                 F0 01 => XOR R0,R1
             */
-            case 0xF0 :
+            VM_CASE(0xF0) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
                     word_val = Regs->GPRs[(byte_val & 0xF0)>>4] ^= Regs->GPRs[byte_val & 0x0F];
-                    if(word_val == 0)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    Regs->CF = 0;
+                    VM_FLAGS_LOGIC(word_val);
                 }
                 else
                     goto exception;
                 //printf("XOR R%d,R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*===============================================================*/
             /*ARITHMETIC OPERATIONS ON THE LOWER BYTE OF THE REGISTER*/
             /*
@@ -432,83 +572,70 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 F1 12  : XORL R1,R2
                 F1 01 :  XORL R0,R1
             */
-            case 0xF1 :
+            VM_CASE(0xF1) :
                 byte_val = AS->data[Regs->IP++];
                 if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3)
                 {
                     byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] ^= *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
-                    if(byte_val2 == 0)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    Regs->CF = 0;
+                    VM_FLAGS_LOGIC(byte_val2);
                 }
                 else
                     goto exception;
                 //printf("XORL R%d,R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
                 ADDL : add only to the lower of the register
                 A1 03 20 => ADDL R3,20h
             */
-            case 0xA1:
+            VM_CASE(0xA1) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 byte_val2 = AS->data[Regs->IP++];
                 byte_val3 = *(BYTE*)&Regs->GPRs[byte_val] + byte_val2;
-                if(byte_val3 == 0)
-                    Regs->ZF = 1;
-                else
-                    Regs->ZF = 0;
-                if(byte_val3 < *(BYTE*)&Regs->GPRs[byte_val])
-                    Regs->CF = 1;
-                else
-                    Regs->CF = 0;
+                VM_FLAGS_ADD(*(BYTE*)&Regs->GPRs[byte_val],byte_val3);
                 *(BYTE*)&Regs->GPRs[byte_val] = byte_val3;
                 //printf("ADDL R%d,%.2X\n",byte_val,byte_val2);
-                break;
+                VM_NEXT;
             /*
                 SUBL : Substract only from the lower byte of the register
                 51 03 20 => SUBL R3,20h
             */
-            case 0x51:
+            VM_CASE(0x51) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
                 byte_val2 = AS->data[Regs->IP++];
                 byte_val3 = *(BYTE*)&Regs->GPRs[byte_val] - byte_val2;
-                if(byte_val3 == 0)
-                    Regs->ZF = 1;
-                else
-                    Regs->ZF = 0;
-                if(byte_val3 > *(BYTE*)&Regs->GPRs[byte_val])
-                    Regs->CF = 1;
-                else
-                    Regs->CF = 0;
+                VM_FLAGS_SUB(*(BYTE*)&Regs->GPRs[byte_val],byte_val3);
                 *(BYTE*)&Regs->GPRs[byte_val] = byte_val3;
                 //printf("SUBL R%d,%.2X\n",byte_val,byte_val2);
-                break;
+                VM_NEXT;
             /*===============================================================*/
             /*
             Store register (low byte) at [Rx].
             55 21 => MOV BYTE [R2],R1
             */
-            case 0x55 :
+            VM_CASE(0x55) :
                 byte_val = AS->data[Regs->IP++];
-                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && Regs->GPRs[(byte_val & 0xF0)>>4] < sizeof(AS->data))
+                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && !VM_OUT_OF_DATA(Regs->GPRs[(byte_val & 0xF0)>>4]))
+                {
                     AS->data[Regs->GPRs[(byte_val & 0xF0)>>4]] = *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                    VM_MARK_DIRTY(AS,Regs->GPRs[(byte_val & 0xF0)>>4]);
+                    VM_TRACE_WRITE(Regs->GPRs[(byte_val & 0xF0)>>4],1);
+                    VM_CODE_WRITE(Regs->GPRs[(byte_val & 0xF0)>>4]);
+                }
                 else
                     goto exception;
                 //printf("MOV BYTE [R%d],R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
             Load and extend low byte of register from memory pointed by a register
             56 21 => MOV R2,BYTE [R1]
             */
-            case 0x56 :
+            VM_CASE(0x56) :
                 byte_val = AS->data[Regs->IP++];
-                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && Regs->GPRs[(byte_val & 0x0F)] < sizeof(AS->data))
+                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && !VM_OUT_OF_DATA(Regs->GPRs[(byte_val & 0x0F)]))
                 {
                     *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4] = AS->data[Regs->GPRs[byte_val & 0x0F]];
                     Regs->GPRs[(byte_val & 0xF0)>>4] &= 0xFF;
@@ -516,58 +643,92 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 else
                     goto exception;
                 //printf("MOVX R%d, BYTE [R%d]\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
+            /*
+            Bulk memory (see Bulk.c) , the registers of the ranges are in the nibbles of 2
+            operand bytes , the whole range is checked before anything is done :
+            60 12 30 => MEMCPY [R1],[R2],R3     copy R3 bytes (overlapping ranges like memmove)
+            61 12 30 => MEMSET [R1],R2,R3       set R3 bytes to the low byte of R2
+            62 12 30 => MEMCMP [R1],[R2],R3     ZF : equal , CF : [R1] is below at the first byte that differs
+            64 12 30 => XORKEY [R1],[R2],R3,R0  XOR R3 bytes with the key of R0 bytes at [R2] , repeated
+            The ones that write set ZF when R3 is 0 and clear CF. The low nibble of the
+            second operand is only used by XORKEY.
+            */
+            VM_CASE(0x60) :
+            VM_CASE(0x61) :
+            VM_CASE(0x62) :
+            VM_CASE(0x64) :
+            VM_FAST_SAME(0x60)
+            VM_FAST_SAME(0x61)
+            VM_FAST_SAME(0x62)
+            VM_FAST_SAME(0x64)
+                byte_val3 = AS->data[Regs->IP - 1];
+                byte_val = AS->data[Regs->IP++];
+                byte_val2 = AS->data[Regs->IP++];
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3 || (byte_val2 & 0xF0) > 0x30 || (byte_val2 & 0x0F) > 3)
+                    goto exception;
+                word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
+                if(!VmBulk(AS,byte_val3,word_val,Regs->GPRs[byte_val & 0x0F],Regs->GPRs[(byte_val2 & 0xF0)>>4],Regs->GPRs[byte_val2 & 0x0F],&bulk))
+                    goto exception;
+                VM_FLAGS_SET(bulk.ZF,bulk.CF);
+                VM_TRACE_WRITE(word_val,bulk.WriteSize);
+#ifdef VM_VERIFY
+                for(i = word_val;i < word_val + bulk.WriteSize;i++)
+                    VM_CODE_WRITE(i);
+#endif
+                VM_NEXT;
+            /*
+            Length of the string at [Rs] into Rd , ZF : empty , CF : no terminating 0
+            before the end of data (the length goes to the end of data).
+            63 12 => STRLEN R1,[R2]
+            */
+            VM_CASE(0x63) :
+            VM_FAST_SAME(0x63)
+                byte_val = AS->data[Regs->IP++];
+                if((byte_val & 0xF0) > 0x30 || (byte_val & 0x0F) > 3)
+                    goto exception;
+                if(!VmBulk(AS,0x63,0,Regs->GPRs[byte_val & 0x0F],0,0,&bulk))
+                    goto exception;
+                Regs->GPRs[(byte_val & 0xF0)>>4] = bulk.Length;
+                VM_FLAGS_SET(bulk.ZF,bulk.CF);
+                VM_NEXT;
             /*
             CMP : Compare 2 registers (word)
                 70 12 : CMP R1,R2
             */
-            case 0x70 :
+            VM_CASE(0x70) :
                 byte_val = AS->data[Regs->IP++];
-                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && Regs->GPRs[(byte_val & 0x0F)] < sizeof(AS->data))
+                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && !VM_OUT_OF_DATA(Regs->GPRs[(byte_val & 0x0F)]))
                 {
                     word_val = Regs->GPRs[(byte_val & 0xF0)>>4];
                     word_val2 =  Regs->GPRs[byte_val & 0x0F];
-                    if(word_val2 == word_val)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    if(word_val2 > word_val)
-                        Regs->CF = 1;
-                    else
-                        Regs->CF = 0;
+                    VM_FLAGS_SUB(word_val,(WORD)(word_val - word_val2));
                 }
                 else
                     goto exception;
                 //printf("CMP R%d,R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
                 CMPL : Compare 2 registers (lower byte)
                 71 12 : CMPL R1,R2
             */
-            case 0x71 :
+            VM_CASE(0x71) :
                 byte_val = AS->data[Regs->IP++];
-                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && Regs->GPRs[(byte_val & 0x0F)] < sizeof(AS->data))
+                if((byte_val & 0xF0) <= 0x30 && (byte_val & 0x0F) <= 3 && !VM_OUT_OF_DATA(Regs->GPRs[(byte_val & 0x0F)]))
                 {
                     byte_val2 = *(BYTE*)&Regs->GPRs[(byte_val & 0xF0)>>4];
                     byte_val3 =  *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
-                    if(byte_val3 == byte_val2)
-                        Regs->ZF = 1;
-                    else
-                        Regs->ZF = 0;
-                    if(byte_val3 > byte_val2)
-                        Regs->CF = 1;
-                    else
-                        Regs->CF = 0;
+                    VM_FLAGS_SUB(byte_val2,(BYTE)(byte_val2 - byte_val3));
                 }
                 else
                     goto exception;
                 //printf("CMP R%d,R%d\n",(byte_val & 0xF0)>>4,byte_val & 0x0F);
-                break;
+                VM_NEXT;
             /*
             Push register
             example : AF 01 => PUSH R1
             */
-            case 0xAF :
+            VM_CASE(0xAF) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
@@ -578,13 +739,15 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                     goto exception;
                 /*Push value */
                 AS->stack[Regs->SP] = Regs->GPRs[byte_val];
+                VM_MARK_STACK_DIRTY(AS,Regs->SP);
+                VM_TRACE_WRITE(VM_DATA_SIZE + Regs->SP * 2,2);
                 //printf("PUSH R%d\n",byte_val);
-                break;
+                VM_NEXT;
             /*
             Pop a register
             AE 01 => POP R1
             */
-            case 0xAE :
+            VM_CASE(0xAE) :
                 byte_val = AS->data[Regs->IP++];
                 if(byte_val > 3)
                     goto exception;
@@ -598,54 +761,70 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 /*Value popped , increment SP*/
                 Regs->SP++;
                 //printf("POP R%d\n",byte_val);
-                break;
+                VM_NEXT;
             /*========================================================*/
             /*User interaction operations (print and receive input)*/
             /*
             Print Word to user as integer, the value must be at the top of the stack and it is popped
             C0 => print integer
             */
-            case 0xC0 :
+            VM_CASE(0xC0) :
+            VM_FAST_SAME(0xC0)
                 /*read value then pop it*/
                 if(&AS->stack[Regs->SP] == &AS->stack[sizeof(AS->stack)/sizeof(WORD)])
                     goto exception;
                 word_val = AS->stack[Regs->SP++];
                 //printf("Print integer\n");
-                printf("%u\n",word_val);
-                break;
+                VmPrintInteger(word_val);
+                VM_NEXT;
             /*
             Print string to user, the pointer must be at the top of the stack and it is popped
             C2 => print string
             */
-            case 0xC2 :
+            VM_CASE(0xC2) :
+            VM_FAST_SAME(0xC2)
                 if(&AS->stack[Regs->SP] == &AS->stack[sizeof(AS->stack)/sizeof(WORD)])
                     goto exception;
                 /*read it and pop it*/
                 word_val = AS->stack[Regs->SP++];
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 //printf("Print string\n");
-                printf("%s",&AS->data[word_val]);
-                break;
+                VmPrintString((char*)&AS->data[word_val]);
+                VM_NEXT;
             /*
             Scan string from user, the pointer where to store the integer must be on top of the stack
             89
             */
-            case 0x89 :
+            VM_CASE(0x89) :
+            VM_FAST_SAME(0x89)
+                /*no complete line yet : stop at the 89 , it runs again when the VM is resumed*/
+                if(!VmInputReady(NULL))
+                {
+                    Regs->IP--;
+                    goto input_wait;
+                }
                 if(&AS->stack[Regs->SP] == &AS->stack[sizeof(AS->stack)/sizeof(WORD)])
                     goto exception;
                 /*read it and pop it*/
                 word_val = AS->stack[Regs->SP++];
-                if(word_val > sizeof(AS->data))
+                if(VM_OUT_OF_DATA(word_val))
                     goto exception;
                 //printf("Scan string\n");
                 //printf("    [+] Input : ");
-                gets((char*)&AS->data[word_val]);
-                break;
+                VmScanString((char*)&AS->data[word_val],VM_DATA_SIZE - word_val);
+                VmMarkDirty(AS,word_val,strlen((char*)&AS->data[word_val]) + 1);
+                VM_TRACE_WRITE(word_val,strlen((char*)&AS->data[word_val]) + 1);
+#ifdef VM_VERIFY
+                for(i = word_val;i <= word_val + strlen((char*)&AS->data[word_val]) && i < VM_DATA_SIZE;i++)
+                    VM_CODE_WRITE(i);
+#endif
+                VM_NEXT;
             /*=======================================================*/
             /*0xDB Debugging Only*/
             /*
             case 0xDB :
+                VM_STORE_FLAGS();
                 printf("\n===Debug Information Start===\n");
                 printf("+ Registers :\n");
                 for(i=0;i<=3;i++)
@@ -672,53 +851,392 @@ void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
                 break;
                 */
             /*======================================================*/
-            case 0xED :
+#ifdef VM_VERIFY
+            /*
+            Unchecked handlers , only dispatched in proven blocks : the registers ,
+            the memory operands and the jump targets were checked by VmVerify.
+            */
+            VM_FAST_CASE(0x10) :
+                byte_val = AS->data[Regs->IP++];
+                Regs->GPRs[byte_val >> 4] = Regs->GPRs[byte_val & 0x0F];
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x12) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                Regs->GPRs[byte_val] = AS->data[word_val];
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x14) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                Regs->GPRs[byte_val] = *(WORD*)&AS->data[word_val];
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x16) :
+                byte_val = AS->data[Regs->IP++];
+                Regs->GPRs[byte_val] = AS->data[Regs->IP++];
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x18) :
+                byte_val = AS->data[Regs->IP++];
+                Regs->GPRs[byte_val] = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x1c) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                AS->data[word_val] = *(BYTE*)&Regs->GPRs[byte_val];
+                VM_MARK_DIRTY(AS,word_val);
+                VM_TRACE_WRITE(word_val,1);
+                VM_CODE_WRITE(word_val);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x1f) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                *(WORD*)&AS->data[word_val] = Regs->GPRs[byte_val];
+                VM_MARK_DIRTY(AS,word_val);
+                VM_MARK_DIRTY(AS,word_val + 1);
+                VM_TRACE_WRITE(word_val,2);
+                VM_CODE_WRITE(word_val);
+                VM_CODE_WRITE(word_val + 1);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xE0) :
+                Regs->IP = *(WORD*)&AS->data[Regs->IP];
+                VM_CHARGE();
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xE2) :
+                VM_FAST_JUMP(VM_ZF);
+            VM_FAST_CASE(0xE3) :
+                VM_FAST_JUMP(! VM_ZF);
+            VM_FAST_CASE(0xE4) :
+                VM_FAST_JUMP(VM_ZF || ! VM_CF);
+            VM_FAST_CASE(0xE6) :
+                VM_FAST_JUMP(VM_ZF || VM_CF);
+            VM_FAST_CASE(0xE8) :
+                VM_FAST_JUMP(VM_CF && ! VM_ZF);
+            VM_FAST_CASE(0xEC) :
+                VM_FAST_JUMP(! VM_CF && ! VM_ZF);
+            VM_FAST_CASE(0xAD) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                word_val2 = Regs->GPRs[byte_val] + word_val;
+                VM_FLAGS_ADD(Regs->GPRs[byte_val],word_val2);
+                Regs->GPRs[byte_val] = word_val2;
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xA5) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = Regs->GPRs[byte_val >> 4];
+                word_val2 = Regs->GPRs[byte_val >> 4] += Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_ADD(word_val,word_val2);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xA2) :
+                byte_val = AS->data[Regs->IP++];
+                byte_val2 = *(BYTE*)&Regs->GPRs[byte_val >> 4];
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val >> 4] += *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_ADD(byte_val2,byte_val3);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x5B) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = *(WORD*)&AS->data[Regs->IP];
+                Regs->IP += 2;
+                word_val2 = Regs->GPRs[byte_val] - word_val;
+                VM_FLAGS_SUB(Regs->GPRs[byte_val],word_val2);
+                Regs->GPRs[byte_val] = word_val2;
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x5C) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = Regs->GPRs[byte_val >> 4];
+                word_val2 = Regs->GPRs[byte_val >> 4] -= Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(word_val,word_val2);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x5D) :
+                byte_val = AS->data[Regs->IP++];
+                byte_val2 = *(BYTE*)&Regs->GPRs[byte_val >> 4];
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val >> 4] -= *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(byte_val2,byte_val3);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xF0) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = Regs->GPRs[byte_val >> 4] ^= Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_LOGIC(word_val);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xF1) :
+                byte_val = AS->data[Regs->IP++];
+                byte_val2 = *(BYTE*)&Regs->GPRs[byte_val >> 4] ^= *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_LOGIC(byte_val2);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xA1) :
+                byte_val = AS->data[Regs->IP++];
+                byte_val2 = AS->data[Regs->IP++];
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val] + byte_val2;
+                VM_FLAGS_ADD(*(BYTE*)&Regs->GPRs[byte_val],byte_val3);
+                *(BYTE*)&Regs->GPRs[byte_val] = byte_val3;
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x51) :
+                byte_val = AS->data[Regs->IP++];
+                byte_val2 = AS->data[Regs->IP++];
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val] - byte_val2;
+                VM_FLAGS_SUB(*(BYTE*)&Regs->GPRs[byte_val],byte_val3);
+                *(BYTE*)&Regs->GPRs[byte_val] = byte_val3;
+                VM_FAST_NEXT;
+            /*the pointer in the register is still checked*/
+            VM_FAST_CASE(0x55) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = Regs->GPRs[byte_val >> 4];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                AS->data[word_val] = *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_MARK_DIRTY(AS,word_val);
+                VM_TRACE_WRITE(word_val,1);
+                VM_CODE_WRITE(word_val);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x56) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = Regs->GPRs[byte_val & 0x0F];
+                if(VM_OUT_OF_DATA(word_val))
+                    goto exception;
+                Regs->GPRs[byte_val >> 4] = AS->data[word_val];
+                VM_FAST_NEXT;
+            /*CMP and CMPL keep the runtime check of the source value done by the checked handlers*/
+            VM_FAST_CASE(0x70) :
+                byte_val = AS->data[Regs->IP++];
+                word_val = Regs->GPRs[byte_val >> 4];
+                word_val2 = Regs->GPRs[byte_val & 0x0F];
+                if(VM_OUT_OF_DATA(word_val2))
+                    goto exception;
+                VM_FLAGS_SUB(word_val,(WORD)(word_val - word_val2));
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0x71) :
+                byte_val = AS->data[Regs->IP++];
+                if(VM_OUT_OF_DATA(Regs->GPRs[byte_val & 0x0F]))
+                    goto exception;
+                byte_val2 = *(BYTE*)&Regs->GPRs[byte_val >> 4];
+                byte_val3 = *(BYTE*)&Regs->GPRs[byte_val & 0x0F];
+                VM_FLAGS_SUB(byte_val2,(BYTE)(byte_val2 - byte_val3));
+                VM_FAST_NEXT;
+            /*the stack bounds are still checked*/
+            VM_FAST_CASE(0xAF) :
+                byte_val = AS->data[Regs->IP++];
+                if(--Regs->SP == 0xFFFF)
+                    goto exception;
+                AS->stack[Regs->SP] = Regs->GPRs[byte_val];
+                VM_MARK_STACK_DIRTY(AS,Regs->SP);
+                VM_TRACE_WRITE(VM_DATA_SIZE + Regs->SP * 2,2);
+                VM_FAST_NEXT;
+            VM_FAST_CASE(0xAE) :
+                byte_val = AS->data[Regs->IP++];
+                if(Regs->SP == VM_STACK_SIZE)
+                    goto exception;
+                Regs->GPRs[byte_val] = AS->stack[Regs->SP++];
+                VM_FAST_NEXT;
+            code_written:
+                if(++rewrites > VM_VERIFY_REWRITES)
+                {
+                    Cfg = NULL;
+                    VM_SET_FAST(FALSE);
+                }
+                else
+                    VM_VERIFY_FROM_IP();
+                VM_NEXT;
+#endif
+            VM_CASE(0xED) :
+            VM_FAST_SAME(0xED)
                 //printf("Exit\n");
-                exit = TRUE;
-                break;
-            default :
+                VM_EXIT;
+            VM_DEFAULT :
                 exception:
                 //printf("\n==Exception : ...Exiting==\n");
-                exit = TRUE;
+                status = VM_STOP_EXCEPTION;
+                VM_EXIT;
+            out_of_fuel:
+                status = VM_STOP_FUEL;
+                VM_EXIT;
+            input_wait:
+                status = VM_STOP_INPUT;
+                VM_EXIT;
         }
     }
+#ifdef VM_THREADED_DISPATCH
+vm_exit:
+#endif
+    VM_TRACE_END();
+    VM_STORE_FLAGS();
+    if(Fuel)
+        *Fuel = fuel;
+    return status;
+}
+void VmLoop(PADDRESS_SPACE AS,PREGS Regs)
+{
+    LoopEngine(AS,Regs,NULL,NULL,NULL,NULL);
 }
-int main()
+/*without VM_VERIFY there are no unchecked handlers and the CFGs are not used*/
+void VmLoopVerified(PADDRESS_SPACE AS,PREGS Regs,PVM_CFG Cfg)
 {
-    PADDRESS_SPACE AS;
-    PREGS Regs;
-    int size;
-    FILE* File;
-    //printf("DEBUG INFO :");
-    //printf("Allocating Address Space\n");
-    AS = (PADDRESS_SPACE) malloc(sizeof(ADDRESS_SPACE));
-    //printf("Allocating Registers\n");
-    Regs = (PREGS) malloc(sizeof(REGS));
-    //printf("Initializing Registers\n");
+    LoopEngine(AS,Regs,Cfg,NULL,NULL,NULL);
+}
+/*Shared is a CFG made from the same code (VmImageCfg) , Cfg is used once the code is written*/
+void VmLoopVerifiedShared(PADDRESS_SPACE AS,PREGS Regs,PVM_CFG Cfg,const VM_CFG* Shared)
+{
+    LoopEngine(AS,Regs,Cfg,Shared,NULL,NULL);
+}
+/*
+Run at most *Fuel basic blocks , *Fuel is left with what wasn't used. Returns
+VM_STOP_FUEL when it ran out (calling again resumes the program) , VM_STOP_INPUT
+when it stopped at a 89 with no line to read yet (see VmInputReady , resumed the
+same way) , VM_STOP_EXIT or VM_STOP_EXCEPTION when the program stopped.
+*/
+int VmLoopFuel(PADDRESS_SPACE AS,PREGS Regs,uint64_t* Fuel)
+{
+    if(!*Fuel)
+        return VM_STOP_FUEL;
+    return LoopEngine(AS,Regs,NULL,NULL,Fuel,NULL);
+}
+/*
+VmLoopFuel that also counts every edge it takes in Coverage (VM_COVERAGE_SIZE
+counters , they wrap at 256) , in VM_COVERAGE builds. Fuel can be NULL.
+*/
+int VmLoopCoverage(PADDRESS_SPACE AS,PREGS Regs,BYTE* Coverage,uint64_t* Fuel)
+{
+    if(Fuel && !*Fuel)
+        return VM_STOP_FUEL;
+    return LoopEngine(AS,Regs,NULL,NULL,Fuel,Coverage);
+}
+PVM_CONTEXT VmCreateContext(void)
+{
+    PVM_CONTEXT Context;
+#ifdef _WIN32
+    Context = (PVM_CONTEXT) _aligned_malloc(sizeof(VM_CONTEXT),64);
+#else
+    if(posix_memalign((void**)&Context,64,sizeof(VM_CONTEXT)))
+        Context = NULL;
+#endif
+    if(!Context)
+        return NULL;
+    memset(Context,0,sizeof(VM_CONTEXT));
+    VmResetRegs(&Context->Regs);
+    return Context;
+}
+void VmDestroyContext(PVM_CONTEXT Context)
+{
+#ifdef VM_JIT
+    VmJitRelease(&Context->Jit);
+#endif
+#ifdef _WIN32
+    _aligned_free(Context);
+#else
+    free(Context);
+#endif
+}
+void VmResetRegs(PREGS Regs)
+{
+    memset(Regs->GPRs,0,sizeof(Regs->GPRs));
     Regs->IP = 0;
-    Regs->SP = sizeof(AS->stack) / sizeof(WORD);
+    Regs->SP = VM_STACK_SIZE;
     Regs->Flags = 0;
-    /*Open code and data file and read it into */
-    File = fopen("vm_file","rb");
-    if(!File)
+}
+/*Run the context with the engine selected at build time*/
+void VmRunContext(PVM_CONTEXT Context)
+{
+#if defined(VM_PROFILE) || defined(VM_TRACE)
+    VmLoop(&Context->AS,&Context->Regs);
+#elif defined(VM_JIT)
+    VmLoopJit(&Context->AS,&Context->Regs,&Context->Jit);
+#elif defined(VM_PREDECODE)
+    VmLoopDecodedShared(&Context->AS,&Context->Regs,&Context->Program,
+                        Context->Image ? VmImageDecoded(Context->Image,&Context->AS) : NULL);
+#elif defined(VM_VERIFY)
+    VmLoopVerifiedShared(&Context->AS,&Context->Regs,&Context->Cfg,
+                         Context->Image ? VmImageCfg(Context->Image,&Context->AS) : NULL);
+#else
+    VmLoop(&Context->AS,&Context->Regs);
+#endif
+}
+/*
+vm [program]                 : run program (vm_file by default)
+vm -batch manifest [threads] : run the jobs of a manifest (see Batch.c)
+vm -lockstep inputs          : run vm_file once per line of inputs (see Lockstep.c)
+vm -green manifest [quantum] : run the jobs of a manifest as green threads on one thread (see Sched.c)
+vm -aot program library      : translate program to C and build it into the shared object library (see Aot.c)
+vm -native library [program] : run program (vm_file by default) on a library made by -aot
+vm -explore program [threads] [seconds] [corpus] : look for inputs that reach new code (see Explore.c)
+vm -optimize program output  : write an optimized equivalent of program to output (see Optimize.c)
+vm -checkpoint file [seconds] [program] : run program with a checkpoint in file every seconds , or resume it (see Checkpoint.c)
+vm -serve socket [program] [quantum] : run program for every connection to a Unix socket , all on one thread (see Event.c)
+vm -paged program             : run a program of any size in a sparse paged address space (see Paged.c)
+*/
+#ifndef VM_NO_MAIN
+int main(int argc,char** argv)
+{
+    PVM_CONTEXT Context;
+#ifdef VM_TRACE
+    PVM_TRACER Trace;
+#endif
+    PVM_IMAGE Image;
+#ifdef VM_PROFILE
+    FILE* File;
+#endif
+    if(argc >= 3 && !strcmp(argv[1],"-batch"))
+        return VmBatchMain(argv[2],argc >= 4 ? atoi(argv[3]) : 0);
+    if(argc >= 3 && !strcmp(argv[1],"-lockstep"))
+        return VmLockstepMain(argv[2]);
+    if(argc >= 3 && !strcmp(argv[1],"-green"))
+        return VmGreenMain(argv[2],argc >= 4 ? atoi(argv[3]) : 0);
+    if(argc >= 4 && !strcmp(argv[1],"-aot"))
+        return VmAotMain(argv[2],argv[3]);
+    if(argc >= 3 && !strcmp(argv[1],"-explore"))
+        return VmExploreMain(argv[2],argc >= 4 ? atoi(argv[3]) : 0,argc >= 5 ? atoi(argv[4]) : 0,argc >= 6 ? argv[5] : NULL);
+    if(argc >= 4 && !strcmp(argv[1],"-optimize"))
+        return VmOptimizeMain(argv[2],argv[3]);
+    if(argc >= 3 && !strcmp(argv[1],"-checkpoint"))
+        return VmCheckpointMain(argv[2],argc >= 4 ? atoi(argv[3]) : 0,argc >= 5 ? argv[4] : "vm_file");
+    if(argc >= 3 && !strcmp(argv[1],"-paged"))
+        return VmPagedMain(argv[2]);
+    if(argc >= 3 && !strcmp(argv[1],"-serve"))
+        return VmServeMain(argv[2],argc >= 4 ? argv[3] : "vm_file",argc >= 5 ? atoi(argv[4]) : 0);
+    if(argc >= 3 && !strcmp(argv[1],"-native"))
+        return VmNativeMain(argv[2],argc >= 4 ? argv[3] : "vm_file");
+    //printf("DEBUG INFO :");
+    //printf("Allocating Address Space and Registers\n");
+    Context = VmCreateContext();
+    /*Map the code and data file (at most the size of data) and copy it into the VM address space*/
+    Image = VmImageOpen(argc >= 2 ? argv[1] : "vm_file");
+    if(!Image)
     {
-        printf("Found trouble opening the file");
+        printf("Found trouble opening the file (or it is larger than the storage available for data and code)");
         return 0;
     }
-    /*Check the file size*/
-    fseek(File,0,SEEK_END);
-    size = ftell(File);
-    if( size > sizeof(AS->data))
+    VmImageLoad(Image,Context);
+    //printf("Starting Execution\n");
+#ifdef VM_TRACE
+    Trace = VmTraceOpen("vm_trace.bin",0);
+    if(Trace)
     {
-        printf("File size is larger than the storage available for data and code");
-        return 0;
+        VmTraceStart(Trace,&Context->AS,&Context->Regs);
+        VmSetTrace(Trace);
     }
-    rewind(File);
-    /*Copy the file to our VM address space*/
-    fread(AS->data,1,size,File);
-    fclose(File);
-    //printf("Starting Execution\n");
-    VmLoop(AS,Regs);
-    _getch();
+#endif
+    VmRunContext(Context);
+    VmFlushIo(NULL);
+    Context->Image = NULL;
+    VmImageRelease(Image);
+#ifdef VM_TRACE
+    if(Trace)
+        VmTraceClose(Trace);
+#endif
+#ifdef VM_PROFILE
+    VmProfileReport(VmGetProfile(),&Context->AS,stderr,20);
+    File = fopen("vm_profile.folded","w");
+    if(File)
+    {
+        VmProfileFolded(VmGetProfile(),&Context->AS,File);
+        fclose(File);
+    }
+#endif
+#if defined(VM_PREDECODE) && !defined(VM_JIT) && defined(VM_FUSION_STATS)
+    VmFusionReport(&Context->Program);
+#endif
     return 0;
 }
+#endif
@@ -0,0 +1,649 @@
+/*
+VM by Souhail Hammou : custom instruction set
+Shared definitions of the address space, the registers and the execution engines.
+*/
+#ifndef _VM_H_
+#define _VM_H_
+#include <stdio.h>
+#include <stdint.h>
+#define TRUE 1
+#define FALSE 0
+typedef unsigned char boolean;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+/*
+data space and stack space sizes (stack size is in WORDs) , both can be set at build
+time (e.g. -DVM_DATA_SIZE=65536). They are powers of two : an address is in data
+when it has no bit above VM_DATA_MASK (VM_OUT_OF_DATA) , with a 64 KB data space
+every 16-bit address is in data and the compiler drops the checks.
+*/
+#ifndef VM_DATA_SIZE
+#define VM_DATA_SIZE 4096
+#endif
+#ifndef VM_STACK_SIZE
+#define VM_STACK_SIZE 256
+#endif
+#if (VM_DATA_SIZE & (VM_DATA_SIZE - 1)) || VM_DATA_SIZE < 512 || VM_DATA_SIZE > 65536
+#error VM_DATA_SIZE must be a power of two from 512 to 65536
+#endif
+#if (VM_STACK_SIZE & (VM_STACK_SIZE - 1)) || VM_STACK_SIZE < 256 || VM_STACK_SIZE > 32768
+#error VM_STACK_SIZE must be a power of two from 256 to 32768
+#endif
+#define VM_DATA_MASK (VM_DATA_SIZE - 1)
+#define VM_OUT_OF_DATA(addr) ((DWORD)(addr) & ~(DWORD)VM_DATA_MASK)
+/*
+Index of a decoded op or of a block , a WORD unless data is large enough to have
+more than 0xFFFF of them.
+*/
+#if 2 * VM_DATA_SIZE + 1 > 0xFFFF
+typedef DWORD VM_INDEX;
+#else
+typedef WORD VM_INDEX;
+#endif
+/*
+Dirty pages : data and stack are taken as one range (the stack starts at offset
+VM_DATA_SIZE) split in VM_PAGE_SIZE pages. Every engine sets the bit of the pages
+it writes so that a snapshot can be restored by copying only those (Snapshot.c).
+*/
+#define VM_PAGE_SHIFT 6
+#define VM_PAGE_SIZE (1 << VM_PAGE_SHIFT)
+#define VM_PAGES ((VM_DATA_SIZE + VM_STACK_SIZE * 2) / VM_PAGE_SIZE)
+#define VM_DATA_PAGES (VM_DATA_SIZE / VM_PAGE_SIZE)
+typedef struct
+{
+    /*data has also the code*/
+    BYTE data[VM_DATA_SIZE];
+    /*stack space , size of one element is WORD in order to be able to push addresses*/
+    WORD stack[VM_STACK_SIZE];
+    /*one bit per page written since the last snapshot or restore*/
+    BYTE Dirty[VM_PAGES / 8];
+}ADDRESS_SPACE,*PADDRESS_SPACE;
+#define VM_MARK_DIRTY(AS,offset) ((AS)->Dirty[(offset) >> (VM_PAGE_SHIFT + 3)] |= 1 << (((offset) >> VM_PAGE_SHIFT) & 7))
+#define VM_MARK_STACK_DIRTY(AS,sp) VM_MARK_DIRTY(AS,VM_DATA_SIZE + (sp) * 2)
+typedef struct
+{
+    /*General Purpose Registers R0 -> R3*/
+    WORD GPRs[4];
+    union
+    {
+        unsigned char Flags;
+        struct
+        {
+            unsigned char ZF:1;
+            unsigned char CF:1;
+            unsigned char Unused:6;
+        };
+    };
+    WORD IP;
+    WORD SP;
+}REGS,*PREGS;
+/*
+Dispatch engine (chosen at build time) :
+- VM_THREADED_DISPATCH : every handler ends with its own indirect jump through
+  a 256-entry label table (computed goto, GCC and Clang only). No exit flag to
+  test and no bounds-checked jump table, and each handler gets its own branch
+  history.
+- VM_SWITCH_DISPATCH : the portable switch inside while(!exit).
+The threaded engine is used by default when the compiler supports it.
+Each engine defines its own VM_NEXT (fetch and dispatch the next handler).
+*/
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH) && !defined(VM_THREADED_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
+#ifdef VM_THREADED_DISPATCH
+#define VM_CASE(op) op_##op
+#define VM_DEFAULT op_default
+#define VM_EXIT goto vm_exit
+#else
+#define VM_CASE(op) case op
+#define VM_DEFAULT default
+#define VM_EXIT exit = TRUE; break
+#endif
+/*
+Condition flags.
+The ALU handlers give the old value and the result of the operation to VM_FLAGS_ADD ,
+VM_FLAGS_SUB (CMP is a SUB that doesn't write its result) or VM_FLAGS_LOGIC , the
+bulk opcodes give ZF and CF to VM_FLAGS_SET , and the conditional jumps read VM_ZF
+and VM_CF.
+VM_LAZY_FLAGS : the ALU handlers only record the kind of operation , its old value and
+its result. ZF and CF are computed when a conditional jump reads them and are stored
+into Regs by VM_STORE_FLAGS when the engine returns. An engine using these macros
+declares BYTE flags_op and WORD flags_a,flags_res and starts with VM_LOAD_FLAGS.
+Without VM_LAZY_FLAGS the flags are stored into Regs right away.
+*/
+#define LAZY_STORED 0 /*Regs->ZF and Regs->CF are current*/
+#define LAZY_ADD    1 /*ZF = res == 0 , CF = res < a*/
+#define LAZY_SUB    2 /*ZF = res == 0 , CF = res > a*/
+#define LAZY_LOGIC  3 /*ZF = res == 0 , CF = 0*/
+#ifdef VM_LAZY_FLAGS
+#define VM_FLAGS_ADD(a,res) (flags_op = LAZY_ADD,flags_a = (a),flags_res = (res))
+#define VM_FLAGS_SUB(a,res) (flags_op = LAZY_SUB,flags_a = (a),flags_res = (res))
+#define VM_FLAGS_LOGIC(res) (flags_op = LAZY_LOGIC,flags_res = (res))
+#define VM_FLAGS_SET(zf,cf) (flags_op = LAZY_STORED,Regs->ZF = (zf),Regs->CF = (cf))
+#define VM_ZF (flags_op == LAZY_STORED ? Regs->ZF : flags_res == 0)
+#define VM_CF (flags_op == LAZY_STORED ? Regs->CF : \
+              flags_op == LAZY_ADD ? flags_res < flags_a : \
+              flags_op == LAZY_SUB && flags_res > flags_a)
+#define VM_LOAD_FLAGS() (flags_op = LAZY_STORED,flags_a = 0,flags_res = 0)
+#define VM_STORE_FLAGS() if(flags_op != LAZY_STORED) \
+                         { \
+                             Regs->ZF = VM_ZF; \
+                             Regs->CF = VM_CF; \
+                             flags_op = LAZY_STORED; \
+                         }
+#else
+#define VM_FLAGS_ADD(a,res) (Regs->ZF = (res) == 0,Regs->CF = (res) < (a))
+#define VM_FLAGS_SUB(a,res) (Regs->ZF = (res) == 0,Regs->CF = (res) > (a))
+#define VM_FLAGS_LOGIC(res) (Regs->ZF = (res) == 0,Regs->CF = 0)
+#define VM_FLAGS_SET(zf,cf) (Regs->ZF = (zf),Regs->CF = (cf))
+#define VM_ZF Regs->ZF
+#define VM_CF Regs->CF
+#define VM_LOAD_FLAGS()
+#define VM_STORE_FLAGS()
+#endif
+/*
+Pre-decoded instruction stream (Decode.c)
+The code in data is decoded once into fixed-size ops, following the control flow
+from the entry point. Operands are checked and resolved at decode time : register
+indexes are split, immediates and addresses are read once, and jump targets are
+translated to decoded-op indexes. An op that would raise an exception when executed
+is decoded as VM_OP_EXCEPTION. A write into decoded code makes the ops of the pages
+it hits VM_OP_STALE , they are decoded again when they run.
+*/
+#define VM_OP_EXCEPTION 0x00 /*any unknown opcode lands in the exception path*/
+#define VM_OP_GOTO      0x01 /*internal : continue at op Imm (end of a linear run)*/
+#define VM_OP_STALE     0x0A /*internal : the code of the op was written , decode it again*/
+/*
+Superinstructions : VmFuse rewrites the first op of a common sequence into a fused
+handler that runs the whole sequence with one dispatch. The following ops are left
+in place (a jump can still land on them), the fused handler reads them and skips them.
+*/
+#define VM_OP_CMP_JCC        0x02 /*CMP Rd,Rs ; Jcc*/
+#define VM_OP_CMPL_JCC       0x03 /*CMPL Rd,Rs ; Jcc*/
+#define VM_OP_LOADB_XORL     0x04 /*MOVX Rd,BYTE [Rs] ; XORL*/
+#define VM_OP_LOADB_ADDL     0x05 /*MOVX Rd,BYTE [Rs] ; ADDL*/
+#define VM_OP_ADD_JNZ        0x06 /*ADD Rd,Imm ; JNZ*/
+#define VM_OP_SUB_JNZ        0x07 /*SUB Rd,Imm ; JNZ*/
+#define VM_OP_LOADB_CMPL_JCC 0x08 /*MOVX Rd,BYTE [Rs] ; CMPL ; Jcc*/
+#define VM_OP_ADD_CMP_JCC    0x09 /*ADD Rd,Imm ; CMP ; Jcc (the flags of ADD are dead)*/
+#define VM_FUSION_FIRST VM_OP_CMP_JCC
+#define VM_FUSION_KINDS (VM_OP_ADD_CMP_JCC - VM_FUSION_FIRST + 1)
+#define VM_MAX_DECODED_OPS (2*VM_DATA_SIZE + 1)
+#define VM_NO_OP ((VM_INDEX)-1)
+typedef struct
+{
+    BYTE Handler;   /*opcode or VM_OP_xxx*/
+    BYTE Dst;       /*destination register (high nibble or register byte)*/
+    BYTE Src;       /*source register (low nibble)*/
+    BYTE Length;    /*size of the encoded instruction*/
+    VM_INDEX Imm;   /*immediate value , memory address or jump target (decoded-op index)*/
+    WORD IP;        /*address of the encoded instruction*/
+}DECODED_OP,*PDECODED_OP;
+typedef struct
+{
+    /*decoded ops, a linear run of code is decoded into consecutive ops*/
+    DECODED_OP Ops[VM_MAX_DECODED_OPS];
+    DWORD Count;
+    /*address -> index of the op decoded at that address (VM_NO_OP if none)*/
+    VM_INDEX Index[VM_DATA_SIZE];
+    /*address -> the first op there that went stale , it goes to the last one decoded there (VM_NO_OP if none)*/
+    VM_INDEX Stale[VM_DATA_SIZE];
+    /*one bit per data byte covered by a decoded op, writes there invalidate the ops of their page*/
+    BYTE CodeMap[VM_DATA_SIZE/8];
+    /*one bit per page (VM_PAGE_SIZE) with decoded code in it or on the first byte of the next one*/
+    BYTE CodePages[VM_DATA_PAGES/8];
+    /*fusion report : sites fused in the current stream , and executions (VM_FUSION_STATS)*/
+    DWORD FusedSites[VM_FUSION_KINDS];
+    uint64_t FusedExecuted[VM_FUSION_KINDS];
+}DECODED_PROGRAM,*PDECODED_PROGRAM;
+#define VM_IS_CODE(Program,addr) ((Program)->CodeMap[(addr)>>3] & (1 << ((addr) & 7)))
+#define VM_IS_CODE_PAGE(Program,addr) ((Program)->CodePages[(addr) >> (VM_PAGE_SHIFT + 3)] & (1 << (((addr) >> VM_PAGE_SHIFT) & 7)))
+/*
+x86-64 JIT (Jit.c)
+The decoded stream is compiled to native code , VM registers and flags are kept in
+host registers. Other hosts fall back to VmLoopDecoded.
+*/
+#define JIT_CODE_SIZE (256*VM_DATA_SIZE)
+typedef struct
+{
+    /*the decoded stream the native code is compiled from*/
+    DECODED_PROGRAM Program;
+    /*executable buffer , allocated by the first compilation*/
+    BYTE* Code;
+    DWORD CodeSize;
+    /*offset of the code that stores the VM state back and returns*/
+    DWORD Epilogue;
+    /*native offset of every decoded op*/
+    DWORD Offsets[VM_MAX_DECODED_OPS];
+    /*rel32 of the jumps to patch once every op is compiled*/
+    DWORD Fixups[VM_MAX_DECODED_OPS];
+    DWORD FixupCount;
+}JIT_PROGRAM,*PJIT_PROGRAM;
+/*
+Load-time verifier (Verify.c)
+VmVerify follows the control flow from an entry point and splits the reachable
+code into basic blocks. A block is proven when every instruction in it decodes
+with valid registers , memory operands inside data and jump targets inside data ,
+and every block it can continue to is proven too , so that execution that enters
+a proven block never leaves the proven ones. Built with VM_VERIFY , VmLoopVerified
+runs proven blocks with handlers that skip those checks and the rest with the
+checked ones. A write into proven code verifies again from the next instruction ,
+up to VM_VERIFY_REWRITES times in a run , then only the checked handlers are used.
+*/
+#define VM_NO_BLOCK ((VM_INDEX)-1)
+typedef struct
+{
+    WORD Start;     /*address of the first instruction*/
+    DWORD End;      /*address past the last instruction*/
+    VM_INDEX Next[2];   /*fall-through and jump target blocks , VM_NO_BLOCK if none*/
+    boolean Valid;  /*the operands of every instruction are in range*/
+    boolean Proven; /*Valid and every Next block is Proven*/
+}VM_BLOCK,*PVM_BLOCK;
+typedef struct
+{
+    VM_BLOCK Blocks[VM_DATA_SIZE];
+    DWORD Count;
+    /*address -> index of the block starting there (VM_NO_BLOCK if none)*/
+    VM_INDEX BlockAt[VM_DATA_SIZE];
+    /*one bit per address where a proven block starts*/
+    BYTE Entries[VM_DATA_SIZE/8];
+    /*one bit per byte of a proven block , one more byte for a word written at the end of data*/
+    BYTE Code[VM_DATA_SIZE/8 + 1];
+}VM_CFG,*PVM_CFG;
+#define VM_IS_PROVEN(Cfg,addr) (!VM_OUT_OF_DATA(addr) && ((Cfg)->Entries[(addr)>>3] & (1 << ((addr) & 7))))
+#define VM_IS_PROVEN_CODE(Cfg,addr) ((Cfg)->Code[(addr)>>3] & (1 << ((addr) & 7)))
+DWORD VmVerify(PADDRESS_SPACE AS,PVM_CFG Cfg,WORD Entry);
+/*
+Input/output of the print and scan opcodes (Io.c)
+Each thread can redirect them to a VM_IO with VmSetIo : the output is appended to
+a growable buffer and 89 reads lines from an in-memory input. Threads that have
+no VM_IO use stdout and stdin through a buffered VM_IO.
+*/
+#ifdef _MSC_VER
+#define VM_THREAD_LOCAL __declspec(thread)
+#define VM_CACHE_ALIGNED __declspec(align(64))
+#else
+#define VM_THREAD_LOCAL __thread
+#define VM_CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+/*output buffered before it is handed to the sink*/
+#define VM_IO_FLUSH_SIZE 4096
+/*receives the output in blocks*/
+typedef void (*VM_IO_SINK)(void* Context,const char* Data,DWORD Size);
+/*reads one line without its newline , at most Size - 1 characters and the terminating 0. FALSE at the end of the input*/
+typedef boolean (*VM_IO_READER)(void* Context,char* Buffer,DWORD Size);
+typedef struct
+{
+    /*captured output (C0 , C2)*/
+    char* Output;
+    DWORD OutputSize;
+    DWORD OutputCapacity;
+    /*optional , Output is passed to Sink when it reaches VM_IO_FLUSH_SIZE and by VmFlushIo*/
+    VM_IO_SINK Sink;
+    void* SinkContext;
+    /*input lines (89)*/
+    const char* Input;
+    DWORD InputSize;
+    DWORD InputPos;
+    /*optional , lines are read from Reader instead of Input*/
+    VM_IO_READER Reader;
+    void* ReaderContext;
+    /*more input can still be appended : 89 waits for a complete line instead of reading the end of Input*/
+    boolean InputOpen;
+}VM_IO,*PVM_IO;
+void VmSetIo(PVM_IO Io);
+void VmFlushIo(PVM_IO Io);
+boolean VmInputReady(PVM_IO Io);
+void VmPrintInteger(WORD Value);
+void VmPrintString(const char* String);
+void VmScanString(char* Buffer,DWORD Size);
+/*
+Execution context : the address space , the registers and the state of the engine
+selected at build time. Contexts are aligned on a cache line so that contexts used
+by different threads never share one. Image is the cached program the context was
+loaded from (VmImageLoad) , if any.
+*/
+typedef struct VM_IMAGE* PVM_IMAGE;
+typedef struct VM_CACHE_ALIGNED
+{
+    ADDRESS_SPACE AS;
+    REGS Regs;
+    PVM_IMAGE Image;
+#if defined(VM_JIT)
+    JIT_PROGRAM Jit;
+#elif defined(VM_PREDECODE)
+    DECODED_PROGRAM Program;
+#elif defined(VM_VERIFY)
+    VM_CFG Cfg;
+#endif
+}VM_CONTEXT,*PVM_CONTEXT;
+PVM_CONTEXT VmCreateContext(void);
+void VmDestroyContext(PVM_CONTEXT Context);
+void VmResetRegs(PREGS Regs);
+void VmRunContext(PVM_CONTEXT Context);
+/*
+Program images (Cache.c)
+VmImageOpen maps a program file and returns the cached image with the same content
+(hash , then compared) if there is one : all the instances of a program share one
+read-only copy. The analyses of an image (decoded stream , CFG) are made the first
+time they are asked for and shared too. VmImageLoad makes a context a fresh instance
+of an image , VmRunContext then starts from the shared analyses as long as the code
+of the instance is still the code of the image.
+*/
+PVM_IMAGE VmImageOpen(const char* Name);
+PVM_IMAGE VmImageFromMemory(const BYTE* Data,DWORD Size);
+void VmImageRelease(PVM_IMAGE Image);
+void VmImageLoad(PVM_IMAGE Image,PVM_CONTEXT Context);
+const DECODED_PROGRAM* VmImageDecoded(PVM_IMAGE Image,PADDRESS_SPACE AS);
+const VM_CFG* VmImageCfg(PVM_IMAGE Image,PADDRESS_SPACE AS);
+/*
+Embedding API (Api.c)
+A VM_POOL allocates contexts in slabs of cache-aligned VM_CONTEXTs and keeps the
+released ones for the next VmPoolAcquire. A pool is used by one thread at a time.
+A context is loaded from an image (VmImageLoad) or from memory , then run to the
+end (VmRun) or for a number of basic blocks (VmStep) with the caller's VM_IO.
+*/
+#define VM_POOL_SLAB 16
+typedef struct VM_POOL* PVM_POOL;
+PVM_POOL VmPoolCreate(DWORD SlabSize);
+void VmPoolDestroy(PVM_POOL Pool);
+PVM_CONTEXT VmPoolAcquire(PVM_POOL Pool);
+void VmPoolRelease(PVM_POOL Pool,PVM_CONTEXT Context);
+boolean VmLoadMemory(PVM_CONTEXT Context,const BYTE* Program,DWORD Size);
+void VmResetContext(PVM_CONTEXT Context);
+void VmRun(PVM_CONTEXT Context,PVM_IO Io);
+int VmStep(PVM_CONTEXT Context,PVM_IO Io,uint64_t Blocks);
+boolean VmReadMemory(PVM_CONTEXT Context,DWORD Offset,void* Buffer,DWORD Size);
+boolean VmWriteMemory(PVM_CONTEXT Context,DWORD Offset,const void* Buffer,DWORD Size);
+void VmGetRegs(PVM_CONTEXT Context,PREGS Regs);
+void VmSetRegs(PVM_CONTEXT Context,const REGS* Regs);
+/*
+Batch runner (Batch.c)
+Runs the (program , input) jobs of a manifest on a pool of worker threads , or
+all of them on the calling thread as green threads (VmGreenMain , Sched.c).
+*/
+int VmBatchMain(const char* Manifest,int Threads);
+int VmGreenMain(const char* Manifest,DWORD Quantum);
+int VmDefaultThreads(void);
+/*
+Input explorer (Explore.c)
+Built with VM_COVERAGE , VmLoopCoverage counts the edges between the basic blocks
+it runs in a map of VM_COVERAGE_SIZE counters (a power of two). The explorer
+mutates the input of a program on every CPU and keeps the inputs that reach edges
+or edge counts no earlier input reached.
+*/
+#define VM_COVERAGE_SIZE 16384
+int VmLoopCoverage(PADDRESS_SPACE AS,PREGS Regs,BYTE* Coverage,uint64_t* Fuel);
+int VmExploreMain(const char* Program,int Threads,int Seconds,const char* Corpus);
+/*
+Bulk memory opcodes (Bulk.c)
+MEMCPY (60) , MEMSET (61) , MEMCMP (62) , STRLEN (63) and XORKEY (64) run over a
+whole range of data , the engines decode the registers and VmBulk checks the
+ranges once and runs the SIMD kernels. It returns FALSE for an exception.
+*/
+typedef struct
+{
+    WORD Length;        /*STRLEN*/
+    BYTE ZF;
+    BYTE CF;
+    DWORD WriteSize;    /*bytes written from Dst*/
+}VM_BULK_RESULT,*PVM_BULK_RESULT;
+boolean VmBulk(PADDRESS_SPACE AS,BYTE Opcode,WORD Dst,WORD Src,WORD Count,WORD Key,PVM_BULK_RESULT Result);
+/*
+Offline optimizer (Optimize.c)
+VmOptimize rewrites the code of a program in data into equivalent code that runs
+fewer instructions : constants are propagated over the basic blocks of Verify.c ,
+dead register and flag writes , NOPs and decided conditional jumps are removed and
+jump chains are threaded. Blocks stay at their address and the ones whose bytes
+the program may read or write are left as they are.
+*/
+typedef struct
+{
+    DWORD Blocks;       /*blocks of the CFG*/
+    DWORD Rewritten;    /*blocks compacted*/
+    DWORD Kept;         /*blocks left as they are (written , read , overlapping , not reached)*/
+    DWORD Removed;      /*instructions removed from the rewritten blocks*/
+    DWORD Folded;       /*instructions replaced by a move of their constant result*/
+    DWORD Branches;     /*conditional jumps decided*/
+    DWORD Threaded;     /*jumps sent straight to the end of a chain*/
+    DWORD Unknown;      /*IP of the read or write at an unknown address that stopped it , VM_DATA_SIZE if none*/
+}VM_OPT_STATS,*PVM_OPT_STATS;
+boolean VmOptimize(PADDRESS_SPACE AS,PVM_OPT_STATS Stats);
+int VmOptimizeMain(const char* Program,const char* Output);
+/*
+Paged address space (Paged.c)
+Programs larger than data run with VmLoopPaged in a sparse 32-bit address space :
+VM_PAGED_PAGE_SIZE pages allocated when they are first written (at most
+VM_PAGED_MAX_PAGES) behind a page table and a software TLB of VM_PAGED_TLB entries.
+The 16-bit addresses are offsets in 64 KB banks , the data accesses use bank DS and
+the code runs in bank CS (D0 , D1 and E1 switch them).
+*/
+#define VM_PAGED_SHIFT 12
+#define VM_PAGED_PAGE_SIZE (1 << VM_PAGED_SHIFT)
+#define VM_PAGED_TLB 64
+#ifndef VM_PAGED_MAX_PAGES
+#define VM_PAGED_MAX_PAGES 65536 /*256 MB*/
+#endif
+typedef struct
+{
+    REGS Regs;
+    WORD CS;    /*bank of IP*/
+    WORD DS;    /*bank of the data accesses*/
+}VM_PAGED_REGS,*PVM_PAGED_REGS;
+typedef struct VM_PAGED* PVM_PAGED;
+PVM_PAGED VmPagedCreate(void);
+void VmPagedDestroy(PVM_PAGED Space);
+DWORD VmPagedPages(PVM_PAGED Space);
+boolean VmPagedRead(PVM_PAGED Space,DWORD Address,void* Buffer,DWORD Size);
+boolean VmPagedWrite(PVM_PAGED Space,DWORD Address,const void* Buffer,DWORD Size);
+int VmLoopPaged(PVM_PAGED Space,PVM_PAGED_REGS Paged,uint64_t* Fuel);
+int VmPagedMain(const char* Program);
+/*
+Snapshots (Snapshot.c)
+A snapshot is a copy of an address space and its registers. VmFork makes a full
+copy of it , VmRestore brings back an address space that was forked or restored
+from the same snapshot (or is the one it was taken from) by copying only the
+pages written since.
+*/
+typedef struct
+{
+    ADDRESS_SPACE AS;
+    REGS Regs;
+}VM_SNAPSHOT,*PVM_SNAPSHOT;
+void VmSnapshot(PVM_SNAPSHOT Snapshot,PADDRESS_SPACE AS,PREGS Regs);
+void VmFork(PVM_SNAPSHOT Snapshot,PADDRESS_SPACE AS,PREGS Regs);
+void VmRestore(PVM_SNAPSHOT Snapshot,PADDRESS_SPACE AS,PREGS Regs);
+void VmMarkDirty(PADDRESS_SPACE AS,DWORD Offset,DWORD Size);
+boolean VmRunTo(PVM_CONTEXT Context,WORD Stop);
+boolean VmRunToInput(PVM_CONTEXT Context);
+/*
+On-disk checkpoints (Checkpoint.c)
+A checkpoint file is mapped in memory and holds two copies of the address space and
+the registers that are written in turn. VmCheckpoint clears the dirty pages like
+VmSnapshot and only copies the pages the older copy is missing , VmCheckpointRestore
+loads the last complete one and the VM resumes at its IP.
+*/
+typedef struct VM_CHECKPOINT* PVM_CHECKPOINT;
+PVM_CHECKPOINT VmCheckpointOpen(const char* Name);
+void VmCheckpointClose(PVM_CHECKPOINT Checkpoint);
+boolean VmCheckpointRestore(PVM_CHECKPOINT Checkpoint,PADDRESS_SPACE AS,PREGS Regs);
+DWORD VmCheckpoint(PVM_CHECKPOINT Checkpoint,PADDRESS_SPACE AS,PREGS Regs);
+int VmCheckpointMain(const char* File,int Seconds,const char* Program);
+/*
+Fuel and green threads (Sched.c)
+VmLoopFuel runs VmLoop for a number of basic blocks (one unit of fuel is charged
+at every jump) and can be called again to resume. The scheduler multiplexes many
+contexts on the calling thread : every runnable task gets Quantum blocks in turn
+with its own VM_IO until it exits or raises an exception.
+*/
+#define VM_STOP_EXIT      0 /*EXIT*/
+#define VM_STOP_EXCEPTION 1
+#define VM_STOP_FUEL      2 /*out of fuel , can be resumed*/
+#define VM_STOP_INPUT     3 /*at a 89 waiting for input , can be resumed*/
+#define VM_SCHED_QUANTUM  1000
+#define VM_NO_TASK 0xFFFFFFFF
+typedef struct
+{
+    PVM_CONTEXT Context;
+    PVM_IO Io;          /*VM_IO of its slices , NULL for stdout and stdin*/
+    int Status;         /*VM_STOP_FUEL while runnable , then how it stopped*/
+    uint64_t Blocks;    /*blocks run so far*/
+    DWORD Slices;
+}VM_TASK,*PVM_TASK;
+typedef struct
+{
+    PVM_TASK Tasks;
+    DWORD Count;
+    DWORD Capacity;
+    /*run queue : ring of Capacity task indexes , Runnable of them from Head*/
+    DWORD* Queue;
+    DWORD Head;
+    DWORD Runnable;
+    uint64_t Quantum;
+}VM_SCHEDULER,*PVM_SCHEDULER;
+void VmSchedInit(PVM_SCHEDULER Sched,uint64_t Quantum);
+DWORD VmSchedAdd(PVM_SCHEDULER Sched,PVM_CONTEXT Context,PVM_IO Io);
+DWORD VmSchedStep(PVM_SCHEDULER Sched);
+void VmSchedRun(PVM_SCHEDULER Sched);
+void VmSchedFree(PVM_SCHEDULER Sched);
+/*
+Event loop (Event.c)
+Sessions are contexts whose input and output are file descriptors , one thread runs
+thousands of them : a session gets slices of Quantum blocks like a green thread ,
+waits in epoll while its VM is stopped at a 89 with no complete line (VM_STOP_INPUT)
+and its output is written without blocking. Linux only.
+*/
+typedef struct VM_EVENT_LOOP* PVM_EVENT_LOOP;
+PVM_EVENT_LOOP VmEventCreate(uint64_t Quantum);
+void VmEventDestroy(PVM_EVENT_LOOP Loop);
+boolean VmEventAdd(PVM_EVENT_LOOP Loop,PVM_CONTEXT Context,int Input,int Output);
+boolean VmEventListen(PVM_EVENT_LOOP Loop,int Socket,PVM_IMAGE Image);
+boolean VmEventRun(PVM_EVENT_LOOP Loop);
+int VmServeMain(const char* Path,const char* Program,DWORD Quantum);
+/*
+Profiler (Profile.c)
+Built with VM_PROFILE , VmLoop counts the executions of every opcode and of every
+instruction address and the outcomes of every conditional jump in the counters of
+the calling thread (VmSetProfile) or in process-wide ones. VmRunContext then
+runs VmLoop whatever the engine selected.
+*/
+typedef struct
+{
+    uint64_t Opcodes[256];
+    uint64_t Ips[VM_DATA_SIZE];
+    /*conditional jumps , by the address of the jump*/
+    uint64_t Taken[VM_DATA_SIZE];
+    uint64_t NotTaken[VM_DATA_SIZE];
+}VM_PROFILE_COUNTERS,*PVM_PROFILE_COUNTERS;
+void VmSetProfile(PVM_PROFILE_COUNTERS Profile);
+PVM_PROFILE_COUNTERS VmGetProfile(void);
+void VmProfileReport(PVM_PROFILE_COUNTERS Profile,PADDRESS_SPACE AS,FILE* File,DWORD Top);
+void VmProfileFolded(PVM_PROFILE_COUNTERS Profile,PADDRESS_SPACE AS,FILE* File);
+const char* VmMnemonic(BYTE Opcode);
+/*
+Execution trace (Trace.c)
+Built with VM_TRACE , VmLoop appends a compact record per instruction (the
+changed registers , flags , SP and memory , delta encoded) to the VM_TRACER of the
+calling thread (VmSetTrace). The records pass through a lock-free ring buffer and
+are drained to a memory-mapped file , tools/TraceDecode.c rebuilds the state at
+any record. VmRunContext then runs VmLoop whatever the engine selected.
+*/
+#define VM_TRACE_MAGIC   0x52544D56 /*"VMTR"*/
+#define VM_TRACE_VERSION 1
+#define VM_TRACE_BIT_R0    0x01
+#define VM_TRACE_BIT_FLAGS 0x10
+#define VM_TRACE_BIT_SP    0x20
+#define VM_TRACE_BIT_WRITE 0x40
+typedef struct
+{
+    DWORD Magic;
+    DWORD Version;
+    WORD GPRs[4];
+    WORD IP;
+    WORD SP;
+    /*ZF (bit 0) , CF (bit 1)*/
+    BYTE Flags;
+    BYTE Reserved[3];
+    /*data then stack*/
+    BYTE AS[VM_DATA_SIZE + VM_STACK_SIZE * 2];
+}VM_TRACE_HEADER,*PVM_TRACE_HEADER;
+typedef struct VM_TRACER* PVM_TRACER;
+PVM_TRACER VmTraceOpen(const char* Name,DWORD RingSize);
+void VmTraceClose(PVM_TRACER Trace);
+void VmTraceStart(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs);
+void VmTraceDrain(PVM_TRACER Trace);
+void VmSetTrace(PVM_TRACER Trace);
+PVM_TRACER VmGetTrace(void);
+void VmTraceStep(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs,BYTE Flags,DWORD WriteOffset,DWORD WriteSize);
+void VmTraceEnd(PVM_TRACER Trace,PADDRESS_SPACE AS,PREGS Regs,BYTE Flags,DWORD WriteOffset,DWORD WriteSize);
+/*
+SIMD lockstep engine (Lockstep.c)
+Runs Count instances of the same program (AS[i] , Regs[i] , Io[i]) VM_LANES at a
+time , one decoded instruction for all the lanes that are at it. Io can be NULL.
+*/
+#define VM_LANES 16
+void VmLoopLockstep(PADDRESS_SPACE AS,PREGS Regs,PVM_IO Io,DWORD Count);
+int VmLockstepMain(const char* Inputs);
+/*
+Ahead-of-time translation (Aot.c)
+VmAotTranslate writes the Valid blocks of a program as C , one function per block
+with the registers in local variables , VmAotBuild compiles it into a shared object
+and VmLoopAot runs a program on the one VmAotLoad loaded. The native code stops with
+VM_AOT_INTERPRET where it can't go on (a block that isn't compiled , a write into
+compiled code) and VmLoop runs the rest. VM_AOT_STATE and VM_AOT_INFO are shared
+with the generated code , changing them changes VM_AOT_VERSION.
+*/
+#define VM_AOT_VERSION   2
+#define VM_AOT_EXIT      1
+#define VM_AOT_EXCEPTION 2
+#define VM_AOT_INTERPRET 3 /*VmLoop goes on at IP*/
+typedef struct
+{
+    WORD GPRs[4];
+    WORD IP;
+    WORD SP;
+    BYTE ZF;
+    BYTE CF;
+    BYTE* Data;
+    WORD* Stack;
+    BYTE* Dirty;
+    PADDRESS_SPACE AS;
+    void (*PrintInteger)(WORD Value);
+    void (*PrintString)(const char* String);
+    void (*ScanString)(char* Buffer,DWORD Size);
+    void (*MarkDirty)(PADDRESS_SPACE AS,DWORD Offset,DWORD Size);
+    boolean (*Bulk)(PADDRESS_SPACE AS,BYTE Opcode,WORD Dst,WORD Src,WORD Count,WORD Key,PVM_BULK_RESULT Result);
+}VM_AOT_STATE,*PVM_AOT_STATE;
+/*exported as vm_aot_info by the generated code*/
+typedef struct
+{
+    DWORD Version;
+    DWORD DataSize;
+    DWORD StackSize;
+    /*one bit per byte of compiled code , and the data the program was translated from*/
+    const BYTE* CodeMap;
+    const BYTE* Image;
+    int (*Run)(PVM_AOT_STATE State);
+}VM_AOT_INFO,*PVM_AOT_INFO;
+typedef struct VM_AOT* PVM_AOT;
+DWORD VmAotTranslate(PADDRESS_SPACE AS,FILE* File);
+boolean VmAotBuild(const char* Source,const char* Library);
+PVM_AOT VmAotLoad(const char* Library);
+void VmAotRelease(PVM_AOT Aot);
+void VmLoopAot(PADDRESS_SPACE AS,PREGS Regs,PVM_AOT Aot);
+int VmAotMain(const char* Program,const char* Library);
+int VmNativeMain(const char* Library,const char* Program);
+void VmLoop(PADDRESS_SPACE AS,PREGS Regs);
+int VmLoopFuel(PADDRESS_SPACE AS,PREGS Regs,uint64_t* Fuel);
+void VmLoopVerified(PADDRESS_SPACE AS,PREGS Regs,PVM_CFG Cfg);
+void VmLoopVerifiedShared(PADDRESS_SPACE AS,PREGS Regs,PVM_CFG Cfg,const VM_CFG* Shared);
+void VmDecodeInstruction(PADDRESS_SPACE AS,WORD ip,PDECODED_OP op);
+VM_INDEX VmDecode(PADDRESS_SPACE AS,PDECODED_PROGRAM Program,WORD Entry);
+void VmFuse(PDECODED_PROGRAM Program);
+void VmFusionReport(PDECODED_PROGRAM Program);
+void VmLoopDecoded(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program);
+void VmLoopDecodedShared(PADDRESS_SPACE AS,PREGS Regs,PDECODED_PROGRAM Program,const DECODED_PROGRAM* Shared);
+void VmLoopJit(PADDRESS_SPACE AS,PREGS Regs,PJIT_PROGRAM Jit);
+void VmJitRelease(PJIT_PROGRAM Jit);
+#endif
@@ -0,0 +1,169 @@
+/*
+Load-time verifier and control-flow graph.
+VmVerify walks the code reachable from the entry point (there are no indirect jumps ,
+every target is an immediate) in two passes :
+- the first one decodes every reachable instruction and marks the leaders : the
+  entry point , the jump targets , the instruction after a conditional jump and any
+  instruction reached both by falling through and by a jump.
+- the second one makes a block of each leader , from it up to the next leader or
+  to the first JMP , Jcc , EXIT or invalid instruction.
+A block is Valid when VmDecodeInstruction accepts all its instructions (registers
+0 to 3 , memory operands and jump targets below VM_DATA_SIZE) and nothing runs or
+jumps to the end of data. The proven blocks are then the largest set of Valid blocks
+closed under their successors : Valid blocks with a successor that isn't proven lose
+their proof until nothing changes. Checks that depend on runtime values (pointers in
+registers , stack bounds) are not covered and stay in the unchecked handlers.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "VM.h"
+#define VERIFY_BIT(map,addr) ((map)[(addr)>>3] & (1 << ((addr) & 7)))
+#define VERIFY_SET(map,addr) ((map)[(addr)>>3] |= 1 << ((addr) & 7))
+static boolean IsJump(BYTE opcode)
+{
+    return opcode >= 0xE0 && opcode <= 0xEC;
+}
+/*
+Build the blocks of the code reachable from Entry and prove them ,
+the previous content of Cfg is discarded. Returns the number of proven blocks.
+*/
+DWORD VmVerify(PADDRESS_SPACE AS,PVM_CFG Cfg,WORD Entry)
+{
+    WORD worklist[VM_DATA_SIZE + 1];
+    BYTE visited[VM_DATA_SIZE/8],leaders[VM_DATA_SIZE/8];
+    DWORD pending = 0,i,ip,proven;
+    DECODED_OP op;
+    PVM_BLOCK block;
+    boolean changed;
+    Cfg->Count = 0;
+    memset(Cfg->BlockAt,0xFF,sizeof(Cfg->BlockAt));
+    memset(Cfg->Entries,0,sizeof(Cfg->Entries));
+    memset(Cfg->Code,0,sizeof(Cfg->Code));
+    memset(visited,0,sizeof(visited));
+    memset(leaders,0,sizeof(leaders));
+    if(Entry >= VM_DATA_SIZE)
+        return 0;
+    VERIFY_SET(leaders,Entry);
+    worklist[pending++] = Entry;
+    /*first pass : reachable instructions and leaders*/
+    while(pending)
+    {
+        ip = worklist[--pending];
+        while(ip < VM_DATA_SIZE)
+        {
+            if(VERIFY_BIT(visited,ip))
+            {
+                /*reached from two places*/
+                VERIFY_SET(leaders,ip);
+                break;
+            }
+            VERIFY_SET(visited,ip);
+            VmDecodeInstruction(AS,ip,&op);
+            if(op.Handler == VM_OP_EXCEPTION || op.Handler == 0xED)
+                break;
+            if(IsJump(op.Handler))
+            {
+                if(op.Imm < VM_DATA_SIZE)
+                {
+                    VERIFY_SET(leaders,op.Imm);
+                    if(!VERIFY_BIT(visited,op.Imm))
+                        worklist[pending++] = op.Imm;
+                }
+                if(op.Handler == 0xE0)
+                    break;
+                if(ip + op.Length < VM_DATA_SIZE)
+                    VERIFY_SET(leaders,ip + op.Length);
+            }
+            ip += op.Length;
+        }
+    }
+    /*second pass : one block per leader , successors are addresses for now*/
+    for(ip = 0;ip < VM_DATA_SIZE;ip++)
+    {
+        if(!VERIFY_BIT(leaders,ip) || !VERIFY_BIT(visited,ip))
+            continue;
+        block = &Cfg->Blocks[Cfg->Count];
+        Cfg->BlockAt[ip] = Cfg->Count++;
+        block->Start = ip;
+        block->Next[0] = block->Next[1] = VM_NO_BLOCK;
+        block->Valid = TRUE;
+        i = ip;
+        while(1)
+        {
+            VmDecodeInstruction(AS,i,&op);
+            i += op.Length;
+            if(op.Handler == VM_OP_EXCEPTION)
+            {
+                block->Valid = FALSE;
+                break;
+            }
+            if(op.Handler == 0xED)
+                break;
+            if(IsJump(op.Handler))
+            {
+                if(op.Imm < VM_DATA_SIZE)
+                    block->Next[1] = op.Imm;
+                else
+                    block->Valid = FALSE;
+                if(op.Handler != 0xE0)
+                {
+                    if(i < VM_DATA_SIZE)
+                        block->Next[0] = i;
+                    else
+                        block->Valid = FALSE;
+                }
+                break;
+            }
+            /*running past data fetches from the stack*/
+            if(i >= VM_DATA_SIZE)
+            {
+                block->Valid = FALSE;
+                break;
+            }
+            if(VERIFY_BIT(leaders,i))
+            {
+                block->Next[0] = i;
+                break;
+            }
+        }
+        block->End = i;
+        block->Proven = block->Valid;
+    }
+    for(i = 0;i < Cfg->Count;i++)
+    {
+        block = &Cfg->Blocks[i];
+        if(block->Next[0] != VM_NO_BLOCK)
+            block->Next[0] = Cfg->BlockAt[block->Next[0]];
+        if(block->Next[1] != VM_NO_BLOCK)
+            block->Next[1] = Cfg->BlockAt[block->Next[1]];
+    }
+    /*drop the proof of blocks that can continue to an unproven one until it holds for all*/
+    do
+    {
+        changed = FALSE;
+        for(i = Cfg->Count;i-- > 0;)
+        {
+            block = &Cfg->Blocks[i];
+            if(!block->Proven)
+                continue;
+            if((block->Next[0] != VM_NO_BLOCK && !Cfg->Blocks[block->Next[0]].Proven) ||
+               (block->Next[1] != VM_NO_BLOCK && !Cfg->Blocks[block->Next[1]].Proven))
+            {
+                block->Proven = FALSE;
+                changed = TRUE;
+            }
+        }
+    }while(changed);
+    proven = 0;
+    for(i = 0;i < Cfg->Count;i++)
+    {
+        block = &Cfg->Blocks[i];
+        if(!block->Proven)
+            continue;
+        proven++;
+        VERIFY_SET(Cfg->Entries,block->Start);
+        for(ip = block->Start;ip < block->End;ip++)
+            VERIFY_SET(Cfg->Code,ip);
+    }
+    return proven;
+}
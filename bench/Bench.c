@@ -0,0 +1,584 @@
+/*
+Benchmarks for the execution engines.
+Every benchmark is a program built in memory : micro-benchmarks that repeat one
+opcode family and a small corpus of programs shaped like real protected code.
+The builder counts the instructions as it emits them (loops multiply the count
+of their body) so the number of executed instructions is known exactly.
+
+Each program is run on VmLoop , VmLoopVerified , VmLoopDecoded and VmLoopJit : a few warm-up runs
+then the timed runs , the median run gives the instructions per second , ns and
+cycles (TSC on x86) per instruction. The output and registers of every engine
+are checked against VmLoop.
+
+    vm_bench [-runs N] [-warmup N] [-engine loop|verified|decoded|jit] [-csv file] [benchmark ...]
+
+-csv appends one line per engine and benchmark (with the build options) to file
+so that builds can be compared.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../VM.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define BENCH_HAS_TSC
+#endif
+#define BENCH_MAX_DEPTH 4
+#define BENCH_MAX_RUNS 101
+/*data used by the programs , the code stays below*/
+#define BENCH_COUNTER 0x700
+#define BENCH_DATA    0x800
+typedef struct
+{
+    BYTE Image[VM_DATA_SIZE];
+    DWORD Size;
+    /*instructions counted in each open loop , [0] is the whole program*/
+    uint64_t Count[BENCH_MAX_DEPTH];
+    WORD Start[BENCH_MAX_DEPTH];
+    int Depth;
+}BENCH_PROGRAM,*PBENCH_PROGRAM;
+typedef struct
+{
+    const char* Name;
+    const char* Kind;
+    void (*Build)(PBENCH_PROGRAM Program);
+}BENCH,*PBENCH;
+/*per engine state , kept across runs like a VM_CONTEXT would*/
+typedef struct
+{
+    DECODED_PROGRAM Program;
+    JIT_PROGRAM Jit;
+    VM_CFG Cfg;
+}BENCH_STATE,*PBENCH_STATE;
+typedef struct
+{
+    const char* Name;
+    void (*Run)(PADDRESS_SPACE AS,PREGS Regs,PBENCH_STATE State);
+}BENCH_ENGINE,*PBENCH_ENGINE;
+/*
+Program builder
+*/
+static void Emit(PBENCH_PROGRAM Program,const BYTE* Bytes,DWORD Size)
+{
+    memcpy(&Program->Image[Program->Size],Bytes,Size);
+    Program->Size += Size;
+    Program->Count[Program->Depth]++;
+}
+static void Op(PBENCH_PROGRAM Program,BYTE Opcode)
+{
+    Emit(Program,&Opcode,1);
+}
+/*PUSH , POP*/
+static void OpR(PBENCH_PROGRAM Program,BYTE Opcode,BYTE Reg)
+{
+    BYTE bytes[2] = {Opcode,Reg};
+    Emit(Program,bytes,sizeof(bytes));
+}
+/*register to register , the destination is the high nibble*/
+static void OpRR(PBENCH_PROGRAM Program,BYTE Opcode,BYTE Dst,BYTE Src)
+{
+    BYTE bytes[2] = {Opcode,(Dst << 4) | Src};
+    Emit(Program,bytes,sizeof(bytes));
+}
+static void OpRB(PBENCH_PROGRAM Program,BYTE Opcode,BYTE Reg,BYTE Imm)
+{
+    BYTE bytes[3] = {Opcode,Reg,Imm};
+    Emit(Program,bytes,sizeof(bytes));
+}
+/*immediates and memory operands*/
+static void OpRW(PBENCH_PROGRAM Program,BYTE Opcode,BYTE Reg,WORD Imm)
+{
+    BYTE bytes[4] = {Opcode,Reg,Imm & 0xFF,Imm >> 8};
+    Emit(Program,bytes,sizeof(bytes));
+}
+static void OpJump(PBENCH_PROGRAM Program,BYTE Opcode,WORD Target)
+{
+    BYTE bytes[3] = {Opcode,Target & 0xFF,Target >> 8};
+    Emit(Program,bytes,sizeof(bytes));
+}
+/*a jump to the next instruction , the same instruction count taken or not*/
+static void OpJumpNext(PBENCH_PROGRAM Program,BYTE Opcode)
+{
+    OpJump(Program,Opcode,Program->Size + 3);
+}
+/*forward jump , returns where to patch the target*/
+static DWORD OpJumpForward(PBENCH_PROGRAM Program,BYTE Opcode)
+{
+    OpJump(Program,Opcode,0);
+    return Program->Size - 2;
+}
+static void PatchHere(PBENCH_PROGRAM Program,DWORD Where)
+{
+    *(WORD*)&Program->Image[Where] = Program->Size;
+}
+/*
+Everything emitted between LoopBegin and LoopEnd is counted Iterations times ,
+the caller emits the branch back to Program->Start[Program->Depth].
+*/
+static void LoopBegin(PBENCH_PROGRAM Program)
+{
+    Program->Depth++;
+    Program->Start[Program->Depth] = Program->Size;
+    Program->Count[Program->Depth] = 0;
+}
+static void LoopEnd(PBENCH_PROGRAM Program,uint64_t Iterations)
+{
+    Program->Depth--;
+    Program->Count[Program->Depth] += Program->Count[Program->Depth + 1] * Iterations;
+}
+/*counted loop on R3*/
+static void RegLoopBegin(PBENCH_PROGRAM Program,WORD Iterations)
+{
+    OpRW(Program,0x18,3,Iterations);            /*MOV R3,Iterations*/
+    LoopBegin(Program);
+}
+static void RegLoopEnd(PBENCH_PROGRAM Program,WORD Iterations)
+{
+    OpRW(Program,0x5B,3,1);                     /*SUB R3,1*/
+    OpJump(Program,0xE3,Program->Start[Program->Depth]);
+    LoopEnd(Program,Iterations);
+}
+/*counted loop with the counter in memory , clobbers R0 at every iteration*/
+static void MemLoopBegin(PBENCH_PROGRAM Program,WORD Iterations)
+{
+    OpRW(Program,0x18,0,Iterations);            /*MOV R0,Iterations*/
+    OpRW(Program,0x1f,0,BENCH_COUNTER);         /*MOV WORD [counter],R0*/
+    LoopBegin(Program);
+}
+static void MemLoopEnd(PBENCH_PROGRAM Program,WORD Iterations)
+{
+    OpRW(Program,0x14,0,BENCH_COUNTER);         /*MOV R0,WORD [counter]*/
+    OpRW(Program,0x5B,0,1);
+    OpRW(Program,0x1f,0,BENCH_COUNTER);
+    OpJump(Program,0xE3,Program->Start[Program->Depth]);
+    LoopEnd(Program,Iterations);
+}
+/*print R and exit*/
+static void PrintExit(PBENCH_PROGRAM Program,BYTE Reg)
+{
+    OpR(Program,0xAF,Reg);
+    Op(Program,0xC0);
+    Op(Program,0xED);
+}
+/*
+Micro-benchmarks : one opcode family unrolled in a loop
+*/
+#define MICRO_OUTER 200
+#define MICRO_INNER 1000
+#define MICRO_UNROLL 4
+static void BuildMove(PBENCH_PROGRAM Program)
+{
+    int i;
+    MemLoopBegin(Program,MICRO_OUTER);
+    RegLoopBegin(Program,MICRO_INNER);
+    for(i = 0;i < MICRO_UNROLL;i++)
+    {
+        OpRR(Program,0x10,0,1);                 /*MOV R0,R1*/
+        OpRW(Program,0x18,1,0x1234);            /*MOV R1,1234h*/
+        OpRB(Program,0x16,2,0x56);              /*MOVX R2,56h*/
+        OpRR(Program,0x10,1,2);
+    }
+    RegLoopEnd(Program,MICRO_INNER);
+    MemLoopEnd(Program,MICRO_OUTER);
+    PrintExit(Program,1);
+}
+static void BuildLoadStore(PBENCH_PROGRAM Program)
+{
+    int i;
+    OpRW(Program,0x18,2,BENCH_DATA);
+    MemLoopBegin(Program,MICRO_OUTER);
+    RegLoopBegin(Program,MICRO_INNER);
+    for(i = 0;i < MICRO_UNROLL;i++)
+    {
+        OpRW(Program,0x12,0,BENCH_DATA);        /*MOVX R0,BYTE [data]*/
+        OpRW(Program,0x1c,0,BENCH_DATA + 1);    /*MOV BYTE [data+1],R0*/
+        OpRW(Program,0x14,1,BENCH_DATA + 2);    /*MOV R1,WORD [data+2]*/
+        OpRW(Program,0x1f,1,BENCH_DATA + 4);
+        OpRR(Program,0x56,0,2);                 /*MOVX R0,BYTE [R2]*/
+        OpRR(Program,0x55,2,1);                 /*MOV BYTE [R2],R1*/
+    }
+    RegLoopEnd(Program,MICRO_INNER);
+    MemLoopEnd(Program,MICRO_OUTER);
+    PrintExit(Program,1);
+}
+static void BuildAluWord(PBENCH_PROGRAM Program)
+{
+    int i;
+    MemLoopBegin(Program,MICRO_OUTER);
+    RegLoopBegin(Program,MICRO_INNER);
+    for(i = 0;i < MICRO_UNROLL;i++)
+    {
+        OpRR(Program,0xA5,0,1);                 /*ADD R0,R1*/
+        OpRR(Program,0x5C,1,2);                 /*SUB R1,R2*/
+        OpRR(Program,0xF0,2,0);                 /*XOR R2,R0*/
+        OpRW(Program,0xAD,0,0x1357);            /*ADD R0,1357h*/
+    }
+    RegLoopEnd(Program,MICRO_INNER);
+    MemLoopEnd(Program,MICRO_OUTER);
+    PrintExit(Program,2);
+}
+static void BuildAluByte(PBENCH_PROGRAM Program)
+{
+    int i;
+    MemLoopBegin(Program,MICRO_OUTER);
+    RegLoopBegin(Program,MICRO_INNER);
+    for(i = 0;i < MICRO_UNROLL;i++)
+    {
+        OpRR(Program,0xA2,0,1);                 /*ADDL R0,R1*/
+        OpRR(Program,0x5D,1,2);                 /*SUBL R1,R2*/
+        OpRR(Program,0xF1,2,0);                 /*XORL R2,R0*/
+        OpRB(Program,0xA1,0,7);                 /*ADDL R0,7*/
+        OpRB(Program,0x51,1,3);                 /*SUBL R1,3*/
+    }
+    RegLoopEnd(Program,MICRO_INNER);
+    MemLoopEnd(Program,MICRO_OUTER);
+    PrintExit(Program,2);
+}
+static void BuildJump(PBENCH_PROGRAM Program)
+{
+    int i;
+    OpRW(Program,0x18,1,0x10);
+    OpRW(Program,0x18,2,0x20);
+    MemLoopBegin(Program,MICRO_OUTER);
+    RegLoopBegin(Program,MICRO_INNER);
+    for(i = 0;i < MICRO_UNROLL;i++)
+    {
+        OpJumpNext(Program,0xE0);               /*JMP*/
+        OpRR(Program,0x70,2,1);                 /*CMP R2,R1*/
+        OpJumpNext(Program,0xE2);               /*JZ*/
+        OpJumpNext(Program,0xE3);               /*JNZ*/
+        OpRR(Program,0x71,1,2);                 /*CMPL R1,R2*/
+        OpJumpNext(Program,0xE8);               /*JB*/
+        OpJumpNext(Program,0xE4);               /*JAE*/
+    }
+    RegLoopEnd(Program,MICRO_INNER);
+    MemLoopEnd(Program,MICRO_OUTER);
+    PrintExit(Program,1);
+}
+static void BuildPushPop(PBENCH_PROGRAM Program)
+{
+    int i;
+    MemLoopBegin(Program,MICRO_OUTER);
+    RegLoopBegin(Program,MICRO_INNER);
+    for(i = 0;i < MICRO_UNROLL;i++)
+    {
+        OpR(Program,0xAF,0);                    /*PUSH R0*/
+        OpR(Program,0xAF,1);
+        OpR(Program,0xAF,3);
+        OpR(Program,0xAE,1);                    /*POP R1*/
+        OpR(Program,0xAE,2);
+        OpR(Program,0xAE,0);
+    }
+    RegLoopEnd(Program,MICRO_INNER);
+    MemLoopEnd(Program,MICRO_OUTER);
+    PrintExit(Program,2);
+}
+/*
+Corpus
+*/
+/*nested counting loops with a little arithmetic*/
+static void BuildLoops(PBENCH_PROGRAM Program)
+{
+    OpRW(Program,0x18,1,0x5A5A);
+    MemLoopBegin(Program,400);
+    RegLoopBegin(Program,2000);
+    OpRW(Program,0xAD,0,3);
+    OpRR(Program,0xA5,2,0);
+    OpRR(Program,0xF0,2,1);
+    RegLoopEnd(Program,2000);
+    MemLoopEnd(Program,400);
+    PrintExit(Program,2);
+}
+/*byte by byte compare of two equal 64 characters strings*/
+#define STRCMP_LENGTH 64
+static void BuildStrcmp(PBENCH_PROGRAM Program)
+{
+    DWORD fail,i;
+    for(i = 0;i < STRCMP_LENGTH;i++)
+    {
+        Program->Image[BENCH_DATA + i] = 'A' + i % 26;
+        Program->Image[BENCH_DATA + 0x80 + i] = 'A' + i % 26;
+    }
+    MemLoopBegin(Program,5000);
+    OpRW(Program,0x18,1,BENCH_DATA);
+    OpRW(Program,0x18,2,BENCH_DATA + 0x80);
+    LoopBegin(Program);
+    OpRR(Program,0x56,0,1);                     /*MOVX R0,BYTE [R1]*/
+    OpRR(Program,0x56,3,2);                     /*MOVX R3,BYTE [R2]*/
+    OpRR(Program,0x71,0,3);                     /*CMPL R0,R3*/
+    fail = OpJumpForward(Program,0xE3);
+    OpRW(Program,0xAD,1,1);
+    OpRW(Program,0xAD,2,1);
+    OpRB(Program,0xA1,0,0);                     /*ADDL R0,0 : end of the string*/
+    OpJump(Program,0xE3,Program->Start[Program->Depth]);
+    LoopEnd(Program,STRCMP_LENGTH + 1);
+    MemLoopEnd(Program,5000);
+    PatchHere(Program,fail);
+    PrintExit(Program,1);
+}
+/*rolling-key XOR over a 256 bytes buffer , every pass undoes the previous one*/
+static void BuildXorDecrypt(PBENCH_PROGRAM Program)
+{
+    DWORD i;
+    for(i = 0;i < 256;i++)
+        Program->Image[BENCH_DATA + i] = i * 7;
+    MemLoopBegin(Program,1000);
+    OpRW(Program,0x18,1,BENCH_DATA);
+    OpRW(Program,0x18,2,0x3B);
+    RegLoopBegin(Program,256);
+    OpRR(Program,0x56,0,1);
+    OpRR(Program,0xF1,0,2);                     /*XORL R0,R2*/
+    OpRR(Program,0x55,1,0);                     /*MOV BYTE [R1],R0*/
+    OpRB(Program,0xA1,2,0x1D);
+    OpRW(Program,0xAD,1,1);
+    RegLoopEnd(Program,256);
+    MemLoopEnd(Program,1000);
+    OpRW(Program,0x14,0,BENCH_DATA + 0x40);
+    PrintExit(Program,0);
+}
+/*fill the stack and fold it back*/
+static void BuildStack(PBENCH_PROGRAM Program)
+{
+    MemLoopBegin(Program,2000);
+    RegLoopBegin(Program,32);
+    OpR(Program,0xAF,3);
+    OpR(Program,0xAF,2);
+    RegLoopEnd(Program,32);
+    RegLoopBegin(Program,32);
+    OpR(Program,0xAE,0);
+    OpR(Program,0xAE,1);
+    OpRR(Program,0xA5,2,0);
+    OpRR(Program,0xF0,2,1);
+    RegLoopEnd(Program,32);
+    MemLoopEnd(Program,2000);
+    PrintExit(Program,2);
+}
+static BENCH Benchmarks[] =
+{
+    {"move","micro",BuildMove},
+    {"load_store","micro",BuildLoadStore},
+    {"alu_word","micro",BuildAluWord},
+    {"alu_byte","micro",BuildAluByte},
+    {"jump","micro",BuildJump},
+    {"push_pop","micro",BuildPushPop},
+    {"loops","corpus",BuildLoops},
+    {"strcmp","corpus",BuildStrcmp},
+    {"xor_decrypt","corpus",BuildXorDecrypt},
+    {"stack","corpus",BuildStack},
+};
+/*
+Engines
+*/
+static void RunLoop(PADDRESS_SPACE AS,PREGS Regs,PBENCH_STATE State)
+{
+    VmLoop(AS,Regs);
+}
+static void RunVerified(PADDRESS_SPACE AS,PREGS Regs,PBENCH_STATE State)
+{
+    VmLoopVerified(AS,Regs,&State->Cfg);
+}
+static void RunDecoded(PADDRESS_SPACE AS,PREGS Regs,PBENCH_STATE State)
+{
+    VmLoopDecoded(AS,Regs,&State->Program);
+}
+static void RunJit(PADDRESS_SPACE AS,PREGS Regs,PBENCH_STATE State)
+{
+    VmLoopJit(AS,Regs,&State->Jit);
+}
+static BENCH_ENGINE Engines[] =
+{
+    {"loop",RunLoop},
+    {"verified",RunVerified},
+    {"decoded",RunDecoded},
+    {"jit",RunJit},
+};
+static uint64_t BenchNanoseconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter,frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart * (1e9 / frequency.QuadPart));
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+static uint64_t BenchCycles(void)
+{
+#ifdef BENCH_HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+static int CompareU64(const void* a,const void* b)
+{
+    uint64_t x = *(const uint64_t*)a,y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+/*the build options that change the engines*/
+static const char* BenchBuild(void)
+{
+    static char build[128];
+    build[0] = 0;
+#ifdef VM_THREADED_DISPATCH
+    strcat(build,"threaded");
+#else
+    strcat(build,"switch");
+#endif
+#ifdef VM_LAZY_FLAGS
+    strcat(build,"+lazy_flags");
+#endif
+#ifdef VM_NO_FUSION
+    strcat(build,"+no_fusion");
+#endif
+#ifdef VM_VERIFY
+    strcat(build,"+verify");
+#endif
+#ifdef VM_PROFILE
+    strcat(build,"+profile");
+#endif
+    if(VM_DATA_SIZE != 4096 || VM_STACK_SIZE != 256)
+        sprintf(build + strlen(build),"+data%u+stack%u",VM_DATA_SIZE,VM_STACK_SIZE);
+    return build;
+}
+/*a fresh instance of the program*/
+static void BenchLoad(PVM_CONTEXT Context,PBENCH_PROGRAM Program,PVM_IO Io)
+{
+    memcpy(Context->AS.data,Program->Image,sizeof(Program->Image));
+    memset(Context->AS.stack,0,sizeof(Context->AS.stack));
+    VmResetRegs(&Context->Regs);
+    Io->OutputSize = 0;
+}
+static boolean BenchSame(PVM_CONTEXT Context,PVM_IO Io,PVM_CONTEXT Reference,PVM_IO ReferenceIo)
+{
+    return Io->OutputSize == ReferenceIo->OutputSize &&
+           !memcmp(Io->Output,ReferenceIo->Output,Io->OutputSize) &&
+           !memcmp(Context->Regs.GPRs,Reference->Regs.GPRs,sizeof(Context->Regs.GPRs)) &&
+           Context->Regs.SP == Reference->Regs.SP;
+}
+int main(int argc,char** argv)
+{
+    static BENCH_PROGRAM program;
+    PVM_CONTEXT context,reference;
+    PBENCH_STATE state;
+    VM_IO io,reference_io;
+    uint64_t ns[BENCH_MAX_RUNS],cycles[BENCH_MAX_RUNS],instructions,start,start_cycles;
+    int runs = 11,warmup = 3,selected = 0,i,r;
+    DWORD b,e;
+    const char* engine = NULL;
+    const char* csv = NULL;
+    FILE* File = NULL;
+    double median_ns;
+    for(i = 1;i < argc;i++)
+    {
+        if(!strcmp(argv[i],"-runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-warmup") && i + 1 < argc)
+            warmup = atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-engine") && i + 1 < argc)
+            engine = argv[++i];
+        else if(!strcmp(argv[i],"-csv") && i + 1 < argc)
+            csv = argv[++i];
+        else
+            selected++;
+    }
+    if(runs < 1 || runs > BENCH_MAX_RUNS)
+        runs = runs < 1 ? 1 : BENCH_MAX_RUNS;
+    context = VmCreateContext();
+    reference = VmCreateContext();
+    state = (PBENCH_STATE) calloc(1,sizeof(BENCH_STATE));
+    if(!context || !reference || !state)
+        return 1;
+    if(csv)
+    {
+        File = fopen(csv,"a+");
+        if(!File)
+        {
+            printf("Found trouble opening %s\n",csv);
+            return 1;
+        }
+        fseek(File,0,SEEK_END);
+        if(!ftell(File))
+            fprintf(File,"build,engine,benchmark,kind,instructions,runs,best_ns,median_ns,ns_per_instruction,instructions_per_second,cycles_per_instruction\n");
+    }
+    memset(&io,0,sizeof(io));
+    memset(&reference_io,0,sizeof(reference_io));
+    printf("build : %s\n",BenchBuild());
+    printf("%-12s %-8s %12s %10s %10s %8s %8s\n","benchmark","engine","instructions","median ms","Minstr/s","ns/ins","cyc/ins");
+    for(b = 0;b < sizeof(Benchmarks) / sizeof(Benchmarks[0]);b++)
+    {
+        if(selected)
+        {
+            for(i = 1;i < argc;i++)
+            {
+                if(argv[i][0] == '-')
+                    i++;
+                else if(!strcmp(argv[i],Benchmarks[b].Name))
+                    break;
+            }
+            if(i >= argc)
+                continue;
+        }
+        memset(&program,0,sizeof(program));
+        Benchmarks[b].Build(&program);
+        instructions = program.Count[0];
+        /*VmLoop gives the expected result*/
+        BenchLoad(reference,&program,&reference_io);
+        VmSetIo(&reference_io);
+        VmLoop(&reference->AS,&reference->Regs);
+        for(e = 0;e < sizeof(Engines) / sizeof(Engines[0]);e++)
+        {
+            if(engine && strcmp(engine,Engines[e].Name))
+                continue;
+            for(r = -warmup;r < runs;r++)
+            {
+                BenchLoad(context,&program,&io);
+                VmSetIo(&io);
+                start = BenchNanoseconds();
+                start_cycles = BenchCycles();
+                Engines[e].Run(&context->AS,&context->Regs,state);
+                if(r >= 0)
+                {
+                    cycles[r] = BenchCycles() - start_cycles;
+                    ns[r] = BenchNanoseconds() - start;
+                }
+            }
+            VmSetIo(NULL);
+            if(!BenchSame(context,&io,reference,&reference_io))
+                printf("%-12s %-8s differs from loop\n",Benchmarks[b].Name,Engines[e].Name);
+            qsort(ns,runs,sizeof(ns[0]),CompareU64);
+            qsort(cycles,runs,sizeof(cycles[0]),CompareU64);
+            median_ns = (double)ns[runs / 2];
+            printf("%-12s %-8s %12llu %10.3f %10.1f %8.3f %8.2f\n",Benchmarks[b].Name,Engines[e].Name,
+                   (unsigned long long)instructions,median_ns / 1e6,instructions / median_ns * 1e3,
+                   median_ns / instructions,(double)cycles[runs / 2] / instructions);
+            if(File)
+                fprintf(File,"%s,%s,%s,%s,%llu,%d,%llu,%.0f,%.4f,%.0f,%.4f\n",BenchBuild(),Engines[e].Name,
+                        Benchmarks[b].Name,Benchmarks[b].Kind,(unsigned long long)instructions,runs,
+                        (unsigned long long)ns[0],median_ns,median_ns / instructions,
+                        instructions / median_ns * 1e9,(double)cycles[runs / 2] / instructions);
+        }
+    }
+    VmSetIo(NULL);
+    if(File)
+        fclose(File);
+    free(io.Output);
+    free(reference_io.Output);
+    VmJitRelease(&state->Jit);
+    free(state);
+    VmDestroyContext(context);
+    VmDestroyContext(reference);
+    return 0;
+}
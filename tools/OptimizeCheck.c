@@ -0,0 +1,180 @@
+/*
+Optimizer regressions.
+Programs the optimizer got wrong once and loops it must still optimize : each one is
+optimized with VmOptimize , then the original and the optimized program are run and
+must print the same output and stop with the same SP. The loops of the benchmarks
+must also be optimized rather than left as they are. Prints one line per program and
+returns 1 if one of them fails.
+
+    vm_optimize_check
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../VM.h"
+typedef struct
+{
+    const char* Name;
+    const BYTE* Code;
+    DWORD Size;
+    /*data of the program , NULL if it has none*/
+    void (*Data)(BYTE* Data);
+    /*VmOptimize must not leave it as it is*/
+    boolean Optimized;
+}OPT_CHECK,*POPT_CHECK;
+/*
+PUSH R1 ; C2 with R1 = 0 prints its own code. The store into the block at 0018 drops
+the constants , the address popped by C2 isn't known and block 0 (its NOPs) was
+compacted.
+*/
+static const BYTE PrintCodeAfterStore[] =
+{
+    0x90,                   /*0000 NOP*/
+    0x90,                   /*0001 NOP*/
+    0x18,0x01,0x00,0x00,    /*0002 MOV R1,0000*/
+    0x18,0x02,0xAF,0x00,    /*0006 MOV R2,00AF*/
+    0x1C,0x02,0x18,0x00,    /*000A MOV byte [0018],R2*/
+    0xE0,0x18,0x00,         /*000E JMP 0018*/
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+    0xAF,0x01,              /*0018 PUSH R1*/
+    0xC2,                   /*001A C2*/
+    0xED                    /*001B EXIT*/
+};
+/*
+Block 0 prints the string at R3 and is entered again with R3 pointing at the target
+of its own JAE , R3 isn't known at its start. The JAE to a JMP was threaded and the
+second line printed changed.
+*/
+static const BYTE PrintCodeInLoop[] =
+{
+    0xAF,0x03,              /*0000 PUSH R3*/
+    0xC2,                   /*0002 C2*/
+    0x16,0x03,0x0F,         /*0003 MOV R3,0F*/
+    0xA1,0x02,0x01,         /*0006 ADD byte R2,01*/
+    0x16,0x01,0x02,         /*0009 MOV R1,02*/
+    0x70,0x21,              /*000C CMP R2,R1*/
+    0xE4,0x14,0x00,         /*000E JAE 0014*/
+    0xE0,0x00,0x00,         /*0011 JMP 0000*/
+    0xE0,0x17,0x00,         /*0014 JMP 0017*/
+    0xED                    /*0017 EXIT*/
+};
+/*
+strcmp of bench/Bench.c : R1 and R2 walk the strings from a known address , the
+reads are bounded by the end of data and never reach the code.
+*/
+static const BYTE Strcmp[] =
+{
+    0x18,0x00,0x88,0x13,    /*0000 MOV R0,1388*/
+    0x1F,0x00,0x00,0x07,    /*0004 MOV WORD [0700],R0*/
+    0x18,0x01,0x00,0x08,    /*0008 MOV R1,0800*/
+    0x18,0x02,0x80,0x08,    /*000C MOV R2,0880*/
+    0x56,0x01,              /*0010 MOVX R0,BYTE [R1]*/
+    0x56,0x32,              /*0012 MOVX R3,BYTE [R2]*/
+    0x71,0x03,              /*0014 CMPL R0,R3*/
+    0xE3,0x36,0x00,         /*0016 JNZ 0036*/
+    0xAD,0x01,0x01,0x00,    /*0019 ADD R1,0001*/
+    0xAD,0x02,0x01,0x00,    /*001D ADD R2,0001*/
+    0xA1,0x00,0x00,         /*0021 ADDL R0,00*/
+    0xE3,0x10,0x00,         /*0024 JNZ 0010*/
+    0x14,0x00,0x00,0x07,    /*0027 MOV R0,WORD [0700]*/
+    0x5B,0x00,0x01,0x00,    /*002B SUB R0,0001*/
+    0x1F,0x00,0x00,0x07,    /*002F MOV WORD [0700],R0*/
+    0xE3,0x08,0x00,         /*0033 JNZ 0008*/
+    0xAF,0x01,              /*0036 PUSH R1*/
+    0xC0,                   /*0038 C0*/
+    0xED                    /*0039 EXIT*/
+};
+static void StrcmpData(BYTE* Data)
+{
+    DWORD i;
+    for(i = 0;i < 64;i++)
+        Data[0x800 + i] = Data[0x880 + i] = 'A' + i % 26;
+}
+/*xor_decrypt of bench/Bench.c : R1 reads and writes the buffer it walks*/
+static const BYTE XorDecrypt[] =
+{
+    0x18,0x00,0xE8,0x03,    /*0000 MOV R0,03E8*/
+    0x1F,0x00,0x00,0x07,    /*0004 MOV WORD [0700],R0*/
+    0x18,0x01,0x00,0x08,    /*0008 MOV R1,0800*/
+    0x18,0x02,0x3B,0x00,    /*000C MOV R2,003B*/
+    0x18,0x03,0x00,0x01,    /*0010 MOV R3,0100*/
+    0x56,0x01,              /*0014 MOVX R0,BYTE [R1]*/
+    0xF1,0x02,              /*0016 XORL R0,R2*/
+    0x55,0x10,              /*0018 MOV BYTE [R1],R0*/
+    0xA1,0x02,0x1D,         /*001A ADDL R2,1D*/
+    0xAD,0x01,0x01,0x00,    /*001D ADD R1,0001*/
+    0x5B,0x03,0x01,0x00,    /*0021 SUB R3,0001*/
+    0xE3,0x14,0x00,         /*0025 JNZ 0014*/
+    0x14,0x00,0x00,0x07,    /*0028 MOV R0,WORD [0700]*/
+    0x5B,0x00,0x01,0x00,    /*002C SUB R0,0001*/
+    0x1F,0x00,0x00,0x07,    /*0030 MOV WORD [0700],R0*/
+    0xE3,0x08,0x00,         /*0034 JNZ 0008*/
+    0x14,0x00,0x40,0x08,    /*0037 MOV R0,WORD [0840]*/
+    0xAF,0x00,              /*003B PUSH R0*/
+    0xC0,                   /*003D C0*/
+    0xED                    /*003E EXIT*/
+};
+static void XorDecryptData(BYTE* Data)
+{
+    DWORD i;
+    for(i = 0;i < 256;i++)
+        Data[0x800 + i] = i * 7;
+}
+static OPT_CHECK Checks[] =
+{
+    {"print_code_after_store",PrintCodeAfterStore,sizeof(PrintCodeAfterStore),NULL,FALSE},
+    {"print_code_in_loop",PrintCodeInLoop,sizeof(PrintCodeInLoop),NULL,FALSE},
+    {"strcmp",Strcmp,sizeof(Strcmp),StrcmpData,TRUE},
+    {"xor_decrypt",XorDecrypt,sizeof(XorDecrypt),XorDecryptData,TRUE},
+};
+static void CheckRun(PVM_CONTEXT Context,const BYTE* Code,PVM_IO Io)
+{
+    memset(Io,0,sizeof(*Io));
+    VmLoadMemory(Context,Code,VM_DATA_SIZE);
+    VmRun(Context,Io);
+}
+int main(void)
+{
+    static BYTE original[VM_DATA_SIZE];
+    static ADDRESS_SPACE AS;
+    PVM_CONTEXT context;
+    VM_IO io,optimized_io;
+    VM_OPT_STATS stats;
+    WORD sp;
+    DWORD c;
+    boolean optimized;
+    int failed = 0;
+    context = VmCreateContext();
+    if(!context)
+        return 1;
+    for(c = 0;c < sizeof(Checks) / sizeof(Checks[0]);c++)
+    {
+        memset(original,0,sizeof(original));
+        memcpy(original,Checks[c].Code,Checks[c].Size);
+        if(Checks[c].Data)
+            Checks[c].Data(original);
+        memset(&AS,0,sizeof(AS));
+        memcpy(AS.data,original,VM_DATA_SIZE);
+        optimized = VmOptimize(&AS,&stats);
+        CheckRun(context,original,&io);
+        sp = context->Regs.SP;
+        CheckRun(context,AS.data,&optimized_io);
+        if(Checks[c].Optimized && !optimized)
+        {
+            printf("%-24s FAILED : left as it is (%.4X)\n",Checks[c].Name,stats.Unknown);
+            failed = 1;
+        }
+        else if(io.OutputSize != optimized_io.OutputSize || memcmp(io.Output,optimized_io.Output,io.OutputSize) ||
+                sp != context->Regs.SP)
+        {
+            printf("%-24s FAILED\n",Checks[c].Name);
+            failed = 1;
+        }
+        else
+            printf("%-24s ok\n",Checks[c].Name);
+        free(io.Output);
+        free(optimized_io.Output);
+    }
+    VmDestroyContext(context);
+    return failed;
+}
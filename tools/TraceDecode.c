@@ -0,0 +1,170 @@
+/*
+Trace decoder.
+Replays a trace written by a VM_TRACE build (see Trace.c for the format) from the
+initial state of its header and prints the state after every instruction , or the
+full state (registers , flags and stack) after instruction N.
+
+    vm_trace_decode trace [-at N]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../VM.h"
+typedef struct
+{
+    WORD GPRs[4];
+    WORD IP;
+    WORD SP;
+    BYTE Flags;
+    /*data then stack , as in the header*/
+    BYTE AS[VM_DATA_SIZE + VM_STACK_SIZE * 2];
+}TRACE_STATE,*PTRACE_STATE;
+static const BYTE* DecodeVarint(const BYTE* In,const BYTE* End,DWORD* Value)
+{
+    DWORD shift = 0;
+    *Value = 0;
+    while(In < End && shift < 32)
+    {
+        *Value |= (DWORD)(*In & 0x7F) << shift;
+        if(!(*In++ & 0x80))
+            return In;
+        shift += 7;
+    }
+    return NULL;
+}
+/*apply a zigzag delta to a 16 bits value*/
+static const BYTE* DecodeDelta(const BYTE* In,const BYTE* End,WORD* Value)
+{
+    DWORD zigzag;
+    In = DecodeVarint(In,End,&zigzag);
+    if(In)
+        *Value += (WORD)((zigzag >> 1) ^ (0 - (zigzag & 1)));
+    return In;
+}
+/*one record , NULL if it is truncated*/
+static const BYTE* DecodeRecord(const BYTE* In,const BYTE* End,PTRACE_STATE State,BYTE* Opcode,DWORD* WriteOffset,DWORD* WriteSize)
+{
+    BYTE changes;
+    DWORD i;
+    if(End - In < 2)
+        return NULL;
+    changes = *In++;
+    *Opcode = *In++;
+    *WriteSize = 0;
+    In = DecodeDelta(In,End,&State->IP);
+    for(i = 0;i < 4 && In;i++)
+    {
+        if(changes & (VM_TRACE_BIT_R0 << i))
+            In = DecodeDelta(In,End,&State->GPRs[i]);
+    }
+    if(In && (changes & VM_TRACE_BIT_FLAGS))
+        State->Flags = In < End ? *In++ : 0;
+    if(In && (changes & VM_TRACE_BIT_SP))
+        In = DecodeDelta(In,End,&State->SP);
+    if(In && (changes & VM_TRACE_BIT_WRITE))
+    {
+        In = DecodeVarint(In,End,WriteOffset);
+        if(In)
+            In = DecodeVarint(In,End,WriteSize);
+        if(!In || *WriteOffset + *WriteSize > sizeof(State->AS) || (DWORD)(End - In) < *WriteSize)
+            return NULL;
+        memcpy(&State->AS[*WriteOffset],In,*WriteSize);
+        In += *WriteSize;
+    }
+    return In;
+}
+static void PrintState(PTRACE_STATE State)
+{
+    DWORD sp;
+    printf("R0 : 0x%.4X\nR1 : 0x%.4X\nR2 : 0x%.4X\nR3 : 0x%.4X\n",State->GPRs[0],State->GPRs[1],State->GPRs[2],State->GPRs[3]);
+    printf("SP : 0x%.4X\nZF = %d\nCF = %d\n",State->SP * 2,State->Flags & 1,(State->Flags >> 1) & 1);
+    if(State->SP >= VM_STACK_SIZE)
+        printf("The stack is empty.\n");
+    for(sp = State->SP;sp < VM_STACK_SIZE;sp++)
+        printf("    SP+%u => 0x%.4X : %.4X\n",(sp - State->SP) * 2,sp * 2,*(WORD*)&State->AS[VM_DATA_SIZE + sp * 2]);
+}
+int main(int argc,char** argv)
+{
+    static TRACE_STATE state;
+    VM_TRACE_HEADER header;
+    FILE* File;
+    BYTE* data;
+    const BYTE* in;
+    const BYTE* end;
+    long size;
+    uint64_t n = 0,at = 0;
+    boolean show_at = FALSE;
+    BYTE opcode;
+    DWORD write_offset,write_size;
+    if(argc < 2)
+    {
+        printf("usage : %s trace [-at N]\n",argv[0]);
+        return 1;
+    }
+    if(argc >= 4 && !strcmp(argv[2],"-at"))
+    {
+        at = strtoull(argv[3],NULL,0);
+        show_at = TRUE;
+    }
+    File = fopen(argv[1],"rb");
+    if(!File)
+    {
+        printf("Found trouble opening %s\n",argv[1]);
+        return 1;
+    }
+    fseek(File,0,SEEK_END);
+    size = ftell(File);
+    rewind(File);
+    data = (BYTE*) malloc(size ? size : 1);
+    if(!data || fread(data,1,size,File) != (size_t)size || size < (long)sizeof(header))
+    {
+        printf("Found trouble reading %s\n",argv[1]);
+        return 1;
+    }
+    fclose(File);
+    memcpy(&header,data,sizeof(header));
+    if(header.Magic != VM_TRACE_MAGIC || header.Version != VM_TRACE_VERSION)
+    {
+        printf("%s is not a trace\n",argv[1]);
+        return 1;
+    }
+    memcpy(state.GPRs,header.GPRs,sizeof(state.GPRs));
+    state.IP = header.IP;
+    state.SP = header.SP;
+    state.Flags = header.Flags;
+    memcpy(state.AS,header.AS,sizeof(state.AS));
+    in = data + sizeof(header);
+    end = data + size;
+    while(in < end)
+    {
+        in = DecodeRecord(in,end,&state,&opcode,&write_offset,&write_size);
+        if(!in)
+        {
+            printf("truncated record %llu\n",(unsigned long long)n);
+            return 1;
+        }
+        if(show_at)
+        {
+            if(n == at)
+            {
+                printf("instruction %llu : 0x%.4X %s\n",(unsigned long long)n,state.IP,VmMnemonic(opcode));
+                PrintState(&state);
+                return 0;
+            }
+        }
+        else
+        {
+            printf("%-8llu 0x%.4X %-14s R0=%.4X R1=%.4X R2=%.4X R3=%.4X SP=%.4X ZF=%d CF=%d",(unsigned long long)n,
+                   state.IP,VmMnemonic(opcode),state.GPRs[0],state.GPRs[1],state.GPRs[2],state.GPRs[3],
+                   state.SP * 2,state.Flags & 1,(state.Flags >> 1) & 1);
+            if(write_size)
+                printf(" [0x%.4X] %u bytes",write_offset,write_size);
+            printf("\n");
+        }
+        n++;
+    }
+    if(show_at)
+        printf("the trace has %llu instructions\n",(unsigned long long)n);
+    free(data);
+    return 0;
+}